@@ -25,12 +25,19 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := audio.primary.waydroid
 LOCAL_PROPRIETARY_MODULE := true
 LOCAL_MODULE_RELATIVE_PATH := hw
-LOCAL_SRC_FILES := audio_hw.c
-LOCAL_SHARED_LIBRARIES := liblog libcutils libasound
+LOCAL_SRC_FILES := \
+        audio_hw.c \
+        backend_alsa.c \
+        backend_pulse.c \
+        capture_buffer.c \
+        mmap_stream.c \
+        stream_stats.c
+LOCAL_SHARED_LIBRARIES := liblog libcutils libasound libpulse libaudioutils
 LOCAL_HEADER_LIBRARIES := libhardware_headers
 LOCAL_CFLAGS := -Wno-unused-parameter
 LOCAL_C_INCLUDES += \
         external/alsa-lib/include \
+        external/pulseaudio/src \
         external/expat/lib \
         system/media/audio_utils/include \
         system/media/audio_effects/include
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WAYDROID_AUDIO_BACKEND_H
+#define WAYDROID_AUDIO_BACKEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <system/audio.h>
+
+/* Configuration for a stream */
+struct pcm_config {
+    unsigned int channels;
+    unsigned int rate;
+    unsigned int period_size;
+    unsigned int period_count;
+    audio_format_t format;
+
+    /* Values to use for the ALSA start, stop and silence thresholds, and
+     * silence size.  Setting any one of these values to 0 will cause the
+     * default tinyalsa values to be used instead.
+     * Tinyalsa defaults are as follows.
+     *
+     * start_threshold   : period_count * period_size
+     * stop_threshold    : period_count * period_size
+     * silence_threshold : 0
+     * silence_size      : 0
+     */
+    unsigned int start_threshold;
+    unsigned int stop_threshold;
+    unsigned int silence_threshold;
+    unsigned int silence_size;
+
+    /* Minimum number of frames available before pcm_mmap_write() will actually
+     * write into the kernel buffer. Only used if the stream is opened in mmap mode
+     * (pcm_open() called with PCM_MMAP flag set).   Use 0 for default.
+     */
+    int avail_min;
+};
+
+struct audio_backend_stream;
+
+/*
+ * A way to reach the host sound server.  All calls on a stream are
+ * serialized by the stream lock of the HAL.
+ */
+struct audio_backend {
+    const char *name;
+
+    /* Open a stream.  The period size and count of config are updated to
+     * what the host actually granted. */
+    int (*open)(struct audio_backend_stream **stream, bool capture,
+                struct pcm_config *config);
+    void (*close)(struct audio_backend_stream *stream);
+
+    /* Stop a playback stream, dropping what is queued, but keep it open so
+     * that resume is cheap. */
+    int (*pause)(struct audio_backend_stream *stream);
+    int (*resume)(struct audio_backend_stream *stream);
+
+    /* Blocking transfers, return the number of frames or a negative errno.
+     * Xruns are recovered from internally and only counted. */
+    ssize_t (*write)(struct audio_backend_stream *stream, const void *buffer,
+                     size_t frames);
+    ssize_t (*read)(struct audio_backend_stream *stream, void *buffer, size_t frames);
+
+    /* Frames queued between the HAL and the speaker, or between the mic and
+     * the HAL for capture, as of the CLOCK_MONOTONIC timestamp. */
+    int (*get_delay)(struct audio_backend_stream *stream, uint64_t *frames,
+                     struct timespec *timestamp);
+    unsigned int (*get_xruns)(struct audio_backend_stream *stream);
+};
+
+extern const struct audio_backend audio_backend_alsa;
+extern const struct audio_backend audio_backend_pulse;
+
+#endif  // WAYDROID_AUDIO_BACKEND_H
@@ -20,7 +20,9 @@
 #include <errno.h>
 #include <malloc.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/time.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,29 +37,38 @@
 #include <system/audio.h>
 #include <hardware/audio.h>
 
-#include <alsa/asoundlib.h>
+#include <audio_utils/primitives.h>
 #include <audio_utils/resampler.h>
 #include <audio_utils/echo_reference.h>
 #include <hardware/audio_effect.h>
 #include <audio_effects/effect_aec.h>
 
+#include "audio_backend.h"
+#include "capture_buffer.h"
+#include "mmap_stream.h"
+#include "stream_stats.h"
+
 /* Minimum granularity - Arbitrary but small value */
 #define CODEC_BASE_FRAME_COUNT 32
 
 #define CHANNEL_STEREO 2
+/* 7.1, the widest layout handed to the host */
+#define CHANNEL_MAX 8
 
-#define PCM_OPEN_RETRIES 100
-#define PCM_OPEN_WAIT_TIME_MS 20
+/* -3 dB, for folding center and surround channels into stereo */
+#define MINUS_3_DB 0.70710678f
 
 /* Capture codec parameters */
 /* Set up a capture period of 20 ms:
- * CAPTURE_PERIOD = PERIOD_SIZE / SAMPLE_RATE, so (20e-3) = PERIOD_SIZE / (16e3)
- * => PERIOD_SIZE = 320 frames, where each "frame" consists of 1 sample of every channel (here, 2ch) */
-#define CAPTURE_PERIOD_MULTIPLIER 10
+ * CAPTURE_PERIOD = PERIOD_SIZE / SAMPLE_RATE, so (20e-3) = PERIOD_SIZE / (48e3)
+ * => PERIOD_SIZE = 960 frames, where each "frame" consists of 1 sample of every channel (here, 2ch) */
+#define CAPTURE_PERIOD_MULTIPLIER 30
 #define CAPTURE_PERIOD_SIZE (CODEC_BASE_FRAME_COUNT * CAPTURE_PERIOD_MULTIPLIER)
 #define CAPTURE_PERIOD_COUNT 2
 #define CAPTURE_PERIOD_START_THRESHOLD 0
-#define CAPTURE_CODEC_SAMPLING_RATE 16000
+/* the host is captured at its native rate and converted for the client */
+#define CAPTURE_CODEC_SAMPLING_RATE 48000
+#define CAPTURE_MIN_SAMPLING_RATE 8000
 
 /* Playback codec parameters */
 /* number of base blocks in a short period (low latency) */
@@ -70,71 +81,181 @@
 #define PLAYBACK_CODEC_SAMPLING_RATE 48000
 #define MIN_WRITE_SLEEP_US      2000
 
+/* Fast output, for AUDIO_OUTPUT_FLAG_FAST tracks */
+/* number of frames per period, 5 ms */
+#define FAST_PERIOD_SIZE 240
+#define FAST_PERIOD_COUNT 2
+/* the period doubles on each underrun, up to 20 ms */
+#define FAST_PERIOD_SIZE_MAX (FAST_PERIOD_SIZE * 4)
+/* and halves again after this many seconds without one */
+#define FAST_PERIOD_DECAY_SECONDS 5
+
+/* Deep buffer output, for long form playback: 80 ms periods so that the
+ * mixer thread and the host only wake up a dozen times per second */
+#define DEEP_BUFFER_PERIOD_SIZE 3840
+#define DEEP_BUFFER_PERIOD_COUNT 4
+
+/* MMAP no-IRQ streams for AAudio, one 5 ms burst at a time */
+#define MMAP_PERIOD_SIZE 240
+#define MMAP_PERIOD_COUNT 2
+#define MMAP_SAMPLING_RATE 48000
+
+/* backoff between attempts to reach the host sound server again */
+#define RECONNECT_DELAY_MIN_MS 20
+#define RECONNECT_DELAY_MAX_MS 2000
+
+/* how long an output in standby keeps its host stream open, paused */
+#define DEFAULT_STANDBY_TIMEOUT_MS 5000
+
+/* AEC, NS and AGC */
+#define MAX_PREPROCESSORS 3
+
+/*
+ * Note on mutex acquisition order: a stream mutex is always taken before
+ * the hw device mutex, and the hw device mutex is only held for
+ * bookkeeping, never across an open, read or write of the host stream.
+ */
+
+/* Runs expire() from its own thread once an armed deadline passes */
+struct idle_timer {
+    void (*expire)(void *context);
+    void *context;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    bool exit;
+    bool armed;
+    struct timespec deadline;
+};
+
+/* Background reopening of a stream whose host side is unavailable */
+struct stream_reconnect {
+    struct alsa_audio_device *adev;
+    bool capture;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    bool cancel;
+    struct pcm_config config;
+    /* set by the thread once connected, taken over by the stream */
+    const struct audio_backend *backend;
+    struct audio_backend_stream *pcm;
+};
+
 struct alsa_audio_device {
     struct audio_hw_device hw_device;
 
-    pthread_mutex_t lock;   /* see note below on mutex acquisition order */
+    pthread_mutex_t lock;   /* see note above on mutex acquisition order */
     int out_devices;
     int in_devices;
     struct alsa_stream_in *active_input;
     struct alsa_stream_out *active_output;
     bool mic_mute;
-};
-
-/* Configuration for a stream */
-struct pcm_config {
-    unsigned int channels;
-    unsigned int rate;
-    unsigned int period_size;
-    unsigned int period_count;
-    snd_pcm_format_t format;
-
-    /* Values to use for the ALSA start, stop and silence thresholds, and
-     * silence size.  Setting any one of these values to 0 will cause the
-     * default tinyalsa values to be used instead.
-     * Tinyalsa defaults are as follows.
-     *
-     * start_threshold   : period_count * period_size
-     * stop_threshold    : period_count * period_size
-     * silence_threshold : 0
-     * silence_size      : 0
-     */
-    unsigned int start_threshold;
-    unsigned int stop_threshold;
-    unsigned int silence_threshold;
-    unsigned int silence_size;
-
-    /* Minimum number of frames available before pcm_mmap_write() will actually
-     * write into the kernel buffer. Only used if the stream is opened in mmap mode
-     * (pcm_open() called with PCM_MMAP flag set).   Use 0 for default.
+    /*
+     * host sound server access, set once from waydroid.audio.backend; an
+     * open it fails falls back to alsa for that stream only
      */
-    int avail_min;
+    const struct audio_backend *backend;
+    /* 0 closes the host stream as soon as an output goes to standby */
+    unsigned int standby_timeout_ms;
+    /* fed by the active output at that rate, owned by the input with the AEC */
+    struct echo_reference_itfe *echo_reference;
+    unsigned int echo_reference_rate;
 };
 
 struct alsa_stream_in {
     struct audio_stream_in stream;
 
-    pthread_mutex_t lock;   /* see note below on mutex acquisition order */
+    pthread_mutex_t lock;   /* see note above on mutex acquisition order */
+    /* host side, 16 bit stereo, converted to what the client asked for below */
     struct pcm_config config;
-    snd_pcm_t *pcm;
+    unsigned int rate;
+    unsigned int channels;
+    audio_format_t format;
+    struct resampler_itfe *resampler;
+    struct resampler_buffer_provider buf_provider;
+    int16_t *host_buf;
+    size_t host_buf_frames;
+    size_t host_frames;
+    size_t host_offset;
+    int read_status;
+    /* host periods queued by a real-time thread, drained by in_read() */
+    struct capture_buffer capture;
+    const struct audio_backend *backend;
+    struct audio_backend_stream *pcm;
     bool unavailable;
     bool standby;
     struct alsa_audio_device *dev;
     int read_threshold;
-    unsigned int read;
+    /* frames handed to the client, never reset */
+    uint64_t read;
+    /* client frames replaced by silence since the last get_input_frames_lost() */
+    uint64_t frames_lost;
+    audio_input_flags_t flags;
+    struct mmap_stream mmap;
+    struct stream_reconnect reconnect;
+    /* real-time pacing of the silence returned while unavailable */
+    struct timespec silence_until;
+    /* pre-processing effects are run here, AudioFlinger leaves them to the HAL */
+    effect_handle_t preprocessors[MAX_PREPROCESSORS];
+    int num_preprocessors;
+    bool need_echo_reference;
+    struct echo_reference_itfe *echo_reference;
+    int16_t *ref_buf;
+    size_t ref_buf_frames;
+    struct stream_stats stats;
+    /* capture buffer xrun count as of the last read */
+    unsigned int last_xruns;
 };
 
 struct alsa_stream_out {
     struct audio_stream_out stream;
 
-    pthread_mutex_t lock;   /* see note below on mutex acquisition order */
+    pthread_mutex_t lock;   /* see note above on mutex acquisition order */
+    /* host side, falls back to stereo and 16 bit if the host refuses the client format */
     struct pcm_config config;
-    snd_pcm_t *pcm;
+    unsigned int channels;
+    audio_format_t format;
+    /* stereo fold-down gains per client channel, and scratch for the conversion */
+    float downmix[CHANNEL_MAX][2];
+    void *conv_buf;
+    size_t conv_buf_size;
+    /* 16 bit stereo copy of what was written, for the echo reference */
+    void *ref_buf;
+    size_t ref_buf_size;
+    const struct audio_backend *backend;
+    struct audio_backend_stream *pcm;
     bool unavailable;
     int standby;
     struct alsa_audio_device *dev;
     int write_threshold;
-    unsigned int written;
+    /* frames taken from the client, never reset */
+    uint64_t written;
+    /* written when the stream last left standby, for the render position */
+    uint64_t written_at_start;
+    /* last presentation position reported, it must never go backwards */
+    uint64_t presented;
+    audio_output_flags_t flags;
+    /* frames per write, fixed for the life of the stream */
+    size_t buffer_frames;
+    /* config changed, reopen the pcm on the next write */
+    bool reconfigure;
+    struct mmap_stream mmap;
+    struct stream_reconnect reconnect;
+    /* real-time pacing of the writes dropped while unavailable */
+    struct timespec silence_until;
+    /* in standby with the host stream still open, closed by idle_timer */
+    bool paused;
+    struct idle_timer idle_timer;
+    struct stream_stats stats;
+    /* backend xrun count as of the last write, of the current pcm */
+    unsigned int last_xruns;
+    /* frames written since the last underrun, while the fast period is grown */
+    uint64_t clean_frames;
 };
 
 static size_t out_get_buffer_size(const struct audio_stream *stream);
@@ -153,107 +274,377 @@ static void select_devices(struct alsa_audio_device *adev)
     ALOGV("hp=%c speaker=%c headset-mic=%c", headphones_on ? 'y' : 'n', speaker_on ? 'y' : 'n', headset_mic_on ? 'y' : 'n');
 }
 
-/* must be called with hw device and output stream mutexes locked */
-static int start_output_stream(struct alsa_stream_out *out)
+/*
+ * Open on one backend.  With negotiate, a layout or format it refuses
+ * (-EINVAL) is retried as stereo, then as 16 bit; anything else means the
+ * host is not there and no other config would do better.
+ */
+static int open_backend_negotiated(const struct audio_backend *backend, bool capture,
+                                   bool negotiate, struct pcm_config *config,
+                                   struct audio_backend_stream **stream)
 {
-    struct alsa_audio_device *adev = out->dev;
-    snd_pcm_hw_params_t *hwparams;
     int ret;
 
-    /* default to low power: will be corrected in out_write if necessary before first write to
-     * tinyalsa.
-     */
-    out->write_threshold = PLAYBACK_PERIOD_COUNT * PLAYBACK_PERIOD_SIZE;
-    out->config.start_threshold = PLAYBACK_PERIOD_START_THRESHOLD * PLAYBACK_PERIOD_SIZE;
-    out->config.avail_min = PLAYBACK_PERIOD_SIZE;
-    out->unavailable = true;
-    unsigned int pcm_retry_count = PCM_OPEN_RETRIES;
- 
-    while (1) {
-        ret = snd_pcm_open(&out->pcm, "pulse", SND_PCM_STREAM_PLAYBACK, 0);
-        if (ret < 0) {
-            if (out->pcm != NULL) {
-                snd_pcm_close(out->pcm);
-                out->pcm = NULL;
-            }
-            if (--pcm_retry_count == 0) {
-                ALOGE("Failed to open pcm_out after %d tries", PCM_OPEN_RETRIES);
-                adev->active_output = NULL;
-                return -ENODEV;
-            }
-            usleep(PCM_OPEN_WAIT_TIME_MS * 1000);
-        } else {
-            break;
-        }
+    ret = backend->open(stream, capture, config);
+    if (ret == -EINVAL && negotiate && config->channels != CHANNEL_STEREO) {
+        config->channels = CHANNEL_STEREO;
+        ret = backend->open(stream, capture, config);
     }
+    if (ret == -EINVAL && negotiate && config->format != AUDIO_FORMAT_PCM_16_BIT) {
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        ret = backend->open(stream, capture, config);
+    }
+    return ret;
+}
 
-    snd_pcm_hw_params_alloca(&hwparams);
-    if (snd_pcm_hw_params_any(out->pcm, hwparams) < 0) {
-        ALOGE("Can not configure this PCM device.");
-        adev->active_output = NULL;
-        return -ENODEV;
+/*
+ * The backend is picked once per open: the configured one, else alsa.
+ * Must be called without the hw device mutex, the open may take a while.
+ */
+static int open_backend_stream(struct alsa_audio_device *adev, bool capture, bool negotiate,
+                               struct pcm_config *config,
+                               const struct audio_backend **backend,
+                               struct audio_backend_stream **stream)
+{
+    /* set once in adev_open */
+    const struct audio_backend *selected = adev->backend;
+    struct pcm_config requested = *config;
+    int ret;
+
+    ret = open_backend_negotiated(selected, capture, negotiate, config, stream);
+    if (ret && selected != &audio_backend_alsa) {
+        /*
+         * for this stream only, the sound server may just be restarting
+         * and the next open should try it again
+         */
+        ALOGW("%s backend failed to open a stream (%d), falling back to alsa",
+              selected->name, ret);
+        *config = requested;
+        ret = open_backend_negotiated(&audio_backend_alsa, capture, negotiate, config, stream);
+        if (ret == 0)
+            selected = &audio_backend_alsa;
     }
 
-    if (snd_pcm_hw_params_set_access(out->pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
-        ALOGE("Error setting access.\n");
-        adev->active_output = NULL;
-  	    return -ENODEV;
+    if (ret == 0)
+        *backend = selected;
+    return ret;
+}
+
+static void cond_init_monotonic(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void deadline_from_now(struct timespec *deadline, unsigned int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
     }
+}
 
-    if (snd_pcm_hw_params_set_format(out->pcm, hwparams, out->config.format) < 0) {
-        ALOGE("Error setting format.\n");
-        adev->active_output = NULL;
-  	    return -ENODEV;
+static bool deadline_passed(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void idle_timer_init(struct idle_timer *t, void (*expire)(void *context),
+                            void *context)
+{
+    t->expire = expire;
+    t->context = context;
+    pthread_mutex_init(&t->lock, NULL);
+    cond_init_monotonic(&t->cond);
+}
+
+static void *idle_timer_thread(void *context)
+{
+    struct idle_timer *t = context;
+
+    pthread_mutex_lock(&t->lock);
+    while (!t->exit) {
+        if (!t->armed) {
+            pthread_cond_wait(&t->cond, &t->lock);
+            continue;
+        }
+        pthread_cond_timedwait(&t->cond, &t->lock, &t->deadline);
+        if (t->exit || !t->armed || !deadline_passed(&t->deadline))
+            continue;
+
+        /* expire() takes the stream lock, which may be held by a caller of arm() */
+        t->armed = false;
+        pthread_mutex_unlock(&t->lock);
+        t->expire(t->context);
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+static void idle_timer_arm(struct idle_timer *t, unsigned int ms)
+{
+    pthread_mutex_lock(&t->lock);
+    deadline_from_now(&t->deadline, ms);
+    t->armed = true;
+    if (!t->running) {
+        int ret = pthread_create(&t->thread, NULL, idle_timer_thread, t);
+        if (ret)
+            ALOGE("failed to start the idle timer: %s", strerror(ret));
+        else
+            t->running = true;
     }
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void idle_timer_disarm(struct idle_timer *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->armed = false;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* must not be called with a lock expire() takes */
+static void idle_timer_destroy(struct idle_timer *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->exit = true;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    if (t->running)
+        pthread_join(t->thread, NULL);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+}
+
+static void reconnect_init(struct stream_reconnect *r, struct alsa_audio_device *adev,
+                           bool capture)
+{
+    r->adev = adev;
+    r->capture = capture;
+    pthread_mutex_init(&r->lock, NULL);
+    cond_init_monotonic(&r->cond);
+}
 
-    if (snd_pcm_hw_params_set_rate_near(out->pcm, hwparams, &out->config.rate, 0) < 0) {
-        ALOGE("Error setting rate.\n");
-        adev->active_output = NULL;
-  	    return -ENODEV;
+static void *reconnect_thread(void *context)
+{
+    struct stream_reconnect *r = context;
+    unsigned int delay_ms = RECONNECT_DELAY_MIN_MS;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->cancel) {
+        const struct audio_backend *backend;
+        struct audio_backend_stream *pcm;
+        struct pcm_config config;
+        struct timespec deadline;
+        int ret;
+
+        deadline_from_now(&deadline, delay_ms);
+        pthread_cond_timedwait(&r->cond, &r->lock, &deadline);
+        if (r->cancel)
+            break;
+
+        config = r->config;
+        pthread_mutex_unlock(&r->lock);
+        ret = open_backend_stream(r->adev, r->capture, false, &config, &backend, &pcm);
+        pthread_mutex_lock(&r->lock);
+
+        if (ret == 0) {
+            if (r->cancel) {
+                backend->close(pcm);
+            } else {
+                ALOGI("%s stream reconnected", r->capture ? "input" : "output");
+                r->config = config;
+                r->backend = backend;
+                r->pcm = pcm;
+            }
+            break;
+        }
+
+        delay_ms *= 2;
+        if (delay_ms > RECONNECT_DELAY_MAX_MS)
+            delay_ms = RECONNECT_DELAY_MAX_MS;
     }
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
 
-    if (snd_pcm_hw_params_set_channels(out->pcm, hwparams, out->config.channels) < 0) {
-        ALOGE("Error setting channels.\n");
-        adev->active_output = NULL;
-  	    return -ENODEV;
+/* must be called with the stream mutex locked */
+static void reconnect_start(struct stream_reconnect *r, const struct pcm_config *config)
+{
+    int ret;
+
+    if (r->running)
+        return;
+
+    r->config = *config;
+    r->cancel = false;
+    r->pcm = NULL;
+    ret = pthread_create(&r->thread, NULL, reconnect_thread, r);
+    if (ret) {
+        ALOGE("failed to start the reconnect thread: %s", strerror(ret));
+        return;
     }
+    r->running = true;
+}
 
-    if (snd_pcm_hw_params_set_periods(out->pcm, hwparams, out->config.period_count, 0) < 0) {
-        ALOGE("Error setting periods.\n");
-        adev->active_output = NULL;
-  	    return -ENODEV;
+/*
+ * Hand over the stream opened by the reconnect thread, if any.  Must be
+ * called with the stream mutex locked.
+ */
+static bool reconnect_take(struct stream_reconnect *r, struct pcm_config *config,
+                           const struct audio_backend **backend,
+                           struct audio_backend_stream **pcm)
+{
+    bool connected;
+
+    if (!r->running)
+        return false;
+
+    pthread_mutex_lock(&r->lock);
+    connected = r->pcm != NULL;
+    if (connected) {
+        *config = r->config;
+        *backend = r->backend;
+        *pcm = r->pcm;
+        r->pcm = NULL;
     }
+    pthread_mutex_unlock(&r->lock);
 
-    if (snd_pcm_hw_params_set_buffer_size(out->pcm, hwparams, out_get_buffer_size((struct audio_stream *)out)) < 0) {
-        ALOGE("Error setting periods.\n");
-        adev->active_output = NULL;
-  	    return -ENODEV;
+    if (connected) {
+        /* the thread is done once it published the stream */
+        pthread_join(r->thread, NULL);
+        r->running = false;
     }
+    return connected;
+}
 
-    if (snd_pcm_hw_params(out->pcm, hwparams) < 0) {
-        ALOGE("Error setting HW params.");
-        adev->active_output = NULL;
-        return -ENODEV;
+/* must be called with the stream mutex locked */
+static void reconnect_cancel(struct stream_reconnect *r)
+{
+    if (!r->running)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->cancel = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    r->running = false;
+
+    if (r->pcm) {
+        r->backend->close(r->pcm);
+        r->pcm = NULL;
     }
+}
 
-    if (snd_pcm_prepare(out->pcm) < 0) {
-       ALOGE("Can not prepare this PCM device.");
-        adev->active_output = NULL;
-        return -ENODEV;
+static void reconnect_destroy(struct stream_reconnect *r)
+{
+    reconnect_cancel(r);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+}
+
+/* Consume frames at the stream rate while there is no host stream. */
+static void pace_silence(struct timespec *until, size_t frames, unsigned int rate)
+{
+    struct timespec now;
+    int64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (until->tv_sec == 0 && until->tv_nsec == 0)
+        *until = now;
+
+    ns = until->tv_nsec + (int64_t)frames * 1000000000 / rate;
+    until->tv_sec += ns / 1000000000;
+    until->tv_nsec = ns % 1000000000;
+
+    if (until->tv_sec < now.tv_sec ||
+            (until->tv_sec == now.tv_sec && until->tv_nsec < now.tv_nsec)) {
+        /* the caller is late already, do not make up for it */
+        *until = now;
+        return;
     }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, until, NULL);
+}
 
-    if (snd_pcm_state(out->pcm) != SND_PCM_STATE_PREPARED) {
-        ALOGE("cannot open pcm_out driver");
-        snd_pcm_close(out->pcm);
-        adev->active_output = NULL;
+/* must be called with the output stream mutex locked */
+static int start_output_stream(struct alsa_stream_out *out)
+{
+    struct alsa_audio_device *adev = out->dev;
+    int ret;
+
+    /* default to low power: will be corrected in out_write if necessary before first write to
+     * tinyalsa.
+     */
+    out->write_threshold = out->config.period_count * out->config.period_size;
+    out->config.start_threshold = PLAYBACK_PERIOD_START_THRESHOLD * out->config.period_size;
+    out->config.avail_min = out->config.period_size;
+    out->unavailable = true;
+
+    /* pass the client format through when the host takes it, else fold it down */
+    out->config.channels = out->channels;
+    out->config.format = out->format;
+    ret = open_backend_stream(adev, false, true, &out->config, &out->backend, &out->pcm);
+    if (ret) {
+        ALOGE("cannot open output stream: %d", ret);
         return -ENODEV;
     }
+    if (out->config.channels != out->channels || out->config.format != out->format)
+        ALOGI("host refused %u ch format %#x, converting to %u ch format %#x",
+              out->channels, out->format, out->config.channels, out->config.format);
 
     out->unavailable = false;
+    out->last_xruns = 0;
+    out->stats.cold_starts++;
+    pthread_mutex_lock(&adev->lock);
     adev->active_output = out;
+    pthread_mutex_unlock(&adev->lock);
     return 0;
 }
 
+static int do_output_standby(struct alsa_stream_out *out, bool warm);
+
+/*
+ * Leave standby, resuming the paused host stream when there is one.  Must
+ * be called with the output stream mutex locked.
+ */
+static int resume_output_stream(struct alsa_stream_out *out)
+{
+    struct alsa_audio_device *adev = out->dev;
+
+    if (out->paused) {
+        idle_timer_disarm(&out->idle_timer);
+        out->paused = false;
+        if (out->backend->resume(out->pcm) == 0) {
+            out->stats.warm_starts++;
+            pthread_mutex_lock(&adev->lock);
+            adev->active_output = out;
+            pthread_mutex_unlock(&adev->lock);
+            return 0;
+        }
+        ALOGW("failed to resume the output stream, reopening it");
+        do_output_standby(out, false);
+    }
+
+    return start_output_stream(out);
+}
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
     struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
@@ -268,11 +659,12 @@ static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
 
 static size_t out_get_buffer_size(const struct audio_stream *stream)
 {
-    ALOGV("out_get_buffer_size: %d", 4096);
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+    ALOGV("out_get_buffer_size: %zu", out->buffer_frames);
 
     /* return the closest majoring multiple of 16 frames, as
      * audioflinger expects audio buffers to be a multiple of 16 frames */
-    size_t size = PLAYBACK_PERIOD_SIZE;
+    size_t size = out->buffer_frames;
     size = ((size + 15) / 16) * 16;
     return size * audio_stream_out_frame_size((struct audio_stream_out *)stream);
 }
@@ -281,83 +673,14 @@ static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
 {
     ALOGV("out_get_channels");
     struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
-    return audio_channel_out_mask_from_count(out->config.channels);
-}
-
-/* Converts audio_format to pcm_format.
- * Parameters:
- *  format  the audio_format_t to convert
- *
- * Logs a fatal error if format is not a valid convertible audio_format_t.
- */
-static inline snd_pcm_format_t pcm_format_from_audio_format(audio_format_t format)
-{
-    switch (format) {
-#if HAVE_BIG_ENDIAN
-    case AUDIO_FORMAT_PCM_16_BIT:
-        return SND_PCM_FORMAT_S16_BE;
-    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
-        return SND_PCM_FORMAT_S24_3BE;
-    case AUDIO_FORMAT_PCM_32_BIT:
-        return SND_PCM_FORMAT_S32_BE;
-    case AUDIO_FORMAT_PCM_8_24_BIT:
-        return SND_PCM_FORMAT_S24_BE;
-#else
-    case AUDIO_FORMAT_PCM_16_BIT:
-        return SND_PCM_FORMAT_S16_LE;
-    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
-        return SND_PCM_FORMAT_S24_3LE;
-    case AUDIO_FORMAT_PCM_32_BIT:
-        return SND_PCM_FORMAT_S32_LE;
-    case AUDIO_FORMAT_PCM_8_24_BIT:
-        return SND_PCM_FORMAT_S24_LE;
-#endif
-    case AUDIO_FORMAT_PCM_FLOAT:  /* there is no equivalent for float */
-    default:
-        LOG_ALWAYS_FATAL("pcm_format_from_audio_format: invalid audio format %#x", format);
-        return 0;
-    }
-}
-
-/* Converts pcm_format to audio_format.
- * Parameters:
- *  format  the pcm_format to convert
- *
- * Logs a fatal error if format is not a valid convertible pcm_format.
- */
-static audio_format_t audio_format_from_pcm_format(snd_pcm_format_t format)
-{
-    switch (format) {
-#if HAVE_BIG_ENDIAN
-    case SND_PCM_FORMAT_S16_BE:
-        return AUDIO_FORMAT_PCM_16_BIT;
-    case SND_PCM_FORMAT_S24_3BE:
-        return AUDIO_FORMAT_PCM_24_BIT_PACKED;
-    case SND_PCM_FORMAT_S24_BE:
-        return AUDIO_FORMAT_PCM_8_24_BIT;
-    case SND_PCM_FORMAT_S32_BE:
-        return AUDIO_FORMAT_PCM_32_BIT;
-#else
-    case SND_PCM_FORMAT_S16_LE:
-        return AUDIO_FORMAT_PCM_16_BIT;
-    case SND_PCM_FORMAT_S24_3LE:
-        return AUDIO_FORMAT_PCM_24_BIT_PACKED;
-    case SND_PCM_FORMAT_S24_LE:
-        return AUDIO_FORMAT_PCM_8_24_BIT;
-    case SND_PCM_FORMAT_S32_LE:
-        return AUDIO_FORMAT_PCM_32_BIT;
-#endif
-    default:
-        LOG_ALWAYS_FATAL("audio_format_from_pcm_format: invalid pcm format %#x", format);
-        return 0;
-    }
+    return audio_channel_out_mask_from_count(out->channels);
 }
 
 static audio_format_t out_get_format(const struct audio_stream *stream)
 {
     ALOGV("out_get_format");
     struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
-    return audio_format_from_pcm_format(out->config.format);
+    return out->format;
 }
 
 static int out_set_format(struct audio_stream *stream, audio_format_t format)
@@ -366,36 +689,97 @@ static int out_set_format(struct audio_stream *stream, audio_format_t format)
     return -ENOSYS;
 }
 
-static int do_output_standby(struct alsa_stream_out *out)
+/*
+ * Go to standby.  A warm standby only pauses the host stream, it gets
+ * closed once the stream has been idle for standby_timeout_ms, or right
+ * away on a cold standby.  Must be called with the output stream mutex
+ * locked.
+ */
+static int do_output_standby(struct alsa_stream_out *out, bool warm)
 {
     struct alsa_audio_device *adev = out->dev;
 
     if (!out->standby) {
-        snd_pcm_close(out->pcm);
-        out->pcm = NULL;
-        adev->active_output = NULL;
+        mmap_stream_stop(&out->mmap);
+        reconnect_cancel(&out->reconnect);
         out->standby = 1;
+        out->unavailable = false;
+        out->silence_until.tv_sec = 0;
+        out->silence_until.tv_nsec = 0;
+        pthread_mutex_lock(&adev->lock);
+        if (adev->active_output == out) {
+            adev->active_output = NULL;
+            /* playback stopped, the reference resyncs on the next write */
+            if (adev->echo_reference)
+                adev->echo_reference->write(adev->echo_reference, NULL);
+        }
+        pthread_mutex_unlock(&adev->lock);
+
+        if (warm && out->pcm && adev->standby_timeout_ms &&
+                out->backend->pause(out->pcm) == 0) {
+            out->paused = true;
+            idle_timer_arm(&out->idle_timer, adev->standby_timeout_ms);
+            return 0;
+        }
+    }
+
+    if (out->paused) {
+        idle_timer_disarm(&out->idle_timer);
+        out->paused = false;
+    }
+    if (out->pcm) {
+        out->backend->close(out->pcm);
+        out->pcm = NULL;
     }
     return 0;
 }
 
+static void out_idle_expired(void *context)
+{
+    struct alsa_stream_out *out = context;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->paused) {
+        ALOGV("output idle, closing the host stream");
+        do_output_standby(out, false);
+    }
+    pthread_mutex_unlock(&out->lock);
+}
+
 static int out_standby(struct audio_stream *stream)
 {
     ALOGV("out_standby");
     struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
     int status;
 
-    pthread_mutex_lock(&out->dev->lock);
     pthread_mutex_lock(&out->lock);
-    status = do_output_standby(out);
+    status = do_output_standby(out, true);
+    /* whatever made the fast mixer late is likely over by the next use */
+    if ((out->flags & AUDIO_OUTPUT_FLAG_FAST) && out->config.period_size > FAST_PERIOD_SIZE) {
+        out->config.period_size = FAST_PERIOD_SIZE;
+        out->clean_frames = 0;
+        out->reconfigure = true;
+    }
     pthread_mutex_unlock(&out->lock);
-    pthread_mutex_unlock(&out->dev->lock);
     return status;
 }
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
     ALOGV("out_dump");
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    dprintf(fd, "      Backend: %s\n", out->backend ? out->backend->name : "none");
+    dprintf(fd, "      Host config: %u Hz, %u ch, format %#x, period %u x %u\n",
+            out->config.rate, out->config.channels, out->config.format,
+            out->config.period_size, out->config.period_count);
+    dprintf(fd, "      Standby: %s%s\n",
+            !out->standby ? "no" : out->paused ? "warm" : "cold",
+            out->unavailable ? ", host unavailable" : "");
+    dprintf(fd, "      Frames written: %llu\n", (unsigned long long)out->written);
+    stream_stats_dump(&out->stats, fd);
+    pthread_mutex_unlock(&out->lock);
     return 0;
 }
 
@@ -414,13 +798,11 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
     if (ret >= 0) {
         val = atoi(value);
         pthread_mutex_lock(&adev->lock);
-        pthread_mutex_lock(&out->lock);
         if (((adev->out_devices & AUDIO_DEVICE_OUT_ALL) != val) && (val != 0)) {
              adev->out_devices &= ~AUDIO_DEVICE_OUT_ALL;
              adev->out_devices |= val;
         }
         select_devices(adev);
-        pthread_mutex_unlock(&out->lock);
         pthread_mutex_unlock(&adev->lock);
     }
 
@@ -438,7 +820,7 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     ALOGV("out_get_latency");
     struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
-    return (PLAYBACK_PERIOD_SIZE * PLAYBACK_PERIOD_COUNT * 1000) / out->config.rate;
+    return (out->config.period_size * out->config.period_count * 1000) / out->config.rate;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -448,6 +830,237 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
     return 0;
 }
 
+/* must be called with the output stream mutex locked */
+static void out_handle_underrun(struct alsa_stream_out *out)
+{
+    stream_stats_xrun(&out->stats);
+
+    /* the fast mixer could not keep up, trade some latency for stability */
+    if ((out->flags & AUDIO_OUTPUT_FLAG_FAST) &&
+            out->config.period_size < FAST_PERIOD_SIZE_MAX) {
+        out->config.period_size *= 2;
+        out->reconfigure = true;
+        ALOGI("underrun on fast output, period size now %u frames", out->config.period_size);
+    }
+    out->clean_frames = 0;
+}
+
+/* must be called with the output stream mutex locked */
+static void out_decay_period(struct alsa_stream_out *out, size_t frames)
+{
+    if (!(out->flags & AUDIO_OUTPUT_FLAG_FAST) || out->config.period_size <= FAST_PERIOD_SIZE)
+        return;
+
+    /* a hiccup should not cost latency for the rest of the stream */
+    out->clean_frames += frames;
+    if (out->clean_frames < (uint64_t)out->config.rate * FAST_PERIOD_DECAY_SECONDS)
+        return;
+    out->clean_frames = 0;
+    out->config.period_size /= 2;
+    out->reconfigure = true;
+    ALOGI("no underrun on fast output for %d s, period size now %u frames",
+          FAST_PERIOD_DECAY_SECONDS, out->config.period_size);
+}
+
+/*
+ * Gains folding the client channel layout into stereo, as ITU-R BS.775 has
+ * them: fronts at unity, centre and surrounds at -3 dB, LFE dropped.  The
+ * sum can exceed full scale, downmix_to_stereo_float() clamps it.
+ */
+static void out_init_downmix(struct alsa_stream_out *out)
+{
+    audio_channel_mask_t mask = audio_channel_out_mask_from_count(out->channels);
+    unsigned int c = 0;
+    uint32_t bit;
+
+    if (out->channels == 1) {
+        out->downmix[0][0] = out->downmix[0][1] = 1.0f;
+        return;
+    }
+
+    /* interleaved samples follow the mask bits, lowest first */
+    for (bit = 1; bit && c < out->channels; bit <<= 1) {
+        float *gain = out->downmix[c];
+
+        if (!(mask & bit))
+            continue;
+        switch (bit) {
+        case AUDIO_CHANNEL_OUT_FRONT_LEFT:
+            gain[0] = 1.0f;
+            gain[1] = 0;
+            break;
+        case AUDIO_CHANNEL_OUT_FRONT_RIGHT:
+            gain[0] = 0;
+            gain[1] = 1.0f;
+            break;
+        case AUDIO_CHANNEL_OUT_BACK_LEFT:
+        case AUDIO_CHANNEL_OUT_SIDE_LEFT:
+            gain[0] = MINUS_3_DB;
+            gain[1] = 0;
+            break;
+        case AUDIO_CHANNEL_OUT_BACK_RIGHT:
+        case AUDIO_CHANNEL_OUT_SIDE_RIGHT:
+            gain[0] = 0;
+            gain[1] = MINUS_3_DB;
+            break;
+        case AUDIO_CHANNEL_OUT_LOW_FREQUENCY:
+            /* small stereo speakers cannot reproduce it, it would only eat headroom */
+            gain[0] = gain[1] = 0;
+            break;
+        default:
+            gain[0] = gain[1] = MINUS_3_DB;
+            break;
+        }
+        c++;
+    }
+}
+
+static inline float clamp_unity(float x)
+{
+    return x > 1.0f ? 1.0f : x < -1.0f ? -1.0f : x;
+}
+
+/* May run in place: frame i is fully read before its stereo result is stored. */
+static void downmix_to_stereo_float(float *dst, const float *src, size_t frames,
+                                    unsigned int channels, const float (*gain)[2])
+{
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames; i++, src += channels, dst += 2) {
+        float l = 0, r = 0;
+
+        for (c = 0; c < channels; c++) {
+            l += src[c] * gain[c][0];
+            r += src[c] * gain[c][1];
+        }
+        dst[0] = clamp_unity(l);
+        dst[1] = clamp_unity(r);
+    }
+}
+
+/*
+ * Convert a client buffer to the host layout and format, returns what to
+ * hand to the backend.  Must be called with the output stream mutex locked.
+ */
+static const void *out_convert(struct alsa_stream_out *out, const void *buffer, size_t frames)
+{
+    size_t size = frames * out->channels * sizeof(float);
+    const float *src;
+
+    if (out->config.channels == out->channels && out->config.format == out->format)
+        return buffer;
+
+    if (out->conv_buf_size < size) {
+        void *conv_buf = realloc(out->conv_buf, size);
+        if (!conv_buf)
+            return NULL;
+        out->conv_buf = conv_buf;
+        out->conv_buf_size = size;
+    }
+
+    /* everything goes through float, the audio_utils helpers are vectorized */
+    if (out->format == AUDIO_FORMAT_PCM_FLOAT) {
+        src = buffer;
+    } else {
+        memcpy_to_float_from_i16(out->conv_buf, buffer, frames * out->channels);
+        src = out->conv_buf;
+    }
+
+    if (out->config.channels != out->channels) {
+        downmix_to_stereo_float(out->conv_buf, src, frames, out->channels,
+                                (const float (*)[2])out->downmix);
+        src = out->conv_buf;
+    }
+
+    if (out->config.format == AUDIO_FORMAT_PCM_16_BIT)
+        memcpy_to_i16_from_float(out->conv_buf, src, frames * out->config.channels);
+    else if (src != out->conv_buf)
+        memcpy(out->conv_buf, src, frames * out->config.channels * sizeof(float));
+
+    return out->conv_buf;
+}
+
+/*
+ * The echo reference only takes 16 bit with up to two channels, so the
+ * host data is folded down once more when needed.  Must be called with the
+ * output stream mutex locked.
+ */
+static const void *out_echo_reference_frames(struct alsa_stream_out *out, const void *data,
+                                             size_t frames)
+{
+    size_t size = frames * out->config.channels * sizeof(float);
+    const float *src;
+
+    if (out->config.format == AUDIO_FORMAT_PCM_16_BIT && out->config.channels == CHANNEL_STEREO)
+        return data;
+
+    if (out->ref_buf_size < size) {
+        void *ref_buf = realloc(out->ref_buf, size);
+        if (!ref_buf)
+            return NULL;
+        out->ref_buf = ref_buf;
+        out->ref_buf_size = size;
+    }
+
+    if (out->config.format == AUDIO_FORMAT_PCM_FLOAT) {
+        src = data;
+    } else {
+        memcpy_to_float_from_i16(out->ref_buf, data, frames * out->config.channels);
+        src = out->ref_buf;
+    }
+    /* more than two host channels means the client layout was passed through */
+    if (out->config.channels != CHANNEL_STEREO) {
+        downmix_to_stereo_float(out->ref_buf, src, frames, out->config.channels,
+                                (const float (*)[2])out->downmix);
+        src = out->ref_buf;
+    }
+    memcpy_to_i16_from_float(out->ref_buf, src, frames * CHANNEL_STEREO);
+
+    return out->ref_buf;
+}
+
+/*
+ * Hand what was just written to the capture AEC, along with when it will
+ * be heard.  Must be called with the output stream mutex locked.
+ */
+static void out_echo_reference_write(struct alsa_stream_out *out, const void *data,
+                                     size_t frames, uint64_t delay,
+                                     const struct timespec *timestamp)
+{
+    struct alsa_audio_device *adev = out->dev;
+    struct echo_reference_buffer b;
+
+    /* unlocked peek, checked again below: most of the time nobody listens */
+    if (!adev->echo_reference || adev->active_output != out)
+        return;
+
+    b.raw = (void *)out_echo_reference_frames(out, data, frames);
+    if (!b.raw)
+        return;
+    b.frame_count = frames;
+    /* the first frame written plays once what was queued before it has */
+    b.delay_ns = (delay > frames ? delay - frames : 0) * 1000000000 / out->config.rate;
+    b.time_stamp = *timestamp;
+
+    pthread_mutex_lock(&adev->lock);
+    if (adev->echo_reference && adev->active_output == out &&
+            adev->echo_reference_rate == out->config.rate)
+        adev->echo_reference->write(adev->echo_reference, &b);
+    pthread_mutex_unlock(&adev->lock);
+}
+
+/* must be called with the output stream mutex locked */
+static void out_set_unavailable(struct alsa_stream_out *out)
+{
+    if (out->pcm) {
+        out->backend->close(out->pcm);
+        out->pcm = NULL;
+    }
+    out->unavailable = true;
+    reconnect_start(&out->reconnect, &out->config);
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         size_t bytes)
 {
@@ -456,182 +1069,265 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     struct alsa_audio_device *adev = out->dev;
     size_t frame_size = audio_stream_out_frame_size(stream);
     size_t out_frames = bytes / frame_size;
+    unsigned int xruns;
 
-    /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-     * on the output stream mutex - e.g. executing select_mode() while holding the hw device
-     * mutex
-     */
-    pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&out->lock);
+    if (out->reconfigure) {
+        do_output_standby(out, false);
+        out->reconfigure = false;
+    }
     if (out->standby) {
-        ret = start_output_stream(out);
-        if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            goto exit;
-        }
         out->standby = 0;
+        out->written_at_start = out->written;
+        if (resume_output_stream(out) != 0)
+            out_set_unavailable(out);
+    } else if (out->unavailable &&
+               reconnect_take(&out->reconnect, &out->config, &out->backend, &out->pcm)) {
+        out->unavailable = false;
+        out->last_xruns = 0;
+        out->silence_until.tv_sec = 0;
+        out->silence_until.tv_nsec = 0;
+        out->stats.reconnects++;
+        pthread_mutex_lock(&adev->lock);
+        adev->active_output = out;
+        pthread_mutex_unlock(&adev->lock);
     }
 
-    pthread_mutex_unlock(&adev->lock);
+    stream_stats_begin(&out->stats);
+    if (!out->unavailable) {
+        struct timespec timestamp;
+        uint64_t delay;
+
+        const void *data = out_convert(out, buffer, out_frames);
+
+        ret = data ? out->backend->write(out->pcm, data, out_frames) : -ENOMEM;
+        /* pulse counts underflows from its own thread, between writes too */
+        xruns = out->backend->get_xruns(out->pcm);
+        if (xruns != out->last_xruns) {
+            out->last_xruns = xruns;
+            out_handle_underrun(out);
+        } else if (ret >= 0) {
+            out_decay_period(out, out_frames);
+        }
 
-    ret = snd_pcm_writei(out->pcm, buffer, out_frames);
-    if (ret == -EPIPE) {
-	    snd_pcm_prepare(out->pcm);
-	    ret = snd_pcm_writei(out->pcm, buffer, out_frames);
-    }
+        if (ret >= 0 && out->backend->get_delay(out->pcm, &delay, &timestamp) == 0) {
+            stream_stats_transfer(&out->stats, out_frames, delay,
+                                  out->config.period_size * out->config.period_count,
+                                  out->config.rate);
+            out_echo_reference_write(out, data, out_frames, delay, &timestamp);
+        }
 
-    if (ret > 0) {
-        out->written += ret;
+        if (ret < 0) {
+            out->stats.errors++;
+            ALOGW("write failed: %d, reconnecting in the background", ret);
+            out_set_unavailable(out);
+        }
     }
-exit:
+
+    /* the host is not there: drop the data, but at the rate it would have played */
+    if (out->unavailable)
+        pace_silence(&out->silence_until, out_frames, out->config.rate);
+    out->written += out_frames;
+
     pthread_mutex_unlock(&out->lock);
 
-    if (ret < 0) {
-        usleep((int64_t)bytes * 1000000 / audio_stream_out_frame_size(stream) /
-                out_get_sample_rate(&stream->common));
+    return bytes;
+}
+
+/*
+ * Frames that reached the speaker: everything written minus what the host
+ * still has queued, as of the timestamp.  Must be called with the output
+ * stream mutex locked.
+ */
+static int out_get_presented_locked(struct alsa_stream_out *out, uint64_t *frames,
+                                    struct timespec *timestamp)
+{
+    uint64_t delay;
+
+    if (out->pcm && !out->paused) {
+        if (out->backend->get_delay(out->pcm, &delay, timestamp))
+            return -ENODATA;
+        *frames = out->written > delay ? out->written - delay : 0;
+    } else if (out->unavailable || out->paused) {
+        /* dropped or flushed frames count as played, they were consumed in real time */
+        clock_gettime(CLOCK_MONOTONIC, timestamp);
+        *frames = out->written;
+    } else {
+        return -ENODATA;
     }
 
-    return bytes;
+    /* the host latency estimate jitters and jumps on underruns */
+    if (*frames < out->presented)
+        *frames = out->presented;
+    out->presented = *frames;
+    return 0;
 }
 
 static int out_get_render_position(const struct audio_stream_out *stream,
         uint32_t *dsp_frames)
 {
-    *dsp_frames = 0;
-    ALOGV("out_get_render_position: dsp_frames: %p", dsp_frames);
-    return -EINVAL;
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+    struct timespec timestamp;
+    uint64_t frames;
+    int ret = -ENODATA;
+
+    pthread_mutex_lock(&out->lock);
+    if (!out->standby && out_get_presented_locked(out, &frames, &timestamp) == 0) {
+        *dsp_frames = frames > out->written_at_start ? frames - out->written_at_start : 0;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    ALOGV("out_get_render_position: %d", ret);
+    return ret;
 }
 
 static int out_get_presentation_position(const struct audio_stream_out *stream,
                                    uint64_t *frames, struct timespec *timestamp)
 {
     struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
-    int ret = -ENODATA;
+    int ret;
 
-        if (out->pcm) {
-            snd_pcm_uframes_t avail;
-            if (snd_pcm_htimestamp(out->pcm, &avail, timestamp) == 0) {
-                size_t kernel_buffer_size = out->config.period_size * out->config.period_count;
-                int64_t signed_frames = out->written - kernel_buffer_size + avail;
-                if (signed_frames >= 0) {
-                    *frames = signed_frames;
-                    ret = 0;
-                }
-            }
-        }
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_presented_locked(out, frames, timestamp);
+    pthread_mutex_unlock(&out->lock);
 
     return ret;
 }
 
-
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
     ALOGV("out_add_audio_effect: %p", effect);
     return 0;
 }
 
-static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+{
+    ALOGV("out_remove_audio_effect: %p", effect);
+    return 0;
+}
+
+static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
+        int64_t *timestamp)
+{
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+    struct timespec now;
+    uint64_t frames;
+    int ret = -ENODATA;
+
+    /* the next frame plays once everything queued before it did */
+    pthread_mutex_lock(&out->lock);
+    if (!out->standby && out_get_presented_locked(out, &frames, &now) == 0) {
+        *timestamp = now.tv_sec * 1000000LL + now.tv_nsec / 1000 +
+                     (int64_t)(out->written - frames) * 1000000 / out->config.rate;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    ALOGV("out_get_next_write_timestamp: %d", ret);
+    return ret;
+}
+
+static int out_create_mmap_buffer(const struct audio_stream_out *stream,
+                                  int32_t min_size_frames,
+                                  struct audio_mmap_buffer_info *info)
+{
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+    int ret;
+
+    ALOGV("out_create_mmap_buffer: min_size_frames %d", min_size_frames);
+    if (!(out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) || !info)
+        return -EINVAL;
+
+    pthread_mutex_lock(&out->lock);
+    ret = mmap_stream_create_buffer(&out->mmap, false,
+                                    audio_stream_out_frame_size(stream),
+                                    out->config.period_size, min_size_frames, info);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_get_mmap_position(const struct audio_stream_out *stream,
+                                 struct audio_mmap_position *position)
+{
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+
+    if (!position)
+        return -EINVAL;
+    /* called from the AAudio service timing loop, so no stream lock */
+    return mmap_stream_get_position(&out->mmap, position);
+}
+
+static int out_start(const struct audio_stream_out *stream)
+{
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+    int ret = 0;
+
+    ALOGV("out_start");
+    pthread_mutex_lock(&out->lock);
+    if (!mmap_stream_has_buffer(&out->mmap)) {
+        ret = -ENOSYS;
+        goto exit;
+    }
+    if (out->standby) {
+        /* AAudio falls back to a legacy stream, no point reconnecting here */
+        ret = resume_output_stream(out);
+        if (ret) {
+            out->unavailable = false;
+            goto exit;
+        }
+        out->standby = 0;
+    }
+    ret = mmap_stream_start(&out->mmap, out->backend, out->pcm, out->config.rate);
+    if (ret)
+        do_output_standby(out, false);
+exit:
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_stop(const struct audio_stream_out *stream)
 {
-    ALOGV("out_remove_audio_effect: %p", effect);
-    return 0;
-}
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
 
-static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
-        int64_t *timestamp)
-{
-    *timestamp = 0;
-    ALOGV("out_get_next_write_timestamp: %ld", (long int)(*timestamp));
-    return -EINVAL;
+    ALOGV("out_stop");
+    if (!mmap_stream_has_buffer(&out->mmap))
+        return -ENOSYS;
+
+    pthread_mutex_lock(&out->lock);
+    do_output_standby(out, true);
+    pthread_mutex_unlock(&out->lock);
+    return 0;
 }
 
 /** audio_stream_in implementation **/
 
-/* must be called with hw device and input stream mutexes locked */
+/* must be called with the input stream mutex locked */
 static int start_input_stream(struct alsa_stream_in *in)
 {
     struct alsa_audio_device *adev = in->dev;
-    snd_pcm_hw_params_t *hwparams;
-    in->unavailable = true;
-    unsigned int pcm_retry_count = PCM_OPEN_RETRIES;
     int ret;
 
-    while (1) {
-        ret = snd_pcm_open(&in->pcm, "pulse", SND_PCM_STREAM_CAPTURE, 0);
-        if (ret < 0) {
-            if (in->pcm != NULL) {
-                snd_pcm_close(in->pcm);
-                in->pcm = NULL;
-            }
-            if (--pcm_retry_count == 0) {
-                ALOGE("Failed to open pcm_in after %d tries", PCM_OPEN_RETRIES);
-                adev->active_input = NULL;
-                return -ENODEV;
-            }
-            usleep(PCM_OPEN_WAIT_TIME_MS * 1000);
-        } else {
-            break;
-        }
-    }
-
-    snd_pcm_hw_params_alloca(&hwparams);
-    if (snd_pcm_hw_params_any(in->pcm, hwparams) < 0) {
-        ALOGE("Can not configure this PCM device.");
-        adev->active_input = NULL;
-        return -ENODEV;
-    }
-
-    if (snd_pcm_hw_params_set_access(in->pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
-        ALOGE("Error setting access.\n");
-        adev->active_input = NULL;
-  	    return -ENODEV;
-    }
-
-    if (snd_pcm_hw_params_set_format(in->pcm, hwparams, in->config.format) < 0) {
-        ALOGE("Error setting format.\n");
-        adev->active_input = NULL;
-  	    return -ENODEV;
-    }
-
-    if (snd_pcm_hw_params_set_rate_near(in->pcm, hwparams, &in->config.rate, 0) < 0) {
-        ALOGE("Error setting rate.\n");
-        adev->active_input = NULL;
-  	    return -ENODEV;
-    }
-
-    if (snd_pcm_hw_params_set_channels(in->pcm, hwparams, in->config.channels) < 0) {
-        ALOGE("Error setting channels.\n");
-        adev->active_input = NULL;
-  	    return -ENODEV;
-    }
-
-    if (snd_pcm_hw_params(in->pcm, hwparams) < 0) {
-        ALOGE("Error setting HW params.");
-        adev->active_input = NULL;
-        return -ENODEV;
-    }
-
-    if (snd_pcm_prepare(in->pcm) < 0) {
-       ALOGE("Can not prepare this PCM device.");
-        adev->active_input = NULL;
-        return -ENODEV;
-    }
+    in->unavailable = true;
 
-    if (snd_pcm_state(in->pcm) != SND_PCM_STATE_PREPARED) {
-        ALOGE("cannot open pcm_in driver");
-        snd_pcm_close(in->pcm);
-        adev->active_input = NULL;
+    ret = open_backend_stream(adev, true, false, &in->config, &in->backend, &in->pcm);
+    if (ret) {
+        ALOGE("cannot open input stream: %d", ret);
         return -ENODEV;
     }
+    in->stats.cold_starts++;
 
     in->unavailable = false;
+    pthread_mutex_lock(&adev->lock);
     adev->active_input = in;
+    pthread_mutex_unlock(&adev->lock);
     return 0;
 }
 
 static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
     struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
-    return in->config.rate;
+    return in->rate;
 }
 
 static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -640,12 +1336,13 @@ static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
     return -ENOSYS;
 }
 
-static size_t get_input_buffer_size(audio_format_t format,
+static size_t get_input_buffer_size(uint32_t sample_rate, audio_format_t format,
                                     audio_channel_mask_t channel_mask)
 {
-    /* return the closest majoring multiple of 16 frames, as
-     * audioflinger expects audio buffers to be a multiple of 16 frames */
-    size_t frames = CAPTURE_PERIOD_SIZE;
+    /* one host period worth of frames at the client rate, rounded to the
+     * closest majoring multiple of 16 frames, as audioflinger expects audio
+     * buffers to be a multiple of 16 frames */
+    size_t frames = (size_t)CAPTURE_PERIOD_SIZE * sample_rate / CAPTURE_CODEC_SAMPLING_RATE;
     frames = ((frames + 15) / 16) * 16;
     size_t bytes_per_frame = audio_channel_count_from_in_mask(channel_mask) *
                             audio_bytes_per_sample(format);
@@ -656,15 +1353,15 @@ static size_t get_input_buffer_size(audio_format_t format,
 static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
 {
     struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
-    ALOGV("in_get_channels: %d", in->config.channels);
-    return audio_channel_in_mask_from_count(in->config.channels);
+    ALOGV("in_get_channels: %d", in->channels);
+    return audio_channel_in_mask_from_count(in->channels);
 }
 
 static audio_format_t in_get_format(const struct audio_stream *stream)
 {
     struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
-    ALOGV("in_get_format: %d", in->config.format);
-    return audio_format_from_pcm_format(in->config.format);
+    ALOGV("in_get_format: %d", in->format);
+    return in->format;
 }
 
 static int in_set_format(struct audio_stream *stream, audio_format_t format)
@@ -675,20 +1372,81 @@ static int in_set_format(struct audio_stream *stream, audio_format_t format)
 static size_t in_get_buffer_size(const struct audio_stream *stream)
 {
 
-    size_t buffer_size = get_input_buffer_size(stream->get_format(stream),
-                            stream->get_channels(stream));
+    size_t buffer_size = get_input_buffer_size(stream->get_sample_rate(stream),
+                            stream->get_format(stream), stream->get_channels(stream));
     ALOGV("in_get_buffer_size: %zu", buffer_size);
     return buffer_size;
 }
 
+/*
+ * Take the playback reference for the AEC, the first input asking for it
+ * gets it.  Must be called with the input stream mutex locked.
+ */
+static void in_get_echo_reference(struct alsa_stream_in *in)
+{
+    struct alsa_audio_device *adev = in->dev;
+    struct echo_reference_itfe *reference;
+    unsigned int rate;
+
+    pthread_mutex_lock(&adev->lock);
+    if (!adev->echo_reference) {
+        /* output rates are fixed once open, no need for the output lock */
+        rate = adev->active_output ? adev->active_output->config.rate :
+                                     PLAYBACK_CODEC_SAMPLING_RATE;
+        if (create_echo_reference(AUDIO_FORMAT_PCM_16_BIT, in->channels, in->rate,
+                                  AUDIO_FORMAT_PCM_16_BIT, CHANNEL_STEREO, rate,
+                                  &reference) == 0) {
+            adev->echo_reference = reference;
+            adev->echo_reference_rate = rate;
+            in->echo_reference = reference;
+        } else {
+            ALOGW("failed to create an echo reference, %u Hz playback", rate);
+        }
+    }
+    pthread_mutex_unlock(&adev->lock);
+}
+
+/* must be called with the input stream mutex locked */
+static void in_put_echo_reference(struct alsa_stream_in *in)
+{
+    struct alsa_audio_device *adev = in->dev;
+
+    if (!in->echo_reference)
+        return;
+
+    /* once unpublished no output can be writing to it */
+    pthread_mutex_lock(&adev->lock);
+    if (adev->echo_reference == in->echo_reference)
+        adev->echo_reference = NULL;
+    pthread_mutex_unlock(&adev->lock);
+    release_echo_reference(in->echo_reference);
+    in->echo_reference = NULL;
+}
+
+/* must be called with the input stream mutex locked */
 static int do_input_standby(struct alsa_stream_in *in)
 {
     struct alsa_audio_device *adev = in->dev;
 
     if (!in->standby) {
-        snd_pcm_close(in->pcm);
-        in->pcm = NULL;
-        adev->active_input = NULL;
+        mmap_stream_stop(&in->mmap);
+        capture_buffer_stop(&in->capture);
+        reconnect_cancel(&in->reconnect);
+        if (in->pcm) {
+            in->backend->close(in->pcm);
+            in->pcm = NULL;
+        }
+        pthread_mutex_lock(&adev->lock);
+        if (adev->active_input == in)
+            adev->active_input = NULL;
+        pthread_mutex_unlock(&adev->lock);
+        in->unavailable = false;
+        in->silence_until.tv_sec = 0;
+        in->silence_until.tv_nsec = 0;
+        in->host_frames = 0;
+        if (in->resampler)
+            in->resampler->reset(in->resampler);
+        in_put_echo_reference(in);
         in->standby = true;
     }
     return 0;
@@ -700,15 +1458,30 @@ static int in_standby(struct audio_stream *stream)
     int status;
 
     pthread_mutex_lock(&in->lock);
-    pthread_mutex_lock(&in->dev->lock);
     status = do_input_standby(in);
-    pthread_mutex_unlock(&in->dev->lock);
     pthread_mutex_unlock(&in->lock);
     return status;
 }
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+
+    pthread_mutex_lock(&in->lock);
+    dprintf(fd, "      Backend: %s\n", in->backend ? in->backend->name : "none");
+    dprintf(fd, "      Host config: %u Hz, %u ch, format %#x, period %u x %u\n",
+            in->config.rate, in->config.channels, in->config.format,
+            in->config.period_size, in->config.period_count);
+    dprintf(fd, "      Client config: %u Hz, %u ch, format %#x%s\n",
+            in->rate, in->channels, in->format, in->resampler ? ", resampled" : "");
+    dprintf(fd, "      Standby: %s%s\n", in->standby ? "yes" : "no",
+            in->unavailable ? ", host unavailable" : "");
+    dprintf(fd, "      Frames read: %llu\n", (unsigned long long)in->read);
+    dprintf(fd, "      Pre-processing: %d effects%s\n", in->num_preprocessors,
+            in->echo_reference ? ", echo reference" : "");
+    capture_buffer_dump(&in->capture, fd);
+    stream_stats_dump(&in->stats, fd);
+    pthread_mutex_unlock(&in->lock);
     return 0;
 }
 
@@ -728,6 +1501,191 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
     return 0;
 }
 
+/*
+ * Resampler buffer provider: hands out host periods, already downmixed
+ * when the client wants mono so that the resampler has less to chew on.
+ */
+static int in_get_next_buffer(struct resampler_buffer_provider *buffer_provider,
+                              struct resampler_buffer *buffer)
+{
+    struct alsa_stream_in *in = (struct alsa_stream_in *)((char *)buffer_provider -
+            offsetof(struct alsa_stream_in, buf_provider));
+    ssize_t ret;
+
+    if (in->host_frames == 0) {
+        if (in->host_buf_frames < in->config.period_size) {
+            int16_t *host_buf = realloc(in->host_buf, in->config.period_size *
+                                        in->config.channels * sizeof(int16_t));
+            if (!host_buf) {
+                ret = -ENOMEM;
+                goto error;
+            }
+            in->host_buf = host_buf;
+            in->host_buf_frames = in->config.period_size;
+        }
+
+        ret = capture_buffer_read(&in->capture, in->host_buf, in->config.period_size);
+        if (ret <= 0) {
+            ret = ret ? ret : -EIO;
+            goto error;
+        }
+        if (in->channels == 1 && in->config.channels == 2)
+            downmix_to_mono_i16_from_stereo_i16(in->host_buf, in->host_buf, ret);
+        in->host_frames = ret;
+        in->host_offset = 0;
+    }
+
+    if (buffer->frame_count > in->host_frames)
+        buffer->frame_count = in->host_frames;
+    buffer->i16 = in->host_buf + in->host_offset * in->channels;
+    return 0;
+
+error:
+    in->read_status = ret;
+    buffer->raw = NULL;
+    buffer->frame_count = 0;
+    return ret;
+}
+
+static void in_release_buffer(struct resampler_buffer_provider *buffer_provider,
+                              struct resampler_buffer *buffer)
+{
+    struct alsa_stream_in *in = (struct alsa_stream_in *)((char *)buffer_provider -
+            offsetof(struct alsa_stream_in, buf_provider));
+
+    in->host_offset += buffer->frame_count;
+    in->host_frames -= buffer->frame_count;
+}
+
+static void in_set_echo_delay(effect_handle_t effect, int32_t delay_us)
+{
+    uint32_t buf[sizeof(effect_param_t) / sizeof(uint32_t) + 2];
+    effect_param_t *param = (effect_param_t *)buf;
+    uint32_t size = sizeof(int32_t);
+
+    param->psize = sizeof(uint32_t);
+    param->vsize = sizeof(int32_t);
+    *(uint32_t *)param->data = AEC_PARAM_ECHO_DELAY;
+    *((int32_t *)param->data + 1) = delay_us;
+    (*effect)->command(effect, EFFECT_CMD_SET_PARAM,
+                       sizeof(effect_param_t) + param->psize + param->vsize,
+                       param, &size, &param->status);
+}
+
+/*
+ * Give the AEC the playback that matches frames about to be processed.
+ * Must be called with the input stream mutex locked.
+ */
+static void in_push_echo_reference(struct alsa_stream_in *in, size_t frames)
+{
+    struct echo_reference_buffer b;
+    audio_buffer_t buf;
+    uint64_t queued;
+    int i;
+
+    if (in->ref_buf_frames < frames) {
+        int16_t *ref_buf = realloc(in->ref_buf, frames * in->channels * sizeof(int16_t));
+        if (!ref_buf)
+            return;
+        in->ref_buf = ref_buf;
+        in->ref_buf_frames = frames;
+    }
+
+    /* capture delay: still on the host, in the jitter buffer and in the HAL */
+    b.delay_ns = 0;
+    if (capture_buffer_get_position(&in->capture, &queued, &b.time_stamp) == 0) {
+        b.delay_ns = (queued + in->host_frames) * 1000000000 / in->config.rate;
+        if (in->resampler)
+            b.delay_ns += in->resampler->delay_ns(in->resampler);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &b.time_stamp);
+    }
+    b.raw = in->ref_buf;
+    b.frame_count = frames;
+    if (in->echo_reference->read(in->echo_reference, &b) != 0)
+        return;
+
+    /* only the AEC implements these, the other effects just refuse them */
+    buf.frameCount = b.frame_count;
+    buf.s16 = in->ref_buf;
+    for (i = 0; i < in->num_preprocessors; i++) {
+        if ((*in->preprocessors[i])->process_reverse == NULL)
+            continue;
+        (*in->preprocessors[i])->process_reverse(in->preprocessors[i], &buf, NULL);
+        in_set_echo_delay(in->preprocessors[i], b.delay_ns / 1000);
+    }
+}
+
+/* must be called with the input stream mutex locked */
+static void in_preprocess(struct alsa_stream_in *in, int16_t *buffer, size_t frames)
+{
+    audio_buffer_t buf;
+    int i;
+
+    if (in->echo_reference)
+        in_push_echo_reference(in, frames);
+
+    for (i = 0; i < in->num_preprocessors; i++) {
+        buf.frameCount = frames;
+        buf.s16 = buffer;
+        (*in->preprocessors[i])->process(in->preprocessors[i], &buf, &buf);
+    }
+}
+
+/*
+ * Fill buffer with frames at the client rate, channel count and format.
+ * Must be called with the input stream mutex locked.
+ */
+static int in_read_frames(struct alsa_stream_in *in, void *buffer, size_t frames)
+{
+    int16_t *dst = buffer;
+    size_t done = 0;
+
+    in->read_status = 0;
+    if (in->resampler) {
+        done = frames;
+        in->resampler->resample_from_provider(in->resampler, dst, &done);
+    } else {
+        while (done < frames && in->read_status == 0) {
+            struct resampler_buffer b = { .frame_count = frames - done };
+
+            if (in_get_next_buffer(&in->buf_provider, &b))
+                break;
+            memcpy(dst + done * in->channels, b.i16, b.frame_count * in->channels * sizeof(int16_t));
+            done += b.frame_count;
+            in_release_buffer(&in->buf_provider, &b);
+        }
+    }
+    if (in->read_status)
+        return in->read_status;
+    if (done < frames)
+        return -EIO;
+
+    /* the effects are configured for the client rate and channels, in 16 bit */
+    if (in->num_preprocessors)
+        in_preprocess(in, dst, frames);
+
+    /* both helpers convert in place when the buffers start at the same address */
+    if (in->format == AUDIO_FORMAT_PCM_32_BIT)
+        memcpy_to_i32_from_i16(buffer, dst, frames * in->channels);
+    else if (in->format == AUDIO_FORMAT_PCM_FLOAT)
+        memcpy_to_float_from_i16(buffer, dst, frames * in->channels);
+    return 0;
+}
+
+/* must be called with the input stream mutex locked */
+static void in_set_unavailable(struct alsa_stream_in *in)
+{
+    capture_buffer_stop(&in->capture);
+    if (in->pcm) {
+        in->backend->close(in->pcm);
+        in->pcm = NULL;
+    }
+    in->host_frames = 0;
+    in->unavailable = true;
+    reconnect_start(&in->reconnect, &in->config);
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         		size_t bytes)
 {
@@ -738,67 +1696,251 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct alsa_audio_device *adev = in->dev;
     size_t frame_size = audio_stream_in_frame_size(stream);
     size_t in_frames = bytes / frame_size;
+    bool mute;
 
-    /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-     * on the output stream mutex - e.g. executing select_mode() while holding the hw device
-     * mutex
-     */
     pthread_mutex_lock(&in->lock);
-    pthread_mutex_lock(&adev->lock);
     if (in->standby) {
-        ret = start_input_stream(in);
-        if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            ALOGE("start_input_stream failed with code %d", ret);
-            goto exit;
-        }
-        in->standby = 0;
+        in->standby = false;
+        if (start_input_stream(in) != 0)
+            in_set_unavailable(in);
+    } else if (in->unavailable &&
+               reconnect_take(&in->reconnect, &in->config, &in->backend, &in->pcm)) {
+        in->unavailable = false;
+        in->silence_until.tv_sec = 0;
+        in->silence_until.tv_nsec = 0;
+        in->stats.reconnects++;
+        pthread_mutex_lock(&adev->lock);
+        adev->active_input = in;
+        pthread_mutex_unlock(&adev->lock);
     }
 
-    pthread_mutex_unlock(&adev->lock);
+    if (!in->unavailable && !capture_buffer_running(&in->capture) &&
+            capture_buffer_start(&in->capture, in->backend, in->pcm) != 0)
+        in_set_unavailable(in);
+    if (!in->unavailable && in->need_echo_reference && !in->echo_reference)
+        in_get_echo_reference(in);
+
+    stream_stats_begin(&in->stats);
+    if (!in->unavailable) {
+        struct timespec timestamp;
+        unsigned int xruns;
+        uint64_t queued;
+
+        ret = in_read_frames(in, buffer, in_frames);
+        /* counted by the capture thread, whenever they happen */
+        xruns = capture_buffer_get_xruns(&in->capture);
+        if (xruns != in->last_xruns) {
+            in->last_xruns = xruns;
+            stream_stats_xrun(&in->stats);
+        }
+
+        if (ret >= 0 && capture_buffer_get_position(&in->capture, &queued, &timestamp) == 0)
+            stream_stats_transfer(&in->stats,
+                                  (uint64_t)in_frames * in->config.rate / in->rate, queued,
+                                  in->capture.ring_frames +
+                                  in->config.period_size * in->config.period_count,
+                                  in->config.rate);
 
-    ret = snd_pcm_readi(in->pcm, buffer, in_frames);
-    if (ret == -EPIPE) {
-        snd_pcm_prepare(in->pcm);
-        ret = snd_pcm_readi(in->pcm, buffer, in_frames);
+        if (ret < 0) {
+            in->stats.errors++;
+            ALOGW("read failed: %d, reconnecting in the background", ret);
+            in_set_unavailable(in);
+        }
     }
 
-    if (ret > 0) {
-        in->read += ret;
+    /* no host stream: hand out silence at the rate the mic would deliver it */
+    if (in->unavailable) {
+        pace_silence(&in->silence_until, in_frames, in->rate);
+        in->frames_lost += in_frames;
     }
+    in->read += in_frames;
+
+    pthread_mutex_lock(&adev->lock);
+    mute = adev->mic_mute;
+    pthread_mutex_unlock(&adev->lock);
 
     /*
      * Instead of writing zeroes here, we could trust the hardware
      * to always provide zeroes when muted.
      */
-    if (ret >= 0 && adev->mic_mute)
+    if (in->unavailable || mute)
         memset(buffer, 0, bytes);
 
-exit:
     pthread_mutex_unlock(&in->lock);
 
-    if (ret < 0) {
-        in_standby(&in->stream.common);
-        usleep((int64_t)bytes * 1000000 / audio_stream_in_frame_size(stream) /
-                in_get_sample_rate(&stream->common));
+    return bytes;
+}
+
+/*
+ * Frames the client did not get since the last call, at the client rate:
+ * what the jitter buffer dropped or the host overran, and the silence
+ * handed out while the host was unavailable.
+ */
+static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
+{
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    uint64_t lost;
+
+    pthread_mutex_lock(&in->lock);
+    lost = capture_buffer_take_lost(&in->capture) * in->rate / in->config.rate;
+    lost += in->frames_lost;
+    in->frames_lost = 0;
+    pthread_mutex_unlock(&in->lock);
+
+    return lost > UINT32_MAX ? UINT32_MAX : lost;
+}
+
+/*
+ * Frames captured so far: what the client read, plus what is still queued
+ * on the host, in the jitter buffer, in the HAL period buffer and in the
+ * resampler, all at the client rate.
+ */
+static int in_get_capture_position(const struct audio_stream_in *stream,
+                                   int64_t *frames, int64_t *time)
+{
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    struct timespec timestamp;
+    uint64_t queued;
+    int64_t queued_ns;
+    int ret = -ENODATA;
+
+    if (!frames || !time)
+        return -EINVAL;
+
+    pthread_mutex_lock(&in->lock);
+    if (in->pcm && !in->unavailable &&
+            capture_buffer_get_position(&in->capture, &queued, &timestamp) == 0) {
+        queued_ns = (int64_t)(queued + in->host_frames) * 1000000000 / in->config.rate;
+        if (in->resampler)
+            queued_ns += in->resampler->delay_ns(in->resampler);
+        *frames = in->read + queued_ns * in->rate / 1000000000;
+        *time = timestamp.tv_sec * 1000000000LL + timestamp.tv_nsec;
+        ret = 0;
     }
+    pthread_mutex_unlock(&in->lock);
 
-     return bytes;
+    return ret;
 }
 
-static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
+static int in_create_mmap_buffer(const struct audio_stream_in *stream,
+                                 int32_t min_size_frames,
+                                 struct audio_mmap_buffer_info *info)
+{
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    int ret;
+
+    ALOGV("in_create_mmap_buffer: min_size_frames %d", min_size_frames);
+    if (!(in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) || !info)
+        return -EINVAL;
+
+    pthread_mutex_lock(&in->lock);
+    ret = mmap_stream_create_buffer(&in->mmap, true,
+                                    audio_stream_in_frame_size(stream),
+                                    in->config.period_size, min_size_frames, info);
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+static int in_get_mmap_position(const struct audio_stream_in *stream,
+                                struct audio_mmap_position *position)
+{
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+
+    if (!position)
+        return -EINVAL;
+    return mmap_stream_get_position(&in->mmap, position);
+}
+
+static int in_start(const struct audio_stream_in *stream)
+{
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    int ret = 0;
+
+    ALOGV("in_start");
+    pthread_mutex_lock(&in->lock);
+    if (!mmap_stream_has_buffer(&in->mmap)) {
+        ret = -ENOSYS;
+        goto exit;
+    }
+    if (in->standby) {
+        ret = start_input_stream(in);
+        if (ret) {
+            in->unavailable = false;
+            goto exit;
+        }
+        in->standby = false;
+    }
+    ret = mmap_stream_start(&in->mmap, in->backend, in->pcm, in->config.rate);
+    if (ret)
+        do_input_standby(in);
+exit:
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+static int in_stop(const struct audio_stream_in *stream)
 {
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+
+    ALOGV("in_stop");
+    if (!mmap_stream_has_buffer(&in->mmap))
+        return -ENOSYS;
+
+    in_standby((struct audio_stream *)&in->stream.common);
     return 0;
 }
 
+static bool effect_is_aec(effect_handle_t effect)
+{
+    effect_descriptor_t desc;
+
+    return (*effect)->get_descriptor(effect, &desc) == 0 &&
+           memcmp(&desc.type, FX_IID_AEC, sizeof(effect_uuid_t)) == 0;
+}
+
 static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    return 0;
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    int ret = 0;
+
+    pthread_mutex_lock(&in->lock);
+    if (in->num_preprocessors >= MAX_PREPROCESSORS) {
+        ret = -ENOSYS;
+        goto exit;
+    }
+    in->preprocessors[in->num_preprocessors++] = effect;
+    /* the reference is taken on the next read */
+    if (effect_is_aec(effect))
+        in->need_echo_reference = true;
+exit:
+    pthread_mutex_unlock(&in->lock);
+    ALOGV("in_add_audio_effect: %d effects, %d", in->num_preprocessors, ret);
+    return ret;
 }
 
 static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    return 0;
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    int ret = -EINVAL;
+    int i;
+
+    pthread_mutex_lock(&in->lock);
+    for (i = 0; i < in->num_preprocessors; i++) {
+        if (in->preprocessors[i] != effect)
+            continue;
+        in->num_preprocessors--;
+        memmove(&in->preprocessors[i], &in->preprocessors[i + 1],
+                (in->num_preprocessors - i) * sizeof(effect_handle_t));
+        if (effect_is_aec(effect)) {
+            in->need_echo_reference = false;
+            in_put_echo_reference(in);
+        }
+        ret = 0;
+        break;
+    }
+    pthread_mutex_unlock(&in->lock);
+    ALOGV("in_remove_audio_effect: %d effects, %d", in->num_preprocessors, ret);
+    return ret;
 }
 
 static int adev_open_output_stream(struct audio_hw_device *dev,
@@ -813,6 +1955,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
     struct alsa_audio_device *ladev = (struct alsa_audio_device *)dev;
     struct alsa_stream_out *out;
+    char name[16];
     int ret = 0;
 
     out = (struct alsa_stream_out *)calloc(1, sizeof(struct alsa_stream_out));
@@ -837,42 +1980,89 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
     out->stream.get_presentation_position = out_get_presentation_position;
+    out->stream.start = out_start;
+    out->stream.stop = out_stop;
+    out->stream.create_mmap_buffer = out_create_mmap_buffer;
+    out->stream.get_mmap_position = out_get_mmap_position;
 
-    out->config.channels = CHANNEL_STEREO;
     out->config.rate = PLAYBACK_CODEC_SAMPLING_RATE;
-    out->config.format = SND_PCM_FORMAT_S16_LE;
-    out->config.period_size = PLAYBACK_PERIOD_SIZE;
-    out->config.period_count = PLAYBACK_PERIOD_COUNT;
-
-    if (out->config.rate != config->sample_rate ||
-           audio_channel_count_from_out_mask(config->channel_mask) != CHANNEL_STEREO ||
-               out->config.format !=  pcm_format_from_audio_format(config->format) ) {
-        config->sample_rate = out->config.rate;
-        config->format = audio_format_from_pcm_format(out->config.format);
-        config->channel_mask = audio_channel_out_mask_from_count(CHANNEL_STEREO);
+    if (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) {
+        out->config.period_size = MMAP_PERIOD_SIZE;
+        out->config.period_count = MMAP_PERIOD_COUNT;
+    } else if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        out->config.period_size = FAST_PERIOD_SIZE;
+        out->config.period_count = FAST_PERIOD_COUNT;
+    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        out->config.period_size = DEEP_BUFFER_PERIOD_SIZE;
+        out->config.period_count = DEEP_BUFFER_PERIOD_COUNT;
+    } else {
+        out->config.period_size = PLAYBACK_PERIOD_SIZE;
+        out->config.period_count = PLAYBACK_PERIOD_COUNT;
+    }
+    out->flags = flags;
+    out->buffer_frames = out->config.period_size;
+
+    /* stereo to 7.1, 16 bit or float; mmap streams are shared as is so stick to the basics */
+    out->channels = audio_channel_count_from_out_mask(config->channel_mask);
+    if (out->channels < CHANNEL_STEREO || out->channels > CHANNEL_MAX ||
+            config->channel_mask != audio_channel_out_mask_from_count(out->channels) ||
+            (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ && out->channels != CHANNEL_STEREO)) {
+        out->channels = CHANNEL_STEREO;
+        ret = -EINVAL;
+    }
+    out->format = config->format;
+    if ((out->format != AUDIO_FORMAT_PCM_16_BIT && out->format != AUDIO_FORMAT_PCM_FLOAT) ||
+            (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ && out->format != AUDIO_FORMAT_PCM_16_BIT)) {
+        out->format = AUDIO_FORMAT_PCM_16_BIT;
         ret = -EINVAL;
     }
+    if (out->config.rate != config->sample_rate)
+        ret = -EINVAL;
+    out->config.channels = out->channels;
+    out->config.format = out->format;
+    out_init_downmix(out);
 
-    ALOGI("adev_open_output_stream selects channels=%d rate=%d format=%d",
-                out->config.channels, out->config.rate, out->config.format);
+    ALOGI("adev_open_output_stream selects channels=%u rate=%u format=%#x period=%u x %u",
+                out->channels, out->config.rate, out->format,
+                out->config.period_size, out->config.period_count);
 
     out->dev = ladev;
     out->standby = 1;
     out->unavailable = false;
+    reconnect_init(&out->reconnect, ladev, false);
+    snprintf(name, sizeof(name), "out_%d", handle);
+    stream_stats_init(&out->stats, name);
+    idle_timer_init(&out->idle_timer, out_idle_expired, out);
 
     config->format = out_get_format(&out->stream.common);
     config->channel_mask = out_get_channels(&out->stream.common);
     config->sample_rate = out_get_sample_rate(&out->stream.common);
 
-    *stream_out = &out->stream;
+    if (ret) {
+        idle_timer_destroy(&out->idle_timer);
+        reconnect_destroy(&out->reconnect);
+        free(out);
+    } else {
+        *stream_out = &out->stream;
+    }
 
-    return 0;
+    return ret;
 }
 
 static void adev_close_output_stream(struct audio_hw_device *dev,
         struct audio_stream_out *stream)
 {
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+
     ALOGV("adev_close_output_stream...");
+    pthread_mutex_lock(&out->lock);
+    do_output_standby(out, false);
+    pthread_mutex_unlock(&out->lock);
+    idle_timer_destroy(&out->idle_timer);
+    mmap_stream_release_buffer(&out->mmap);
+    reconnect_destroy(&out->reconnect);
+    free(out->conv_buf);
+    free(out->ref_buf);
     free(stream);
 }
 
@@ -956,7 +2146,8 @@ static int adev_get_mic_mute(const struct audio_hw_device *dev, bool *state)
 static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
         const struct audio_config *config)
 {
-    size_t buffer_size = get_input_buffer_size(config->format, config->channel_mask);
+    size_t buffer_size = get_input_buffer_size(config->sample_rate, config->format,
+                                               config->channel_mask);
     ALOGV("adev_get_input_buffer_size: %zu", buffer_size);
     return buffer_size;
 }
@@ -966,7 +2157,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         audio_devices_t devices,
         struct audio_config *config,
         struct audio_stream_in **stream_in,
-        audio_input_flags_t flags __unused,
+        audio_input_flags_t flags,
         const char *address __unused,
         audio_source_t source __unused)
 {
@@ -975,6 +2166,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
     struct alsa_audio_device *ladev = (struct alsa_audio_device *)dev;
     struct alsa_stream_in *in;
+    char name[16];
     int ret = 0;
 
     in = (struct alsa_stream_in *)calloc(1, sizeof(struct alsa_stream_in));
@@ -996,31 +2188,81 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.set_gain = in_set_gain;
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
+    in->stream.get_capture_position = in_get_capture_position;
+    in->stream.start = in_start;
+    in->stream.stop = in_stop;
+    in->stream.create_mmap_buffer = in_create_mmap_buffer;
+    in->stream.get_mmap_position = in_get_mmap_position;
 
     in->config.channels = CHANNEL_STEREO;
-    in->config.rate = CAPTURE_CODEC_SAMPLING_RATE;
-    in->config.format = SND_PCM_FORMAT_S32_LE;
-    in->config.period_size = CAPTURE_PERIOD_SIZE;
-    in->config.period_count = CAPTURE_PERIOD_COUNT;
-
-    if (in->config.rate != config->sample_rate ||
-           audio_channel_count_from_in_mask(config->channel_mask) != CHANNEL_STEREO ||
-               in->config.format !=  pcm_format_from_audio_format(config->format) ) {
-        ret = -EINVAL;
+    in->config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) {
+        /* AAudio wants the same rate and format as the mmap output, no conversion */
+        in->config.rate = MMAP_SAMPLING_RATE;
+        in->config.period_size = MMAP_PERIOD_SIZE;
+        in->config.period_count = MMAP_PERIOD_COUNT;
+        if (config->sample_rate != in->config.rate ||
+                audio_channel_count_from_in_mask(config->channel_mask) != CHANNEL_STEREO ||
+                config->format != in->config.format)
+            ret = -EINVAL;
+        in->rate = in->config.rate;
+        in->channels = in->config.channels;
+        in->format = in->config.format;
+    } else {
+        in->config.rate = CAPTURE_CODEC_SAMPLING_RATE;
+        in->config.period_size = CAPTURE_PERIOD_SIZE;
+        in->config.period_count = CAPTURE_PERIOD_COUNT;
+
+        /* anything we can convert to, suggest the closest match otherwise */
+        in->rate = config->sample_rate;
+        if (in->rate < CAPTURE_MIN_SAMPLING_RATE || in->rate > CAPTURE_CODEC_SAMPLING_RATE) {
+            in->rate = CAPTURE_CODEC_SAMPLING_RATE;
+            ret = -EINVAL;
+        }
+        in->channels = audio_channel_count_from_in_mask(config->channel_mask);
+        if (in->channels != 1 && in->channels != CHANNEL_STEREO) {
+            in->channels = CHANNEL_STEREO;
+            ret = -EINVAL;
+        }
+        in->format = config->format;
+        if (in->format != AUDIO_FORMAT_PCM_16_BIT && in->format != AUDIO_FORMAT_PCM_32_BIT &&
+                in->format != AUDIO_FORMAT_PCM_FLOAT) {
+            in->format = AUDIO_FORMAT_PCM_16_BIT;
+            ret = -EINVAL;
+        }
+    }
+    in->flags = flags;
+
+    in->buf_provider.get_next_buffer = in_get_next_buffer;
+    in->buf_provider.release_buffer = in_release_buffer;
+    if (ret == 0 && in->rate != in->config.rate) {
+        ret = create_resampler(in->config.rate, in->rate, in->channels,
+                               RESAMPLER_QUALITY_DEFAULT, &in->buf_provider, &in->resampler);
+        if (ret) {
+            ALOGE("failed to create a %u to %u Hz resampler: %d", in->config.rate, in->rate, ret);
+            ret = -EINVAL;
+        }
     }
 
-    ALOGI("adev_open_input_stream selects channels=%d rate=%d format=%d",
-                in->config.channels, in->config.rate, in->config.format);
+    ALOGI("adev_open_input_stream selects channels=%u rate=%u format=%#x, host rate %u",
+                in->channels, in->rate, in->format, in->config.rate);
 
     in->dev = ladev;
     in->standby = true;
     in->unavailable = false;
+    capture_buffer_init(&in->capture, in->config.rate, in->config.channels,
+                        in->config.period_size);
+    reconnect_init(&in->reconnect, ladev, true);
+    snprintf(name, sizeof(name), "in_%d", handle);
+    stream_stats_init(&in->stats, name);
 
     config->format = in_get_format(&in->stream.common);
     config->channel_mask = in_get_channels(&in->stream.common);
     config->sample_rate = in_get_sample_rate(&in->stream.common);
 
     if (ret) {
+        capture_buffer_release(&in->capture);
+        reconnect_destroy(&in->reconnect);
         free(in);
     } else {
         *stream_in = &in->stream;
@@ -1032,8 +2274,17 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 static void adev_close_input_stream(struct audio_hw_device *dev,
         			     struct audio_stream_in *in)
 {
+    struct alsa_stream_in *ain = (struct alsa_stream_in *)in;
+
     ALOGV("adev_close_input_stream...");
     in_standby(&in->common);
+    mmap_stream_release_buffer(&ain->mmap);
+    capture_buffer_release(&ain->capture);
+    reconnect_destroy(&ain->reconnect);
+    if (ain->resampler)
+        release_resampler(ain->resampler);
+    free(ain->host_buf);
+    free(ain->ref_buf);
     free(in);
     return;
 }
@@ -1041,6 +2292,15 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
     ALOGV("adev_dump");
+    struct alsa_audio_device *adev = (struct alsa_audio_device *)device;
+
+    pthread_mutex_lock(&adev->lock);
+    dprintf(fd, "    Backend: %s\n", adev->backend->name);
+    dprintf(fd, "    Standby timeout: %u ms\n", adev->standby_timeout_ms);
+    dprintf(fd, "    Devices: out %#x, in %#x\n", adev->out_devices, adev->in_devices);
+    dprintf(fd, "    Mic mute: %s\n", adev->mic_mute ? "yes" : "no");
+    dprintf(fd, "    Active streams: out %p, in %p\n", adev->active_output, adev->active_input);
+    pthread_mutex_unlock(&adev->lock);
     return 0;
 }
 
@@ -1056,6 +2316,7 @@ static int adev_open(const hw_module_t* module, const char* name,
 {
     struct alsa_audio_device *adev;
     char property[PROPERTY_VALUE_MAX];
+    int32_t standby_timeout_ms;
 
     if (property_get("waydroid.pulse_runtime_path", property, "/run/user/1000/pulse") > 0) {
         setenv("PULSE_RUNTIME_PATH", property, 1);
@@ -1092,6 +2353,17 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.close_input_stream = adev_close_input_stream;
     adev->hw_device.dump = adev_dump;
 
+    property_get("waydroid.audio.backend", property, "pulse");
+    if (strcmp(property, "alsa") == 0)
+        adev->backend = &audio_backend_alsa;
+    else
+        adev->backend = &audio_backend_pulse;
+    ALOGI("using the %s audio backend", adev->backend->name);
+
+    standby_timeout_ms = property_get_int32("waydroid.audio.standby_timeout_ms",
+                                            DEFAULT_STANDBY_TIMEOUT_MS);
+    adev->standby_timeout_ms = standby_timeout_ms > 0 ? standby_timeout_ms : 0;
+
     adev->out_devices = AUDIO_DEVICE_OUT_SPEAKER;
     adev->in_devices = AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN;
 
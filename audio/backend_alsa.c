@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Backend going through the ALSA "pulse" PCM of libasound, kept as a
+ * fallback for hosts libpulse cannot talk to directly.
+ */
+
+#define LOG_TAG "audio_hw_alsa"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <log/log.h>
+
+#include <alsa/asoundlib.h>
+
+#include "audio_backend.h"
+
+struct audio_backend_stream {
+    snd_pcm_t *pcm;
+    unsigned int xruns;
+};
+
+/* Converts audio_format to pcm_format.
+ * Parameters:
+ *  format  the audio_format_t to convert
+ *
+ * Logs a fatal error if format is not a valid convertible audio_format_t.
+ */
+static inline snd_pcm_format_t pcm_format_from_audio_format(audio_format_t format)
+{
+    switch (format) {
+#if HAVE_BIG_ENDIAN
+    case AUDIO_FORMAT_PCM_16_BIT:
+        return SND_PCM_FORMAT_S16_BE;
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+        return SND_PCM_FORMAT_S24_3BE;
+    case AUDIO_FORMAT_PCM_32_BIT:
+        return SND_PCM_FORMAT_S32_BE;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        return SND_PCM_FORMAT_S24_BE;
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return SND_PCM_FORMAT_FLOAT_BE;
+#else
+    case AUDIO_FORMAT_PCM_16_BIT:
+        return SND_PCM_FORMAT_S16_LE;
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+        return SND_PCM_FORMAT_S24_3LE;
+    case AUDIO_FORMAT_PCM_32_BIT:
+        return SND_PCM_FORMAT_S32_LE;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        return SND_PCM_FORMAT_S24_LE;
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return SND_PCM_FORMAT_FLOAT_LE;
+#endif
+    default:
+        LOG_ALWAYS_FATAL("pcm_format_from_audio_format: invalid audio format %#x", format);
+        return 0;
+    }
+}
+
+static int alsa_open(struct audio_backend_stream **stream, bool capture,
+                     struct pcm_config *config)
+{
+    struct audio_backend_stream *s;
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t buffer_size;
+    int ret;
+
+    /* the pulse plugin uses the ALSA surround order, not the Android one */
+    if (config->channels > 2)
+        return -EINVAL;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return -ENOMEM;
+
+    /* a single attempt, the HAL retries in the background */
+    ret = snd_pcm_open(&s->pcm, "pulse",
+                       capture ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK, 0);
+    if (ret < 0) {
+        ALOGE("Failed to open pcm: %s", snd_strerror(ret));
+        free(s);
+        return -ENODEV;
+    }
+    ret = -ENODEV;
+
+    snd_pcm_hw_params_alloca(&hwparams);
+    if (snd_pcm_hw_params_any(s->pcm, hwparams) < 0) {
+        ALOGE("Can not configure this PCM device.");
+        goto error;
+    }
+
+    if (snd_pcm_hw_params_set_access(s->pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
+        ALOGE("Error setting access.\n");
+        goto error;
+    }
+
+    if (snd_pcm_hw_params_set_format(s->pcm, hwparams,
+                                     pcm_format_from_audio_format(config->format)) < 0) {
+        ALOGE("Error setting format.\n");
+        ret = -EINVAL;
+        goto error;
+    }
+
+    if (snd_pcm_hw_params_set_rate_near(s->pcm, hwparams, &config->rate, 0) < 0) {
+        ALOGE("Error setting rate.\n");
+        goto error;
+    }
+
+    if (snd_pcm_hw_params_set_channels(s->pcm, hwparams, config->channels) < 0) {
+        ALOGE("Error setting channels.\n");
+        ret = -EINVAL;
+        goto error;
+    }
+
+    if (!capture) {
+        if (snd_pcm_hw_params_set_periods(s->pcm, hwparams, config->period_count, 0) < 0) {
+            ALOGE("Error setting periods.\n");
+            goto error;
+        }
+
+        if (snd_pcm_hw_params_set_buffer_size(s->pcm, hwparams,
+                                              config->period_size * config->period_count) < 0) {
+            ALOGE("Error setting buffer size.\n");
+            goto error;
+        }
+    }
+
+    if (snd_pcm_hw_params(s->pcm, hwparams) < 0) {
+        ALOGE("Error setting HW params.");
+        goto error;
+    }
+
+    /* timestamps default to gettimeofday, the HAL reports CLOCK_MONOTONIC */
+    snd_pcm_sw_params_alloca(&swparams);
+    if (snd_pcm_sw_params_current(s->pcm, swparams) < 0 ||
+            snd_pcm_sw_params_set_tstamp_mode(s->pcm, swparams, SND_PCM_TSTAMP_ENABLE) < 0 ||
+            snd_pcm_sw_params_set_tstamp_type(s->pcm, swparams,
+                                              SND_PCM_TSTAMP_TYPE_MONOTONIC) < 0 ||
+            snd_pcm_sw_params(s->pcm, swparams) < 0)
+        ALOGW("Can not enable monotonic timestamps.");
+
+    if (snd_pcm_prepare(s->pcm) < 0) {
+        ALOGE("Can not prepare this PCM device.");
+        goto error;
+    }
+
+    if (snd_pcm_state(s->pcm) != SND_PCM_STATE_PREPARED) {
+        ALOGE("cannot open pcm driver");
+        goto error;
+    }
+
+    snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size);
+    if (!capture && snd_pcm_hw_params_get_period_size(hwparams, &period_size, NULL) == 0 &&
+            period_size) {
+        config->period_size = period_size;
+        config->period_count = buffer_size / period_size;
+    }
+
+    *stream = s;
+    return 0;
+
+error:
+    snd_pcm_close(s->pcm);
+    free(s);
+    return ret;
+}
+
+static void alsa_close(struct audio_backend_stream *s)
+{
+    snd_pcm_close(s->pcm);
+    free(s);
+}
+
+static int alsa_pause(struct audio_backend_stream *s)
+{
+    return snd_pcm_drop(s->pcm) < 0 ? -EIO : 0;
+}
+
+static int alsa_resume(struct audio_backend_stream *s)
+{
+    return snd_pcm_prepare(s->pcm) < 0 ? -EIO : 0;
+}
+
+static ssize_t alsa_write(struct audio_backend_stream *s, const void *buffer, size_t frames)
+{
+    snd_pcm_sframes_t ret;
+
+    ret = snd_pcm_writei(s->pcm, buffer, frames);
+    if (ret == -EPIPE) {
+        s->xruns++;
+        snd_pcm_prepare(s->pcm);
+        ret = snd_pcm_writei(s->pcm, buffer, frames);
+    }
+
+    return ret;
+}
+
+static ssize_t alsa_read(struct audio_backend_stream *s, void *buffer, size_t frames)
+{
+    snd_pcm_sframes_t ret;
+
+    ret = snd_pcm_readi(s->pcm, buffer, frames);
+    if (ret == -EPIPE) {
+        s->xruns++;
+        snd_pcm_prepare(s->pcm);
+        ret = snd_pcm_readi(s->pcm, buffer, frames);
+    }
+
+    return ret;
+}
+
+static int alsa_get_delay(struct audio_backend_stream *s, uint64_t *frames,
+                          struct timespec *timestamp)
+{
+    snd_pcm_status_t *status;
+    snd_pcm_sframes_t delay;
+
+    snd_pcm_status_alloca(&status);
+    if (snd_pcm_status(s->pcm, status) < 0)
+        return -ENODATA;
+
+    /* queued for playback, or captured and not read yet */
+    delay = snd_pcm_status_get_delay(status);
+    *frames = delay > 0 ? delay : 0;
+
+    /* the ioplug based pulse PCM does not always fill the timestamp in */
+    snd_pcm_status_get_htstamp(status, timestamp);
+    if (timestamp->tv_sec == 0 && timestamp->tv_nsec == 0)
+        clock_gettime(CLOCK_MONOTONIC, timestamp);
+
+    return 0;
+}
+
+static unsigned int alsa_get_xruns(struct audio_backend_stream *s)
+{
+    return s->xruns;
+}
+
+const struct audio_backend audio_backend_alsa = {
+    .name = "alsa",
+    .open = alsa_open,
+    .close = alsa_close,
+    .pause = alsa_pause,
+    .resume = alsa_resume,
+    .write = alsa_write,
+    .read = alsa_read,
+    .get_delay = alsa_get_delay,
+    .get_xruns = alsa_get_xruns,
+};
@@ -0,0 +1,568 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Backend talking to the host PulseAudio (or pipewire-pulse) server with
+ * the libpulse async API.  The buffering is negotiated with the server
+ * (tlength/minreq for playback, fragsize for capture) instead of going
+ * through the ALSA plugin ring, and data is written straight into the
+ * server memblocks.
+ */
+
+#define LOG_TAG "audio_hw_pulse"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#include <pulse/pulseaudio.h>
+
+#include "audio_backend.h"
+
+/* how long the server gets to accept a connection or a stream */
+#define PULSE_CONNECT_TIMEOUT_USEC (2 * PA_USEC_PER_SEC)
+/* how long a transfer or an operation may stall before the stream is given up */
+#define PULSE_IO_TIMEOUT_USEC PA_USEC_PER_SEC
+
+struct audio_backend_stream {
+    pa_stream *stream;
+    pa_sample_spec spec;
+    size_t frame_size;
+    unsigned int xruns;
+
+    /* capture fragment being consumed, data is NULL for a hole */
+    const uint8_t *fragment;
+    size_t fragment_size;
+    size_t fragment_offset;
+};
+
+/* guards the creation of the mainloop, everything else runs under its lock */
+static pthread_mutex_t pulse_lock = PTHREAD_MUTEX_INITIALIZER;
+static pa_threaded_mainloop *pulse_mainloop;
+static pa_context *pulse_context;
+
+static pa_sample_format_t pa_format_from_audio_format(audio_format_t format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        return PA_SAMPLE_S16LE;
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+        return PA_SAMPLE_S24LE;
+    case AUDIO_FORMAT_PCM_32_BIT:
+        return PA_SAMPLE_S32LE;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        return PA_SAMPLE_S24_32LE;
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return PA_SAMPLE_FLOAT32LE;
+    default:
+        return PA_SAMPLE_INVALID;
+    }
+}
+
+/* Bounds a wait on the mainloop, a hung server must not hang the HAL with it. */
+struct pulse_deadline {
+    pa_time_event *event;
+    bool expired;
+};
+
+static void pulse_deadline_cb(pa_mainloop_api *api, pa_time_event *e,
+                              const struct timeval *tv, void *userdata)
+{
+    struct pulse_deadline *d = userdata;
+
+    d->expired = true;
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+/* Must be called with the mainloop locked, as the two below. */
+static void pulse_deadline_start(struct pulse_deadline *d, pa_usec_t timeout)
+{
+    pa_mainloop_api *api = pa_threaded_mainloop_get_api(pulse_mainloop);
+    struct timeval tv;
+
+    d->expired = false;
+    d->event = api->time_new(api, pa_timeval_rtstore(&tv, pa_rtclock_now() + timeout, true),
+                             pulse_deadline_cb, d);
+}
+
+/* Waits for the next signal, -ETIMEDOUT once the deadline has passed. */
+static int pulse_deadline_wait(struct pulse_deadline *d)
+{
+    if (!d->expired)
+        pa_threaded_mainloop_wait(pulse_mainloop);
+    return d->expired ? -ETIMEDOUT : 0;
+}
+
+static void pulse_deadline_end(struct pulse_deadline *d)
+{
+    pa_mainloop_api *api = pa_threaded_mainloop_get_api(pulse_mainloop);
+
+    if (d->event)
+        api->time_free(d->event);
+    d->event = NULL;
+}
+
+static void pulse_context_state_cb(pa_context *c, void *userdata)
+{
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+static void pulse_stream_state_cb(pa_stream *p, void *userdata)
+{
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+static void pulse_stream_request_cb(pa_stream *p, size_t nbytes, void *userdata)
+{
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+static void pulse_stream_xrun_cb(pa_stream *p, void *userdata)
+{
+    struct audio_backend_stream *s = userdata;
+
+    s->xruns++;
+}
+
+/* Returns with the mainloop locked, creating it on first use. */
+static int pulse_lock_mainloop(void)
+{
+    pthread_mutex_lock(&pulse_lock);
+    if (!pulse_mainloop) {
+        pulse_mainloop = pa_threaded_mainloop_new();
+        if (!pulse_mainloop || pa_threaded_mainloop_start(pulse_mainloop) < 0) {
+            ALOGE("failed to start the pulse mainloop");
+            if (pulse_mainloop)
+                pa_threaded_mainloop_free(pulse_mainloop);
+            pulse_mainloop = NULL;
+            pthread_mutex_unlock(&pulse_lock);
+            return -ENOMEM;
+        }
+        pa_threaded_mainloop_set_name(pulse_mainloop, "audio_hw_pulse");
+    }
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    pthread_mutex_unlock(&pulse_lock);
+
+    return 0;
+}
+
+/*
+ * Make sure the context is connected, reconnecting after the server went
+ * away.  Must be called with the mainloop locked.
+ */
+static int pulse_context_ready_locked(void)
+{
+    struct pulse_deadline deadline;
+    pa_context_state_t state;
+    int ret;
+
+    if (pulse_context) {
+        state = pa_context_get_state(pulse_context);
+        if (state == PA_CONTEXT_FAILED || state == PA_CONTEXT_TERMINATED) {
+            pa_context_unref(pulse_context);
+            pulse_context = NULL;
+        }
+    }
+
+    if (!pulse_context) {
+        pulse_context = pa_context_new(pa_threaded_mainloop_get_api(pulse_mainloop), "Android");
+        if (!pulse_context)
+            return -ENOMEM;
+        pa_context_set_state_callback(pulse_context, pulse_context_state_cb, NULL);
+        if (pa_context_connect(pulse_context, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL) < 0) {
+            ALOGE("failed to connect to pulse: %s",
+                  pa_strerror(pa_context_errno(pulse_context)));
+            return -ENODEV;
+        }
+    }
+
+    pulse_deadline_start(&deadline, PULSE_CONNECT_TIMEOUT_USEC);
+    for (;;) {
+        state = pa_context_get_state(pulse_context);
+        if (state == PA_CONTEXT_READY) {
+            ret = 0;
+            break;
+        }
+        if (state == PA_CONTEXT_FAILED || state == PA_CONTEXT_TERMINATED) {
+            ALOGE("pulse connection failed: %s",
+                  pa_strerror(pa_context_errno(pulse_context)));
+            ret = -ENODEV;
+            break;
+        }
+        ret = pulse_deadline_wait(&deadline);
+        if (ret) {
+            /* start over on the next open rather than wait on this one again */
+            ALOGE("timed out connecting to pulse");
+            pa_context_disconnect(pulse_context);
+            pa_context_unref(pulse_context);
+            pulse_context = NULL;
+            break;
+        }
+    }
+    pulse_deadline_end(&deadline);
+
+    return ret;
+}
+
+static int pulse_open(struct audio_backend_stream **stream, bool capture,
+                      struct pcm_config *config)
+{
+    struct audio_backend_stream *s;
+    struct pulse_deadline deadline;
+    const pa_buffer_attr *granted;
+    pa_buffer_attr attr;
+    pa_channel_map map;
+    pa_stream_flags_t flags;
+    pa_stream_state_t state;
+    size_t period_bytes;
+    int ret;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return -ENOMEM;
+
+    s->spec.format = pa_format_from_audio_format(config->format);
+    s->spec.rate = config->rate;
+    s->spec.channels = config->channels;
+    if (!pa_sample_spec_valid(&s->spec)) {
+        free(s);
+        return -EINVAL;
+    }
+    s->frame_size = pa_frame_size(&s->spec);
+    period_bytes = config->period_size * s->frame_size;
+
+    ret = pulse_lock_mainloop();
+    if (ret) {
+        free(s);
+        return ret;
+    }
+
+    ret = pulse_context_ready_locked();
+    if (ret)
+        goto error;
+
+    /* same order as the Android channel masks, e.g. FL FR FC LFE BL BR for 5.1 */
+    pa_channel_map_init_auto(&map, config->channels, PA_CHANNEL_MAP_WAVEEX);
+    s->stream = pa_stream_new(pulse_context, capture ? "Android capture" : "Android playback",
+                              &s->spec, &map);
+    if (!s->stream) {
+        ret = -ENOMEM;
+        goto error;
+    }
+
+    pa_stream_set_state_callback(s->stream, pulse_stream_state_cb, s);
+    flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING |
+            PA_STREAM_AUTO_TIMING_UPDATE;
+
+    attr.maxlength = (uint32_t)-1;
+    if (capture) {
+        attr.tlength = (uint32_t)-1;
+        attr.prebuf = (uint32_t)-1;
+        attr.minreq = (uint32_t)-1;
+        attr.fragsize = period_bytes;
+        pa_stream_set_read_callback(s->stream, pulse_stream_request_cb, s);
+        pa_stream_set_overflow_callback(s->stream, pulse_stream_xrun_cb, s);
+        ret = pa_stream_connect_record(s->stream, NULL, &attr, flags);
+    } else {
+        attr.tlength = period_bytes * config->period_count;
+        attr.prebuf = config->start_threshold ? config->start_threshold * s->frame_size
+                                              : (uint32_t)-1;
+        attr.minreq = period_bytes;
+        attr.fragsize = (uint32_t)-1;
+        pa_stream_set_write_callback(s->stream, pulse_stream_request_cb, s);
+        pa_stream_set_underflow_callback(s->stream, pulse_stream_xrun_cb, s);
+        ret = pa_stream_connect_playback(s->stream, NULL, &attr, flags, NULL, NULL);
+    }
+    if (ret < 0) {
+        ALOGE("failed to connect stream: %s", pa_strerror(pa_context_errno(pulse_context)));
+        ret = -ENODEV;
+        goto error;
+    }
+
+    pulse_deadline_start(&deadline, PULSE_CONNECT_TIMEOUT_USEC);
+    for (;;) {
+        state = pa_stream_get_state(s->stream);
+        if (state == PA_STREAM_READY) {
+            ret = 0;
+            break;
+        }
+        if (state == PA_STREAM_FAILED || state == PA_STREAM_TERMINATED) {
+            ret = pa_context_errno(pulse_context);
+            ALOGE("stream failed: %s", pa_strerror(ret));
+            /* let the caller try another layout or format on this server */
+            ret = ret == PA_ERR_NOTSUPPORTED || ret == PA_ERR_INVALID ? -EINVAL : -ENODEV;
+            break;
+        }
+        ret = pulse_deadline_wait(&deadline);
+        if (ret) {
+            ALOGE("timed out waiting for the %s stream", capture ? "capture" : "playback");
+            break;
+        }
+    }
+    pulse_deadline_end(&deadline);
+    if (ret)
+        goto error;
+
+    /* report what the server settled on, so the latency we advertise is right */
+    granted = pa_stream_get_buffer_attr(s->stream);
+    if (granted) {
+        if (capture && granted->fragsize != (uint32_t)-1) {
+            config->period_size = granted->fragsize / s->frame_size;
+        } else if (!capture && granted->minreq && granted->minreq != (uint32_t)-1) {
+            config->period_size = granted->minreq / s->frame_size;
+            config->period_count = (granted->tlength + granted->minreq - 1) / granted->minreq;
+        }
+    }
+
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+
+    ALOGI("%s stream connected, period %u x %u frames", capture ? "capture" : "playback",
+          config->period_size, config->period_count);
+    *stream = s;
+    return 0;
+
+error:
+    if (s->stream) {
+        pa_stream_disconnect(s->stream);
+        pa_stream_unref(s->stream);
+    }
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+    free(s);
+    return ret;
+}
+
+static void pulse_close(struct audio_backend_stream *s)
+{
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    pa_stream_disconnect(s->stream);
+    pa_stream_unref(s->stream);
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+    free(s);
+}
+
+/* Runs an operation to completion, the mainloop must be locked by the caller. */
+static int pulse_wait_operation(pa_operation *o)
+{
+    struct pulse_deadline deadline;
+    int ret = 0;
+
+    if (!o)
+        return -EIO;
+    pulse_deadline_start(&deadline, PULSE_IO_TIMEOUT_USEC);
+    while (pa_operation_get_state(o) == PA_OPERATION_RUNNING) {
+        ret = pulse_deadline_wait(&deadline);
+        if (ret) {
+            pa_operation_cancel(o);
+            break;
+        }
+    }
+    pulse_deadline_end(&deadline);
+    pa_operation_unref(o);
+    return ret;
+}
+
+static void pulse_stream_success_cb(pa_stream *p, int success, void *userdata)
+{
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+static int pulse_pause(struct audio_backend_stream *s)
+{
+    int ret;
+
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    ret = pulse_wait_operation(pa_stream_flush(s->stream, pulse_stream_success_cb, NULL));
+    if (ret == 0)
+        ret = pulse_wait_operation(pa_stream_cork(s->stream, 1, pulse_stream_success_cb, NULL));
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+
+    return ret;
+}
+
+static int pulse_resume(struct audio_backend_stream *s)
+{
+    pa_operation *o;
+    int ret = 0;
+
+    /* no need to wait, the next write is queued behind the uncork anyway */
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    if (pa_stream_get_state(s->stream) != PA_STREAM_READY)
+        ret = -EIO;
+    else if ((o = pa_stream_cork(s->stream, 0, NULL, NULL)))
+        pa_operation_unref(o);
+    else
+        ret = -EIO;
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+
+    return ret;
+}
+
+static ssize_t pulse_write(struct audio_backend_stream *s, const void *buffer, size_t frames)
+{
+    const uint8_t *src = buffer;
+    size_t remaining = frames * s->frame_size;
+    struct pulse_deadline deadline = { 0 };
+    ssize_t ret = frames;
+
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    while (remaining) {
+        size_t nbytes;
+        void *data;
+
+        if (pa_stream_get_state(s->stream) != PA_STREAM_READY) {
+            ret = -EIO;
+            break;
+        }
+
+        nbytes = pa_stream_writable_size(s->stream);
+        if (nbytes == 0) {
+            /* only armed when the server is behind, most writes never wait */
+            if (!deadline.event)
+                pulse_deadline_start(&deadline, PULSE_IO_TIMEOUT_USEC);
+            if (pulse_deadline_wait(&deadline)) {
+                ALOGE("timed out waiting for the server to take data");
+                ret = -ETIMEDOUT;
+                break;
+            }
+            continue;
+        }
+
+        if (nbytes > remaining)
+            nbytes = remaining;
+        if (pa_stream_begin_write(s->stream, &data, &nbytes) < 0) {
+            ret = -EIO;
+            break;
+        }
+        memcpy(data, src, nbytes);
+        if (pa_stream_write(s->stream, data, nbytes, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+            ret = -EIO;
+            break;
+        }
+
+        src += nbytes;
+        remaining -= nbytes;
+    }
+    pulse_deadline_end(&deadline);
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+
+    return ret;
+}
+
+static ssize_t pulse_read(struct audio_backend_stream *s, void *buffer, size_t frames)
+{
+    uint8_t *dst = buffer;
+    size_t remaining = frames * s->frame_size;
+    struct pulse_deadline deadline = { 0 };
+    ssize_t ret = frames;
+
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    while (remaining) {
+        size_t nbytes;
+
+        if (pa_stream_get_state(s->stream) != PA_STREAM_READY) {
+            ret = -EIO;
+            break;
+        }
+
+        if (!s->fragment_size) {
+            const void *data;
+
+            if (pa_stream_peek(s->stream, &data, &s->fragment_size) < 0) {
+                ret = -EIO;
+                break;
+            }
+            if (!s->fragment_size) {
+                if (!deadline.event)
+                    pulse_deadline_start(&deadline, PULSE_IO_TIMEOUT_USEC);
+                if (pulse_deadline_wait(&deadline)) {
+                    ALOGE("timed out waiting for the server to send data");
+                    ret = -ETIMEDOUT;
+                    break;
+                }
+                continue;
+            }
+            s->fragment = data;
+            s->fragment_offset = 0;
+        }
+
+        nbytes = s->fragment_size - s->fragment_offset;
+        if (nbytes > remaining)
+            nbytes = remaining;
+        if (s->fragment)
+            memcpy(dst, s->fragment + s->fragment_offset, nbytes);
+        else
+            memset(dst, 0, nbytes);
+
+        dst += nbytes;
+        remaining -= nbytes;
+        s->fragment_offset += nbytes;
+        if (s->fragment_offset == s->fragment_size) {
+            pa_stream_drop(s->stream);
+            s->fragment = NULL;
+            s->fragment_size = 0;
+        }
+    }
+    pulse_deadline_end(&deadline);
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+
+    return ret;
+}
+
+static int pulse_get_delay(struct audio_backend_stream *s, uint64_t *frames,
+                           struct timespec *timestamp)
+{
+    pa_usec_t usec;
+    int negative = 0;
+    int ret = 0;
+
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    if (pa_stream_get_latency(s->stream, &usec, &negative) < 0) {
+        ret = -ENODATA;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, timestamp);
+        *frames = negative ? 0 : usec * s->spec.rate / 1000000;
+    }
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+
+    return ret;
+}
+
+static unsigned int pulse_get_xruns(struct audio_backend_stream *s)
+{
+    unsigned int xruns;
+
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    xruns = s->xruns;
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+
+    return xruns;
+}
+
+const struct audio_backend audio_backend_pulse = {
+    .name = "pulse",
+    .open = pulse_open,
+    .close = pulse_close,
+    .pause = pulse_pause,
+    .resume = pulse_resume,
+    .write = pulse_write,
+    .read = pulse_read,
+    .get_delay = pulse_get_delay,
+    .get_xruns = pulse_get_xruns,
+};
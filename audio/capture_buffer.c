@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_capture"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#include "capture_buffer.h"
+
+/* same as the mmap thread, the host must never wait on us */
+#define CAPTURE_THREAD_PRIORITY 3
+
+/* ring size, and the most of it the jitter target may claim */
+#define CAPTURE_RING_PERIODS 16
+#define CAPTURE_TARGET_MAX_PERIODS (CAPTURE_RING_PERIODS - 2)
+/* the jitter estimate loses 1/64 of itself per host period, about 1.3 s at 20 ms */
+#define CAPTURE_JITTER_DECAY 64
+/* drift correction never stretches or squeezes a period by more than 0.5% */
+#define CAPTURE_MAX_ADJUST_DIV 200
+
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void timespec_add_ns(struct timespec *ts, int64_t ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+void capture_buffer_init(struct capture_buffer *cb, unsigned int rate, unsigned int channels,
+                         size_t period_frames)
+{
+    pthread_condattr_t attr;
+
+    memset(cb, 0, sizeof(*cb));
+    cb->rate = rate;
+    cb->channels = channels;
+    cb->period_frames = period_frames;
+    cb->ring_frames = period_frames * CAPTURE_RING_PERIODS;
+    cb->target_frames = period_frames;
+
+    pthread_mutex_init(&cb->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cb->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void capture_buffer_release(struct capture_buffer *cb)
+{
+    capture_buffer_stop(cb);
+    free(cb->ring);
+    free(cb->period_buf);
+    free(cb->stretch_buf);
+    cb->ring = NULL;
+    cb->period_buf = NULL;
+    cb->stretch_buf = NULL;
+    pthread_cond_destroy(&cb->cond);
+    pthread_mutex_destroy(&cb->lock);
+}
+
+/*
+ * Linear interpolation of n frames onto m, a few frames apart.  The first
+ * and last frames are kept so consecutive periods still join up, which
+ * takes both m and n above 1.
+ */
+static void stretch_period(int16_t *dst, size_t m, const int16_t *src, size_t n,
+                           unsigned int channels)
+{
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < m; i++) {
+        uint64_t pos = (uint64_t)i * (n - 1) * 65536 / (m - 1);
+        size_t idx = pos >> 16;
+        int32_t frac = pos & 0xffff;
+        const int16_t *a = src + idx * channels;
+        const int16_t *b = idx + 1 < n ? a + channels : a;
+
+        for (c = 0; c < channels; c++)
+            *dst++ = a[c] + (int16_t)(((int64_t)(b[c] - a[c]) * frac) >> 16);
+    }
+}
+
+/* must be called with cb->lock held */
+static void capture_buffer_push_locked(struct capture_buffer *cb, const int16_t *frames,
+                                       size_t count)
+{
+    size_t offset = cb->wr % cb->ring_frames;
+    size_t fill = cb->wr - cb->rd;
+    size_t first;
+
+    if (fill + count > cb->ring_frames) {
+        /* the client fell behind by more than the ring, drop the oldest */
+        size_t drop = fill + count - cb->ring_frames;
+
+        cb->rd += drop;
+        cb->lost += drop;
+        cb->lost_total += drop;
+    }
+
+    first = cb->ring_frames - offset;
+    if (first > count)
+        first = count;
+    memcpy(cb->ring + offset * cb->channels, frames, first * cb->channels * sizeof(int16_t));
+    memcpy(cb->ring, frames + first * cb->channels,
+           (count - first) * cb->channels * sizeof(int16_t));
+    cb->wr += count;
+}
+
+/*
+ * Steer the fill seen before each host period to half a period above the
+ * target, which is where a client taking whole periods on time keeps it.
+ * Returns how many frames the next period should have.  Reads too short to
+ * move by a frame within the 0.5% limit are left alone.
+ */
+static size_t capture_buffer_steer_locked(struct capture_buffer *cb, size_t frames)
+{
+    int64_t setpoint = cb->target_frames + cb->period_frames / 2;
+    int64_t error;
+    size_t step, max_step;
+
+    cb->fill_avg += ((int64_t)(cb->wr - cb->rd) * 16 - cb->fill_avg) / 16;
+    if (!cb->primed || frames < CAPTURE_MAX_ADJUST_DIV)
+        return frames;
+
+    error = cb->fill_avg / 16 - setpoint;
+    if (error >= -(int64_t)cb->period_frames / 2 && error <= (int64_t)cb->period_frames / 2)
+        return frames;
+
+    max_step = frames / CAPTURE_MAX_ADJUST_DIV;
+    step = (error < 0 ? -error : error) / 64;
+    if (step < 1)
+        step = 1;
+    if (step > max_step)
+        step = max_step;
+
+    return error > 0 ? frames - step : frames + step;
+}
+
+static void *capture_buffer_thread(void *context)
+{
+    struct capture_buffer *cb = context;
+    struct sched_param param = { .sched_priority = CAPTURE_THREAD_PRIORITY };
+    struct timespec last = { 0, 0 };
+    size_t jitter = 0;
+    /* backend xrun count as of the last period, the pcm is new */
+    unsigned int last_xruns = 0, backend_xruns;
+    ssize_t ret;
+
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+        ALOGW("capture thread is not real-time, expect overruns");
+
+    while (atomic_load(&cb->running)) {
+        struct timespec now, timestamp;
+        unsigned int xruns;
+        uint64_t delay;
+        size_t late = 0, lost = 0, target, count;
+        const int16_t *frames;
+
+        ret = cb->backend->read(cb->pcm, cb->period_buf, cb->period_frames);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (ret <= 0) {
+            pthread_mutex_lock(&cb->lock);
+            cb->status = ret ? ret : -EIO;
+            pthread_cond_broadcast(&cb->cond);
+            pthread_mutex_unlock(&cb->lock);
+            break;
+        }
+        if (cb->backend->get_delay(cb->pcm, &delay, &timestamp)) {
+            delay = 0;
+            timestamp = now;
+        }
+
+        /* how much later than its duration this period took to arrive */
+        if (last.tv_sec || last.tv_nsec) {
+            int64_t late_ns = timespec_to_ns(&now) - timespec_to_ns(&last) -
+                              (int64_t)ret * 1000000000 / cb->rate;
+            if (late_ns > 0)
+                late = late_ns * cb->rate / 1000000000;
+        }
+        last = now;
+        jitter -= jitter / CAPTURE_JITTER_DECAY;
+        if (late > jitter)
+            jitter = late;
+        /* pulse counts overflows from its own thread, between reads too */
+        backend_xruns = cb->backend->get_xruns(cb->pcm);
+        xruns = backend_xruns - last_xruns;
+        last_xruns = backend_xruns;
+        /* the host overran while we were late, what it dropped is about that much */
+        if (xruns)
+            lost = late;
+
+        target = cb->period_frames + jitter;
+        if (target > cb->period_frames * CAPTURE_TARGET_MAX_PERIODS)
+            target = cb->period_frames * CAPTURE_TARGET_MAX_PERIODS;
+
+        pthread_mutex_lock(&cb->lock);
+        cb->jitter_frames = jitter;
+        cb->target_frames = target;
+        count = capture_buffer_steer_locked(cb, ret);
+        if (count != (size_t)ret && count > 1 && ret > 1) {
+            stretch_period(cb->stretch_buf, count, cb->period_buf, ret, cb->channels);
+            frames = cb->stretch_buf;
+            cb->adjusted += (int64_t)count - ret;
+        } else {
+            frames = cb->period_buf;
+            count = ret;
+        }
+        capture_buffer_push_locked(cb, frames, count);
+        cb->host_delay = delay;
+        cb->timestamp = timestamp;
+        cb->xruns += xruns;
+        cb->lost += lost;
+        cb->lost_total += lost;
+        pthread_cond_broadcast(&cb->cond);
+        pthread_mutex_unlock(&cb->lock);
+    }
+
+    return NULL;
+}
+
+int capture_buffer_start(struct capture_buffer *cb, const struct audio_backend *backend,
+                         struct audio_backend_stream *pcm)
+{
+    size_t max_frames = cb->period_frames + cb->period_frames / CAPTURE_MAX_ADJUST_DIV + 1;
+    int ret;
+
+    if (atomic_load(&cb->running))
+        return 0;
+
+    if (!cb->ring) {
+        cb->ring = malloc(cb->ring_frames * cb->channels * sizeof(int16_t));
+        cb->period_buf = malloc(cb->period_frames * cb->channels * sizeof(int16_t));
+        cb->stretch_buf = malloc(max_frames * cb->channels * sizeof(int16_t));
+        if (!cb->ring || !cb->period_buf || !cb->stretch_buf) {
+            free(cb->ring);
+            free(cb->period_buf);
+            free(cb->stretch_buf);
+            cb->ring = NULL;
+            cb->period_buf = NULL;
+            cb->stretch_buf = NULL;
+            return -ENOMEM;
+        }
+    }
+
+    cb->backend = backend;
+    cb->pcm = pcm;
+    cb->status = 0;
+    atomic_store(&cb->running, true);
+    ret = pthread_create(&cb->thread, NULL, capture_buffer_thread, cb);
+    if (ret) {
+        ALOGE("failed to start the capture thread: %s", strerror(ret));
+        atomic_store(&cb->running, false);
+        return -ret;
+    }
+
+    return 0;
+}
+
+void capture_buffer_stop(struct capture_buffer *cb)
+{
+    if (!atomic_load(&cb->running))
+        return;
+
+    atomic_store(&cb->running, false);
+    pthread_join(cb->thread, NULL);
+
+    /* the jitter estimate is kept, the host is likely to behave the same next time */
+    pthread_mutex_lock(&cb->lock);
+    cb->wr = 0;
+    cb->rd = 0;
+    cb->status = 0;
+    cb->primed = false;
+    cb->fill_avg = 0;
+    cb->host_delay = 0;
+    cb->timestamp.tv_sec = 0;
+    cb->timestamp.tv_nsec = 0;
+    pthread_mutex_unlock(&cb->lock);
+}
+
+ssize_t capture_buffer_read(struct capture_buffer *cb, int16_t *buffer, size_t frames)
+{
+    struct timespec now;
+    size_t offset, first;
+    bool waited = false;
+
+    pthread_mutex_lock(&cb->lock);
+    if (!cb->primed) {
+        /* build up the cushion first, then take frames on our own clock */
+        while (cb->status == 0 && cb->wr - cb->rd < cb->target_frames + frames)
+            pthread_cond_wait(&cb->cond, &cb->lock);
+        cb->primed = true;
+        cb->fill_avg = (int64_t)(cb->target_frames + cb->period_frames / 2) * 16;
+        clock_gettime(CLOCK_MONOTONIC, &cb->next_read);
+    } else {
+        while (cb->status == 0 &&
+               pthread_cond_timedwait(&cb->cond, &cb->lock, &cb->next_read) != ETIMEDOUT)
+            ;
+    }
+
+    /* the host is later than the cushion covers, wait for it and start over from there */
+    while (cb->status == 0 && cb->wr - cb->rd < frames) {
+        pthread_cond_wait(&cb->cond, &cb->lock);
+        waited = true;
+    }
+    if (waited) {
+        cb->underruns++;
+        clock_gettime(CLOCK_MONOTONIC, &cb->next_read);
+    }
+
+    if (cb->wr - cb->rd < frames) {
+        int status = cb->status;
+
+        pthread_mutex_unlock(&cb->lock);
+        return status;
+    }
+
+    offset = cb->rd % cb->ring_frames;
+    first = cb->ring_frames - offset;
+    if (first > frames)
+        first = frames;
+    memcpy(buffer, cb->ring + offset * cb->channels, first * cb->channels * sizeof(int16_t));
+    memcpy(buffer + first * cb->channels, cb->ring,
+           (frames - first) * cb->channels * sizeof(int16_t));
+    cb->rd += frames;
+
+    /* a client that is late catches up at once, which brings the fill back down */
+    timespec_add_ns(&cb->next_read, (int64_t)frames * 1000000000 / cb->rate);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_to_ns(&now) - timespec_to_ns(&cb->next_read) >
+            (int64_t)cb->ring_frames * 1000000000 / cb->rate)
+        cb->next_read = now;
+    pthread_mutex_unlock(&cb->lock);
+
+    return frames;
+}
+
+int capture_buffer_get_position(struct capture_buffer *cb, uint64_t *queued,
+                                struct timespec *timestamp)
+{
+    int ret = -ENODATA;
+
+    pthread_mutex_lock(&cb->lock);
+    if (cb->timestamp.tv_sec || cb->timestamp.tv_nsec) {
+        *queued = cb->wr - cb->rd + cb->host_delay;
+        *timestamp = cb->timestamp;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&cb->lock);
+
+    return ret;
+}
+
+unsigned int capture_buffer_get_xruns(struct capture_buffer *cb)
+{
+    unsigned int xruns;
+
+    pthread_mutex_lock(&cb->lock);
+    xruns = cb->xruns;
+    pthread_mutex_unlock(&cb->lock);
+    return xruns;
+}
+
+uint64_t capture_buffer_take_lost(struct capture_buffer *cb)
+{
+    uint64_t lost;
+
+    pthread_mutex_lock(&cb->lock);
+    lost = cb->lost;
+    cb->lost = 0;
+    pthread_mutex_unlock(&cb->lock);
+    return lost;
+}
+
+void capture_buffer_dump(struct capture_buffer *cb, int fd)
+{
+    pthread_mutex_lock(&cb->lock);
+    dprintf(fd, "      Jitter buffer: %zu of %zu frames queued, target %zu, jitter %zu\n",
+            (size_t)(cb->wr - cb->rd), cb->ring_frames, cb->target_frames, cb->jitter_frames);
+    dprintf(fd, "      Jitter buffer: %u underruns, %llu frames lost, %lld drift adjusted\n",
+            cb->underruns, (unsigned long long)cb->lost_total, (long long)cb->adjusted);
+    pthread_mutex_unlock(&cb->lock);
+}
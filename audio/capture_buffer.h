@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WAYDROID_AUDIO_CAPTURE_BUFFER_H
+#define WAYDROID_AUDIO_CAPTURE_BUFFER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "audio_backend.h"
+
+/*
+ * Jitter buffer between the host capture stream and the client.
+ *
+ * A real-time thread reads host periods into a ring as soon as the host
+ * delivers them, so a late client no longer overruns the host stream.  The
+ * client side is paced by CLOCK_MONOTONIC and keeps target_frames queued,
+ * which absorbs late host deliveries; the target follows the lateness seen
+ * recently.  The host clock drifts against the monotonic one, so the ring
+ * fill is steered back to the target by stretching or squeezing incoming
+ * periods by a few frames.  Frames that do not fit are dropped and
+ * accounted as lost.
+ *
+ * Samples are 16 bit host frames, anything else is done by the caller.
+ */
+struct capture_buffer {
+    unsigned int rate;
+    unsigned int channels;
+    size_t period_frames;
+    size_t ring_frames;
+    int16_t *ring;
+    /* host read and drift corrected copy of it, thread only */
+    int16_t *period_buf;
+    int16_t *stretch_buf;
+
+    const struct audio_backend *backend;
+    struct audio_backend_stream *pcm;
+    pthread_t thread;
+    /* cleared by capture_buffer_stop(), read by the thread */
+    atomic_bool running;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* frames written by the thread and read by the client, never wrap */
+    uint64_t wr;
+    uint64_t rd;
+    /* read error from the host, the thread is gone once set */
+    int status;
+    /* client side pacing, starts once target_frames are queued */
+    bool primed;
+    struct timespec next_read;
+    /* recent worst host lateness, decaying, and the fill it calls for */
+    size_t jitter_frames;
+    size_t target_frames;
+    /* ring fill before each host period, low pass filtered, in 1/16 frames */
+    int64_t fill_avg;
+    /* host delay and when it was sampled, as of the last host period */
+    uint64_t host_delay;
+    struct timespec timestamp;
+
+    /* host frames lost since the last capture_buffer_take_lost() */
+    uint64_t lost;
+    uint64_t lost_total;
+    unsigned int xruns;
+    unsigned int underruns;
+    /* frames inserted (positive) or dropped (negative) by drift correction */
+    int64_t adjusted;
+};
+
+void capture_buffer_init(struct capture_buffer *cb, unsigned int rate, unsigned int channels,
+                         size_t period_frames);
+void capture_buffer_release(struct capture_buffer *cb);
+
+/* The backend stream is owned by the caller and must outlive the thread. */
+int capture_buffer_start(struct capture_buffer *cb, const struct audio_backend *backend,
+                         struct audio_backend_stream *pcm);
+/* Joins the thread and drops whatever is queued. */
+void capture_buffer_stop(struct capture_buffer *cb);
+static inline bool capture_buffer_running(const struct capture_buffer *cb)
+{
+    return atomic_load(&cb->running);
+}
+
+/*
+ * Blocks until frames are due and available, returns frames or a negative
+ * error from the host stream.
+ */
+ssize_t capture_buffer_read(struct capture_buffer *cb, int16_t *buffer, size_t frames);
+
+/* Frames queued in the ring and on the host, as of timestamp. */
+int capture_buffer_get_position(struct capture_buffer *cb, uint64_t *queued,
+                                struct timespec *timestamp);
+unsigned int capture_buffer_get_xruns(struct capture_buffer *cb);
+uint64_t capture_buffer_take_lost(struct capture_buffer *cb);
+
+void capture_buffer_dump(struct capture_buffer *cb, int fd);
+
+#endif  // WAYDROID_AUDIO_CAPTURE_BUFFER_H
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_mmap"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/memfd.h>
+
+#include <log/log.h>
+
+#include "mmap_stream.h"
+
+/* same as the AudioFlinger fast mixer and AAudio service threads */
+#define MMAP_THREAD_PRIORITY 3
+
+int mmap_stream_create_buffer(struct mmap_stream *s, bool capture, size_t frame_size,
+                              size_t burst_frames, int32_t min_size_frames,
+                              struct audio_mmap_buffer_info *info)
+{
+    size_t buffer_frames;
+    size_t size;
+    int fd;
+
+    if (s->buffer)
+        return -EBUSY;
+
+    /* whole bursts, and enough of them to ride out a late wakeup */
+    buffer_frames = min_size_frames > 0 ? (size_t)min_size_frames : 0;
+    if (buffer_frames < burst_frames * 4)
+        buffer_frames = burst_frames * 4;
+    buffer_frames = (buffer_frames + burst_frames - 1) / burst_frames * burst_frames;
+    size = buffer_frames * frame_size;
+
+    fd = syscall(__NR_memfd_create, capture ? "audio-mmap-in" : "audio-mmap-out", MFD_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("memfd_create failed: %s", strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, size) < 0) {
+        ALOGE("failed to size the mmap buffer: %s", strerror(errno));
+        close(fd);
+        return -ENOMEM;
+    }
+
+    s->buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s->buffer == MAP_FAILED) {
+        ALOGE("failed to map the mmap buffer: %s", strerror(errno));
+        s->buffer = NULL;
+        close(fd);
+        return -ENOMEM;
+    }
+
+    s->capture = capture;
+    s->fd = fd;
+    s->frame_size = frame_size;
+    s->buffer_frames = buffer_frames;
+    s->burst_frames = burst_frames;
+    s->position = 0;
+    s->timestamp.tv_sec = 0;
+    s->timestamp.tv_nsec = 0;
+    pthread_mutex_init(&s->lock, NULL);
+
+    info->shared_memory_address = s->buffer;
+    info->shared_memory_fd = fd;
+    info->buffer_size_frames = buffer_frames;
+    info->burst_size_frames = burst_frames;
+    /* a memfd is fine to hand over to the app, which allows exclusive mode */
+    info->flags = AUDIO_MMAP_APPLICATION_SHAREABLE;
+
+    ALOGI("%s mmap buffer: %zu frames, burst %zu", capture ? "capture" : "playback",
+          buffer_frames, burst_frames);
+    return 0;
+}
+
+void mmap_stream_release_buffer(struct mmap_stream *s)
+{
+    if (!s->buffer)
+        return;
+
+    mmap_stream_stop(s);
+    munmap(s->buffer, s->buffer_frames * s->frame_size);
+    close(s->fd);
+    pthread_mutex_destroy(&s->lock);
+    s->buffer = NULL;
+}
+
+static void *mmap_stream_thread(void *context)
+{
+    struct mmap_stream *s = context;
+    struct sched_param param = { .sched_priority = MMAP_THREAD_PRIORITY };
+    size_t burst_bytes = s->burst_frames * s->frame_size;
+    size_t offset = 0;
+    int64_t position = 0;
+    ssize_t ret;
+
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+        ALOGW("mmap thread is not real-time, expect glitches");
+
+    while (atomic_load(&s->running)) {
+        struct timespec timestamp;
+
+        if (s->capture)
+            ret = s->backend->read(s->pcm, s->buffer + offset, s->burst_frames);
+        else
+            ret = s->backend->write(s->pcm, s->buffer + offset, s->burst_frames);
+
+        if (ret < 0) {
+            /* keep the clock going so the client does not stall on a dead host stream */
+            if (s->capture)
+                memset(s->buffer + offset, 0, burst_bytes);
+            usleep(s->burst_frames * 1000000 / s->backend_rate);
+        }
+
+        offset += burst_bytes;
+        if (offset >= s->buffer_frames * s->frame_size)
+            offset = 0;
+        position += s->burst_frames;
+
+        /*
+         * the burst just left the ring, or just landed in it; the backend's
+         * delay timestamp is of the host pipeline and would not match
+         */
+        clock_gettime(CLOCK_MONOTONIC, &timestamp);
+
+        pthread_mutex_lock(&s->lock);
+        s->position = position;
+        s->timestamp = timestamp;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return NULL;
+}
+
+int mmap_stream_start(struct mmap_stream *s, const struct audio_backend *backend,
+                      struct audio_backend_stream *pcm, unsigned int rate)
+{
+    int ret;
+
+    if (!s->buffer)
+        return -ENOSYS;
+    if (atomic_load(&s->running))
+        return 0;
+
+    s->backend = backend;
+    s->pcm = pcm;
+    s->backend_rate = rate;
+    atomic_store(&s->running, true);
+    ret = pthread_create(&s->thread, NULL, mmap_stream_thread, s);
+    if (ret) {
+        ALOGE("failed to start the mmap thread: %s", strerror(ret));
+        atomic_store(&s->running, false);
+        return -ret;
+    }
+
+    return 0;
+}
+
+void mmap_stream_stop(struct mmap_stream *s)
+{
+    if (!atomic_load(&s->running))
+        return;
+
+    atomic_store(&s->running, false);
+    pthread_join(s->thread, NULL);
+
+    /* the next start begins again at the top of the ring */
+    pthread_mutex_lock(&s->lock);
+    s->position = 0;
+    s->timestamp.tv_sec = 0;
+    s->timestamp.tv_nsec = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+int mmap_stream_get_position(struct mmap_stream *s, struct audio_mmap_position *position)
+{
+    int ret = 0;
+
+    if (!s->buffer)
+        return -ENOSYS;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->timestamp.tv_sec == 0 && s->timestamp.tv_nsec == 0) {
+        ret = -ENODATA;
+    } else {
+        position->position_frames = (int32_t)s->position;
+        position->time_nanoseconds = s->timestamp.tv_sec * 1000000000LL +
+                                     s->timestamp.tv_nsec;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
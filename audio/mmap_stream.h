@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WAYDROID_AUDIO_MMAP_STREAM_H
+#define WAYDROID_AUDIO_MMAP_STREAM_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <hardware/audio.h>
+
+#include "audio_backend.h"
+
+/*
+ * Shared ring for AAudio MMAP streams.  There is no DMA engine behind the
+ * buffer, so a real-time thread moves one burst at a time between the ring
+ * and the backend stream, and the backend's blocking transfers pace it to
+ * the host clock.
+ */
+struct mmap_stream {
+    bool capture;
+    int fd;
+    uint8_t *buffer;
+    size_t frame_size;
+    size_t buffer_frames;
+    size_t burst_frames;
+
+    const struct audio_backend *backend;
+    struct audio_backend_stream *pcm;
+    unsigned int backend_rate;
+    pthread_t thread;
+    /* cleared by mmap_stream_stop(), read by the thread */
+    atomic_bool running;
+
+    /*
+     * How far the thread got through the ring, and when: the position of
+     * the DMA pointer and its time as AAudio expects them.  Both describe
+     * the ring, not the speaker or microphone; the host latency on top is
+     * reported through the stream latency, as for a real DSP.
+     */
+    pthread_mutex_t lock;
+    int64_t position;
+    struct timespec timestamp;
+};
+
+int mmap_stream_create_buffer(struct mmap_stream *s, bool capture, size_t frame_size,
+                              size_t burst_frames, int32_t min_size_frames,
+                              struct audio_mmap_buffer_info *info);
+void mmap_stream_release_buffer(struct mmap_stream *s);
+static inline bool mmap_stream_has_buffer(const struct mmap_stream *s)
+{
+    return s->buffer != NULL;
+}
+
+/* The backend stream is owned by the caller and must outlive the thread. */
+int mmap_stream_start(struct mmap_stream *s, const struct audio_backend *backend,
+                      struct audio_backend_stream *pcm, unsigned int rate);
+void mmap_stream_stop(struct mmap_stream *s);
+int mmap_stream_get_position(struct mmap_stream *s, struct audio_mmap_position *position);
+
+#endif  // WAYDROID_AUDIO_MMAP_STREAM_H
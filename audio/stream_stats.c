@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define ATRACE_TAG ATRACE_TAG_AUDIO
+#include <cutils/trace.h>
+
+#include "stream_stats.h"
+
+#define STATS_DURATION_MIN_US 250
+/* call intervals this many times the audio they carry are pauses */
+#define STATS_JITTER_GAP 4
+
+void stream_stats_init(struct stream_stats *stats, const char *name)
+{
+    memset(stats, 0, sizeof(*stats));
+    snprintf(stats->trace_duration, sizeof(stats->trace_duration), "%s_transfer_us", name);
+    snprintf(stats->trace_fill, sizeof(stats->trace_fill), "%s_fill_pct", name);
+    snprintf(stats->trace_latency, sizeof(stats->trace_latency), "%s_latency_us", name);
+    snprintf(stats->trace_xruns, sizeof(stats->trace_xruns), "%s_xruns", name);
+    snprintf(stats->trace_jitter, sizeof(stats->trace_jitter), "%s_jitter_us", name);
+}
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+void stream_stats_begin(struct stream_stats *stats)
+{
+    int64_t interval_ns, jitter_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &stats->call_start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stats->call_cpu_start);
+
+    /* a gap of several calls is the client stopping, not jitter */
+    if (stats->last_call_ns && (stats->last_call_start.tv_sec || stats->last_call_start.tv_nsec)) {
+        interval_ns = timespec_diff_ns(&stats->call_start, &stats->last_call_start);
+        if (interval_ns < stats->last_call_ns * STATS_JITTER_GAP) {
+            jitter_us = (interval_ns - stats->last_call_ns) / 1000;
+            if (jitter_us < 0)
+                jitter_us = -jitter_us;
+            stats->jitter_sum_us += jitter_us;
+            stats->jitter_count++;
+            if (jitter_us > stats->jitter_max_us)
+                stats->jitter_max_us = jitter_us;
+            if (ATRACE_ENABLED())
+                ATRACE_INT(stats->trace_jitter, jitter_us);
+        }
+    }
+    stats->last_call_start = stats->call_start;
+}
+
+void stream_stats_transfer(struct stream_stats *stats, size_t frames, uint64_t queued,
+                           size_t capacity, unsigned int rate)
+{
+    struct timespec now, cpu;
+    int64_t duration_us, cpu_ns;
+    uint32_t bucket, limit, fill;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    duration_us = timespec_diff_ns(&now, &stats->call_start) / 1000;
+    if (duration_us < 0)
+        duration_us = 0;
+    cpu_ns = timespec_diff_ns(&cpu, &stats->call_cpu_start);
+    if (cpu_ns > 0)
+        stats->cpu_ns += cpu_ns;
+    stats->last_call_ns = (int64_t)frames * 1000000000 / rate;
+    stats->audio_ns += stats->last_call_ns;
+
+    for (bucket = 0, limit = STATS_DURATION_MIN_US;
+         bucket < STATS_DURATION_BUCKETS - 1 && duration_us >= limit;
+         bucket++, limit *= 2)
+        ;
+    stats->duration_hist[bucket]++;
+    if (duration_us > stats->duration_max_us)
+        stats->duration_max_us = duration_us;
+
+    fill = capacity ? queued * 100 / capacity : 0;
+    bucket = fill / (100 / STATS_FILL_BUCKETS);
+    if (bucket >= STATS_FILL_BUCKETS)
+        bucket = STATS_FILL_BUCKETS - 1;
+    stats->fill_hist[bucket]++;
+
+    stats->latency_us = queued * 1000000 / rate;
+    if (!stats->transfers || stats->latency_us < stats->latency_min_us)
+        stats->latency_min_us = stats->latency_us;
+    if (stats->latency_us > stats->latency_max_us)
+        stats->latency_max_us = stats->latency_us;
+    stats->transfers++;
+
+    if (ATRACE_ENABLED()) {
+        ATRACE_INT(stats->trace_duration, duration_us);
+        ATRACE_INT(stats->trace_fill, fill);
+        ATRACE_INT(stats->trace_latency, stats->latency_us);
+    }
+}
+
+void stream_stats_xrun(struct stream_stats *stats)
+{
+    stats->xruns++;
+    ATRACE_INT(stats->trace_xruns, stats->xruns);
+}
+
+void stream_stats_dump(const struct stream_stats *stats, int fd)
+{
+    uint32_t limit;
+    int i;
+
+    dprintf(fd, "      Starts: %u cold, %u warm, %u reconnects\n",
+            stats->cold_starts, stats->warm_starts, stats->reconnects);
+    dprintf(fd, "      Xruns: %u, errors: %u\n", stats->xruns, stats->errors);
+    dprintf(fd, "      Host latency: %u us (min %u, max %u)\n",
+            stats->latency_us, stats->latency_min_us, stats->latency_max_us);
+
+    dprintf(fd, "      Transfers: %llu, longest %u us\n",
+            (unsigned long long)stats->transfers, stats->duration_max_us);
+    dprintf(fd, "      Call jitter: average %llu us, max %u us\n",
+            (unsigned long long)(stats->jitter_count ?
+                                 stats->jitter_sum_us / stats->jitter_count : 0),
+            stats->jitter_max_us);
+    dprintf(fd, "      CPU: %llu us per second of audio\n",
+            (unsigned long long)(stats->audio_ns / 1000000 ?
+                                 stats->cpu_ns / (stats->audio_ns / 1000000) : 0));
+    dprintf(fd, "       ");
+    for (i = 0, limit = STATS_DURATION_MIN_US; i < STATS_DURATION_BUCKETS - 1; i++, limit *= 2)
+        dprintf(fd, " <%uus:%u", limit, stats->duration_hist[i]);
+    dprintf(fd, " more:%u\n", stats->duration_hist[STATS_DURATION_BUCKETS - 1]);
+
+    dprintf(fd, "      Host buffer fill:\n       ");
+    for (i = 0; i < STATS_FILL_BUCKETS; i++)
+        dprintf(fd, " %d%%:%u", i * (100 / STATS_FILL_BUCKETS), stats->fill_hist[i]);
+    dprintf(fd, "\n");
+}
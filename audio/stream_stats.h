@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WAYDROID_AUDIO_STREAM_STATS_H
+#define WAYDROID_AUDIO_STREAM_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* call durations, the first bucket is under 250 us and each one doubles */
+#define STATS_DURATION_BUCKETS 10
+/* host buffer fill, in 10% steps */
+#define STATS_FILL_BUCKETS 10
+
+/*
+ * Per stream counters, updated under the stream lock on every transfer.
+ * They only cost a few additions, and the trace counters are skipped
+ * unless audio tracing is enabled.
+ */
+struct stream_stats {
+    char trace_duration[32];
+    char trace_fill[32];
+    char trace_latency[32];
+    char trace_xruns[32];
+    char trace_jitter[32];
+
+    /* the call in progress, and when the previous one started */
+    struct timespec call_start;
+    struct timespec call_cpu_start;
+    struct timespec last_call_start;
+    int64_t last_call_ns;
+
+    uint64_t transfers;
+    uint32_t duration_hist[STATS_DURATION_BUCKETS];
+    uint32_t duration_max_us;
+    uint32_t fill_hist[STATS_FILL_BUCKETS];
+    uint32_t latency_us;
+    uint32_t latency_min_us;
+    uint32_t latency_max_us;
+
+    /* how far call intervals stray from the audio they carried */
+    uint64_t jitter_sum_us;
+    uint32_t jitter_max_us;
+    uint64_t jitter_count;
+    /* thread CPU time spent in calls, against the audio they moved */
+    uint64_t cpu_ns;
+    uint64_t audio_ns;
+
+    /* underruns for outputs, overruns for inputs, as recovered by the backend */
+    unsigned int xruns;
+    unsigned int errors;
+    unsigned int cold_starts;
+    unsigned int warm_starts;
+    unsigned int reconnects;
+};
+
+/* name shows up in the trace counters, e.g. "out_13" */
+void stream_stats_init(struct stream_stats *stats, const char *name);
+
+/* Call on entry to a read or write, before any conversion. */
+void stream_stats_begin(struct stream_stats *stats);
+/*
+ * Account the read or write begun last, which moved frames and after which
+ * queued frames out of capacity were waiting on the host, all at rate.
+ */
+void stream_stats_transfer(struct stream_stats *stats, size_t frames, uint64_t queued,
+                           size_t capacity, unsigned int rate);
+void stream_stats_xrun(struct stream_stats *stats);
+
+void stream_stats_dump(const struct stream_stats *stats, int fd);
+
+#endif  // WAYDROID_AUDIO_STREAM_STATS_H
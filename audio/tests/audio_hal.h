@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WAYDROID_AUDIO_TESTS_AUDIO_HAL_H
+#define WAYDROID_AUDIO_TESTS_AUDIO_HAL_H
+
+/*
+ * Loads the HAL the way audioserver does, but straight from its file so
+ * that a build that is not installed yet can be tested: AUDIO_HAL names
+ * the .so, the installed one is used otherwise.
+ */
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <hardware/audio.h>
+#include <hardware/hardware.h>
+
+#ifdef __LP64__
+#define AUDIO_HAL_DEFAULT_PATH "/vendor/lib64/hw/audio.primary.waydroid.so"
+#else
+#define AUDIO_HAL_DEFAULT_PATH "/vendor/lib/hw/audio.primary.waydroid.so"
+#endif
+
+static inline int64_t audio_hal_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static inline int64_t audio_hal_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Returns the opened device, or NULL with the reason in *error. */
+static inline struct audio_hw_device *audio_hal_open(void **handle, const char **error)
+{
+    const char *path = getenv("AUDIO_HAL");
+    struct hw_module_t *module;
+    struct hw_device_t *device;
+
+    *handle = dlopen(path ? path : AUDIO_HAL_DEFAULT_PATH, RTLD_NOW);
+    if (!*handle) {
+        *error = dlerror();
+        return NULL;
+    }
+    module = (struct hw_module_t *)dlsym(*handle, HAL_MODULE_INFO_SYM_AS_STR);
+    if (!module) {
+        *error = "no " HAL_MODULE_INFO_SYM_AS_STR " symbol";
+        dlclose(*handle);
+        return NULL;
+    }
+    if (module->methods->open(module, AUDIO_HARDWARE_INTERFACE, &device) != 0) {
+        *error = "cannot open the device";
+        dlclose(*handle);
+        return NULL;
+    }
+    return (struct audio_hw_device *)device;
+}
+
+static inline void audio_hal_close(struct audio_hw_device *dev, void *handle)
+{
+    dev->common.close(&dev->common);
+    dlclose(handle);
+}
+
+#endif  /* WAYDROID_AUDIO_TESTS_AUDIO_HAL_H */
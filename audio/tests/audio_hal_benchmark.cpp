@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Startup, throughput and round trip latency of the HAL, against whatever
+ * the host's default sink and source are.  With a null sink and its monitor
+ * (see run_loopback_test.sh) nothing is audible and the round trip is the
+ * HAL's and the sound server's alone, which makes the numbers comparable
+ * between runs: a change to period sizes or backends shows up here first.
+ *
+ * Xruns, host latency and the HAL's own CPU cost come from the stream's
+ * dump, the same counters dumpsys shows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "audio_hal.h"
+
+namespace {
+
+constexpr uint32_t kRate = 48000;
+constexpr int kChannels = 2;
+constexpr size_t kFrameSize = kChannels * sizeof(int16_t);
+// how long a round trip may take before the impulse counts as lost
+constexpr int64_t kRoundTripTimeoutNs = 1000000000;
+
+struct Hal {
+    void* handle = nullptr;
+    struct audio_hw_device* dev = nullptr;
+    const char* error = nullptr;
+};
+
+// Opened on first use, so that BM_LoadModule loads it from scratch.
+Hal& hal() {
+    static Hal h = [] {
+        Hal h;
+        h.dev = audio_hal_open(&h.handle, &h.error);
+        return h;
+    }();
+    return h;
+}
+
+struct audio_config config(audio_channel_mask_t mask) {
+    struct audio_config config = AUDIO_CONFIG_INITIALIZER;
+
+    config.sample_rate = kRate;
+    config.channel_mask = mask;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    return config;
+}
+
+struct audio_stream_out* openOutput(benchmark::State& state) {
+    struct audio_config cfg = config(AUDIO_CHANNEL_OUT_STEREO);
+    struct audio_stream_out* out = nullptr;
+
+    if (!hal().dev)
+        state.SkipWithError(hal().error);
+    else if (hal().dev->open_output_stream(hal().dev, 1, AUDIO_DEVICE_OUT_SPEAKER,
+                                           AUDIO_OUTPUT_FLAG_PRIMARY, &cfg, &out, ""))
+        state.SkipWithError("cannot open the output");
+    return out;
+}
+
+struct audio_stream_in* openInput(benchmark::State& state) {
+    struct audio_config cfg = config(AUDIO_CHANNEL_IN_STEREO);
+    struct audio_stream_in* in = nullptr;
+
+    if (!hal().dev)
+        state.SkipWithError(hal().error);
+    else if (hal().dev->open_input_stream(hal().dev, 2, AUDIO_DEVICE_IN_BUILTIN_MIC, &cfg, &in,
+                                          AUDIO_INPUT_FLAG_NONE, "", AUDIO_SOURCE_MIC))
+        state.SkipWithError("cannot open the input");
+    return in;
+}
+
+int64_t processCpuNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return audio_hal_ns(&ts);
+}
+
+// Pulls the counters this stream keeps out of its dump.
+void reportStreamStats(benchmark::State& state, const struct audio_stream* stream) {
+    int fd = memfd_create("audio_hal_benchmark", 0);
+    unsigned int xruns = 0, latencyUs = 0;
+    unsigned long long cpuUs = 0;
+    char line[256];
+
+    if (fd < 0)
+        return;
+    stream->dump(stream, fd);
+    lseek(fd, 0, SEEK_SET);
+    FILE* dump = fdopen(fd, "r");
+    if (!dump) {
+        close(fd);
+        return;
+    }
+    while (fgets(line, sizeof(line), dump)) {
+        sscanf(line, " Xruns: %u", &xruns);
+        sscanf(line, " Host latency: %u", &latencyUs);
+        sscanf(line, " CPU: %llu", &cpuUs);
+    }
+    fclose(dump);
+
+    state.counters["xruns"] = xruns;
+    state.counters["host_latency_ms"] = latencyUs / 1000.0;
+    state.counters["hal_cpu_us_per_s"] = cpuUs;
+}
+
+// Call intervals against the audio each call carried, and what the whole
+// process, sound server client included, spent per second of audio.
+class Pacing {
+  public:
+    explicit Pacing(size_t frames)
+        : mPeriodNs(static_cast<int64_t>(frames) * 1000000000 / kRate),
+          mCpuStart(processCpuNs()) {}
+
+    void call() {
+        int64_t now = audio_hal_now_ns();
+
+        if (mLast) {
+            int64_t jitter = std::abs(now - mLast - mPeriodNs);
+            mJitterSum += jitter;
+            mJitterMax = std::max(mJitterMax, jitter);
+            mCalls++;
+        }
+        mLast = now;
+    }
+
+    void report(benchmark::State& state, int64_t audioNs) {
+        if (mCalls) {
+            state.counters["jitter_us"] = mJitterSum / mCalls / 1000.0;
+            state.counters["jitter_max_us"] = mJitterMax / 1000.0;
+        }
+        if (audioNs > 0)
+            state.counters["cpu_us_per_s"] = (processCpuNs() - mCpuStart) * 1e6 / audioNs;
+    }
+
+  private:
+    const int64_t mPeriodNs;
+    const int64_t mCpuStart;
+    int64_t mLast = 0;
+    int64_t mJitterSum = 0;
+    int64_t mJitterMax = 0;
+    int64_t mCalls = 0;
+};
+
+void BM_LoadModule(benchmark::State& state) {
+    for (auto _ : state) {
+        void* handle;
+        const char* error;
+        struct audio_hw_device* dev = audio_hal_open(&handle, &error);
+
+        if (!dev) {
+            state.SkipWithError(error);
+            break;
+        }
+        audio_hal_close(dev, handle);
+    }
+}
+BENCHMARK(BM_LoadModule)->Unit(benchmark::kMillisecond);
+
+// Open to the first buffer accepted, from cold.
+void BM_OutputStartup(benchmark::State& state) {
+    std::vector<char> silence(960 * kFrameSize);
+
+    for (auto _ : state) {
+        struct audio_stream_out* out = openOutput(state);
+
+        if (!out)
+            break;
+        out->write(out, silence.data(), silence.size());
+        state.PauseTiming();
+        hal().dev->close_output_stream(hal().dev, out);
+        state.ResumeTiming();
+    }
+}
+BENCHMARK(BM_OutputStartup)->Unit(benchmark::kMillisecond);
+
+void BM_Write(benchmark::State& state) {
+    size_t frames = state.range(0);
+    std::vector<char> silence(frames * kFrameSize);
+    struct audio_stream_out* out = openOutput(state);
+    int64_t written = 0;
+
+    if (!out)
+        return;
+    Pacing pacing(frames);
+    for (auto _ : state) {
+        pacing.call();
+        if (out->write(out, silence.data(), silence.size()) !=
+                static_cast<ssize_t>(silence.size())) {
+            state.SkipWithError("write failed");
+            break;
+        }
+        written += frames;
+    }
+    pacing.report(state, written * 1000000000 / kRate);
+    reportStreamStats(state, &out->common);
+    hal().dev->close_output_stream(hal().dev, out);
+}
+BENCHMARK(BM_Write)->Arg(240)->Arg(480)->Arg(960)->Arg(1920)->Arg(3840)->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+void BM_Read(benchmark::State& state) {
+    size_t frames = state.range(0);
+    std::vector<char> buffer(frames * kFrameSize);
+    struct audio_stream_in* in = openInput(state);
+    int64_t read = 0;
+
+    if (!in)
+        return;
+    Pacing pacing(frames);
+    for (auto _ : state) {
+        pacing.call();
+        if (in->read(in, buffer.data(), buffer.size()) !=
+                static_cast<ssize_t>(buffer.size())) {
+            state.SkipWithError("read failed");
+            break;
+        }
+        read += frames;
+    }
+    pacing.report(state, read * 1000000000 / kRate);
+    reportStreamStats(state, &in->common);
+    hal().dev->close_input_stream(hal().dev, in);
+}
+BENCHMARK(BM_Read)->Arg(240)->Arg(480)->Arg(960)->Arg(1920)->Arg(3840)->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+// Reads all along, so that an impulse can be looked for in what came in.
+class Recorder {
+  public:
+    explicit Recorder(struct audio_stream_in* in) : mIn(in), mThread([this] { run(); }) {}
+
+    ~Recorder() {
+        mStop = true;
+        mThread.join();
+    }
+
+    // When the first frame from frame on that is louder than a quarter of
+    // full scale was captured, 0 if there is none yet.
+    int64_t findImpulse(int64_t frame, int64_t* found) {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        for (int64_t i = std::max<int64_t>(frame, 0); i < static_cast<int64_t>(mLeft.size());
+             i++) {
+            if (std::abs(mLeft[i]) > INT16_MAX / 4) {
+                *found = i;
+                return mCapturedNs + (i - mCapturedFrames) * 1000000000 / kRate;
+            }
+        }
+        return 0;
+    }
+
+    int64_t frames() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mLeft.size();
+    }
+
+    bool failed() const { return mFailed; }
+
+  private:
+    void run() {
+        std::vector<int16_t> buffer(960 * kChannels);
+
+        while (!mStop) {
+            ssize_t bytes = mIn->read(mIn, buffer.data(), buffer.size() * sizeof(int16_t));
+            if (bytes <= 0) {
+                mFailed = true;
+                return;
+            }
+            int64_t frames, ns;
+            bool position = mIn->get_capture_position(mIn, &frames, &ns) == 0;
+
+            std::lock_guard<std::mutex> lock(mLock);
+            for (size_t i = 0; i < bytes / kFrameSize; i++)
+                mLeft.push_back(buffer[i * kChannels]);
+            if (position) {
+                mCapturedFrames = frames;
+                mCapturedNs = ns;
+            }
+        }
+    }
+
+    struct audio_stream_in* const mIn;
+    std::mutex mLock;
+    std::vector<int16_t> mLeft;
+    int64_t mCapturedFrames = 0;
+    int64_t mCapturedNs = 0;
+    std::atomic<bool> mStop{false};
+    std::atomic<bool> mFailed{false};
+    std::thread mThread;
+};
+
+// From the write call that carries an impulse to the impulse being
+// captured, through the host's loopback.
+void BM_RoundTrip(benchmark::State& state) {
+    constexpr size_t kFrames = 960;
+    std::vector<int16_t> silence(kFrames * kChannels);
+    std::vector<int16_t> impulse(kFrames * kChannels);
+    struct audio_stream_out* out = openOutput(state);
+    struct audio_stream_in* in = out ? openInput(state) : nullptr;
+    int64_t lost = 0;
+
+    if (!out || !in) {
+        if (out)
+            hal().dev->close_output_stream(hal().dev, out);
+        return;
+    }
+    impulse[0] = impulse[1] = INT16_MAX;
+
+    {
+        Recorder recorder(in);
+        auto write = [&](const std::vector<int16_t>& buffer) {
+            return out->write(out, buffer.data(), buffer.size() * sizeof(int16_t)) > 0;
+        };
+
+        // both streams settle before anything is measured
+        for (int i = 0; i < 25; i++)
+            write(silence);
+
+        int64_t searched = recorder.frames();
+        for (auto _ : state) {
+            int64_t sent = audio_hal_now_ns();
+            int64_t found = -1, captured = 0;
+
+            if (!write(impulse) || recorder.failed()) {
+                state.SkipWithError("stream failed");
+                break;
+            }
+            while (!(captured = recorder.findImpulse(searched, &found)) &&
+                   audio_hal_now_ns() - sent < kRoundTripTimeoutNs)
+                write(silence);
+            // some silence after it, so that the next one stands alone
+            for (int i = 0; i < 5; i++)
+                write(silence);
+
+            if (!captured) {
+                lost++;
+                state.SetIterationTime(kRoundTripTimeoutNs / 1e9);
+                continue;
+            }
+            searched = found + 1;
+            state.SetIterationTime(std::max<int64_t>(captured - sent, 0) / 1e9);
+        }
+    }
+    state.counters["lost"] = lost;
+    reportStreamStats(state, &out->common);
+    hal().dev->close_input_stream(hal().dev, in);
+    hal().dev->close_output_stream(hal().dev, out);
+}
+BENCHMARK(BM_RoundTrip)->Iterations(20)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
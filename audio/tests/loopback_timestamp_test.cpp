@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks the positions the HAL reports against what actually comes out of
+ * the host: with the host's default sink a null sink and the default source
+ * its monitor, an impulse written to the output stream is read back from
+ * the input stream, and the presentation and capture timestamps must agree
+ * on when that happened.  run_loopback_test.sh sets that up.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "audio_hal.h"
+
+namespace {
+
+constexpr uint32_t kRate = 48000;
+constexpr int kChannels = 2;
+constexpr size_t kFrameSize = kChannels * sizeof(int16_t);
+// rate the positions move at, over a couple of seconds
+constexpr double kRateTolerance = 0.02;
+// between the two clocks; the null sink runs on a timer of its own
+constexpr int64_t kLoopbackToleranceNs = 20000000;
+// how old a timestamp may be when it is returned
+constexpr int64_t kMaxStalenessNs = 100000000;
+
+struct Position {
+    int64_t frames;
+    int64_t ns;
+};
+
+class LoopbackTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        const char* error = nullptr;
+
+        mDev = audio_hal_open(&mHandle, &error);
+        if (!mDev)
+            GTEST_SKIP() << "no audio HAL: " << error;
+    }
+
+    void TearDown() override {
+        if (mOut)
+            mDev->close_output_stream(mDev, mOut);
+        if (mIn)
+            mDev->close_input_stream(mDev, mIn);
+        if (mDev)
+            audio_hal_close(mDev, mHandle);
+    }
+
+    struct audio_config config() {
+        struct audio_config config = AUDIO_CONFIG_INITIALIZER;
+
+        config.sample_rate = kRate;
+        config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        config.format = AUDIO_FORMAT_PCM_16_BIT;
+        return config;
+    }
+
+    void openOutput() {
+        struct audio_config cfg = config();
+
+        ASSERT_EQ(0, mDev->open_output_stream(mDev, 1, AUDIO_DEVICE_OUT_SPEAKER,
+                                              AUDIO_OUTPUT_FLAG_PRIMARY, &cfg, &mOut, ""));
+        mOutFrames = mOut->common.get_buffer_size(&mOut->common) / kFrameSize;
+        ASSERT_GT(mOutFrames, 0u);
+    }
+
+    void openInput() {
+        struct audio_config cfg = config();
+
+        cfg.channel_mask = AUDIO_CHANNEL_IN_STEREO;
+        ASSERT_EQ(0, mDev->open_input_stream(mDev, 2, AUDIO_DEVICE_IN_BUILTIN_MIC, &cfg, &mIn,
+                                             AUDIO_INPUT_FLAG_NONE, "", AUDIO_SOURCE_MIC));
+        mInFrames = mIn->common.get_buffer_size(&mIn->common) / kFrameSize;
+        ASSERT_GT(mInFrames, 0u);
+    }
+
+    // Writes ms of silence, with a full scale impulse at frame impulse if
+    // that falls in it, and records the position after every write.
+    void play(int ms, int64_t impulse, std::vector<Position>* positions) {
+        std::vector<int16_t> buffer(mOutFrames * kChannels);
+        int64_t end = mWritten + static_cast<int64_t>(kRate) * ms / 1000;
+
+        while (mWritten < end) {
+            std::fill(buffer.begin(), buffer.end(), 0);
+            if (impulse >= mWritten && impulse < mWritten + static_cast<int64_t>(mOutFrames)) {
+                buffer[(impulse - mWritten) * kChannels] = INT16_MAX;
+                buffer[(impulse - mWritten) * kChannels + 1] = INT16_MAX;
+            }
+            ASSERT_EQ(static_cast<ssize_t>(buffer.size() * sizeof(int16_t)),
+                      mOut->write(mOut, buffer.data(), buffer.size() * sizeof(int16_t)));
+            mWritten += mOutFrames;
+
+            uint64_t frames;
+            struct timespec ts;
+            if (mOut->get_presentation_position(mOut, &frames, &ts) == 0)
+                positions->push_back({static_cast<int64_t>(frames), audio_hal_ns(&ts)});
+        }
+    }
+
+    void record(std::vector<int16_t>* samples, std::vector<Position>* positions,
+                const std::atomic<bool>& stop) {
+        std::vector<int16_t> buffer(mInFrames * kChannels);
+
+        while (!stop) {
+            ssize_t bytes = mIn->read(mIn, buffer.data(), buffer.size() * sizeof(int16_t));
+            if (bytes <= 0) {
+                ADD_FAILURE() << "read returned " << bytes;
+                return;
+            }
+            samples->insert(samples->end(), buffer.begin(),
+                            buffer.begin() + bytes / sizeof(int16_t));
+
+            int64_t frames, ns;
+            if (mIn->get_capture_position(mIn, &frames, &ns) == 0)
+                positions->push_back({frames, ns});
+        }
+    }
+
+    struct audio_hw_device* mDev = nullptr;
+    struct audio_stream_out* mOut = nullptr;
+    struct audio_stream_in* mIn = nullptr;
+    size_t mOutFrames = 0;
+    size_t mInFrames = 0;
+    int64_t mWritten = 0;
+
+  private:
+    void* mHandle = nullptr;
+};
+
+// Positions only go forward, never past what was handed over, and move at
+// the nominal rate once the stream is running.
+void checkPositions(const std::vector<Position>& positions, int64_t limit) {
+    ASSERT_GE(positions.size(), 10u);
+    for (size_t i = 1; i < positions.size(); i++) {
+        EXPECT_GE(positions[i].frames, positions[i - 1].frames) << "at " << i;
+        EXPECT_GE(positions[i].ns, positions[i - 1].ns) << "at " << i;
+    }
+    EXPECT_LE(positions.back().frames, limit);
+
+    // skip the start, where the host fills its buffers
+    const Position& first = positions[positions.size() / 4];
+    const Position& last = positions.back();
+    ASSERT_GT(last.ns, first.ns);
+    double rate = (last.frames - first.frames) * 1e9 / (last.ns - first.ns);
+    EXPECT_NEAR(kRate, rate, kRate * kRateTolerance);
+}
+
+// When frame was at the speaker or the microphone, going by the position
+// closest to it.
+int64_t timeOfFrame(const std::vector<Position>& positions, int64_t frame) {
+    const Position* best = &positions.front();
+
+    for (const Position& position : positions) {
+        if (std::abs(position.frames - frame) < std::abs(best->frames - frame))
+            best = &position;
+    }
+    return best->ns + (frame - best->frames) * 1000000000 / kRate;
+}
+
+TEST_F(LoopbackTest, PresentationPosition) {
+    std::vector<Position> positions;
+
+    ASSERT_NO_FATAL_FAILURE(openOutput());
+    ASSERT_NO_FATAL_FAILURE(play(2000, -1, &positions));
+    ASSERT_NO_FATAL_FAILURE(checkPositions(positions, mWritten));
+
+    uint64_t frames;
+    struct timespec ts;
+    ASSERT_EQ(0, mOut->get_presentation_position(mOut, &frames, &ts));
+    int64_t now = audio_hal_now_ns();
+    EXPECT_LE(audio_hal_ns(&ts), now);
+    EXPECT_LT(now - audio_hal_ns(&ts), kMaxStalenessNs);
+}
+
+TEST_F(LoopbackTest, RenderPositionAndNextWrite) {
+    std::vector<Position> positions;
+
+    ASSERT_NO_FATAL_FAILURE(openOutput());
+    ASSERT_NO_FATAL_FAILURE(play(500, -1, &positions));
+
+    uint32_t dspFrames;
+    ASSERT_EQ(0, mOut->get_render_position(mOut, &dspFrames));
+    EXPECT_LE(static_cast<int64_t>(dspFrames), mWritten);
+
+    // what is written now plays after everything queued before it
+    int64_t next;
+    uint64_t frames;
+    struct timespec ts;
+    ASSERT_EQ(0, mOut->get_next_write_timestamp(mOut, &next));
+    ASSERT_EQ(0, mOut->get_presentation_position(mOut, &frames, &ts));
+    EXPECT_GE(next * 1000, audio_hal_ns(&ts));
+}
+
+TEST_F(LoopbackTest, PresentationPositionSurvivesStandby) {
+    std::vector<Position> positions;
+
+    ASSERT_NO_FATAL_FAILURE(openOutput());
+    ASSERT_NO_FATAL_FAILURE(play(500, -1, &positions));
+    ASSERT_FALSE(positions.empty());
+    int64_t before = positions.back().frames;
+
+    ASSERT_EQ(0, mOut->common.standby(&mOut->common));
+    positions.clear();
+    ASSERT_NO_FATAL_FAILURE(play(500, -1, &positions));
+    ASSERT_FALSE(positions.empty());
+    EXPECT_GE(positions.front().frames, before);
+    EXPECT_LE(positions.back().frames, mWritten);
+}
+
+TEST_F(LoopbackTest, CapturePosition) {
+    std::vector<int16_t> samples;
+    std::vector<Position> positions;
+    std::atomic<bool> stop(false);
+
+    ASSERT_NO_FATAL_FAILURE(openInput());
+    std::thread stopper([&stop] {
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        stop = true;
+    });
+    record(&samples, &positions, stop);
+    stopper.join();
+
+    // the position counts what is still queued, so it runs ahead of reads
+    ASSERT_FALSE(positions.empty());
+    EXPECT_GE(positions.back().frames, static_cast<int64_t>(samples.size() / kChannels));
+    ASSERT_NO_FATAL_FAILURE(checkPositions(positions, INT64_MAX));
+    EXPECT_LT(audio_hal_now_ns() - positions.back().ns, kMaxStalenessNs);
+}
+
+TEST_F(LoopbackTest, ImpulseTimestampsAgree) {
+    std::vector<int16_t> samples;
+    std::vector<Position> played, captured;
+    std::atomic<bool> stop(false);
+
+    ASSERT_NO_FATAL_FAILURE(openOutput());
+    ASSERT_NO_FATAL_FAILURE(openInput());
+
+    std::thread recorder([&] { record(&samples, &captured, stop); });
+    // let both streams settle before the impulse goes out
+    int64_t impulse = kRate / 2;
+    play(1500, impulse, &played);
+    stop = true;
+    recorder.join();
+    ASSERT_FALSE(HasFatalFailure());
+    ASSERT_GE(played.size(), 10u);
+    ASSERT_GE(captured.size(), 10u);
+
+    int64_t found = -1;
+    for (size_t i = 0; i < samples.size(); i += kChannels) {
+        if (std::abs(samples[i]) > INT16_MAX / 4) {
+            found = i / kChannels;
+            break;
+        }
+    }
+    ASSERT_GE(found, 0) << "impulse not captured, is the default source the sink's monitor?";
+
+    int64_t playedNs = timeOfFrame(played, impulse);
+    int64_t capturedNs = timeOfFrame(captured, found);
+    EXPECT_NEAR(static_cast<double>(playedNs), static_cast<double>(capturedNs),
+                kLoopbackToleranceNs)
+            << "played at " << playedNs << ", captured at " << capturedNs;
+}
+
+}  // namespace
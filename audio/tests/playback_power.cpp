@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * What a playback costs the container: plays silence the way AudioFlinger
+ * would, one buffer per write, through the primary and the deep buffer
+ * outputs, and reports the wakeups and the CPU time of the whole process,
+ * the HAL's and the sound server client's threads included.  Run it against
+ * a null sink on the host so that nothing else is measured with it.
+ *
+ *   audio.primary.waydroid_playback_power [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <vector>
+
+#include "audio_hal.h"
+
+namespace {
+
+constexpr uint32_t kRate = 48000;
+constexpr size_t kFrameSize = 2 * sizeof(int16_t);
+
+int64_t usOf(const struct timeval& tv) {
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+int measure(struct audio_hw_device* dev, const char* name, audio_output_flags_t flags,
+            int seconds) {
+    struct audio_config config = AUDIO_CONFIG_INITIALIZER;
+    struct audio_stream_out* out;
+
+    config.sample_rate = kRate;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_output_stream(dev, 1, AUDIO_DEVICE_OUT_SPEAKER, flags, &config, &out, "")) {
+        fprintf(stderr, "%s: cannot open the output\n", name);
+        return -1;
+    }
+
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    std::vector<char> silence(bytes);
+    int64_t frames = static_cast<int64_t>(kRate) * seconds;
+    int64_t writes = 0;
+
+    // the first second fills the host's buffers, it is not measured
+    for (int64_t played = 0; played < kRate; played += bytes / kFrameSize)
+        out->write(out, silence.data(), bytes);
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    int64_t start = audio_hal_now_ns();
+    for (int64_t played = 0; played < frames; played += bytes / kFrameSize, writes++)
+        out->write(out, silence.data(), bytes);
+    int64_t wall = audio_hal_now_ns() - start;
+    getrusage(RUSAGE_SELF, &after);
+
+    dev->close_output_stream(dev, out);
+
+    double secs = wall / 1e9;
+    long wakeups = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+    int64_t cpuUs = usOf(after.ru_utime) - usOf(before.ru_utime) +
+                    usOf(after.ru_stime) - usOf(before.ru_stime);
+    printf("%-12s %5zu frames/write  %6.1f writes/s  %6.1f wakeups/s  %5.2f%% CPU\n", name,
+           bytes / kFrameSize, writes / secs, wakeups / secs, cpuUs / 1e4 / secs);
+    return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 30;
+    const char* error = nullptr;
+    void* handle;
+    struct audio_hw_device* dev = audio_hal_open(&handle, &error);
+
+    if (!dev) {
+        fprintf(stderr, "no audio HAL: %s\n", error);
+        return 1;
+    }
+    int ret = measure(dev, "primary", AUDIO_OUTPUT_FLAG_PRIMARY, seconds);
+    if (!ret)
+        ret = measure(dev, "deep_buffer", AUDIO_OUTPUT_FLAG_DEEP_BUFFER, seconds);
+    audio_hal_close(dev, handle);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Copyright (C) 2021 The Waydroid Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Runs the loopback test in a running Waydroid container, against the host's
+# pulse server with a null sink as the default sink and its monitor as the
+# default source, so that nothing is audible and what is played comes back
+# unchanged.  Run on the host as the user that owns the pulse server, after
+# pushing the test to the container:
+#
+#   run_loopback_test.sh [gtest arguments]
+#
+# TEST picks another binary to run the same way, the benchmark for one:
+#
+#   TEST=/data/benchmarktest64/vendor/audio.primary.waydroid_benchmark/audio.primary.waydroid_benchmark \
+#           run_loopback_test.sh
+
+set -e
+
+TEST=${TEST:-/data/nativetest64/vendor/audio.primary.waydroid_loopback_test/audio.primary.waydroid_loopback_test}
+SINK=waydroid_loopback
+
+old_sink=$(pactl get-default-sink)
+old_source=$(pactl get-default-source)
+module=$(pactl load-module module-null-sink sink_name=$SINK rate=48000 channels=2)
+
+restore() {
+    pactl set-default-sink "$old_sink"
+    pactl set-default-source "$old_source"
+    pactl unload-module "$module"
+}
+trap restore EXIT
+
+pactl set-default-sink $SINK
+pactl set-default-source $SINK.monitor
+
+# alsa would bypass the null sink
+sudo waydroid shell -- setprop waydroid.audio.backend pulse
+sudo waydroid shell -- "$TEST" "$@"
@@ -23,7 +23,9 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	gralloc_alloc_table.cpp \
 	gralloc_gbm.cpp \
+	gralloc_sw.cpp \
 	gralloc.cpp
 
 LOCAL_SHARED_LIBRARIES := \
@@ -37,6 +39,7 @@ LOCAL_EXPORT_C_INCLUDE_DIRS := \
 	$(LOCAL_PATH)
 
 LOCAL_MODULE := gralloc.gbm
+LOCAL_REQUIRED_MODULES := gralloc.waydroid.rc
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_RELATIVE_PATH := hw
 LOCAL_PROPRIETARY_MODULE := true
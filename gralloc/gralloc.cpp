@@ -35,6 +35,7 @@
 #include <system/graphics.h>
 
 #include <gbm.h>
+#include <cutils/properties.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_gbm_priv.h"
@@ -44,6 +45,7 @@ struct gbm_module_t {
 
 	pthread_mutex_t mutex;
 	struct gbm_device *gbm;
+	bool sw;
 };
 
 /*
@@ -54,10 +56,15 @@ static int gbm_init(struct gbm_module_t *dmod)
 	int err = 0;
 
 	pthread_mutex_lock(&dmod->mutex);
-	if (!dmod->gbm) {
-		dmod->gbm = gbm_dev_create();
-		if (!dmod->gbm)
-			err = -EINVAL;
+	if (!dmod->gbm && !dmod->sw) {
+		if (gralloc_sw_enabled()) {
+			ALOGI("using the software allocator");
+			dmod->sw = true;
+		} else {
+			dmod->gbm = gbm_dev_create();
+			if (!dmod->gbm)
+				err = -ENODEV;
+		}
 	}
 	pthread_mutex_unlock(&dmod->mutex);
 
@@ -80,6 +87,11 @@ static int gbm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 	case GRALLOC_MODULE_PERFORM_GET_DRM_FD:
 		{
 			int *fd = va_arg(args, int *);
+			if (dmod->sw) {
+				*fd = -1;
+				err = -ENODEV;
+				break;
+			}
 			*fd = gbm_device_get_fd(dmod->gbm);
 			err = 0;
 		}
@@ -104,7 +116,10 @@ static int gbm_mod_register_buffer(const gralloc_module_t *mod,
 		return err;
 
 	pthread_mutex_lock(&dmod->mutex);
-	err = gralloc_gbm_handle_register(handle, dmod->gbm);
+	if (dmod->sw)
+		err = gralloc_sw_handle_register(handle);
+	else
+		err = gralloc_gbm_handle_register(handle, dmod->gbm);
 	pthread_mutex_unlock(&dmod->mutex);
 
 	return err;
@@ -117,7 +132,10 @@ static int gbm_mod_unregister_buffer(const gralloc_module_t *mod,
 	int err;
 
 	pthread_mutex_lock(&dmod->mutex);
-	err = gralloc_gbm_handle_unregister(handle);
+	if (dmod->sw)
+		err = gralloc_sw_handle_unregister(handle);
+	else
+		err = gralloc_gbm_handle_unregister(handle);
 	pthread_mutex_unlock(&dmod->mutex);
 
 	return err;
@@ -131,7 +149,10 @@ static int gbm_mod_lock(const gralloc_module_t *mod, buffer_handle_t handle,
 
 	pthread_mutex_lock(&dmod->mutex);
 
-	err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, ptr);
+	if (dmod->sw)
+		err = gralloc_sw_bo_lock(handle, usage, x, y, w, h, ptr);
+	else
+		err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, ptr);
 	ALOGV("buffer %p lock usage = %08x", handle, usage);
 
 	pthread_mutex_unlock(&dmod->mutex);
@@ -144,7 +165,10 @@ static int gbm_mod_unlock(const gralloc_module_t *mod, buffer_handle_t handle)
 	int err;
 
 	pthread_mutex_lock(&dmod->mutex);
-	err = gralloc_gbm_bo_unlock(handle);
+	if (dmod->sw)
+		err = gralloc_sw_bo_unlock(handle);
+	else
+		err = gralloc_gbm_bo_unlock(handle);
 	pthread_mutex_unlock(&dmod->mutex);
 
 	return err;
@@ -157,7 +181,10 @@ static int gbm_mod_lock_ycbcr(gralloc_module_t const *mod, buffer_handle_t handl
 	int err;
 
 	pthread_mutex_lock(&dmod->mutex);
-	err = gralloc_gbm_bo_lock_ycbcr(handle, usage, x, y, w, h, ycbcr);
+	if (dmod->sw)
+		err = gralloc_sw_bo_lock_ycbcr(handle, usage, x, y, w, h, ycbcr);
+	else
+		err = gralloc_gbm_bo_lock_ycbcr(handle, usage, x, y, w, h, ycbcr);
 	pthread_mutex_unlock(&dmod->mutex);
 
 	return err;
@@ -168,7 +195,10 @@ static int gbm_mod_close_gpu0(struct hw_device_t *dev)
 	struct gbm_module_t *dmod = (struct gbm_module_t *)dev->module;
 	struct alloc_device_t *alloc = (struct alloc_device_t *) dev;
 
-	gbm_dev_destroy(dmod->gbm);
+	if (dmod->gbm)
+		gbm_dev_destroy(dmod->gbm);
+	dmod->gbm = NULL;
+	dmod->sw = false;
 	delete alloc;
 
 	return 0;
@@ -179,7 +209,10 @@ static int gbm_mod_free_gpu0(alloc_device_t *dev, buffer_handle_t handle)
 	struct gbm_module_t *dmod = (struct gbm_module_t *) dev->common.module;
 
 	pthread_mutex_lock(&dmod->mutex);
-	gbm_free(handle);
+	if (dmod->sw)
+		gralloc_sw_free(handle);
+	else
+		gbm_free(handle);
 	native_handle_close(handle);
 	delete handle;
 
@@ -196,7 +229,10 @@ static int gbm_mod_alloc_gpu0(alloc_device_t *dev,
 
 	pthread_mutex_lock(&dmod->mutex);
 
-	*handle = gralloc_gbm_bo_create(dmod->gbm, w, h, format, usage, stride);
+	if (dmod->sw)
+		*handle = gralloc_sw_bo_create(w, h, format, usage, stride);
+	else
+		*handle = gralloc_gbm_bo_create(dmod->gbm, w, h, format, usage, stride);
 	if (!*handle)
 		err = -errno;
 
@@ -270,4 +306,5 @@ struct gbm_module_t HAL_MODULE_INFO_SYM = {
 
 	.mutex = PTHREAD_MUTEX_INITIALIZER,
 	.gbm = NULL,
+	.sw = false,
 };
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC4-WAYDROID"
+
+#include "Allocator.h"
+
+#include <gralloctypes/Gralloc4.h>
+#include <log/log.h>
+
+#include "BufferManager.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace allocator {
+namespace V4_0 {
+namespace implementation {
+
+using ::android::hardware::hidl_handle;
+using ::android::hardware::graphics::mapper::V4_0::Error;
+using ::android::hardware::graphics::waydroid::BufferDescriptorInfo;
+using ::android::hardware::graphics::waydroid::BufferManager;
+
+// Methods from ::android::hardware::graphics::allocator::V4_0::IAllocator follow.
+Return<void> Allocator::allocate(const hidl_vec<uint8_t>& descriptor, uint32_t count,
+                                 allocate_cb hidl_cb) {
+    BufferManager& manager = BufferManager::get();
+    std::vector<native_handle_t*> handles;
+    hidl_vec<hidl_handle> buffers;
+    BufferDescriptorInfo info;
+    uint32_t stride = 0;
+
+    if (gralloc4::decodeBufferDescriptorInfo(descriptor, &info)) {
+        hidl_cb(Error::BAD_DESCRIPTOR, 0, buffers);
+        return Void();
+    }
+
+    if (!manager.isSupported(info)) {
+        hidl_cb(Error::UNSUPPORTED, 0, buffers);
+        return Void();
+    }
+
+    /* all buffers of a batch share the descriptor, so they share a stride too */
+    for (uint32_t i = 0; i < count; i++) {
+        native_handle_t* handle = nullptr;
+        int err = manager.allocate(info, &handle, &stride);
+
+        if (err) {
+            ALOGE("failed to allocate buffer %u of %u: %s", i + 1, count, strerror(-err));
+            for (auto h : handles)
+                manager.freeAllocated(h);
+            hidl_cb(err == -ENOMEM ? Error::NO_RESOURCES : Error::UNSUPPORTED, 0, buffers);
+            return Void();
+        }
+        handles.push_back(handle);
+    }
+
+    buffers.resize(handles.size());
+    for (size_t i = 0; i < handles.size(); i++)
+        buffers[i] = handles[i];
+
+    hidl_cb(Error::NONE, stride, buffers);
+
+    /* the handles have been sent, our copies can go */
+    for (auto h : handles)
+        manager.freeAllocated(h);
+
+    return Void();
+}
+
+}  // namespace implementation
+}  // namespace V4_0
+}  // namespace allocator
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
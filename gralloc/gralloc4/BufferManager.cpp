@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC4-WAYDROID"
+
+#include "BufferManager.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/memfd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include <cutils/properties.h>
+#include <gralloctypes/Gralloc4.h>
+#include <hardware/gralloc.h>
+#include <log/log.h>
+#include <system/graphics.h>
+
+#include "gralloc_gbm_priv.h"
+#include "gralloc_waydroid_handle.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace waydroid {
+
+using ::aidl::android::hardware::graphics::common::BlendMode;
+using ::aidl::android::hardware::graphics::common::Dataspace;
+using ::aidl::android::hardware::graphics::common::PlaneLayoutComponent;
+using ::android::hardware::graphics::common::V1_2::BufferUsage;
+using ::android::hardware::graphics::common::V1_2::PixelFormat;
+
+/* offset of the client reserved region in the metadata memfd */
+static const size_t kReservedRegionOffset = GRALLOC_ALIGN(sizeof(BufferMetadata), 64);
+
+BufferManager& BufferManager::get() {
+    static BufferManager manager;
+    return manager;
+}
+
+BufferManager::BufferManager() : mInitialized(false), mGbm(nullptr) {}
+
+int BufferManager::initLocked() {
+    if (mInitialized)
+        return 0;
+
+    if (gralloc_sw_enabled()) {
+        ALOGI("using the software allocator");
+    } else {
+        mGbm = gbm_dev_create();
+        if (!mGbm)
+            return -ENODEV;
+    }
+
+    mInitialized = true;
+    return 0;
+}
+
+int32_t BufferManager::resolveFormat(const BufferDescriptorInfo& info) {
+    switch (info.format) {
+        case PixelFormat::IMPLEMENTATION_DEFINED:
+            return HAL_PIXEL_FORMAT_RGBX_8888;
+        case PixelFormat::YCBCR_420_888:
+            /* flexible YUV, lockable through the plane layouts */
+            return HAL_PIXEL_FORMAT_YV12;
+        default:
+            return static_cast<int32_t>(info.format);
+    }
+}
+
+bool BufferManager::isSupported(const BufferDescriptorInfo& info) {
+    std::lock_guard<std::mutex> lock(mLock);
+    int32_t format = resolveFormat(info);
+
+    if (initLocked())
+        return false;
+
+    if (!info.width || !info.height || info.layerCount != 1)
+        return false;
+    if (info.usage & static_cast<uint64_t>(BufferUsage::PROTECTED))
+        return false;
+
+    if (mGbm)
+        return gralloc_gbm_get_format(format) != 0;
+    return gralloc_gbm_get_bpp(format) != 0;
+}
+
+static int createMetadata(const BufferDescriptorInfo& info, size_t* outSize) {
+    static std::atomic<uint32_t> nextId(0);
+    size_t size = GRALLOC_ALIGN(kReservedRegionOffset + info.reservedSize,
+                                (size_t)getpagesize());
+    BufferMetadata* metadata;
+    int fd;
+
+    fd = syscall(__NR_memfd_create, "gralloc-metadata", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -errno;
+
+    if (ftruncate(fd, size) < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    metadata = (BufferMetadata*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (metadata == MAP_FAILED) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+
+    memset(metadata, 0, sizeof(*metadata));
+    metadata->magic = BUFFER_METADATA_MAGIC;
+    metadata->bufferId = ((uint64_t)getpid() << 32) | nextId++;
+    strlcpy(metadata->name, info.name.c_str(), sizeof(metadata->name));
+    metadata->width = info.width;
+    metadata->height = info.height;
+    metadata->layerCount = info.layerCount;
+    metadata->formatRequested = static_cast<int32_t>(info.format);
+    metadata->usage = info.usage;
+    metadata->reservedSize = info.reservedSize;
+    metadata->dataspace = static_cast<int32_t>(Dataspace::UNKNOWN);
+    metadata->blendMode = static_cast<int32_t>(BlendMode::INVALID);
+    munmap(metadata, size);
+
+    *outSize = size;
+    return fd;
+}
+
+int BufferManager::allocate(const BufferDescriptorInfo& info, native_handle_t** outHandle,
+                            uint32_t* outStride) {
+    struct waydroid_gralloc_handle_t* wh;
+    struct gralloc_handle_t* gh;
+    buffer_handle_t legacy;
+    native_handle_t* handle;
+    int32_t format = resolveFormat(info);
+    int usage = static_cast<int>(info.usage);
+    size_t metadataSize;
+    int stride, metadataFd;
+
+    if (!isSupported(info))
+        return -EINVAL;
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mGbm)
+        legacy = gralloc_gbm_bo_create(mGbm, info.width, info.height, format, usage, &stride);
+    else
+        legacy = gralloc_sw_bo_create(info.width, info.height, format, usage, &stride);
+    if (!legacy) {
+        ALOGE("failed to allocate %ux%u buffer, format 0x%x", info.width, info.height, format);
+        return -ENOMEM;
+    }
+    gh = gralloc_handle(legacy);
+
+    metadataFd = createMetadata(info, &metadataSize);
+    handle = native_handle_create(WAYDROID_GRALLOC_HANDLE_NUM_FDS, WAYDROID_GRALLOC_HANDLE_NUM_INTS);
+    if (metadataFd < 0 || !handle) {
+        ALOGE("failed to create the buffer metadata");
+        if (metadataFd >= 0)
+            close(metadataFd);
+        if (handle)
+            native_handle_delete(handle);
+        handle = nullptr;
+    } else {
+        wh = (struct waydroid_gralloc_handle_t*)handle;
+        wh->prime_fd = dup(gh->prime_fd);
+        wh->metadata_fd = metadataFd;
+        wh->magic = WAYDROID_GRALLOC_HANDLE_MAGIC;
+        wh->version = WAYDROID_GRALLOC_HANDLE_VERSION;
+        wh->width = gh->width;
+        wh->height = gh->height;
+        wh->format = gh->format;
+        wh->usage = gh->usage;
+        wh->stride = gh->stride;
+        wh->data_owner = gh->data_owner;
+        wh->modifier = gh->modifier;
+    }
+
+    /* the new handle holds its own reference on the dma-buf */
+    if (mGbm)
+        gbm_free(legacy);
+    else
+        gralloc_sw_free(legacy);
+    native_handle_close(legacy);
+    native_handle_delete(const_cast<native_handle_t*>(legacy));
+
+    if (!handle)
+        return -ENOMEM;
+
+    *outHandle = handle;
+    *outStride = stride;
+    return 0;
+}
+
+void BufferManager::freeAllocated(native_handle_t* handle) {
+    native_handle_close(handle);
+    native_handle_delete(handle);
+}
+
+/*
+ * Build a gralloc_handle_t pointing at the same dma-buf, so the buffer can
+ * go through the gralloc_gbm/gralloc_sw code.  It does not own the fd.
+ */
+native_handle_t* BufferManager::createLegacyHandle(const native_handle_t* handle) {
+    struct waydroid_gralloc_handle_t* wh = waydroid_gralloc_handle(handle);
+    native_handle_t* legacy;
+    struct gralloc_handle_t* gh;
+
+    legacy = native_handle_create(GRALLOC_HANDLE_NUM_FDS, GRALLOC_HANDLE_NUM_INTS);
+    if (!legacy)
+        return nullptr;
+
+    gh = gralloc_handle(legacy);
+    gh->prime_fd = wh->prime_fd;
+    gh->magic = GRALLOC_HANDLE_MAGIC;
+    gh->version = GRALLOC_HANDLE_VERSION;
+    gh->width = wh->width;
+    gh->height = wh->height;
+    gh->format = wh->format;
+    gh->usage = wh->usage;
+    gh->stride = wh->stride;
+    gh->data_owner = wh->data_owner;
+    gh->modifier = wh->modifier;
+
+    return legacy;
+}
+
+int BufferManager::importBuffer(const native_handle_t* rawHandle, native_handle_t** outHandle) {
+    struct waydroid_gralloc_handle_t* wh;
+    native_handle_t* handle;
+    Buffer buffer;
+    off_t size;
+    int err;
+
+    if (!rawHandle || !waydroid_gralloc_handle(rawHandle))
+        return -EINVAL;
+
+    handle = native_handle_clone(rawHandle);
+    if (!handle)
+        return -ENOMEM;
+    wh = waydroid_gralloc_handle(handle);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    err = initLocked();
+    if (err)
+        goto err_handle;
+
+    size = lseek(wh->metadata_fd, 0, SEEK_END);
+    if (size < (off_t)sizeof(BufferMetadata)) {
+        err = -EINVAL;
+        goto err_handle;
+    }
+    buffer.metadataSize = size;
+    buffer.metadata = (BufferMetadata*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                            wh->metadata_fd, 0);
+    if (buffer.metadata == MAP_FAILED) {
+        err = -errno;
+        goto err_handle;
+    }
+    if (buffer.metadata->magic != BUFFER_METADATA_MAGIC) {
+        err = -EINVAL;
+        goto err_metadata;
+    }
+
+    buffer.legacy = createLegacyHandle(handle);
+    if (!buffer.legacy) {
+        err = -ENOMEM;
+        goto err_metadata;
+    }
+
+    if (mGbm)
+        err = gralloc_gbm_handle_register(buffer.legacy, mGbm);
+    else
+        err = gralloc_sw_handle_register(buffer.legacy);
+    if (err)
+        goto err_legacy;
+
+    mBuffers.emplace(handle, buffer);
+    *outHandle = handle;
+    return 0;
+
+err_legacy:
+    native_handle_delete(buffer.legacy);
+err_metadata:
+    munmap(buffer.metadata, buffer.metadataSize);
+err_handle:
+    native_handle_close(handle);
+    native_handle_delete(handle);
+    return err;
+}
+
+int BufferManager::freeBuffer(native_handle_t* handle) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mBuffers.find(handle);
+    if (it == mBuffers.end())
+        return -EINVAL;
+
+    if (mGbm)
+        gralloc_gbm_handle_unregister(it->second.legacy);
+    else
+        gralloc_sw_handle_unregister(it->second.legacy);
+    native_handle_delete(it->second.legacy);
+    munmap(it->second.metadata, it->second.metadataSize);
+    mBuffers.erase(it);
+
+    native_handle_close(handle);
+    native_handle_delete(handle);
+    return 0;
+}
+
+bool BufferManager::isImported(buffer_handle_t handle) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return mBuffers.count(handle) != 0;
+}
+
+int BufferManager::lock(buffer_handle_t handle, uint64_t usage, const IMapper::Rect& region,
+                        void** addr) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mBuffers.find(handle);
+    if (it == mBuffers.end())
+        return -EINVAL;
+
+    if (mGbm)
+        return gralloc_gbm_bo_lock(it->second.legacy, static_cast<int>(usage), region.left,
+                                   region.top, region.width, region.height, addr);
+    return gralloc_sw_bo_lock(it->second.legacy, static_cast<int>(usage), region.left,
+                              region.top, region.width, region.height, addr);
+}
+
+int BufferManager::unlock(buffer_handle_t handle) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mBuffers.find(handle);
+    if (it == mBuffers.end())
+        return -EINVAL;
+
+    if (mGbm)
+        return gralloc_gbm_bo_unlock(it->second.legacy);
+    return gralloc_sw_bo_unlock(it->second.legacy);
+}
+
+BufferMetadata* BufferManager::getMetadata(buffer_handle_t handle) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mBuffers.find(handle);
+    return it != mBuffers.end() ? it->second.metadata : nullptr;
+}
+
+void* BufferManager::getReservedRegion(buffer_handle_t handle, uint64_t* size) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mBuffers.find(handle);
+    if (it == mBuffers.end())
+        return nullptr;
+
+    *size = it->second.metadata->reservedSize;
+    if (!*size)
+        return nullptr;
+    return (char*)it->second.metadata + kReservedRegionOffset;
+}
+
+uint64_t BufferManager::getAllocationSize(buffer_handle_t handle) {
+    struct waydroid_gralloc_handle_t* wh = waydroid_gralloc_handle(handle);
+    off_t size = lseek(wh->prime_fd, 0, SEEK_END);
+
+    return size > 0 ? size : 0;
+}
+
+static PlaneLayoutComponent component(const aidl::android::hardware::graphics::common::ExtendableType& type,
+                                      int64_t offsetInBits, int64_t sizeInBits) {
+    PlaneLayoutComponent c;
+
+    c.type = type;
+    c.offsetInBits = offsetInBits;
+    c.sizeInBits = sizeInBits;
+    return c;
+}
+
+static std::vector<PlaneLayoutComponent> rgbComponents(uint32_t format) {
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            return {component(gralloc4::PlaneLayoutComponentType_R, 0, 8),
+                    component(gralloc4::PlaneLayoutComponentType_G, 8, 8),
+                    component(gralloc4::PlaneLayoutComponentType_B, 16, 8),
+                    component(gralloc4::PlaneLayoutComponentType_A, 24, 8)};
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return {component(gralloc4::PlaneLayoutComponentType_R, 0, 8),
+                    component(gralloc4::PlaneLayoutComponentType_G, 8, 8),
+                    component(gralloc4::PlaneLayoutComponentType_B, 16, 8)};
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return {component(gralloc4::PlaneLayoutComponentType_B, 0, 8),
+                    component(gralloc4::PlaneLayoutComponentType_G, 8, 8),
+                    component(gralloc4::PlaneLayoutComponentType_R, 16, 8),
+                    component(gralloc4::PlaneLayoutComponentType_A, 24, 8)};
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return {component(gralloc4::PlaneLayoutComponentType_R, 11, 5),
+                    component(gralloc4::PlaneLayoutComponentType_G, 5, 6),
+                    component(gralloc4::PlaneLayoutComponentType_B, 0, 5)};
+        default:
+            return {};
+    }
+}
+
+/*
+ * Describe the planes of a buffer, with the stride and offset of the bo
+ * itself.  YUV layouts are taken from gralloc_gbm_fill_ycbcr() so they
+ * always match what lock hands out.
+ */
+std::vector<PlaneLayout> BufferManager::getPlaneLayouts(buffer_handle_t handle) {
+    struct waydroid_gralloc_handle_t* wh = waydroid_gralloc_handle(handle);
+    std::vector<PlaneLayout> layouts;
+    PlaneLayout plane;
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mBuffers.find(handle);
+    if (it == mBuffers.end())
+        return layouts;
+    uint32_t offset = gralloc_gbm_get_offset(it->second.legacy);
+
+    plane.offsetInBytes = offset;
+    plane.horizontalSubsampling = 1;
+    plane.verticalSubsampling = 1;
+
+    if (wh->format == HAL_PIXEL_FORMAT_YV12 || wh->format == HAL_PIXEL_FORMAT_YCrCb_420_SP) {
+        struct android_ycbcr ycbcr;
+
+        if (gralloc_gbm_fill_ycbcr(it->second.legacy, nullptr, &ycbcr))
+            return layouts;
+
+        plane.components = {component(gralloc4::PlaneLayoutComponentType_Y, 0, 8)};
+        plane.sampleIncrementInBits = 8;
+        plane.strideInBytes = ycbcr.ystride;
+        plane.widthInSamples = wh->width;
+        plane.heightInSamples = wh->height;
+        plane.totalSizeInBytes = ycbcr.ystride * wh->height;
+        layouts.push_back(plane);
+
+        plane.strideInBytes = ycbcr.cstride;
+        plane.widthInSamples = wh->width / 2;
+        plane.heightInSamples = wh->height / 2;
+        plane.totalSizeInBytes = ycbcr.cstride * wh->height / 2;
+        plane.horizontalSubsampling = 2;
+        plane.verticalSubsampling = 2;
+
+        uintptr_t cb = (uintptr_t)ycbcr.cb, cr = (uintptr_t)ycbcr.cr;
+        if (ycbcr.chroma_step == 2) {
+            /* interleaved chroma */
+            uintptr_t base = std::min(cb, cr);
+            plane.components = {
+                    component(gralloc4::PlaneLayoutComponentType_CB, (cb - base) * 8, 8),
+                    component(gralloc4::PlaneLayoutComponentType_CR, (cr - base) * 8, 8)};
+            plane.offsetInBytes = offset + base;
+            plane.sampleIncrementInBits = 16;
+            layouts.push_back(plane);
+        } else {
+            plane.sampleIncrementInBits = 8;
+            plane.components = {component(gralloc4::PlaneLayoutComponentType_CB, 0, 8)};
+            plane.offsetInBytes = offset + cb;
+            layouts.push_back(plane);
+            plane.components = {component(gralloc4::PlaneLayoutComponentType_CR, 0, 8)};
+            plane.offsetInBytes = offset + cr;
+            layouts.push_back(plane);
+        }
+        return layouts;
+    }
+
+    int bpp = gralloc_gbm_get_bpp(wh->format);
+    plane.components = rgbComponents(wh->format);
+    plane.sampleIncrementInBits = bpp * 8;
+    plane.strideInBytes = wh->stride;
+    plane.widthInSamples = wh->width;
+    plane.heightInSamples = wh->height;
+    plane.totalSizeInBytes = (int64_t)wh->stride * wh->height;
+    layouts.push_back(plane);
+
+    return layouts;
+}
+
+void BufferManager::forEachBuffer(const std::function<void(buffer_handle_t)>& fn) {
+    std::vector<buffer_handle_t> handles;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        for (auto const& buffer : mBuffers)
+            handles.push_back(buffer.first);
+    }
+    for (buffer_handle_t handle : handles)
+        fn(handle);
+}
+
+}  // namespace waydroid
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef WAYDROID_GRALLOC4_BUFFERMANAGER_H
+#define WAYDROID_GRALLOC4_BUFFERMANAGER_H
+
+#include <aidl/android/hardware/graphics/common/PlaneLayout.h>
+#include <android/hardware/graphics/mapper/4.0/IMapper.h>
+#include <cutils/native_handle.h>
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct gbm_device;
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace waydroid {
+
+using ::aidl::android::hardware::graphics::common::PlaneLayout;
+using ::android::hardware::graphics::mapper::V4_0::IMapper;
+using BufferDescriptorInfo = IMapper::BufferDescriptorInfo;
+
+#define BUFFER_METADATA_MAGIC 0x57444d44
+#define BUFFER_METADATA_NAME_SIZE 128
+#define BUFFER_METADATA_SMPTE2094_40_SIZE 2048
+
+/*
+ * Layout of the metadata memfd shared by all the handles of a buffer.  The
+ * reserved region requested by the client follows it.
+ */
+struct BufferMetadata {
+    uint32_t magic;
+    uint64_t bufferId;
+    char name[BUFFER_METADATA_NAME_SIZE];
+    uint32_t width;
+    uint32_t height;
+    uint32_t layerCount;
+    int32_t formatRequested;
+    uint64_t usage;
+    uint64_t reservedSize;
+
+    /* settable */
+    int32_t dataspace;
+    int32_t blendMode;
+    bool hasSmpte2086;
+    float smpte2086[10];
+    bool hasCta861_3;
+    float cta861_3[2];
+    uint32_t smpte2094_40Size;
+    uint8_t smpte2094_40[BUFFER_METADATA_SMPTE2094_40_SIZE];
+};
+
+/*
+ * Owns the gbm device, or the software allocator, of the process and the
+ * buffers it allocated or imported.  Shared by the allocator service and
+ * the mapper.
+ */
+class BufferManager {
+  public:
+    static BufferManager& get();
+
+    int32_t resolveFormat(const BufferDescriptorInfo& info);
+    bool isSupported(const BufferDescriptorInfo& info);
+
+    /* allocator side, the returned handle is owned by the caller */
+    int allocate(const BufferDescriptorInfo& info, native_handle_t** outHandle,
+                 uint32_t* outStride);
+    void freeAllocated(native_handle_t* handle);
+
+    /* mapper side */
+    int importBuffer(const native_handle_t* rawHandle, native_handle_t** outHandle);
+    int freeBuffer(native_handle_t* handle);
+    bool isImported(buffer_handle_t handle);
+    int lock(buffer_handle_t handle, uint64_t usage, const IMapper::Rect& region, void** addr);
+    int unlock(buffer_handle_t handle);
+
+    BufferMetadata* getMetadata(buffer_handle_t handle);
+    void* getReservedRegion(buffer_handle_t handle, uint64_t* size);
+    std::vector<PlaneLayout> getPlaneLayouts(buffer_handle_t handle);
+    uint64_t getAllocationSize(buffer_handle_t handle);
+    void forEachBuffer(const std::function<void(buffer_handle_t)>& fn);
+
+  private:
+    struct Buffer {
+        native_handle_t* legacy;
+        BufferMetadata* metadata;
+        size_t metadataSize;
+    };
+
+    BufferManager();
+    int initLocked();
+    native_handle_t* createLegacyHandle(const native_handle_t* handle);
+
+    std::mutex mLock;
+    bool mInitialized;
+    struct gbm_device* mGbm;
+    std::unordered_map<buffer_handle_t, Buffer> mBuffers;
+};
+
+}  // namespace waydroid
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
+
+#endif  // WAYDROID_GRALLOC4_BUFFERMANAGER_H
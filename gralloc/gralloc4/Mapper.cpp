@@ -0,0 +1,582 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC4-WAYDROID"
+
+#include "Mapper.h"
+
+#include <drm_fourcc.h>
+#include <gralloctypes/Gralloc4.h>
+#include <hardware/gralloc.h>
+#include <log/log.h>
+#include <sync/sync.h>
+
+#include "BufferManager.h"
+#include "gralloc_gbm_priv.h"
+#include "gralloc_waydroid_handle.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V4_0 {
+namespace implementation {
+
+using ::aidl::android::hardware::graphics::common::BlendMode;
+using ::aidl::android::hardware::graphics::common::Cta861_3;
+using ::aidl::android::hardware::graphics::common::Dataspace;
+using ::aidl::android::hardware::graphics::common::Smpte2086;
+using ::aidl::android::hardware::graphics::common::StandardMetadataType;
+using ::android::hardware::graphics::common::V1_2::PixelFormat;
+using ::android::hardware::graphics::waydroid::BufferManager;
+using ::android::hardware::graphics::waydroid::BufferMetadata;
+
+static const std::vector<IMapper::MetadataTypeDescription> kMetadataTypes = {
+    {gralloc4::MetadataType_BufferId, "", true, false},
+    {gralloc4::MetadataType_Name, "", true, false},
+    {gralloc4::MetadataType_Width, "", true, false},
+    {gralloc4::MetadataType_Height, "", true, false},
+    {gralloc4::MetadataType_LayerCount, "", true, false},
+    {gralloc4::MetadataType_PixelFormatRequested, "", true, false},
+    {gralloc4::MetadataType_PixelFormatFourCC, "", true, false},
+    {gralloc4::MetadataType_PixelFormatModifier, "", true, false},
+    {gralloc4::MetadataType_Usage, "", true, false},
+    {gralloc4::MetadataType_AllocationSize, "", true, false},
+    {gralloc4::MetadataType_ProtectedContent, "", true, false},
+    {gralloc4::MetadataType_Compression, "", true, false},
+    {gralloc4::MetadataType_Interlaced, "", true, false},
+    {gralloc4::MetadataType_ChromaSiting, "", true, false},
+    {gralloc4::MetadataType_PlaneLayouts, "", true, false},
+    {gralloc4::MetadataType_Crop, "", true, false},
+    {gralloc4::MetadataType_Dataspace, "", true, true},
+    {gralloc4::MetadataType_BlendMode, "", true, true},
+    {gralloc4::MetadataType_Smpte2086, "", true, true},
+    {gralloc4::MetadataType_Cta861_3, "", true, true},
+    {gralloc4::MetadataType_Smpte2094_40, "", true, true},
+};
+
+static uint32_t getFourCC(uint32_t format) {
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+            return DRM_FORMAT_YVU420;
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+            return DRM_FORMAT_NV21;
+        default:
+            return gralloc_gbm_get_format(format);
+    }
+}
+
+static buffer_handle_t getImportedHandle(void* buffer) {
+    buffer_handle_t handle = static_cast<buffer_handle_t>(buffer);
+
+    if (!handle || !BufferManager::get().isImported(handle))
+        return nullptr;
+    return handle;
+}
+
+static Error errnoToError(int err) {
+    switch (err) {
+        case 0:
+            return Error::NONE;
+        case -ENOMEM:
+            return Error::NO_RESOURCES;
+        case -EINVAL:
+            return Error::BAD_VALUE;
+        default:
+            return Error::UNSUPPORTED;
+    }
+}
+
+// Methods from ::android::hardware::graphics::mapper::V4_0::IMapper follow.
+Return<void> Mapper::createDescriptor(const BufferDescriptorInfo& description,
+                                      createDescriptor_cb hidl_cb) {
+    hidl_vec<uint8_t> descriptor;
+
+    if (!description.width || !description.height || !description.layerCount) {
+        hidl_cb(Error::BAD_VALUE, descriptor);
+        return Void();
+    }
+
+    if (gralloc4::encodeBufferDescriptorInfo(description, &descriptor)) {
+        hidl_cb(Error::BAD_DESCRIPTOR, descriptor);
+        return Void();
+    }
+
+    hidl_cb(Error::NONE, descriptor);
+    return Void();
+}
+
+Return<void> Mapper::importBuffer(const hidl_handle& rawHandle, importBuffer_cb hidl_cb) {
+    native_handle_t* handle = nullptr;
+    int err;
+
+    if (!rawHandle.getNativeHandle()) {
+        hidl_cb(Error::BAD_BUFFER, nullptr);
+        return Void();
+    }
+
+    err = BufferManager::get().importBuffer(rawHandle.getNativeHandle(), &handle);
+    if (err) {
+        ALOGE("failed to import buffer: %s", strerror(-err));
+        hidl_cb(err == -EINVAL ? Error::BAD_BUFFER : Error::NO_RESOURCES, nullptr);
+        return Void();
+    }
+
+    hidl_cb(Error::NONE, handle);
+    return Void();
+}
+
+Return<Error> Mapper::freeBuffer(void* buffer) {
+    buffer_handle_t handle = getImportedHandle(buffer);
+
+    if (!handle)
+        return Error::BAD_BUFFER;
+
+    BufferManager::get().freeBuffer(const_cast<native_handle_t*>(handle));
+    return Error::NONE;
+}
+
+Return<Error> Mapper::validateBufferSize(void* buffer, const BufferDescriptorInfo& description,
+                                         uint32_t stride) {
+    buffer_handle_t handle = getImportedHandle(buffer);
+    struct waydroid_gralloc_handle_t* wh;
+    BufferMetadata* metadata;
+    int bpp;
+
+    if (!handle)
+        return Error::BAD_BUFFER;
+    wh = waydroid_gralloc_handle(handle);
+    metadata = BufferManager::get().getMetadata(handle);
+
+    if (description.width != metadata->width || description.height != metadata->height ||
+        description.layerCount != metadata->layerCount ||
+        static_cast<int32_t>(description.format) != metadata->formatRequested ||
+        (description.usage & metadata->usage) != description.usage ||
+        description.reservedSize > metadata->reservedSize)
+        return Error::BAD_VALUE;
+
+    bpp = gralloc_gbm_get_bpp(wh->format);
+    if (stride && bpp && stride != wh->stride / bpp)
+        return Error::BAD_VALUE;
+
+    return Error::NONE;
+}
+
+Return<void> Mapper::getTransportSize(void* buffer, getTransportSize_cb hidl_cb) {
+    if (!getImportedHandle(buffer)) {
+        hidl_cb(Error::BAD_BUFFER, 0, 0);
+        return Void();
+    }
+
+    hidl_cb(Error::NONE, WAYDROID_GRALLOC_HANDLE_NUM_FDS, WAYDROID_GRALLOC_HANDLE_NUM_INTS);
+    return Void();
+}
+
+Return<void> Mapper::lock(void* buffer, uint64_t cpuUsage, const Rect& accessRegion,
+                          const hidl_handle& acquireFence, lock_cb hidl_cb) {
+    buffer_handle_t handle = getImportedHandle(buffer);
+    const native_handle_t* fence = acquireFence.getNativeHandle();
+    void* addr = nullptr;
+    int err;
+
+    if (!handle) {
+        hidl_cb(Error::BAD_BUFFER, nullptr);
+        return Void();
+    }
+
+    if (!(cpuUsage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK)) ||
+        accessRegion.left < 0 || accessRegion.top < 0 ||
+        accessRegion.width < 0 || accessRegion.height < 0) {
+        hidl_cb(Error::BAD_VALUE, nullptr);
+        return Void();
+    }
+
+    if (fence && fence->numFds == 1) {
+        err = sync_wait(fence->data[0], -1);
+        if (err) {
+            hidl_cb(Error::NO_RESOURCES, nullptr);
+            return Void();
+        }
+    }
+
+    err = BufferManager::get().lock(handle, cpuUsage, accessRegion, &addr);
+    if (err) {
+        hidl_cb(errnoToError(err), nullptr);
+        return Void();
+    }
+
+    hidl_cb(Error::NONE, addr);
+    return Void();
+}
+
+Return<void> Mapper::unlock(void* buffer, unlock_cb hidl_cb) {
+    buffer_handle_t handle = getImportedHandle(buffer);
+
+    if (!handle) {
+        hidl_cb(Error::BAD_BUFFER, nullptr);
+        return Void();
+    }
+
+    /* writes are flushed by the unmap, no release fence needed */
+    hidl_cb(errnoToError(BufferManager::get().unlock(handle)), nullptr);
+    return Void();
+}
+
+Return<void> Mapper::flushLockedBuffer(void* buffer, flushLockedBuffer_cb hidl_cb) {
+    hidl_cb(getImportedHandle(buffer) ? Error::NONE : Error::BAD_BUFFER, nullptr);
+    return Void();
+}
+
+Return<Error> Mapper::rereadLockedBuffer(void* buffer) {
+    return getImportedHandle(buffer) ? Error::NONE : Error::BAD_BUFFER;
+}
+
+Return<void> Mapper::isSupported(const BufferDescriptorInfo& description,
+                                 isSupported_cb hidl_cb) {
+    hidl_cb(Error::NONE, BufferManager::get().isSupported(description));
+    return Void();
+}
+
+Error Mapper::getMetadata(buffer_handle_t handle, const MetadataType& metadataType,
+                          hidl_vec<uint8_t>* out) {
+    BufferManager& manager = BufferManager::get();
+    struct waydroid_gralloc_handle_t* wh = waydroid_gralloc_handle(handle);
+    BufferMetadata* metadata = manager.getMetadata(handle);
+    status_t status;
+
+    if (!gralloc4::isStandardMetadataType(metadataType))
+        return Error::UNSUPPORTED;
+
+    switch (gralloc4::getStandardMetadataTypeValue(metadataType)) {
+        case StandardMetadataType::BUFFER_ID:
+            status = gralloc4::encodeBufferId(metadata->bufferId, out);
+            break;
+        case StandardMetadataType::NAME:
+            status = gralloc4::encodeName(metadata->name, out);
+            break;
+        case StandardMetadataType::WIDTH:
+            status = gralloc4::encodeWidth(metadata->width, out);
+            break;
+        case StandardMetadataType::HEIGHT:
+            status = gralloc4::encodeHeight(metadata->height, out);
+            break;
+        case StandardMetadataType::LAYER_COUNT:
+            status = gralloc4::encodeLayerCount(metadata->layerCount, out);
+            break;
+        case StandardMetadataType::PIXEL_FORMAT_REQUESTED:
+            status = gralloc4::encodePixelFormatRequested(
+                    static_cast<PixelFormat>(metadata->formatRequested), out);
+            break;
+        case StandardMetadataType::PIXEL_FORMAT_FOURCC:
+            status = gralloc4::encodePixelFormatFourCC(getFourCC(wh->format), out);
+            break;
+        case StandardMetadataType::PIXEL_FORMAT_MODIFIER:
+            status = gralloc4::encodePixelFormatModifier(wh->modifier, out);
+            break;
+        case StandardMetadataType::USAGE:
+            status = gralloc4::encodeUsage(metadata->usage, out);
+            break;
+        case StandardMetadataType::ALLOCATION_SIZE:
+            status = gralloc4::encodeAllocationSize(manager.getAllocationSize(handle), out);
+            break;
+        case StandardMetadataType::PROTECTED_CONTENT:
+            status = gralloc4::encodeProtectedContent(0, out);
+            break;
+        case StandardMetadataType::COMPRESSION:
+            status = gralloc4::encodeCompression(gralloc4::Compression_None, out);
+            break;
+        case StandardMetadataType::INTERLACED:
+            status = gralloc4::encodeInterlaced(gralloc4::Interlaced_None, out);
+            break;
+        case StandardMetadataType::CHROMA_SITING:
+            status = gralloc4::encodeChromaSiting(gralloc4::ChromaSiting_None, out);
+            break;
+        case StandardMetadataType::PLANE_LAYOUTS:
+            status = gralloc4::encodePlaneLayouts(manager.getPlaneLayouts(handle), out);
+            break;
+        case StandardMetadataType::CROP: {
+            std::vector<aidl::android::hardware::graphics::common::Rect> crops(1);
+            crops[0].left = 0;
+            crops[0].top = 0;
+            crops[0].right = metadata->width;
+            crops[0].bottom = metadata->height;
+            status = gralloc4::encodeCrop(crops, out);
+            break;
+        }
+        case StandardMetadataType::DATASPACE:
+            status = gralloc4::encodeDataspace(static_cast<Dataspace>(metadata->dataspace), out);
+            break;
+        case StandardMetadataType::BLEND_MODE:
+            status = gralloc4::encodeBlendMode(static_cast<BlendMode>(metadata->blendMode), out);
+            break;
+        case StandardMetadataType::SMPTE2086: {
+            std::optional<Smpte2086> smpte2086;
+            if (metadata->hasSmpte2086) {
+                const float* v = metadata->smpte2086;
+                smpte2086 = Smpte2086{{v[0], v[1]}, {v[2], v[3]}, {v[4], v[5]}, {v[6], v[7]},
+                                      v[8], v[9]};
+            }
+            status = gralloc4::encodeSmpte2086(smpte2086, out);
+            break;
+        }
+        case StandardMetadataType::CTA861_3: {
+            std::optional<Cta861_3> cta861_3;
+            if (metadata->hasCta861_3)
+                cta861_3 = Cta861_3{metadata->cta861_3[0], metadata->cta861_3[1]};
+            status = gralloc4::encodeCta861_3(cta861_3, out);
+            break;
+        }
+        case StandardMetadataType::SMPTE2094_40: {
+            std::optional<std::vector<uint8_t>> smpte2094_40;
+            if (metadata->smpte2094_40Size)
+                smpte2094_40 = std::vector<uint8_t>(
+                        metadata->smpte2094_40,
+                        metadata->smpte2094_40 + metadata->smpte2094_40Size);
+            status = gralloc4::encodeSmpte2094_40(smpte2094_40, out);
+            break;
+        }
+        default:
+            return Error::UNSUPPORTED;
+    }
+
+    return status == OK ? Error::NONE : Error::NO_RESOURCES;
+}
+
+Return<void> Mapper::get(void* buffer, const MetadataType& metadataType, get_cb hidl_cb) {
+    buffer_handle_t handle = getImportedHandle(buffer);
+    hidl_vec<uint8_t> out;
+
+    if (!handle) {
+        hidl_cb(Error::BAD_BUFFER, out);
+        return Void();
+    }
+
+    Error error = getMetadata(handle, metadataType, &out);
+    hidl_cb(error, out);
+    return Void();
+}
+
+Return<Error> Mapper::set(void* buffer, const MetadataType& metadataType,
+                          const hidl_vec<uint8_t>& in) {
+    buffer_handle_t handle = getImportedHandle(buffer);
+    BufferMetadata* metadata;
+
+    if (!handle)
+        return Error::BAD_BUFFER;
+    metadata = BufferManager::get().getMetadata(handle);
+
+    if (!gralloc4::isStandardMetadataType(metadataType))
+        return Error::UNSUPPORTED;
+
+    switch (gralloc4::getStandardMetadataTypeValue(metadataType)) {
+        case StandardMetadataType::DATASPACE: {
+            Dataspace dataspace;
+            if (gralloc4::decodeDataspace(in, &dataspace))
+                return Error::BAD_VALUE;
+            metadata->dataspace = static_cast<int32_t>(dataspace);
+            break;
+        }
+        case StandardMetadataType::BLEND_MODE: {
+            BlendMode blendMode;
+            if (gralloc4::decodeBlendMode(in, &blendMode))
+                return Error::BAD_VALUE;
+            metadata->blendMode = static_cast<int32_t>(blendMode);
+            break;
+        }
+        case StandardMetadataType::SMPTE2086: {
+            std::optional<Smpte2086> smpte2086;
+            if (gralloc4::decodeSmpte2086(in, &smpte2086))
+                return Error::BAD_VALUE;
+            metadata->hasSmpte2086 = smpte2086.has_value();
+            if (smpte2086) {
+                float* v = metadata->smpte2086;
+                v[0] = smpte2086->primaryRed.x;
+                v[1] = smpte2086->primaryRed.y;
+                v[2] = smpte2086->primaryGreen.x;
+                v[3] = smpte2086->primaryGreen.y;
+                v[4] = smpte2086->primaryBlue.x;
+                v[5] = smpte2086->primaryBlue.y;
+                v[6] = smpte2086->whitePoint.x;
+                v[7] = smpte2086->whitePoint.y;
+                v[8] = smpte2086->maxLuminance;
+                v[9] = smpte2086->minLuminance;
+            }
+            break;
+        }
+        case StandardMetadataType::CTA861_3: {
+            std::optional<Cta861_3> cta861_3;
+            if (gralloc4::decodeCta861_3(in, &cta861_3))
+                return Error::BAD_VALUE;
+            metadata->hasCta861_3 = cta861_3.has_value();
+            if (cta861_3) {
+                metadata->cta861_3[0] = cta861_3->maxContentLightLevel;
+                metadata->cta861_3[1] = cta861_3->maxFrameAverageLightLevel;
+            }
+            break;
+        }
+        case StandardMetadataType::SMPTE2094_40: {
+            std::optional<std::vector<uint8_t>> smpte2094_40;
+            if (gralloc4::decodeSmpte2094_40(in, &smpte2094_40))
+                return Error::BAD_VALUE;
+            if (smpte2094_40 && smpte2094_40->size() > sizeof(metadata->smpte2094_40))
+                return Error::BAD_VALUE;
+            metadata->smpte2094_40Size = smpte2094_40 ? smpte2094_40->size() : 0;
+            if (smpte2094_40)
+                memcpy(metadata->smpte2094_40, smpte2094_40->data(), smpte2094_40->size());
+            break;
+        }
+        default:
+            return Error::UNSUPPORTED;
+    }
+
+    return Error::NONE;
+}
+
+Return<void> Mapper::getFromBufferDescriptorInfo(const BufferDescriptorInfo& description,
+                                                 const MetadataType& metadataType,
+                                                 getFromBufferDescriptorInfo_cb hidl_cb) {
+    hidl_vec<uint8_t> out;
+    status_t status;
+
+    if (!gralloc4::isStandardMetadataType(metadataType)) {
+        hidl_cb(Error::UNSUPPORTED, out);
+        return Void();
+    }
+
+    switch (gralloc4::getStandardMetadataTypeValue(metadataType)) {
+        case StandardMetadataType::NAME:
+            status = gralloc4::encodeName(description.name, &out);
+            break;
+        case StandardMetadataType::WIDTH:
+            status = gralloc4::encodeWidth(description.width, &out);
+            break;
+        case StandardMetadataType::HEIGHT:
+            status = gralloc4::encodeHeight(description.height, &out);
+            break;
+        case StandardMetadataType::LAYER_COUNT:
+            status = gralloc4::encodeLayerCount(description.layerCount, &out);
+            break;
+        case StandardMetadataType::PIXEL_FORMAT_REQUESTED:
+            status = gralloc4::encodePixelFormatRequested(description.format, &out);
+            break;
+        case StandardMetadataType::PIXEL_FORMAT_FOURCC:
+            status = gralloc4::encodePixelFormatFourCC(
+                    getFourCC(BufferManager::get().resolveFormat(description)), &out);
+            break;
+        case StandardMetadataType::USAGE:
+            status = gralloc4::encodeUsage(description.usage, &out);
+            break;
+        case StandardMetadataType::PROTECTED_CONTENT:
+            status = gralloc4::encodeProtectedContent(0, &out);
+            break;
+        case StandardMetadataType::COMPRESSION:
+            status = gralloc4::encodeCompression(gralloc4::Compression_None, &out);
+            break;
+        case StandardMetadataType::INTERLACED:
+            status = gralloc4::encodeInterlaced(gralloc4::Interlaced_None, &out);
+            break;
+        case StandardMetadataType::CHROMA_SITING:
+            status = gralloc4::encodeChromaSiting(gralloc4::ChromaSiting_None, &out);
+            break;
+        case StandardMetadataType::DATASPACE:
+            status = gralloc4::encodeDataspace(Dataspace::UNKNOWN, &out);
+            break;
+        case StandardMetadataType::BLEND_MODE:
+            status = gralloc4::encodeBlendMode(BlendMode::INVALID, &out);
+            break;
+        default:
+            hidl_cb(Error::UNSUPPORTED, out);
+            return Void();
+    }
+
+    hidl_cb(status == OK ? Error::NONE : Error::NO_RESOURCES, out);
+    return Void();
+}
+
+Return<void> Mapper::listSupportedMetadataTypes(listSupportedMetadataTypes_cb hidl_cb) {
+    hidl_vec<MetadataTypeDescription> descriptions(kMetadataTypes);
+
+    hidl_cb(Error::NONE, descriptions);
+    return Void();
+}
+
+Error Mapper::dumpBuffer(buffer_handle_t handle, BufferDump* out) {
+    std::vector<MetadataDump> dumps;
+
+    for (auto const& description : kMetadataTypes) {
+        MetadataDump dump;
+
+        dump.metadataType = description.metadataType;
+        if (getMetadata(handle, description.metadataType, &dump.metadata) != Error::NONE)
+            continue;
+        dumps.push_back(dump);
+    }
+    out->metadataDump = dumps;
+
+    return Error::NONE;
+}
+
+Return<void> Mapper::dumpBuffer(void* buffer, dumpBuffer_cb hidl_cb) {
+    buffer_handle_t handle = getImportedHandle(buffer);
+    BufferDump dump;
+
+    if (!handle) {
+        hidl_cb(Error::BAD_BUFFER, dump);
+        return Void();
+    }
+
+    hidl_cb(dumpBuffer(handle, &dump), dump);
+    return Void();
+}
+
+Return<void> Mapper::dumpBuffers(dumpBuffers_cb hidl_cb) {
+    std::vector<BufferDump> dumps;
+
+    BufferManager::get().forEachBuffer([&](buffer_handle_t handle) {
+        BufferDump dump;
+        if (dumpBuffer(handle, &dump) == Error::NONE)
+            dumps.push_back(dump);
+    });
+
+    hidl_cb(Error::NONE, dumps);
+    return Void();
+}
+
+Return<void> Mapper::getReservedRegion(void* buffer, getReservedRegion_cb hidl_cb) {
+    buffer_handle_t handle = getImportedHandle(buffer);
+    uint64_t size = 0;
+    void* region;
+
+    if (!handle) {
+        hidl_cb(Error::BAD_BUFFER, nullptr, 0);
+        return Void();
+    }
+
+    region = BufferManager::get().getReservedRegion(handle, &size);
+    hidl_cb(Error::NONE, region, size);
+    return Void();
+}
+
+IMapper* HIDL_FETCH_IMapper(const char* /* name */) {
+    return new Mapper();
+}
+
+}  // namespace implementation
+}  // namespace V4_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_HARDWARE_GRAPHICS_MAPPER_V4_0_MAPPER_H
+#define ANDROID_HARDWARE_GRAPHICS_MAPPER_V4_0_MAPPER_H
+
+#include <android/hardware/graphics/mapper/4.0/IMapper.h>
+#include <hidl/Status.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V4_0 {
+namespace implementation {
+
+using ::android::hardware::hidl_handle;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::Return;
+using ::android::hardware::Void;
+using ::android::hardware::graphics::mapper::V4_0::Error;
+using ::android::hardware::graphics::mapper::V4_0::IMapper;
+
+class Mapper : public IMapper {
+  public:
+    // Methods from ::android::hardware::graphics::mapper::V4_0::IMapper follow.
+    Return<void> createDescriptor(const BufferDescriptorInfo& description,
+                                  createDescriptor_cb hidl_cb) override;
+    Return<void> importBuffer(const hidl_handle& rawHandle, importBuffer_cb hidl_cb) override;
+    Return<Error> freeBuffer(void* buffer) override;
+    Return<Error> validateBufferSize(void* buffer, const BufferDescriptorInfo& description,
+                                     uint32_t stride) override;
+    Return<void> getTransportSize(void* buffer, getTransportSize_cb hidl_cb) override;
+    Return<void> lock(void* buffer, uint64_t cpuUsage, const Rect& accessRegion,
+                      const hidl_handle& acquireFence, lock_cb hidl_cb) override;
+    Return<void> unlock(void* buffer, unlock_cb hidl_cb) override;
+    Return<void> flushLockedBuffer(void* buffer, flushLockedBuffer_cb hidl_cb) override;
+    Return<Error> rereadLockedBuffer(void* buffer) override;
+    Return<void> isSupported(const BufferDescriptorInfo& description,
+                             isSupported_cb hidl_cb) override;
+    Return<void> get(void* buffer, const MetadataType& metadataType, get_cb hidl_cb) override;
+    Return<Error> set(void* buffer, const MetadataType& metadataType,
+                      const hidl_vec<uint8_t>& metadata) override;
+    Return<void> getFromBufferDescriptorInfo(const BufferDescriptorInfo& description,
+                                             const MetadataType& metadataType,
+                                             getFromBufferDescriptorInfo_cb hidl_cb) override;
+    Return<void> listSupportedMetadataTypes(listSupportedMetadataTypes_cb hidl_cb) override;
+    Return<void> dumpBuffer(void* buffer, dumpBuffer_cb hidl_cb) override;
+    Return<void> dumpBuffers(dumpBuffers_cb hidl_cb) override;
+    Return<void> getReservedRegion(void* buffer, getReservedRegion_cb hidl_cb) override;
+
+  private:
+    Error getMetadata(buffer_handle_t handle, const MetadataType& metadataType,
+                      hidl_vec<uint8_t>* out);
+    Error dumpBuffer(buffer_handle_t handle, BufferDump* out);
+};
+
+extern "C" IMapper* HIDL_FETCH_IMapper(const char* name);
+
+}  // namespace implementation
+}  // namespace V4_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_GRAPHICS_MAPPER_V4_0_MAPPER_H
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.graphics.allocator@4.0-service.waydroid"
+
+#include <android-base/logging.h>
+#include <hidl/HidlTransportSupport.h>
+
+#include "Allocator.h"
+
+using android::hardware::configureRpcThreadpool;
+using android::hardware::joinRpcThreadpool;
+
+using android::hardware::graphics::allocator::V4_0::IAllocator;
+using android::hardware::graphics::allocator::V4_0::implementation::Allocator;
+
+using android::OK;
+using android::status_t;
+
+int main() {
+    android::sp<IAllocator> service = new Allocator();
+
+    configureRpcThreadpool(4, true);
+
+    status_t status = service->registerAsService();
+    if (status != OK) {
+        LOG(ERROR) << "Cannot register Allocator HAL service.";
+        return 1;
+    }
+
+    LOG(INFO) << "Waydroid allocator HAL service ready.";
+
+    joinRpcThreadpool();
+
+    LOG(ERROR) << "Allocator HAL service failed to join thread pool.";
+    return 1;
+}
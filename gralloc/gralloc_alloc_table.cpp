@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Publishes allocations in the table read by the memtrack HAL, see
+ * gralloc_alloc_table.h.
+ */
+
+#define LOG_TAG "GRALLOC-TABLE"
+
+#include <log/log.h>
+#include <cutils/properties.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <hardware/gralloc.h>
+
+#include "gralloc_alloc_table.h"
+#include "gralloc_gbm_priv.h"
+
+static struct gralloc_alloc_table *alloc_table;
+static bool alloc_table_failed;
+
+static struct gralloc_alloc_table *alloc_table_map(void)
+{
+	char path[PROPERTY_VALUE_MAX];
+	struct gralloc_alloc_table *table;
+	struct stat st;
+	int fd;
+
+	if (alloc_table || alloc_table_failed)
+		return alloc_table;
+	alloc_table_failed = true;
+
+	property_get("gralloc.gbm.alloc_table", path, GRALLOC_ALLOC_TABLE_PATH);
+	if (!path[0])
+		return NULL;
+
+	/* init creates the default one, see gralloc.waydroid.rc */
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+	if (fd < 0) {
+		ALOGW("failed to open %s: %s, not publishing allocations", path, strerror(errno));
+		return NULL;
+	}
+
+	/* the first allocator to get here sets the table up, the others wait */
+	if (flock(fd, LOCK_EX) < 0) {
+		ALOGW("failed to lock %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+	    ((size_t)st.st_size < sizeof(*table) && ftruncate(fd, sizeof(*table)) < 0)) {
+		ALOGW("failed to size %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	table = (struct gralloc_alloc_table *)mmap(NULL, sizeof(*table),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (table == MAP_FAILED) {
+		ALOGW("failed to map %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	/* a new file, or one left by an incompatible build */
+	if (table->magic != GRALLOC_ALLOC_TABLE_MAGIC ||
+	    table->version != GRALLOC_ALLOC_TABLE_VERSION) {
+		memset(table, 0, sizeof(*table));
+		table->version = GRALLOC_ALLOC_TABLE_VERSION;
+		__atomic_store_n(&table->magic, GRALLOC_ALLOC_TABLE_MAGIC, __ATOMIC_RELEASE);
+	}
+	/* unlocks */
+	close(fd);
+
+	alloc_table_failed = false;
+	alloc_table = table;
+	return alloc_table;
+}
+
+/*
+ * Record the buffer behind fd.  Several allocator processes may share the
+ * table, slots are claimed atomically.
+ */
+void gralloc_alloc_table_record(int fd, int format, int usage)
+{
+	struct gralloc_alloc_table *table = alloc_table_map();
+	struct gralloc_alloc_entry *entry;
+	struct stat st;
+	uint32_t index;
+
+	if (!table || fd < 0 || fstat(fd, &st) < 0)
+		return;
+
+	index = __atomic_fetch_add(&table->head, 1, __ATOMIC_RELAXED);
+	entry = &table->entries[index % GRALLOC_ALLOC_TABLE_ENTRIES];
+
+	__atomic_fetch_add(&entry->seq, 1, __ATOMIC_ACQUIRE);
+	entry->ino = st.st_ino;
+	entry->dev = st.st_dev;
+	entry->size = st.st_size;
+	entry->usage = usage;
+	entry->format = format;
+	entry->pid = getpid();
+	__atomic_fetch_add(&entry->seq, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _GRALLOC_ALLOC_TABLE_H_
+#define _GRALLOC_ALLOC_TABLE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Ring of the most recent allocations, published by gralloc in a file
+ * shared with the memtrack HAL.  Buffers are identified by the device and
+ * inode of their dma-buf (or memfd), so it does not matter which process ends up
+ * holding them.  Entries are never removed, a freed buffer simply stops
+ * showing up in /proc/<pid>/fd.
+ */
+#define GRALLOC_ALLOC_TABLE_PATH "/dev/gralloc_waydroid_allocs"
+#define GRALLOC_ALLOC_TABLE_MAGIC 0x57444154
+#define GRALLOC_ALLOC_TABLE_VERSION 2
+#define GRALLOC_ALLOC_TABLE_ENTRIES 4096
+
+struct gralloc_alloc_entry {
+	/* odd while the entry is being written */
+	uint32_t seq;
+	uint32_t usage;
+	uint64_t ino;
+	uint64_t dev;
+	uint64_t size;
+	int32_t pid;
+	int32_t format;
+};
+
+struct gralloc_alloc_table {
+	uint32_t magic;
+	uint32_t version;
+	/* total number of allocations recorded, the slot is head % ENTRIES */
+	uint32_t head;
+	uint32_t reserved;
+	struct gralloc_alloc_entry entries[GRALLOC_ALLOC_TABLE_ENTRIES];
+};
+
+/*
+ * Copy out an entry.  Returns 0 on success, -1 if the slot is empty or
+ * kept changing under us.
+ */
+static inline int gralloc_alloc_table_read(const struct gralloc_alloc_table *table,
+		uint32_t index, struct gralloc_alloc_entry *out)
+{
+	const struct gralloc_alloc_entry *entry =
+		&table->entries[index % GRALLOC_ALLOC_TABLE_ENTRIES];
+	int tries;
+
+	for (tries = 0; tries < 4; tries++) {
+		uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+
+		*out = *entry;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq)
+			return out->ino ? 0 : -1;
+	}
+
+	return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _GRALLOC_ALLOC_TABLE_H_ */
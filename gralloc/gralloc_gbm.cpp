@@ -28,32 +28,77 @@
 #include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <fcntl.h>
+#include <linux/magic.h>
 #include <assert.h>
 
 #include <hardware/gralloc.h>
 #include <system/graphics.h>
 
 #include <gbm.h>
+#include <drm_fourcc.h>
 
 #include "gralloc_gbm_priv.h"
+#include "gralloc_waydroid_handle.h"
 #include <android/gralloc_handle.h>
 
 #include <unordered_map>
+#include <vector>
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+#ifndef DMA_BUF_MAGIC
+#define DMA_BUF_MAGIC 0x444d4142
+#endif
+
+/* a dma-buf, whichever fd refers to it; ino 0 when it cannot be told apart */
+struct gbm_buf_id {
+	dev_t dev;
+	ino_t ino;
+
+	bool operator==(const gbm_buf_id &other) const {
+		return dev == other.dev && ino == other.ino;
+	}
+};
+
+struct gbm_buf_id_hash {
+	size_t operator()(const gbm_buf_id &id) const {
+		return std::hash<ino_t>()(id.ino) ^ (std::hash<dev_t>()(id.dev) << 1);
+	}
+};
+
 static std::unordered_map<buffer_handle_t, struct gbm_bo *> gbm_bo_handle_map;
+/* bos by dma-buf, so clones of a handle share a single import */
+static std::unordered_map<gbm_buf_id, struct gbm_bo *, gbm_buf_id_hash> gbm_bo_buf_map;
 
 struct bo_data_t {
+	struct gbm_buf_id id;
+	/* number of handles in gbm_bo_handle_map pointing at the bo */
+	int refcount;
 	void *map_data;
+	void *map_addr;
+	/* region covered by map_data, in pixels of the bo */
+	int map_x, map_y, map_w, map_h;
+	/*
+	 * Rows of the region at the bo stride, when the staging copy of the
+	 * driver has a pitch of its own; copied back to it on unmap.
+	 */
+	char *shadow;
+	char *staging;
+	uint32_t staging_stride;
+	int shadow_cpp;
+	int shadow_write;
 	int lock_count;
 	int locked_for;
 };
@@ -70,8 +115,42 @@ static struct bo_data_t *gbm_bo_data(struct gbm_bo *bo) {
 	return (struct bo_data_t *)gbm_bo_get_user_data(bo);
 }
 
+/*
+ * Only dma-buf fs gives each buffer an inode of its own: older kernels put
+ * them all on the one anon inode, and memfds or other files are not ours to
+ * share, so those are never deduplicated.
+ */
+static struct gbm_buf_id gbm_fd_id(int fd)
+{
+	struct gbm_buf_id id = {};
+	struct statfs sfs;
+	struct stat st;
+
+	if (fd < 0 || fstatfs(fd, &sfs) || sfs.f_type != DMA_BUF_MAGIC || fstat(fd, &st))
+		return id;
+
+	id.dev = st.st_dev;
+	id.ino = st.st_ino;
+	return id;
+}
+
+/*
+ * Start tracking a bo created or imported from the dma-buf fd.
+ */
+static void gbm_bo_track(struct gbm_bo *bo, int fd)
+{
+	struct bo_data_t *bo_data = new struct bo_data_t();
+
+	bo_data->id = gbm_fd_id(fd);
+	bo_data->refcount = 1;
+	gbm_bo_set_user_data(bo, bo_data, gralloc_gbm_destroy_user_data);
+
+	if (bo_data->id.ino)
+		gbm_bo_buf_map.emplace(bo_data->id, bo);
+}
+
 
-static uint32_t get_gbm_format(int format)
+uint32_t gralloc_gbm_get_format(int format)
 {
 	uint32_t fmt;
 
@@ -111,7 +190,7 @@ static uint32_t get_gbm_format(int format)
 	return fmt;
 }
 
-static int gralloc_gbm_get_bpp(int format)
+int gralloc_gbm_get_bpp(int format)
 {
 	int bpp;
 
@@ -171,7 +250,7 @@ static struct gbm_bo *gbm_import(struct gbm_device *gbm,
 	struct gbm_import_fd_data data;
 	#endif
 
-	int format = get_gbm_format(handle->format);
+	int format = gralloc_gbm_get_format(handle->format);
 	if (handle->prime_fd < 0)
 		return NULL;
 
@@ -200,12 +279,107 @@ static struct gbm_bo *gbm_import(struct gbm_device *gbm,
 	return bo;
 }
 
+#ifdef GBM_BO_IMPORT_FD_MODIFIER
+/*
+ * Newer than GBM_BO_IMPORT_FD_MODIFIER (Mesa 19.x and 21.3), so they are
+ * weak and looked up at run time: with an older libgbm they are NULL and
+ * buffers are allocated without modifiers.
+ */
+extern "C" {
+int gbm_device_get_format_modifier_plane_count(struct gbm_device *gbm,
+		uint32_t format, uint64_t modifier) __attribute__((weak));
+struct gbm_bo *gbm_bo_create_with_modifiers2(struct gbm_device *gbm,
+		uint32_t width, uint32_t height, uint32_t format,
+		const uint64_t *modifiers, const unsigned int count,
+		uint32_t flags) __attribute__((weak));
+}
+
+static bool gbm_has_modifiers2(void)
+{
+	return gbm_device_get_format_modifier_plane_count &&
+	       gbm_bo_create_with_modifiers2;
+}
+
+/* modifiers advertised by the compositor that the render node can allocate */
+static std::unordered_map<uint32_t, std::vector<uint64_t>> gbm_modifiers;
+static struct timespec gbm_modifiers_mtime;
+
+/*
+ * (Re)load the modifiers cache written by the hwcomposer.  The compositor
+ * may only connect after the allocator started, so this is checked on
+ * every allocation and is a no-op unless the file changed.
+ */
+static void gbm_load_modifiers(struct gbm_device *gbm)
+{
+	char path[PROPERTY_VALUE_MAX];
+	struct stat st;
+	uint32_t format;
+	uint64_t modifier;
+	FILE *f;
+
+	property_get("gralloc.gbm.modifiers_file", path, GRALLOC_GBM_MODIFIERS_FILE);
+	if (stat(path, &st) < 0)
+		return;
+
+	if (st.st_mtim.tv_sec == gbm_modifiers_mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == gbm_modifiers_mtime.tv_nsec)
+		return;
+
+	f = fopen(path, "re");
+	if (!f)
+		return;
+
+	gbm_modifiers.clear();
+	while (fscanf(f, "%" SCNx32 " %" SCNx64, &format, &modifier) == 2) {
+		if (modifier == DRM_FORMAT_MOD_INVALID)
+			continue;
+		/* the handle carries a single fd and stride, skip aux planes (CCS, DCC) */
+		if (gbm_device_get_format_modifier_plane_count(gbm, format, modifier) != 1)
+			continue;
+		gbm_modifiers[format].push_back(modifier);
+	}
+	fclose(f);
+
+	gbm_modifiers_mtime = st.st_mtim;
+	ALOGI("loaded modifiers for %zu formats from %s", gbm_modifiers.size(), path);
+}
+
+/*
+ * Return the modifiers to allocate a buffer with, or NULL to let the driver
+ * pick its default layout.  Buffers the CPU may touch stay linear, as
+ * gralloc0 has no way to hand out the stride of a detiled mapping.
+ */
+static const std::vector<uint64_t> *gbm_get_modifiers(struct gbm_device *gbm,
+		struct gralloc_handle_t *handle, uint32_t format, uint32_t usage)
+{
+	if (usage & GBM_BO_USE_LINEAR)
+		return NULL;
+	if (handle->usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
+		return NULL;
+	/* lock_ycbcr computes the plane offsets assuming a linear layout */
+	if (handle->format == HAL_PIXEL_FORMAT_YV12)
+		return NULL;
+	if (!gbm_has_modifiers2())
+		return NULL;
+	if (!property_get_bool("persist.waydroid.gbm_modifiers", true))
+		return NULL;
+
+	gbm_load_modifiers(gbm);
+
+	auto it = gbm_modifiers.find(format);
+	if (it == gbm_modifiers.end() || it->second.empty())
+		return NULL;
+
+	return &it->second;
+}
+#endif
+
 static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
 		buffer_handle_t _handle)
 {
 	struct gbm_bo *bo;
 	struct gralloc_handle_t *handle = gralloc_handle(_handle);
-	int format = get_gbm_format(handle->format);
+	int format = gralloc_gbm_get_format(handle->format);
 	int usage = get_pipe_bind(handle->usage);
 	int width, height;
 
@@ -229,7 +403,23 @@ static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
 
 	ALOGV("create BO, size=%dx%d, fmt=%d, usage=%x",
 	      handle->width, handle->height, handle->format, usage);
+	#ifdef GBM_BO_IMPORT_FD_MODIFIER
+	const std::vector<uint64_t> *modifiers =
+		gbm_get_modifiers(gbm, handle, format, usage);
+	if (modifiers) {
+		bo = gbm_bo_create_with_modifiers2(gbm, width, height, format,
+				modifiers->data(), modifiers->size(), usage);
+		if (!bo)
+			ALOGW("failed to create BO with %zu modifiers, fmt=%d, falling back",
+			      modifiers->size(), handle->format);
+	} else {
+		bo = NULL;
+	}
+	if (!bo)
+		bo = gbm_bo_create(gbm, width, height, format, usage);
+	#else
 	bo = gbm_bo_create(gbm, width, height, format, usage);
+	#endif
 	if (!bo) {
 		ALOGE("failed to create BO, size=%dx%d, fmt=%d, usage=%x",
 		      handle->width, handle->height, handle->format, usage);
@@ -249,52 +439,180 @@ void gbm_free(buffer_handle_t handle)
 {
 	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
 
+	struct bo_data_t *bo_data;
+
 	if (!bo)
 		return;
 
 	gbm_bo_handle_map.erase(handle);
+
+	bo_data = gbm_bo_data(bo);
+	if (bo_data) {
+		if (--bo_data->refcount > 0)
+			return;
+		if (bo_data->id.ino)
+			gbm_bo_buf_map.erase(bo_data->id);
+	}
+
 	gbm_bo_destroy(bo);
 }
 
+/*
+ * Offset of the first plane within the dma-buf, 0 for buffers that are not
+ * gbm bos.
+ */
+uint32_t gralloc_gbm_get_offset(buffer_handle_t handle)
+{
+	#ifdef GBM_BO_IMPORT_FD_MODIFIER
+	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
+
+	if (bo)
+		return gbm_bo_get_offset(bo, 0);
+	#else
+	(void)handle;
+	#endif
+	return 0;
+}
+
 /*
  * Return the bo of a registered handle.
  */
 struct gbm_bo *gralloc_gbm_bo_from_handle(buffer_handle_t handle)
 {
-	return gbm_bo_handle_map[handle];
+	auto it = gbm_bo_handle_map.find(handle);
+
+	return it != gbm_bo_handle_map.end() ? it->second : NULL;
 }
 
-static int gbm_map(buffer_handle_t handle, int enable_write, void **addr)
+static bool gbm_is_planar(int format)
 {
-	int err = 0;
+	switch (format) {
+	case HAL_PIXEL_FORMAT_YV12:
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Map the part of the bo covering the given rectangle.  The returned address
+ * always points at pixel (0, 0) as gralloc0 expects, so only the locked rows
+ * and columns may be dereferenced.  Drivers that go through a staging blit
+ * then only transfer, and write back on unmap, the locked region.
+ */
+static int gbm_map(buffer_handle_t handle, int enable_write,
+		int x, int y, int w, int h, void **addr)
+{
+	struct gralloc_handle_t *gbm_handle = gralloc_handle(handle);
 	int flags = GBM_BO_TRANSFER_READ;
 	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
 	struct bo_data_t *bo_data = gbm_bo_data(bo);
-	uint32_t stride;
+	int bo_width = gbm_bo_get_width(bo);
+	int bo_height = gbm_bo_get_height(bo);
+	int bpp = gralloc_gbm_get_bpp(gbm_handle->format);
+	uint32_t stride, bo_stride;
+	void *ptr;
+
+	/* planes of planar formats are not contiguous, map them whole */
+	if (gbm_is_planar(gbm_handle->format) || !bpp || w <= 0 || h <= 0) {
+		x = y = 0;
+		w = bo_width;
+		h = bo_height;
+	} else {
+		x = MAX(x, 0);
+		y = MAX(y, 0);
+		w = MIN(w, bo_width - x);
+		h = MIN(h, bo_height - y);
+		if (w <= 0 || h <= 0)
+			return -EINVAL;
+	}
 
-	if (bo_data->map_data)
-		return -EINVAL;
+	if (bo_data->map_data) {
+		/* nested lock, only valid inside the region already mapped */
+		if (x < bo_data->map_x || y < bo_data->map_y ||
+		    x + w > bo_data->map_x + bo_data->map_w ||
+		    y + h > bo_data->map_y + bo_data->map_h)
+			return -EINVAL;
+
+		*addr = bo_data->map_addr;
+		return 0;
+	}
 
 	if (enable_write)
 		flags |= GBM_BO_TRANSFER_WRITE;
 
-	*addr = gbm_bo_map(bo, 0, 0, gbm_bo_get_width(bo), gbm_bo_get_height(bo),
-	                   flags, &stride, &bo_data->map_data);
-	ALOGV("mapped bo %p at %p", bo, *addr);
-	if (*addr == NULL)
+	ptr = gbm_bo_map(bo, x, y, w, h, flags, &stride, &bo_data->map_data);
+	ALOGV("mapped bo %p (%d,%d %dx%d) at %p", bo, x, y, w, h, ptr);
+	if (ptr == NULL) {
+		bo_data->map_data = NULL;
 		return -ENOMEM;
+	}
+
+	bo_stride = gbm_bo_get_stride(bo);
+	if (stride != bo_stride) {
+		/*
+		 * The staging copy has its own pitch, which the locker cannot
+		 * know about.  Hand out the locked rows at the bo stride and
+		 * blit the rectangle between the two, in pixels of the bo as
+		 * planar formats use a different one.
+		 */
+		int cpp = gbm_bo_get_bpp(bo) / 8;
+		int i;
+
+		bo_data->shadow = (char *)malloc((size_t)h * bo_stride);
+		if (!bo_data->shadow) {
+			gbm_bo_unmap(bo, bo_data->map_data);
+			bo_data->map_data = NULL;
+			return -ENOMEM;
+		}
+		for (i = 0; i < h; i++)
+			memcpy(bo_data->shadow + (size_t)i * bo_stride + (size_t)x * cpp,
+			       (char *)ptr + (size_t)i * stride, (size_t)w * cpp);
+
+		bo_data->staging = (char *)ptr;
+		bo_data->staging_stride = stride;
+		bo_data->shadow_cpp = cpp;
+		bo_data->shadow_write = enable_write;
+		ptr = bo_data->shadow + (size_t)x * cpp;
+		stride = bo_stride;
+	}
 
-	assert(stride == gbm_bo_get_stride(bo));
+	bo_data->map_addr = (char *)ptr - (size_t)y * stride - (size_t)x * bpp;
+	bo_data->map_x = x;
+	bo_data->map_y = y;
+	bo_data->map_w = w;
+	bo_data->map_h = h;
+	*addr = bo_data->map_addr;
 
-	return err;
+	return 0;
 }
 
 static void gbm_unmap(struct gbm_bo *bo)
 {
 	struct bo_data_t *bo_data = gbm_bo_data(bo);
 
+	if (bo_data->shadow) {
+		if (bo_data->shadow_write) {
+			int cpp = bo_data->shadow_cpp;
+			uint32_t bo_stride = gbm_bo_get_stride(bo);
+			int i;
+
+			for (i = 0; i < bo_data->map_h; i++)
+				memcpy(bo_data->staging + (size_t)i * bo_data->staging_stride,
+				       bo_data->shadow + (size_t)i * bo_stride +
+						(size_t)bo_data->map_x * cpp,
+				       (size_t)bo_data->map_w * cpp);
+		}
+		free(bo_data->shadow);
+		bo_data->shadow = NULL;
+		bo_data->staging = NULL;
+	}
+
 	gbm_bo_unmap(bo, bo_data->map_data);
 	bo_data->map_data = NULL;
+	bo_data->map_addr = NULL;
 }
 
 void gbm_dev_destroy(struct gbm_device *gbm)
@@ -333,6 +651,8 @@ struct gbm_device *gbm_dev_create(void)
 int gralloc_gbm_handle_register(buffer_handle_t _handle, struct gbm_device *gbm)
 {
 	struct gbm_bo *bo;
+	struct gbm_buf_id id;
+	int prime_fd;
 
 	if (!_handle)
 		return -EINVAL;
@@ -340,10 +660,23 @@ int gralloc_gbm_handle_register(buffer_handle_t _handle, struct gbm_device *gbm)
 	if (gbm_bo_handle_map.count(_handle))
 		return -EINVAL;
 
+	/* another handle to an already imported dma-buf, share its bo */
+	prime_fd = gralloc_handle(_handle)->prime_fd;
+	id = gbm_fd_id(prime_fd);
+	if (id.ino) {
+		auto it = gbm_bo_buf_map.find(id);
+		if (it != gbm_bo_buf_map.end()) {
+			gbm_bo_data(it->second)->refcount++;
+			gbm_bo_handle_map.emplace(_handle, it->second);
+			return 0;
+		}
+	}
+
 	bo = gbm_import(gbm, _handle);
 	if (!bo)
 		return -EINVAL;
 
+	gbm_bo_track(bo, prime_fd);
 	gbm_bo_handle_map.emplace(_handle, bo);
 
 	return 0;
@@ -378,7 +711,9 @@ buffer_handle_t gralloc_gbm_bo_create(struct gbm_device *gbm,
 		return NULL;
 	}
 
+	gbm_bo_track(bo, gralloc_handle(handle)->prime_fd);
 	gbm_bo_handle_map.emplace(handle, bo);
+	gralloc_alloc_table_record(gralloc_handle(handle)->prime_fd, format, usage);
 
 	/* in pixels */
 	*stride = gralloc_handle(handle)->stride / gralloc_gbm_get_bpp(format);
@@ -390,7 +725,7 @@ buffer_handle_t gralloc_gbm_bo_create(struct gbm_device *gbm,
  * Lock a bo.  XXX thread-safety?
  */
 int gralloc_gbm_bo_lock(buffer_handle_t handle,
-		int usage, int /*x*/, int /*y*/, int /*w*/, int /*h*/,
+		int usage, int x, int y, int w, int h,
 		void **addr)
 {
 	struct gralloc_handle_t *gbm_handle = gralloc_handle(handle);
@@ -430,7 +765,7 @@ int gralloc_gbm_bo_lock(buffer_handle_t handle,
 		     GRALLOC_USAGE_SW_READ_MASK)) {
 		/* the driver is supposed to wait for the bo */
 		int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
-		int err = gbm_map(handle, write, addr);
+		int err = gbm_map(handle, write, x, y, w, h, addr);
 		if (err)
 			return err;
 	}
@@ -455,45 +790,37 @@ int gralloc_gbm_bo_unlock(buffer_handle_t handle)
 		return -EINVAL;
 
 	bo_data = gbm_bo_data(bo);
+	if (!bo_data || !bo_data->lock_count)
+		return 0;
 
-	int mapped = bo_data->locked_for &
-		(GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
-
-	if (!bo_data->lock_count)
+	bo_data->lock_count--;
+	if (bo_data->lock_count)
 		return 0;
 
-	if (mapped)
+	/* the mapping is shared by nested locks, drop it with the last one */
+	if (bo_data->map_data)
 		gbm_unmap(bo);
-
-	bo_data->lock_count--;
-	if (!bo_data->lock_count)
-		bo_data->locked_for = 0;
+	bo_data->locked_for = 0;
 
 	return 0;
 }
 
-#define GRALLOC_ALIGN(value, base) (((value) + ((base)-1)) & ~((base)-1))
-
-int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle,
-		int usage, int x, int y, int w, int h,
+/*
+ * Fill in the planes of a YUV buffer mapped at addr, as it was allocated:
+ * the stride is the one of the bo (or memfd), so alignment the driver
+ * added is accounted for.
+ */
+int gralloc_gbm_fill_ycbcr(buffer_handle_t handle, void *addr,
 		struct android_ycbcr *ycbcr)
 {
 	struct gralloc_handle_t *hnd = gralloc_handle(handle);
 	int ystride, cstride;
-	void *addr = 0;
-	int err;
-
-	ALOGV("handle %p, hnd %p, usage 0x%x", handle, hnd, usage);
-
-	err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, &addr);
-	if (err)
-		return err;
 
 	memset(ycbcr->reserved, 0, sizeof(ycbcr->reserved));
 
 	switch (hnd->format) {
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-		ystride = cstride = GRALLOC_ALIGN(hnd->width, 16);
+		ystride = cstride = hnd->stride;
 		ycbcr->y = addr;
 		ycbcr->cr = (unsigned char *)addr + ystride * hnd->height;
 		ycbcr->cb = (unsigned char *)addr + ystride * hnd->height + 1;
@@ -502,8 +829,15 @@ int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle,
 		ycbcr->chroma_step = 2;
 		break;
 	case HAL_PIXEL_FORMAT_YV12:
-		ystride = hnd->width;
-		cstride = GRALLOC_ALIGN(ystride / 2, 16);
+		ystride = hnd->stride;
+		/*
+		 * In a GR88 bo the chroma planes share its rows, two rows of
+		 * a plane per row of the bo.  memfds have the usual layout.
+		 */
+		if (gralloc_gbm_bo_from_handle(handle))
+			cstride = ystride / 2;
+		else
+			cstride = GRALLOC_ALIGN(ystride / 2, 16);
 		ycbcr->y = addr;
 		ycbcr->cr = (unsigned char *)addr + ystride * hnd->height;
 		ycbcr->cb = (unsigned char *)addr + ystride * hnd->height + cstride * hnd->height / 2;
@@ -518,3 +852,19 @@ int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle,
 
 	return 0;
 }
+
+int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle,
+		int usage, int x, int y, int w, int h,
+		struct android_ycbcr *ycbcr)
+{
+	void *addr = 0;
+	int err;
+
+	ALOGV("handle %p, usage 0x%x", handle, usage);
+
+	err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, &addr);
+	if (err)
+		return err;
+
+	return gralloc_gbm_fill_ycbcr(handle, addr, ycbcr);
+}
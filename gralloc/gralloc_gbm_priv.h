@@ -42,15 +42,39 @@ void gbm_free(buffer_handle_t handle);
 struct gbm_bo *gralloc_gbm_bo_from_handle(buffer_handle_t handle);
 buffer_handle_t gralloc_gbm_bo_get_handle(struct gbm_bo *bo);
 int gralloc_gbm_get_gem_handle(buffer_handle_t handle);
+int gralloc_gbm_get_bpp(int format);
+uint32_t gralloc_gbm_get_offset(buffer_handle_t handle);
+uint32_t gralloc_gbm_get_format(int format);
 
 int gralloc_gbm_bo_lock(buffer_handle_t handle, int usage, int x, int y, int w, int h, void **addr);
 int gralloc_gbm_bo_unlock(buffer_handle_t handle);
 int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle, int usage,
 		int x, int y, int w, int h, struct android_ycbcr *ycbcr);
+int gralloc_gbm_fill_ycbcr(buffer_handle_t handle, void *addr,
+		struct android_ycbcr *ycbcr);
 
 struct gbm_device *gbm_dev_create(void);
 void gbm_dev_destroy(struct gbm_device *gbm);
 
+/* memfd backed allocator, used when there is no render node */
+int gralloc_sw_enabled(void);
+int gralloc_sw_handle_register(buffer_handle_t handle);
+int gralloc_sw_handle_unregister(buffer_handle_t handle);
+
+buffer_handle_t gralloc_sw_bo_create(int width, int height, int format,
+		int usage, int *stride);
+void gralloc_sw_free(buffer_handle_t handle);
+
+int gralloc_sw_bo_lock(buffer_handle_t handle, int usage, int x, int y, int w, int h, void **addr);
+int gralloc_sw_bo_unlock(buffer_handle_t handle);
+int gralloc_sw_bo_lock_ycbcr(buffer_handle_t handle, int usage,
+		int x, int y, int w, int h, struct android_ycbcr *ycbcr);
+
+/* allocation records for the memtrack HAL */
+void gralloc_alloc_table_record(int fd, int format, int usage);
+
+#define GRALLOC_ALIGN(value, base) (((value) + ((base)-1)) & ~((base)-1))
+
 #ifdef __cplusplus
 }
 #endif
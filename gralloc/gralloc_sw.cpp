@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Software allocator for hosts without a render node.  Buffers are sealed
+ * memfds, exported as dma-bufs through /dev/udmabuf when the kernel has it,
+ * so the compositor can import them either through linux-dmabuf or wl_shm.
+ */
+
+#define LOG_TAG "GRALLOC-SW"
+
+#include <log/log.h>
+#include <cutils/properties.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/dma-buf.h>
+#include <linux/memfd.h>
+#include <linux/udmabuf.h>
+
+#include <hardware/gralloc.h>
+#include <system/graphics.h>
+
+#include <drm_fourcc.h>
+
+#include "gralloc_gbm_priv.h"
+#include <android/gralloc_handle.h>
+
+#include <unordered_map>
+
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#define SW_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+struct sw_bo_t {
+	void *addr;
+	size_t size;
+	bool dmabuf;
+	int lock_count;
+	int locked_for;
+};
+
+static std::unordered_map<buffer_handle_t, struct sw_bo_t> sw_bo_handle_map;
+
+/*
+ * Whether buffers come from this allocator.  A buffer only works through
+ * the backend that allocated it, so every process has to come to the same
+ * answer: it depends on the device alone, never on whether this process
+ * managed to open the render node.
+ */
+int gralloc_sw_enabled(void)
+{
+	char path[PROPERTY_VALUE_MAX];
+
+	if (property_get_bool("gralloc.gbm.software", false))
+		return 1;
+
+	property_get("gralloc.gbm.device", path, "/dev/dri/renderD128");
+	return access(path, F_OK) != 0;
+}
+
+/*
+ * Compute the stride and size of a buffer, with the plane layout that
+ * gralloc_gbm_fill_ycbcr() expects for YUV formats.
+ */
+static int sw_get_layout(int width, int height, int format,
+		uint32_t *stride, size_t *size)
+{
+	int bpp = gralloc_gbm_get_bpp(format);
+
+	switch (format) {
+	case HAL_PIXEL_FORMAT_YV12:
+		/* as the YV12 definition in graphics.h has it */
+		*stride = GRALLOC_ALIGN(width, 16);
+		*size = (size_t)*stride * height +
+			(size_t)GRALLOC_ALIGN(*stride / 2, 16) * height;
+		break;
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+		*stride = GRALLOC_ALIGN(width, 16);
+		*size = (size_t)*stride * height * 3 / 2;
+		break;
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+		*stride = GRALLOC_ALIGN(width, 16);
+		*size = (size_t)*stride * height * 2;
+		break;
+	default:
+		if (!bpp)
+			return -EINVAL;
+		*stride = GRALLOC_ALIGN(width * bpp, 64);
+		*size = (size_t)*stride * height;
+		break;
+	}
+
+	*size = GRALLOC_ALIGN(*size, (size_t)getpagesize());
+	/* let shmem back large buffers with transparent huge pages */
+	if (*size >= SW_HUGE_PAGE_SIZE)
+		*size = GRALLOC_ALIGN(*size, (size_t)SW_HUGE_PAGE_SIZE);
+
+	return 0;
+}
+
+static int sw_memfd_create(size_t size)
+{
+	int fd;
+
+	fd = syscall(__NR_memfd_create, "gralloc-sw", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		ALOGE("memfd_create failed: %s", strerror(errno));
+		return -errno;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		int err = -errno;
+		ALOGE("failed to resize memfd to %zu: %s", size, strerror(errno));
+		close(fd);
+		return err;
+	}
+
+	/* udmabuf requires F_SEAL_SHRINK and refuses F_SEAL_WRITE */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		ALOGW("failed to seal memfd: %s", strerror(errno));
+
+	return fd;
+}
+
+/*
+ * Wrap a memfd into a dma-buf.  Returns the new fd, or -1 if udmabuf is not
+ * available, in which case the memfd itself is used as the buffer.
+ */
+static int sw_udmabuf_create(int memfd, size_t size)
+{
+	static bool no_udmabuf;
+	struct udmabuf_create create;
+	int dev, fd;
+
+	if (no_udmabuf)
+		return -1;
+
+	dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (dev < 0) {
+		ALOGI("/dev/udmabuf not available, sharing plain memfds");
+		no_udmabuf = true;
+		return -1;
+	}
+
+	memset(&create, 0, sizeof(create));
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+
+	fd = ioctl(dev, UDMABUF_CREATE, &create);
+	if (fd < 0)
+		ALOGW("UDMABUF_CREATE failed: %s", strerror(errno));
+	close(dev);
+
+	return fd;
+}
+
+static bool sw_is_dmabuf(int fd)
+{
+	/* only memfds know about seals */
+	return fcntl(fd, F_GET_SEALS) < 0;
+}
+
+static int sw_bo_init(buffer_handle_t handle, struct sw_bo_t *bo)
+{
+	struct gralloc_handle_t *hnd = gralloc_handle(handle);
+	off_t size;
+
+	if (hnd->prime_fd < 0)
+		return -EINVAL;
+
+	size = lseek(hnd->prime_fd, 0, SEEK_END);
+	if (size <= 0)
+		return -EINVAL;
+
+	memset(bo, 0, sizeof(*bo));
+	bo->size = size;
+	bo->dmabuf = sw_is_dmabuf(hnd->prime_fd);
+
+	return 0;
+}
+
+static void sw_bo_fini(struct sw_bo_t *bo)
+{
+	if (bo->addr)
+		munmap(bo->addr, bo->size);
+	bo->addr = NULL;
+}
+
+/*
+ * Register a buffer handle.
+ */
+int gralloc_sw_handle_register(buffer_handle_t handle)
+{
+	struct sw_bo_t bo;
+	int err;
+
+	if (!handle)
+		return -EINVAL;
+
+	if (sw_bo_handle_map.count(handle))
+		return -EINVAL;
+
+	err = sw_bo_init(handle, &bo);
+	if (err)
+		return err;
+
+	sw_bo_handle_map.emplace(handle, bo);
+
+	return 0;
+}
+
+/*
+ * Unregister a buffer handle.
+ */
+int gralloc_sw_handle_unregister(buffer_handle_t handle)
+{
+	gralloc_sw_free(handle);
+
+	return 0;
+}
+
+/*
+ * Create a bo.
+ */
+buffer_handle_t gralloc_sw_bo_create(int width, int height, int format,
+		int usage, int *stride)
+{
+	struct gralloc_handle_t *hnd;
+	native_handle_t *handle;
+	struct sw_bo_t bo;
+	uint32_t byte_stride;
+	size_t size;
+	int memfd, fd;
+
+	if (sw_get_layout(width, height, format, &byte_stride, &size)) {
+		ALOGE("unsupported format 0x%x", format);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	handle = gralloc_handle_create(width, height, format, usage);
+	if (!handle)
+		return NULL;
+
+	memfd = sw_memfd_create(size);
+	if (memfd < 0) {
+		native_handle_delete(handle);
+		errno = -memfd;
+		return NULL;
+	}
+
+	fd = sw_udmabuf_create(memfd, size);
+	if (fd >= 0)
+		close(memfd);
+	else
+		fd = memfd;
+
+	hnd = gralloc_handle(handle);
+	hnd->prime_fd = fd;
+	hnd->stride = byte_stride;
+	hnd->modifier = DRM_FORMAT_MOD_LINEAR;
+
+	if (sw_bo_init(handle, &bo)) {
+		close(fd);
+		native_handle_delete(handle);
+		errno = EINVAL;
+		return NULL;
+	}
+	sw_bo_handle_map.emplace(handle, bo);
+	gralloc_alloc_table_record(fd, format, usage);
+
+	/* in pixels */
+	*stride = byte_stride / MAX(gralloc_gbm_get_bpp(format), 1);
+
+	return handle;
+}
+
+void gralloc_sw_free(buffer_handle_t handle)
+{
+	auto it = sw_bo_handle_map.find(handle);
+
+	if (it == sw_bo_handle_map.end())
+		return;
+
+	sw_bo_fini(&it->second);
+	sw_bo_handle_map.erase(it);
+}
+
+static void sw_bo_sync(struct gralloc_handle_t *hnd, struct sw_bo_t *bo,
+		uint64_t flags)
+{
+	struct dma_buf_sync sync;
+
+	if (!bo->dmabuf)
+		return;
+
+	if (bo->locked_for & GRALLOC_USAGE_SW_READ_MASK)
+		flags |= DMA_BUF_SYNC_READ;
+	if (bo->locked_for & GRALLOC_USAGE_SW_WRITE_MASK)
+		flags |= DMA_BUF_SYNC_WRITE;
+
+	sync.flags = flags;
+	if (ioctl(hnd->prime_fd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+		ALOGW("DMA_BUF_IOCTL_SYNC failed: %s", strerror(errno));
+}
+
+/*
+ * Lock a bo.  The whole buffer stays mapped until it is freed, so unlike
+ * with gbm there is no transfer to restrict to the locked region.
+ */
+int gralloc_sw_bo_lock(buffer_handle_t handle,
+		int usage, int /*x*/, int /*y*/, int /*w*/, int /*h*/,
+		void **addr)
+{
+	struct gralloc_handle_t *hnd = gralloc_handle(handle);
+	struct sw_bo_t *bo;
+
+	auto it = sw_bo_handle_map.find(handle);
+	if (it == sw_bo_handle_map.end())
+		return -EINVAL;
+	bo = &it->second;
+
+	if ((hnd->usage & usage) != (uint32_t)usage) {
+		/* make FB special for testing software renderer with */
+
+		if (!(hnd->usage & GRALLOC_USAGE_SW_READ_OFTEN) &&
+				!(hnd->usage & GRALLOC_USAGE_HW_FB) &&
+				!(hnd->usage & GRALLOC_USAGE_HW_TEXTURE)) {
+			ALOGE("bo.usage:x%X/usage:x%X is not GRALLOC_USAGE_HW_FB or GRALLOC_USAGE_HW_TEXTURE",
+				hnd->usage, usage);
+			return -EINVAL;
+		}
+	}
+
+	/* allow multiple locks with compatible usages */
+	if (bo->lock_count && (bo->locked_for & usage) != usage)
+		return -EINVAL;
+
+	if (usage & (GRALLOC_USAGE_SW_WRITE_MASK |
+		     GRALLOC_USAGE_SW_READ_MASK)) {
+		if (!bo->addr) {
+			void *ptr = mmap(NULL, bo->size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED, hnd->prime_fd, 0);
+			if (ptr == MAP_FAILED) {
+				ALOGE("failed to map bo: %s", strerror(errno));
+				return -ENOMEM;
+			}
+			if (bo->size >= SW_HUGE_PAGE_SIZE)
+				madvise(ptr, bo->size, MADV_HUGEPAGE);
+			bo->addr = ptr;
+		}
+		*addr = bo->addr;
+	}
+
+	if (!bo->lock_count) {
+		bo->locked_for = usage;
+		sw_bo_sync(hnd, bo, DMA_BUF_SYNC_START);
+	}
+
+	bo->lock_count++;
+	bo->locked_for |= usage;
+
+	return 0;
+}
+
+/*
+ * Unlock a bo.
+ */
+int gralloc_sw_bo_unlock(buffer_handle_t handle)
+{
+	struct sw_bo_t *bo;
+
+	auto it = sw_bo_handle_map.find(handle);
+	if (it == sw_bo_handle_map.end())
+		return -EINVAL;
+	bo = &it->second;
+
+	if (!bo->lock_count)
+		return 0;
+
+	bo->lock_count--;
+	if (bo->lock_count)
+		return 0;
+
+	sw_bo_sync(gralloc_handle(handle), bo, DMA_BUF_SYNC_END);
+	bo->locked_for = 0;
+
+	return 0;
+}
+
+int gralloc_sw_bo_lock_ycbcr(buffer_handle_t handle,
+		int usage, int x, int y, int w, int h,
+		struct android_ycbcr *ycbcr)
+{
+	void *addr = 0;
+	int err;
+
+	ALOGV("handle %p, usage 0x%x", handle, usage);
+
+	err = gralloc_sw_bo_lock(handle, usage, x, y, w, h, &addr);
+	if (err)
+		return err;
+
+	return gralloc_gbm_fill_ycbcr(handle, addr, ycbcr);
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _GRALLOC_WAYDROID_HANDLE_H_
+#define _GRALLOC_WAYDROID_HANDLE_H_
+
+#include <android/gralloc_handle.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Modifiers the compositor advertised, written by the hwcomposer and read
+ * by gralloc.gbm; gralloc.gbm.modifiers_file overrides the path.
+ */
+#define GRALLOC_GBM_MODIFIERS_FILE "/data/vendor/gralloc/modifiers"
+
+/*
+ * Handle of buffers allocated through the gralloc 4 HAL.  It carries the
+ * fields of gralloc_handle_t, plus a memfd holding the shared metadata of
+ * the buffer.  That fd has to come right after prime_fd, as native handles
+ * store all their fds first.
+ */
+struct waydroid_gralloc_handle_t {
+	native_handle_t base;
+
+	int prime_fd;
+	int metadata_fd;
+
+	uint32_t magic;
+	uint32_t version;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t usage;
+	uint32_t stride;
+	int data_owner;
+	uint64_t modifier __attribute__((aligned(8)));
+
+	union {
+		void *data;
+		uint64_t reserved;
+	} __attribute__((aligned(8)));
+};
+
+#define WAYDROID_GRALLOC_HANDLE_VERSION 1
+#define WAYDROID_GRALLOC_HANDLE_MAGIC 0x57444734
+#define WAYDROID_GRALLOC_HANDLE_NUM_FDS 2
+#define WAYDROID_GRALLOC_HANDLE_NUM_INTS ( \
+	((sizeof(struct waydroid_gralloc_handle_t) - sizeof(native_handle_t))/sizeof(int)) \
+	 - WAYDROID_GRALLOC_HANDLE_NUM_FDS)
+
+static inline struct waydroid_gralloc_handle_t *waydroid_gralloc_handle(buffer_handle_t handle)
+{
+	if (handle->numFds != WAYDROID_GRALLOC_HANDLE_NUM_FDS ||
+	    handle->numInts != (int)WAYDROID_GRALLOC_HANDLE_NUM_INTS ||
+	    ((struct waydroid_gralloc_handle_t *)handle)->magic != WAYDROID_GRALLOC_HANDLE_MAGIC)
+		return NULL;
+
+	return (struct waydroid_gralloc_handle_t *)handle;
+}
+
+/* what a consumer needs to know to import a buffer of either layout */
+struct waydroid_gralloc_buffer_info {
+	int prime_fd;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t usage;
+	uint32_t stride;
+	uint64_t modifier;
+};
+
+static inline void waydroid_gralloc_get_info(buffer_handle_t handle,
+		struct waydroid_gralloc_buffer_info *info)
+{
+	struct waydroid_gralloc_handle_t *wh = waydroid_gralloc_handle(handle);
+
+	if (wh) {
+		info->prime_fd = wh->prime_fd;
+		info->width = wh->width;
+		info->height = wh->height;
+		info->format = wh->format;
+		info->usage = wh->usage;
+		info->stride = wh->stride;
+		info->modifier = wh->modifier;
+	} else {
+		struct gralloc_handle_t *gh = gralloc_handle(handle);
+
+		info->prime_fd = gh->prime_fd;
+		info->width = gh->width;
+		info->height = gh->height;
+		info->format = gh->format;
+		info->usage = gh->usage;
+		info->stride = gh->stride;
+		info->modifier = gh->modifier;
+	}
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _GRALLOC_WAYDROID_HANDLE_H_ */
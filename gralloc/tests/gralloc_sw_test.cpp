@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2021 The Waydroid Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The memfd allocator needs no GPU, so this runs on any machine: buffers
+ * are allocated, written and read back through a second handle, the way a
+ * producer and a consumer process would.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include <hardware/gralloc.h>
+#include <system/graphics.h>
+
+#include <gtest/gtest.h>
+
+#include "gralloc_gbm_priv.h"
+#include <android/gralloc_handle.h>
+
+namespace {
+
+constexpr int kSwUsage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+
+class GrallocSwTest : public ::testing::Test {
+  protected:
+    void TearDown() override {
+        for (buffer_handle_t handle : mHandles) {
+            gralloc_sw_free(handle);
+            native_handle_close(handle);
+            native_handle_delete(const_cast<native_handle_t*>(handle));
+        }
+    }
+
+    buffer_handle_t allocate(int width, int height, int format, int usage, int* stride) {
+        buffer_handle_t handle = gralloc_sw_bo_create(width, height, format, usage, stride);
+        if (handle)
+            mHandles.push_back(handle);
+        return handle;
+    }
+
+    // What another process gets once the handle went through binder.
+    buffer_handle_t import(buffer_handle_t handle) {
+        native_handle_t* clone = native_handle_clone(handle);
+        if (!clone || gralloc_sw_handle_register(clone)) {
+            if (clone) {
+                native_handle_close(clone);
+                native_handle_delete(clone);
+            }
+            return nullptr;
+        }
+        mHandles.push_back(clone);
+        return clone;
+    }
+
+  private:
+    std::vector<buffer_handle_t> mHandles;
+};
+
+TEST_F(GrallocSwTest, RgbaLayout) {
+    int stride;
+    buffer_handle_t handle = allocate(100, 50, HAL_PIXEL_FORMAT_RGBA_8888, kSwUsage, &stride);
+    ASSERT_NE(nullptr, handle);
+
+    struct gralloc_handle_t* hnd = gralloc_handle(handle);
+    EXPECT_GE(stride, 100);
+    EXPECT_EQ(0u, hnd->stride % 64);
+    EXPECT_EQ(static_cast<uint32_t>(stride * 4), hnd->stride);
+    EXPECT_GE(lseek(hnd->prime_fd, 0, SEEK_END), static_cast<off_t>(hnd->stride * 50));
+}
+
+TEST_F(GrallocSwTest, LargeBuffersAreHugePageAligned) {
+    int stride;
+    buffer_handle_t handle = allocate(1920, 1080, HAL_PIXEL_FORMAT_RGBA_8888, kSwUsage, &stride);
+    ASSERT_NE(nullptr, handle);
+
+    EXPECT_EQ(0, lseek(gralloc_handle(handle)->prime_fd, 0, SEEK_END) % (2 * 1024 * 1024));
+}
+
+TEST_F(GrallocSwTest, MemfdIsSealed) {
+    int stride;
+    buffer_handle_t handle = allocate(64, 64, HAL_PIXEL_FORMAT_RGBA_8888, kSwUsage, &stride);
+    ASSERT_NE(nullptr, handle);
+
+    int seals = fcntl(gralloc_handle(handle)->prime_fd, F_GET_SEALS);
+    if (seals < 0)
+        GTEST_SKIP() << "exported through udmabuf";
+    EXPECT_EQ(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL, seals);
+}
+
+TEST_F(GrallocSwTest, WritesAreSeenThroughAnotherHandle) {
+    int stride;
+    buffer_handle_t handle = allocate(32, 16, HAL_PIXEL_FORMAT_RGBA_8888, kSwUsage, &stride);
+    ASSERT_NE(nullptr, handle);
+    uint32_t byteStride = gralloc_handle(handle)->stride;
+
+    void* addr = nullptr;
+    ASSERT_EQ(0, gralloc_sw_bo_lock(handle, GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0, 32, 16, &addr));
+    for (int y = 0; y < 16; y++)
+        memset(static_cast<char*>(addr) + y * byteStride, y + 1, 32 * 4);
+    ASSERT_EQ(0, gralloc_sw_bo_unlock(handle));
+
+    buffer_handle_t imported = import(handle);
+    ASSERT_NE(nullptr, imported);
+    ASSERT_EQ(0, gralloc_sw_bo_lock(imported, GRALLOC_USAGE_SW_READ_OFTEN, 0, 0, 32, 16, &addr));
+    for (int y = 0; y < 16; y++) {
+        const uint8_t* row = static_cast<const uint8_t*>(addr) + y * byteStride;
+        EXPECT_EQ(y + 1, row[0]);
+        EXPECT_EQ(y + 1, row[32 * 4 - 1]);
+    }
+    EXPECT_EQ(0, gralloc_sw_bo_unlock(imported));
+}
+
+TEST_F(GrallocSwTest, NestedLocksNeedCompatibleUsage) {
+    int stride;
+    buffer_handle_t handle = allocate(16, 16, HAL_PIXEL_FORMAT_RGBA_8888, kSwUsage, &stride);
+    ASSERT_NE(nullptr, handle);
+
+    void* addr = nullptr;
+    void* again = nullptr;
+    ASSERT_EQ(0, gralloc_sw_bo_lock(handle, GRALLOC_USAGE_SW_READ_OFTEN, 0, 0, 16, 16, &addr));
+    EXPECT_EQ(0, gralloc_sw_bo_lock(handle, GRALLOC_USAGE_SW_READ_OFTEN, 0, 0, 8, 8, &again));
+    EXPECT_EQ(addr, again);
+    EXPECT_EQ(-EINVAL, gralloc_sw_bo_lock(handle, GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0, 16, 16,
+                                          &again));
+    EXPECT_EQ(0, gralloc_sw_bo_unlock(handle));
+    EXPECT_EQ(0, gralloc_sw_bo_unlock(handle));
+}
+
+TEST_F(GrallocSwTest, Nv21Planes) {
+    int stride;
+    buffer_handle_t handle = allocate(64, 32, HAL_PIXEL_FORMAT_YCrCb_420_SP, kSwUsage, &stride);
+    ASSERT_NE(nullptr, handle);
+
+    struct android_ycbcr ycbcr = {};
+    ASSERT_EQ(0, gralloc_sw_bo_lock_ycbcr(handle, GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0, 64, 32,
+                                          &ycbcr));
+    const uint8_t* y = static_cast<const uint8_t*>(ycbcr.y);
+    const uint8_t* cb = static_cast<const uint8_t*>(ycbcr.cb);
+    const uint8_t* cr = static_cast<const uint8_t*>(ycbcr.cr);
+    EXPECT_EQ(2u, ycbcr.chroma_step);
+    EXPECT_EQ(ycbcr.ystride, ycbcr.cstride);
+    EXPECT_EQ(y + ycbcr.ystride * 32, cr);
+    EXPECT_EQ(cr + 1, cb);
+    EXPECT_EQ(0, gralloc_sw_bo_unlock(handle));
+}
+
+TEST_F(GrallocSwTest, Yv12Planes) {
+    int stride;
+    buffer_handle_t handle = allocate(100, 20, HAL_PIXEL_FORMAT_YV12, kSwUsage, &stride);
+    ASSERT_NE(nullptr, handle);
+
+    struct android_ycbcr ycbcr = {};
+    ASSERT_EQ(0, gralloc_sw_bo_lock_ycbcr(handle, GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0, 100, 20,
+                                          &ycbcr));
+    const uint8_t* y = static_cast<const uint8_t*>(ycbcr.y);
+    // y_stride = ALIGN(width, 16), c_stride = ALIGN(y_stride / 2, 16)
+    EXPECT_EQ(112u, ycbcr.ystride);
+    EXPECT_EQ(64u, ycbcr.cstride);
+    EXPECT_EQ(1u, ycbcr.chroma_step);
+    EXPECT_EQ(y + 112 * 20, ycbcr.cr);
+    EXPECT_EQ(y + 112 * 20 + 64 * 10, ycbcr.cb);
+    EXPECT_GE(lseek(gralloc_handle(handle)->prime_fd, 0, SEEK_END), 112 * 20 + 2 * 64 * 10);
+    EXPECT_EQ(0, gralloc_sw_bo_unlock(handle));
+}
+
+TEST_F(GrallocSwTest, UnsupportedFormatFails) {
+    int stride;
+
+    EXPECT_EQ(nullptr, allocate(16, 16, 0x7fff, kSwUsage, &stride));
+}
+
+}  // namespace
@@ -20,6 +20,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <wayland-client.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -35,7 +36,7 @@
 #include <sync/sync.h>
 #include <drm_fourcc.h>
 #include <presentation-time-client-protocol.h>
-#include <gralloc_handle.h>
+#include <gralloc_waydroid_handle.h>
 
 #define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <cutils/trace.h>
@@ -161,12 +162,24 @@ static struct buffer *get_wl_buffer(struct waydroid_hwc_composer_device_1 *pdev,
 
     buf = (struct buffer *)calloc(1, sizeof *buf);
     if (pdev->display->gtype == GRALLOC_GBM) {
-        struct gralloc_handle_t *drm_handle = (struct gralloc_handle_t *)layer->handle;
-        if (pdev->display->dmabuf) {
-            ret = create_dmabuf_wl_buffer(pdev->display, buf, width, height, drm_handle->format, drm_handle->prime_fd, drm_handle->stride, drm_handle->modifier);
+        struct waydroid_gralloc_buffer_info info;
+        waydroid_gralloc_get_info(layer->handle, &info);
+        /*
+         * memfds from the software gralloc (without udmabuf) are not
+         * dma-bufs, whether or not the compositor takes those
+         */
+        bool memfd = fcntl(info.prime_fd, F_GET_SEALS) >= 0;
+        if (!memfd && pdev->display->dmabuf) {
+            ret = create_dmabuf_wl_buffer(pdev->display, buf, width, height, info.format, info.prime_fd, info.stride, info.modifier);
         } else {
-            ret = create_shm_wl_buffer(pdev->display, buf, drm_handle->width, drm_handle->height, drm_handle->format, drm_handle->stride, layer->handle);
-            update_shm_buffer(pdev->display, buf);
+            /* memfds are shared with the compositor as is */
+            ret = -EINVAL;
+            if (memfd)
+                ret = create_shm_fd_wl_buffer(pdev->display, buf, info.width, info.height, info.format, info.prime_fd, info.stride);
+            if (ret) {
+                ret = create_shm_wl_buffer(pdev->display, buf, info.width, info.height, info.format, info.stride, layer->handle);
+                update_shm_buffer(pdev->display, buf);
+            }
         }
     } else {
         uint32_t format = HAL_PIXEL_FORMAT_RGBA_8888;
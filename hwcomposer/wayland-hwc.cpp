@@ -28,6 +28,7 @@
 
 #include "wayland-hwc.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,10 +49,12 @@
 #include <system/graphics.h>
 #include <syscall.h>
 #include <cmath>
+#include <algorithm>
 
 #include <libsync/sw_sync.h>
 #include <sync/sync.h>
 #include <hardware/gralloc.h>
+#include <gralloc_waydroid_handle.h>
 #include <log/log.h>
 
 #define ATRACE_TAG ATRACE_TAG_GRAPHICS
@@ -275,6 +278,51 @@ create_shm_wl_buffer(struct display *display, struct buffer *buffer,
     return 0;
 }
 
+/*
+ * Wrap a buffer that already lives in a memfd, as handed out by the
+ * software gralloc, into a wl_shm buffer without copying it.  Only formats
+ * the compositor can sample as is are accepted.
+ */
+int
+create_shm_fd_wl_buffer(struct display *display, struct buffer *buffer,
+             int width, int height, int format, int fd, int stride)
+{
+    uint32_t shm_format;
+
+    switch (format) {
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            shm_format = WL_SHM_FORMAT_ARGB8888;
+            break;
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            shm_format = WL_SHM_FORMAT_ABGR8888;
+            break;
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+            shm_format = WL_SHM_FORMAT_XBGR8888;
+            break;
+        case HAL_PIXEL_FORMAT_RGB_565:
+            shm_format = WL_SHM_FORMAT_RGB565;
+            break;
+        default:
+            return -EINVAL;
+    }
+    if (std::find(display->shm_formats.begin(), display->shm_formats.end(),
+                  shm_format) == display->shm_formats.end())
+        return -EINVAL;
+
+    buffer->format = shm_format;
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = stride;
+    buffer->isShm = false;
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(display->shm, fd, stride * height);
+    buffer->buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, shm_format);
+    wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+    wl_shm_pool_destroy(pool);
+
+    return 0;
+}
+
 static void
 xdg_surface_handle_configure(void *, struct xdg_surface *surface,
                  uint32_t serial)
@@ -1046,10 +1094,12 @@ static const struct wl_seat_listener seat_listener = {
 
 static void
 dmabuf_modifiers(void *data, struct zwp_linux_dmabuf_v1 *,
-         uint32_t format, uint32_t, uint32_t)
+         uint32_t format, uint32_t modifier_hi, uint32_t modifier_lo)
 {
     struct display *d = (struct display*)data;
 
+    d->modifiers[format].push_back(((uint64_t)modifier_hi << 32) | modifier_lo);
+
     ++d->formats_count;
     d->formats = (uint32_t*)realloc(d->formats,
                     d->formats_count * sizeof(*d->formats));
@@ -1072,6 +1122,18 @@ static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
     dmabuf_modifiers
 };
 
+static void
+shm_format(void *data, struct wl_shm *, uint32_t format)
+{
+    struct display *d = (struct display*)data;
+
+    d->shm_formats.push_back(format);
+}
+
+static const struct wl_shm_listener shm_listener = {
+    shm_format
+};
+
 static void
 output_handle_mode(void *data, struct wl_output *,
                    uint32_t, int32_t width, int32_t height,
@@ -1540,6 +1602,7 @@ registry_handle_global(void *data, struct wl_registry *registry,
     } else if (strcmp(interface, "wl_shm") == 0) {
 		d->shm = (struct wl_shm *)wl_registry_bind(registry, id,
                 &wl_shm_interface, 1);
+        wl_shm_add_listener(d->shm, &shm_listener, d);
     } else if (strcmp(interface, "wl_output") == 0) {
         d->output = (struct wl_output*)wl_registry_bind(registry, id,
                 &wl_output_interface, (version > 3) ? 3 : version);
@@ -1581,6 +1644,38 @@ static const struct wl_registry_listener registry_listener = {
     registry_handle_global_remove
 };
 
+/*
+ * Publish the modifiers the compositor advertised, one "format modifier"
+ * pair per line, so gralloc.gbm can allocate in a layout it can scan out.
+ */
+static void
+write_modifiers_cache(struct display *display)
+{
+    char path[PROPERTY_VALUE_MAX];
+    std::string tmp;
+    FILE *f;
+
+    property_get("gralloc.gbm.modifiers_file", path, GRALLOC_GBM_MODIFIERS_FILE);
+    tmp = std::string(path) + ".tmp";
+
+    f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        ALOGE("failed to open %s: %s", tmp.c_str(), strerror(errno));
+        return;
+    }
+    for (auto const& fmt : display->modifiers) {
+        for (uint64_t modifier : fmt.second)
+            fprintf(f, "%08x %016" PRIx64 "\n", fmt.first, modifier);
+    }
+    fclose(f);
+    chmod(tmp.c_str(), 0644);
+
+    if (rename(tmp.c_str(), path) < 0) {
+        ALOGE("failed to rename %s: %s", tmp.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
+
 int
 get_gralloc_type(const char *gralloc)
 {
@@ -1613,6 +1708,12 @@ create_display(const char *gralloc)
     wl_registry_add_listener(display->registry,
                  &registry_listener, display);
     wl_display_roundtrip(display->display);
+    /* zwp_linux_dmabuf_v1 was bound above, its modifier events come in the next one */
+    if (display->dmabuf)
+        wl_display_roundtrip(display->display);
+
+    if (display->dmabuf && !display->modifiers.empty())
+        write_modifiers_cache(display);
 
     display->task = IWaydroidTask::getService();
     return display;
@@ -44,6 +44,7 @@
 #include <errno.h>
 #include <map>
 #include <list>
+#include <vector>
 #include <pthread.h>
 #include <vendor/waydroid/task/1.0/IWaydroidTask.h>
 
@@ -130,6 +131,8 @@ struct display {
     int refresh;
     uint32_t *formats;
     int formats_count;
+    std::map<uint32_t, std::vector<uint64_t>> modifiers;
+    std::vector<uint32_t> shm_formats;
     bool geo_changed;
     std::map<uint32_t, std::string> layer_names;
     std::map<uint32_t, struct handleExt> layer_handles_ext;
@@ -185,6 +188,10 @@ int
 create_shm_wl_buffer(struct display *display, struct buffer *buffer,
              int width, int height, int format, int stride, buffer_handle_t target);
 
+int
+create_shm_fd_wl_buffer(struct display *display, struct buffer *buffer,
+             int width, int height, int format, int fd, int stride);
+
 struct display *
 create_display(const char* gralloc);
 void
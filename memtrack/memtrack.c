@@ -14,7 +14,447 @@
  * limitations under the License.
  */
 
+
+/*
+ * Memory tracker for graphics buffers.  Every dma-buf a process holds an
+ * fd to is charged to it, classified with the allocation records gralloc
+ * publishes (see gralloc_alloc_table.h) or, for buffers gralloc did not
+ * allocate, with the name of their exporter.  GL memory comes from the
+ * DRM client usage stats in fdinfo.
+ */
+
+#define LOG_TAG "memtrack-waydroid"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <hardware/gralloc.h>
 #include <hardware/memtrack.h>
+#include <log/log.h>
+
+#include <gralloc_alloc_table.h>
+
+/* getMemory is called once per type, a scan covers all of them */
+#define PID_CACHE_SIZE 16
+#define PID_CACHE_TIMEOUT_NS 1000000000LL
+
+#define INO_CACHE_SIZE 8192
+#define INO_CACHE_PROBES 16
+
+enum {
+    BUF_GRAPHICS,
+    BUF_MULTIMEDIA,
+    BUF_NUM_TYPES,
+};
+
+struct ino_entry {
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t size;
+    int type;
+};
+
+struct pid_entry {
+    pid_t pid;
+    int64_t timestamp;
+    uint64_t graphics;
+    uint64_t gl;
+    uint64_t multimedia;
+};
+
+struct fd_buffer {
+    /* 0 for buffers that cannot be told apart, counted per fd */
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t size;
+    int type;
+};
+
+struct drm_client {
+    uint64_t id;
+    uint64_t size;
+};
+
+static pthread_mutex_t memtrack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * dma-buf classification by device and inode, their size and exporter
+ * never change
+ */
+static struct ino_entry ino_cache[INO_CACHE_SIZE];
+static struct pid_entry pid_cache[PID_CACHE_SIZE];
+static unsigned int pid_cache_next;
+
+static const struct gralloc_alloc_table *alloc_table;
+static uint32_t alloc_table_head;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct ino_entry *ino_cache_slot(uint64_t dev, uint64_t ino, bool insert)
+{
+    size_t home = (size_t)(((ino ^ dev * 31) * 0x9e3779b97f4a7c15ULL) >> 51) % INO_CACHE_SIZE;
+    size_t i;
+
+    for (i = 0; i < INO_CACHE_PROBES; i++) {
+        struct ino_entry *entry = &ino_cache[(home + i) % INO_CACHE_SIZE];
+
+        if ((entry->ino == ino && entry->dev == dev) || (insert && !entry->ino))
+            return entry;
+    }
+
+    /* full neighbourhood, evict the home slot */
+    return insert ? &ino_cache[home] : NULL;
+}
+
+static void ino_cache_insert(uint64_t dev, uint64_t ino, uint64_t size, int type)
+{
+    struct ino_entry *entry = ino_cache_slot(dev, ino, true);
+
+    entry->ino = ino;
+    entry->dev = dev;
+    entry->size = size;
+    entry->type = type;
+}
+
+static int usage_to_type(uint32_t usage)
+{
+    if (usage & (GRALLOC_USAGE_HW_VIDEO_ENCODER | GRALLOC_USAGE_HW_CAMERA_MASK))
+        return BUF_MULTIMEDIA;
+    return BUF_GRAPHICS;
+}
+
+static void alloc_table_map(void)
+{
+    char path[PROPERTY_VALUE_MAX];
+    void *addr;
+    int fd;
+
+    property_get("gralloc.gbm.alloc_table", path, GRALLOC_ALLOC_TABLE_PATH);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    addr = mmap(NULL, sizeof(*alloc_table), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return;
+
+    alloc_table = (const struct gralloc_alloc_table *)addr;
+}
+
+/*
+ * Pull the allocations recorded since the last scan into the inode cache.
+ * They take precedence over the exporter name, gralloc knows what the
+ * buffer is for.
+ */
+static void alloc_table_sync(void)
+{
+    struct gralloc_alloc_entry entry;
+    uint32_t head, i;
+
+    /* gralloc creates the table on its first allocation */
+    if (!alloc_table)
+        alloc_table_map();
+    if (!alloc_table ||
+        __atomic_load_n(&alloc_table->magic, __ATOMIC_ACQUIRE) != GRALLOC_ALLOC_TABLE_MAGIC ||
+        alloc_table->version != GRALLOC_ALLOC_TABLE_VERSION)
+        return;
+
+    head = __atomic_load_n(&alloc_table->head, __ATOMIC_ACQUIRE);
+    i = alloc_table_head;
+    /* the ring wrapped since, or gralloc restarted with a fresh table */
+    if (head - i > GRALLOC_ALLOC_TABLE_ENTRIES)
+        i = head - GRALLOC_ALLOC_TABLE_ENTRIES;
+
+    for (; i != head; i++) {
+        if (gralloc_alloc_table_read(alloc_table, i, &entry))
+            continue;
+        ino_cache_insert(entry.dev, entry.ino, entry.size, usage_to_type(entry.usage));
+    }
+    alloc_table_head = head;
+}
+
+static ssize_t read_fdinfo(pid_t pid, const char *fd, char *buf, size_t size)
+{
+    char path[64];
+    ssize_t len;
+    int info;
+
+    snprintf(path, sizeof(path), "/proc/%d/fdinfo/%s", pid, fd);
+    info = open(path, O_RDONLY | O_CLOEXEC);
+    if (info < 0)
+        return -1;
+
+    len = read(info, buf, size - 1);
+    close(info);
+    if (len < 0)
+        return -1;
+
+    buf[len] = '\0';
+    return len;
+}
+
+static int exporter_to_type(const char *exp_name)
+{
+    if (!strncmp(exp_name, "videobuf2", 9) || !strncmp(exp_name, "vb2", 3) ||
+        !strncmp(exp_name, "v4l2", 4))
+        return BUF_MULTIMEDIA;
+    return BUF_GRAPHICS;
+}
+
+/* classify a dma-buf gralloc did not tell us about */
+static int dmabuf_type(pid_t pid, const char *fd)
+{
+    char buf[1024];
+    char *exp_name;
+
+    if (read_fdinfo(pid, fd, buf, sizeof(buf)) < 0)
+        return BUF_GRAPHICS;
+
+    exp_name = strstr(buf, "exp_name:");
+    if (!exp_name)
+        return BUF_GRAPHICS;
+
+    exp_name += strlen("exp_name:");
+    exp_name += strspn(exp_name, " \t");
+    return exporter_to_type(exp_name);
+}
+
+static uint64_t parse_drm_size(const char *value)
+{
+    char *end;
+    uint64_t size = strtoull(value, &end, 10);
+
+    end += strspn(end, " \t");
+    if (!strncmp(end, "KiB", 3))
+        size <<= 10;
+    else if (!strncmp(end, "MiB", 3))
+        size <<= 20;
+    else if (!strncmp(end, "GiB", 3))
+        size <<= 30;
+
+    return size;
+}
+
+/*
+ * Read the DRM usage stats of a client.  Buffers shared with other clients
+ * are dma-bufs already charged as graphics memory, they are left out.
+ * Returns false if the fd has no usage stats.
+ */
+static bool drm_client_stats(pid_t pid, const char *fd, struct drm_client *client)
+{
+    char buf[4096];
+    char *line, *save = NULL;
+    uint64_t total = 0, shared = 0;
+    bool has_id = false, has_total = false;
+
+    if (read_fdinfo(pid, fd, buf, sizeof(buf)) < 0)
+        return false;
+
+    for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *value = strchr(line, ':');
+
+        if (!value)
+            continue;
+        value++;
+
+        if (!strncmp(line, "drm-client-id:", 14)) {
+            client->id = strtoull(value, NULL, 10);
+            has_id = true;
+        } else if (!strncmp(line, "drm-total-", 10)) {
+            total += parse_drm_size(value);
+            has_total = true;
+        } else if (!strncmp(line, "drm-shared-", 11)) {
+            shared += parse_drm_size(value);
+        } else if (!has_total && !strncmp(line, "drm-memory-", 11)) {
+            /* kernels before 6.3 only report this one */
+            total += parse_drm_size(value);
+        }
+    }
+
+    client->size = total > shared ? total - shared : 0;
+    return has_id;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int compare_buffers(const void *a, const void *b)
+{
+    const struct fd_buffer *x = a, *y = b;
+
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return x->dev < y->dev ? -1 : x->dev > y->dev;
+}
+
+static void scan_pid(pid_t pid, struct pid_entry *result)
+{
+    char path[64], link[64];
+    struct fd_buffer *buffers = NULL;
+    struct drm_client *clients = NULL;
+    size_t num_buffers = 0, num_clients = 0, cap_buffers = 0, cap_clients = 0, i;
+    struct dirent *de;
+    DIR *dir;
+    int dfd;
+
+    result->graphics = result->gl = result->multimedia = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    dir = opendir(path);
+    if (!dir)
+        return;
+    dfd = dirfd(dir);
+
+    alloc_table_sync();
+
+    while ((de = readdir(dir))) {
+        struct ino_entry *cached;
+        struct stat st;
+        ssize_t len;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        len = readlinkat(dfd, de->d_name, link, sizeof(link) - 1);
+        if (len < 0)
+            continue;
+        link[len] = '\0';
+
+        if (!strncmp(link, "/dev/dri/", 9)) {
+            struct drm_client client;
+
+            if (!drm_client_stats(pid, de->d_name, &client))
+                continue;
+            if (num_clients == cap_clients) {
+                struct drm_client *n;
+                cap_clients = cap_clients ? cap_clients * 2 : 8;
+                n = realloc(clients, cap_clients * sizeof(*clients));
+                if (!n)
+                    break;
+                clients = n;
+            }
+            clients[num_clients++] = client;
+            continue;
+        }
+
+        /* follows the link to the buffer, dma-bufs report their size */
+        if (fstatat(dfd, de->d_name, &st, 0) < 0)
+            continue;
+
+        if (num_buffers == cap_buffers) {
+            struct fd_buffer *n;
+            cap_buffers = cap_buffers ? cap_buffers * 2 : 32;
+            n = realloc(buffers, cap_buffers * sizeof(*buffers));
+            if (!n)
+                break;
+            buffers = n;
+        }
+
+        /*
+         * Kernels before dma-buf fs put every dma-buf on the one anon
+         * inode: nothing to cache or dedupe them by, classify each fd.
+         */
+        if (!strcmp(link, "anon_inode:dmabuf")) {
+            buffers[num_buffers].ino = 0;
+            buffers[num_buffers].dev = 0;
+            buffers[num_buffers].size = (uint64_t)st.st_size;
+            buffers[num_buffers].type = dmabuf_type(pid, de->d_name);
+            num_buffers++;
+            continue;
+        }
+
+        cached = ino_cache_slot((uint64_t)st.st_dev, (uint64_t)st.st_ino, false);
+        if (cached && cached->size != (uint64_t)st.st_size)
+            cached = NULL;
+
+        if (!cached) {
+            /* memfds from the software gralloc only count if it recorded them */
+            if (strncmp(link, "/dmabuf:", 8))
+                continue;
+            ino_cache_insert((uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                             dmabuf_type(pid, de->d_name));
+            cached = ino_cache_slot((uint64_t)st.st_dev, (uint64_t)st.st_ino, false);
+            if (!cached)
+                continue;
+        }
+
+        buffers[num_buffers].ino = cached->ino;
+        buffers[num_buffers].dev = cached->dev;
+        buffers[num_buffers].size = cached->size;
+        buffers[num_buffers].type = cached->type;
+        num_buffers++;
+    }
+    closedir(dir);
+
+    /* a buffer or client may be open through several fds, count it once */
+    if (num_buffers)
+        qsort(buffers, num_buffers, sizeof(*buffers), compare_buffers);
+    for (i = 0; i < num_buffers; i++) {
+        if (i && buffers[i].ino && buffers[i].ino == buffers[i - 1].ino &&
+                buffers[i].dev == buffers[i - 1].dev)
+            continue;
+        if (buffers[i].type == BUF_MULTIMEDIA)
+            result->multimedia += buffers[i].size;
+        else
+            result->graphics += buffers[i].size;
+    }
+
+    if (num_clients)
+        qsort(clients, num_clients, sizeof(*clients), compare_u64);
+    for (i = 0; i < num_clients; i++) {
+        if (i && clients[i].id == clients[i - 1].id)
+            continue;
+        result->gl += clients[i].size;
+    }
+
+    free(buffers);
+    free(clients);
+}
+
+static const struct pid_entry *lookup_pid(pid_t pid)
+{
+    int64_t now = now_ns();
+    struct pid_entry *entry;
+    unsigned int i;
+
+    for (i = 0; i < PID_CACHE_SIZE; i++) {
+        entry = &pid_cache[i];
+        if (entry->pid == pid && now - entry->timestamp < PID_CACHE_TIMEOUT_NS)
+            return entry;
+    }
+
+    entry = &pid_cache[pid_cache_next];
+    pid_cache_next = (pid_cache_next + 1) % PID_CACHE_SIZE;
+
+    scan_pid(pid, entry);
+    entry->pid = pid;
+    entry->timestamp = now;
+
+    return entry;
+}
 
 static int memtrack_init(const struct memtrack_module *module)
 {
@@ -24,6 +464,49 @@ static int memtrack_init(const struct memtrack_module *module)
     return 0;
 }
 
+static int memtrack_get_memory(const struct memtrack_module *module,
+                               pid_t pid,
+                               int type,
+                               struct memtrack_record *records,
+                               size_t *num_records)
+{
+    struct memtrack_record record;
+    const struct pid_entry *entry;
+    uint64_t size;
+
+    (void)module;
+
+    if (type < 0 || type >= MEMTRACK_NUM_TYPES)
+        return -EINVAL;
+
+    if (type == MEMTRACK_TYPE_OTHER || type == MEMTRACK_TYPE_CAMERA) {
+        *num_records = 0;
+        return 0;
+    }
+
+    pthread_mutex_lock(&memtrack_lock);
+    entry = lookup_pid(pid);
+    if (type == MEMTRACK_TYPE_GL)
+        size = entry->gl;
+    else if (type == MEMTRACK_TYPE_MULTIMEDIA)
+        size = entry->multimedia;
+    else
+        size = entry->graphics;
+    pthread_mutex_unlock(&memtrack_lock);
+
+    record.size_in_bytes = (size_t)size;
+    record.flags = MEMTRACK_FLAG_SMAPS_UNACCOUNTED | MEMTRACK_FLAG_SYSTEM |
+                   MEMTRACK_FLAG_NONSECURE;
+    /* dma-bufs are shared with the compositor, GL memory is per client */
+    record.flags |= type == MEMTRACK_TYPE_GL ? MEMTRACK_FLAG_PRIVATE : MEMTRACK_FLAG_SHARED;
+
+    if (*num_records > 0)
+        records[0] = record;
+    *num_records = 1;
+
+    return 0;
+}
+
 static struct hw_module_methods_t memtrack_module_methods = {
     .open = NULL,
 };
@@ -34,10 +517,11 @@ struct memtrack_module HAL_MODULE_INFO_SYM = {
         .module_api_version = MEMTRACK_MODULE_API_VERSION_0_1,
         .hal_api_version = HARDWARE_HAL_API_VERSION,
         .id = MEMTRACK_HARDWARE_MODULE_ID,
-        .name = "Dummy Memory Tracker HAL",
-        .author = "The Android-x86 Open Source Project",
+        .name = "Waydroid Memory Tracker HAL",
+        .author = "The Waydroid Project",
         .methods = &memtrack_module_methods,
     },
 
     .init = memtrack_init,
+    .getMemory = memtrack_get_memory,
 };
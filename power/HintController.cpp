@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "HintController.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace impl {
+namespace waydroid {
+
+// output per unit of relative error: 10% late is 6 points more right away
+static constexpr double kProportionalGain = 60.0;
+// what the integral moves per report and unit of error, overruns push
+// harder than slack pulls back, so a workload just making it stays boosted
+static constexpr double kIntegralGainUp = 8.0;
+static constexpr double kIntegralGainDown = 2.0;
+// a single report counts for at most this, a stall must not saturate us
+static constexpr double kMaxError = 1.0;
+static constexpr int kMaxOutput = 100;
+
+HintController::HintController(int64_t targetNs) : mTargetNs(targetNs) {
+}
+
+void HintController::setTarget(int64_t targetNs) {
+    mTargetNs = targetNs;
+}
+
+int HintController::update(int64_t actualNs) {
+    if (mTargetNs <= 0 || actualNs <= 0)
+        return mOutput;
+
+    double error = static_cast<double>(actualNs - mTargetNs) / static_cast<double>(mTargetNs);
+    error = std::clamp(error, -kMaxError, kMaxError);
+
+    mIntegral += error * (error > 0 ? kIntegralGainUp : kIntegralGainDown);
+    mIntegral = std::clamp(mIntegral, 0.0, static_cast<double>(kMaxOutput));
+
+    double output = mIntegral + error * kProportionalGain;
+    mOutput = static_cast<int>(std::lround(std::clamp(output, 0.0, static_cast<double>(kMaxOutput))));
+    return mOutput;
+}
+
+void HintController::reset() {
+    mIntegral = 0;
+    mOutput = 0;
+}
+
+}  // namespace waydroid
+}  // namespace impl
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
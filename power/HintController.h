@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_POWER_HINTCONTROLLER_H
+#define ANDROID_HARDWARE_POWER_HINTCONTROLLER_H
+
+#include <cstdint>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace impl {
+namespace waydroid {
+
+/*
+ * PI controller from reported work durations to a boost, 0 to 100, meant
+ * as the uclamp.min of the threads doing the work.  The error is how far
+ * the work overran its target, relative to it; the integral settles at the
+ * boost that makes the target, the proportional part reacts to single
+ * late or early frames.  Pure arithmetic, so it can be fed synthetic
+ * traces.
+ */
+class HintController {
+  public:
+    explicit HintController(int64_t targetNs);
+
+    // A new target keeps the integral, the work is the same.
+    void setTarget(int64_t targetNs);
+    int64_t target() const { return mTargetNs; }
+
+    // Takes one reported duration and returns the new output.
+    int update(int64_t actualNs);
+    int output() const { return mOutput; }
+
+    // Forgets the history, as after a pause.
+    void reset();
+
+  private:
+    int64_t mTargetNs;
+    double mIntegral = 0;
+    int mOutput = 0;
+};
+
+}  // namespace waydroid
+}  // namespace impl
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+#endif  // ANDROID_HARDWARE_POWER_HINTCONTROLLER_H
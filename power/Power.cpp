@@ -14,48 +14,142 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "android.hardware.power-service.waydroid"
+
 #include "Power.h"
 
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+namespace aidl {
 namespace android {
 namespace hardware {
 namespace power {
-namespace V1_0 {
-namespace implementation {
+namespace impl {
+namespace waydroid {
 
-using ::android::hardware::power::V1_0::Feature;
-using ::android::hardware::power::V1_0::PowerHint;
-using ::android::hardware::power::V1_0::PowerStatePlatformSleepState;
-using ::android::hardware::power::V1_0::Status;
-using ::android::hardware::hidl_vec;
-using ::android::hardware::Return;
-using ::android::hardware::Void;
+// how often sessions are expected to report, one frame at 60 Hz
+static constexpr int64_t kPreferredRateNs = 16666666;
 
 Power::Power() {
+    char cgroupDir[PROPERTY_VALUE_MAX];
+    char boostCpus[PROPERTY_VALUE_MAX];
+
+    // the container's own cgroup, overridable to run against a fake cgroupfs
+    property_get("waydroid.power.cgroup", cgroupDir, "/sys/fs/cgroup");
+    // the CPUs launches may spread to, when the host pins us to fewer
+    property_get("waydroid.power.boost_cpus", boostCpus, "");
+
+    mPolicy = std::make_shared<PowerPolicy>(cgroupDir, boostCpus);
+}
+
+ndk::ScopedAStatus Power::setMode(Mode type, bool enabled) {
+    switch (type) {
+        case Mode::INTERACTIVE:
+            mPolicy->setInteractive(enabled);
+            break;
+        case Mode::LAUNCH:
+            if (enabled)
+                mPolicy->start(PowerPolicy::Boost::LAUNCH);
+            else
+                mPolicy->end(PowerPolicy::Boost::LAUNCH);
+            break;
+        case Mode::SUSTAINED_PERFORMANCE:
+            if (enabled)
+                mPolicy->start(PowerPolicy::Boost::SUSTAINED_PERFORMANCE);
+            else
+                mPolicy->end(PowerPolicy::Boost::SUSTAINED_PERFORMANCE);
+            break;
+        default:
+            return ndk::ScopedAStatus::fromExceptionCode(EX_UNSUPPORTED_OPERATION);
+    }
+    return ndk::ScopedAStatus::ok();
 }
 
-// Methods from ::android::hardware::power::V1_0::IPower follow.
-Return<void> Power::setInteractive(bool __attribute__((__unused__)) interactive)  {
-    return Void();
+ndk::ScopedAStatus Power::isModeSupported(Mode type, bool* _aidl_return) {
+    *_aidl_return = type == Mode::INTERACTIVE || type == Mode::LAUNCH ||
+                    type == Mode::SUSTAINED_PERFORMANCE;
+    return ndk::ScopedAStatus::ok();
 }
 
-Return<void> Power::powerHint(PowerHint __attribute__((__unused__)) hint, int32_t __attribute__((__unused__)) data) {
-    return Void();
+ndk::ScopedAStatus Power::setBoost(Boost type, int32_t durationMs) {
+    if (type != Boost::INTERACTION)
+        return ndk::ScopedAStatus::fromExceptionCode(EX_UNSUPPORTED_OPERATION);
+
+    // 0 when the duration is not known, negative cancels
+    if (durationMs < 0)
+        mPolicy->end(PowerPolicy::Boost::INTERACTION);
+    else
+        mPolicy->start(PowerPolicy::Boost::INTERACTION, std::chrono::milliseconds(durationMs));
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Power::isBoostSupported(Boost type, bool* _aidl_return) {
+    *_aidl_return = type == Boost::INTERACTION;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Power::createHintSession(int32_t tgid, int32_t uid,
+                                            const std::vector<int32_t>& threadIds,
+                                            int64_t durationNanos,
+                                            std::shared_ptr<IPowerHintSession>* _aidl_return) {
+    if (threadIds.empty() || durationNanos <= 0) {
+        *_aidl_return = nullptr;
+        return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
+    }
+    // only threads of the process the session is for
+    for (int32_t tid : threadIds) {
+        std::string task = "/proc/" + std::to_string(tgid) + "/task/" + std::to_string(tid);
+        if (access(task.c_str(), F_OK) != 0) {
+            ALOGW("thread %d is not in process %d", tid, tgid);
+            *_aidl_return = nullptr;
+            return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
+        }
+    }
+
+    std::shared_ptr<PowerHintSession> session = ndk::SharedRefBase::make<PowerHintSession>(
+            mPolicy, tgid, uid, threadIds, durationNanos);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mSessions.erase(std::remove_if(mSessions.begin(), mSessions.end(),
+                                   [](const std::weak_ptr<PowerHintSession>& s) {
+                                       return s.expired();
+                                   }),
+                    mSessions.end());
+    mSessions.push_back(session);
+
+    *_aidl_return = session;
+    return ndk::ScopedAStatus::ok();
 }
 
-Return<void> Power::setFeature(Feature /*feature*/, bool /*activate*/)  {
-    return Void();
+ndk::ScopedAStatus Power::getHintSessionPreferredRate(int64_t* outNanoseconds) {
+    *outNanoseconds = kPreferredRateNs;
+    return ndk::ScopedAStatus::ok();
 }
 
-Return<void> Power::getPlatformLowPowerStats(getPlatformLowPowerStats_cb _hidl_cb) {
-    hidl_vec<PowerStatePlatformSleepState> states;
+binder_status_t Power::dump(int fd, const char**, uint32_t) {
+    mPolicy->dump(fd);
 
-    states.resize(0);
-    _hidl_cb(states, Status::SUCCESS);
-    return Void();
+    std::lock_guard<std::mutex> lock(mLock);
+    dprintf(fd, "hint sessions:\n");
+    for (const auto& entry : mSessions) {
+        std::shared_ptr<PowerHintSession> session = entry.lock();
+        if (session && !session->isClosed())
+            session->dump(fd);
+    }
+    return STATUS_OK;
 }
 
-}  // namespace implementation
-}  // namespace V1_0
+}  // namespace waydroid
+}  // namespace impl
 }  // namespace power
 }  // namespace hardware
 }  // namespace android
+}  // namespace aidl
@@ -14,40 +14,54 @@
  * limitations under the License.
  */
 
-#ifndef ANDROID_HARDWARE_POWER_V1_0_POWER_H
-#define ANDROID_HARDWARE_POWER_V1_0_POWER_H
+#ifndef ANDROID_HARDWARE_POWER_POWER_H
+#define ANDROID_HARDWARE_POWER_POWER_H
 
-#include <android/hardware/power/1.0/IPower.h>
-#include <hidl/MQDescriptor.h>
-#include <hidl/Status.h>
+#include <aidl/android/hardware/power/BnPower.h>
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "PowerHintSession.h"
+#include "PowerPolicy.h"
+
+namespace aidl {
 namespace android {
 namespace hardware {
 namespace power {
-namespace V1_0 {
-namespace implementation {
+namespace impl {
+namespace waydroid {
 
-using ::android::hardware::power::V1_0::Feature;
-using ::android::hardware::power::V1_0::PowerHint;
-using ::android::hardware::power::V1_0::IPower;
-using ::android::hardware::Return;
-using ::android::hardware::Void;
+class Power : public BnPower {
+  public:
+    Power();
 
-struct Power : public IPower {
-    // Methods from ::android::hardware::power::V1_0::IPower follow.
+    ndk::ScopedAStatus setMode(Mode type, bool enabled) override;
+    ndk::ScopedAStatus isModeSupported(Mode type, bool* _aidl_return) override;
+    ndk::ScopedAStatus setBoost(Boost type, int32_t durationMs) override;
+    ndk::ScopedAStatus isBoostSupported(Boost type, bool* _aidl_return) override;
+    ndk::ScopedAStatus createHintSession(int32_t tgid, int32_t uid,
+                                         const std::vector<int32_t>& threadIds,
+                                         int64_t durationNanos,
+                                         std::shared_ptr<IPowerHintSession>* _aidl_return) override;
+    ndk::ScopedAStatus getHintSessionPreferredRate(int64_t* outNanoseconds) override;
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
 
-    Power();
+  private:
+    // shared with the sessions, which may outlive a call into us
+    std::shared_ptr<PowerPolicy> mPolicy;
 
-    Return<void> setInteractive(bool interactive) override;
-    Return<void> powerHint(PowerHint hint, int32_t data) override;
-    Return<void> setFeature(Feature feature, bool activate) override;
-    Return<void> getPlatformLowPowerStats(getPlatformLowPowerStats_cb _hidl_cb) override;
+    std::mutex mLock;
+    // open sessions, for dump(), pruned as they go away
+    std::vector<std::weak_ptr<PowerHintSession>> mSessions;
 };
 
-}  // namespace implementation
-}  // namespace V1_0
+}  // namespace waydroid
+}  // namespace impl
 }  // namespace power
 }  // namespace hardware
 }  // namespace android
+}  // namespace aidl
 
-#endif  // ANDROID_HARDWARE_POWER_V1_0_POWER_H
+#endif  // ANDROID_HARDWARE_POWER_POWER_H
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.power-service.waydroid"
+
+#include "PowerHintSession.h"
+
+#include <linux/sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <log/log.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace impl {
+namespace waydroid {
+
+// smaller output changes are not worth a syscall per thread
+static constexpr int kHysteresis = 2;
+// nice levels a full boost is worth, when there is no uclamp
+static constexpr int kMaxNiceBoost = 10;
+// output from which the container wide fallback kicks in
+static constexpr int kCgroupThreshold = 30;
+
+// As in linux/sched/types.h, which clashes with the libc sched_param.
+struct SchedAttr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+    uint32_t sched_util_min;
+    uint32_t sched_util_max;
+};
+
+// uclamp.min as requested for the thread, 0 if there is none or no uclamp.
+static uint32_t getUclampMin(int32_t tid) {
+    SchedAttr attr = {};
+
+    if (syscall(__NR_sched_getattr, tid, &attr, sizeof(attr), 0) != 0 ||
+            attr.size < offsetof(SchedAttr, sched_util_max))
+        return 0;
+    return attr.sched_util_min;
+}
+
+// Sets uclamp.min alone, policy and everything else stay as they are.
+static int setUclampMin(int32_t tid, uint32_t util) {
+    SchedAttr attr = {};
+
+    attr.size = sizeof(attr);
+    attr.sched_flags = SCHED_FLAG_KEEP_ALL | SCHED_FLAG_UTIL_CLAMP_MIN;
+    attr.sched_util_min = util;
+    return syscall(__NR_sched_setattr, tid, &attr, 0);
+}
+
+static const char* actuatorName(int actuator) {
+    static const char* const kNames[] = {"uclamp", "nice", "cgroup"};
+    return kNames[actuator];
+}
+
+PowerHintSession::PowerHintSession(std::shared_ptr<PowerPolicy> policy, int32_t tgid,
+                                   int32_t uid, const std::vector<int32_t>& threadIds,
+                                   int64_t targetDurationNanos)
+    : mPolicy(policy),
+      mTgid(tgid),
+      mUid(uid),
+      mActuator(Actuator::UCLAMP),
+      mController(targetDurationNanos) {
+    for (int32_t tid : threadIds) {
+        errno = 0;
+        int nice = getpriority(PRIO_PROCESS, tid);
+        if (nice == -1 && errno)
+            nice = 0;
+        mThreads.push_back({tid, nice, nice, getUclampMin(tid)});
+    }
+
+    // setting the clamp to what it is anyway tells us whether we can
+    if (!mThreads.empty() &&
+            setUclampMin(mThreads[0].tid, mThreads[0].originalUclampMin) != 0) {
+        // EACCES is how SELinux says no
+        mActuator = errno == EPERM || errno == EACCES ? Actuator::CGROUP : Actuator::NICE;
+        ALOGI("session for %d: no uclamp (%s), using %s", mTgid, strerror(errno),
+              actuatorName(static_cast<int>(mActuator)));
+    }
+}
+
+PowerHintSession::~PowerHintSession() {
+    close();
+}
+
+void PowerHintSession::applyLocked(int boost) {
+    if (mActuator != Actuator::CGROUP &&
+            (boost == mApplied || (boost && std::abs(boost - mApplied) < kHysteresis)))
+        return;
+
+    if (mActuator == Actuator::UCLAMP) {
+        // threads that exited in the meantime do not matter
+        for (const Thread& thread : mThreads)
+            setUclampMin(thread.tid, std::max(thread.originalUclampMin,
+                                              static_cast<uint32_t>(boost) * 1024 / 100));
+    } else if (mActuator == Actuator::NICE) {
+        for (Thread& thread : mThreads) {
+            errno = 0;
+            int current = getpriority(PRIO_PROCESS, thread.tid);
+            if (current == -1 && errno)
+                continue;
+            // the app reniced the thread itself, keep its choice as the baseline
+            if (current != thread.appliedNice)
+                thread.originalNice = thread.appliedNice = current;
+
+            int nice = std::max(-20, thread.originalNice - boost * kMaxNiceBoost / 100);
+            if (nice == current)
+                continue;
+            if (setpriority(PRIO_PROCESS, thread.tid, nice) != 0) {
+                if (errno != EPERM && errno != EACCES)
+                    continue;
+                ALOGI("session for %d: cannot renice, using cgroup", mTgid);
+                mActuator = Actuator::CGROUP;
+                break;
+            }
+            thread.appliedNice = nice;
+        }
+    }
+
+    // short lived, every report that needs it arms it again
+    if (mActuator == Actuator::CGROUP && boost >= kCgroupThreshold)
+        mPolicy->start(PowerPolicy::Boost::RENDERING);
+    mApplied = boost;
+}
+
+ndk::ScopedAStatus PowerHintSession::updateTargetWorkDuration(int64_t targetDurationNanos) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (targetDurationNanos <= 0)
+        return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
+    if (mClosed)
+        return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+    mController.setTarget(targetDurationNanos);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus PowerHintSession::reportActualWorkDuration(
+        const std::vector<WorkDuration>& durations) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (durations.empty())
+        return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
+    if (mClosed)
+        return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+    if (mPaused)
+        return ndk::ScopedAStatus::ok();
+
+    for (const WorkDuration& duration : durations) {
+        mController.update(duration.durationNanos);
+
+        mReports++;
+        if (duration.durationNanos > mController.target())
+            mLate++;
+        mTotalActualNs += duration.durationNanos;
+        mLastActualNs = duration.durationNanos;
+        mMaxActualNs = std::max(mMaxActualNs, duration.durationNanos);
+    }
+
+    int boost = mController.output();
+    mMaxBoost = std::max(mMaxBoost, boost);
+    applyLocked(boost);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus PowerHintSession::pause() {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mClosed)
+        return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+    mPaused = true;
+    applyLocked(0);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus PowerHintSession::resume() {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mClosed)
+        return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+    // what the work needed before the pause says little about now
+    if (mPaused)
+        mController.reset();
+    mPaused = false;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus PowerHintSession::close() {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mClosed)
+        return ndk::ScopedAStatus::ok();
+    applyLocked(0);
+    mClosed = true;
+    return ndk::ScopedAStatus::ok();
+}
+
+bool PowerHintSession::isClosed() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mClosed;
+}
+
+void PowerHintSession::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    dprintf(fd, "  tgid %d uid %d, %zu threads, %s%s\n", mTgid, mUid, mThreads.size(),
+            actuatorName(static_cast<int>(mActuator)), mPaused ? ", paused" : "");
+    dprintf(fd,
+            "    target %" PRId64 " us, %" PRIu64 " reports, %" PRIu64 " late, "
+            "actual avg %" PRId64 " last %" PRId64 " max %" PRId64 " us\n",
+            mController.target() / 1000, mReports, mLate,
+            mReports ? mTotalActualNs / static_cast<int64_t>(mReports) / 1000 : 0,
+            mLastActualNs / 1000, mMaxActualNs / 1000);
+    dprintf(fd, "    boost %d, applied %d, max %d\n", mController.output(), mApplied, mMaxBoost);
+}
+
+}  // namespace waydroid
+}  // namespace impl
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_POWER_POWERHINTSESSION_H
+#define ANDROID_HARDWARE_POWER_POWERHINTSESSION_H
+
+#include <aidl/android/hardware/power/BnPowerHintSession.h>
+#include <aidl/android/hardware/power/WorkDuration.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "HintController.h"
+#include "PowerPolicy.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace impl {
+namespace waydroid {
+
+/*
+ * A set of threads working towards a target duration per unit of work,
+ * usually a frame.  Reported durations go through a HintController whose
+ * output becomes the threads' uclamp.min.  Kernels without uclamp get a
+ * nice boost instead, and when we may not touch the threads at all the
+ * whole container gets a short rendering boost while the work runs late.
+ */
+class PowerHintSession : public BnPowerHintSession {
+  public:
+    PowerHintSession(std::shared_ptr<PowerPolicy> policy, int32_t tgid, int32_t uid,
+                     const std::vector<int32_t>& threadIds, int64_t targetDurationNanos);
+    ~PowerHintSession();
+
+    ndk::ScopedAStatus updateTargetWorkDuration(int64_t targetDurationNanos) override;
+    ndk::ScopedAStatus reportActualWorkDuration(
+            const std::vector<WorkDuration>& durations) override;
+    ndk::ScopedAStatus pause() override;
+    ndk::ScopedAStatus resume() override;
+    ndk::ScopedAStatus close() override;
+
+    bool isClosed();
+    void dump(int fd);
+
+  private:
+    enum class Actuator {
+        UCLAMP,
+        NICE,
+        CGROUP,
+    };
+
+    struct Thread {
+        int32_t tid;
+        int originalNice;
+        // what the session last set, anything else was changed behind its back
+        int appliedNice;
+        // uclamp.min as set before the session, in 1/1024ths
+        uint32_t originalUclampMin;
+    };
+
+    // Moves the threads to the given boost, 0 puts them back as they were.
+    void applyLocked(int boost);
+
+    const std::shared_ptr<PowerPolicy> mPolicy;
+    const int32_t mTgid;
+    const int32_t mUid;
+    std::vector<Thread> mThreads;
+
+    std::mutex mLock;
+    Actuator mActuator;
+    HintController mController;
+    bool mPaused = false;
+    bool mClosed = false;
+    // boost the threads have now
+    int mApplied = 0;
+
+    // for dump()
+    uint64_t mReports = 0;
+    uint64_t mLate = 0;
+    int64_t mTotalActualNs = 0;
+    int64_t mLastActualNs = 0;
+    int64_t mMaxActualNs = 0;
+    int mMaxBoost = 0;
+};
+
+}  // namespace waydroid
+}  // namespace impl
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+#endif  // ANDROID_HARDWARE_POWER_POWERHINTSESSION_H
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.power-service.waydroid"
+
+#include "PowerPolicy.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <log/log.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace impl {
+namespace waydroid {
+
+using std::chrono::milliseconds;
+
+namespace {
+
+struct BoostLevel {
+    const char* name;
+    // cpu.weight, in percent of the baseline
+    int weight;
+    // cpu.uclamp.min, in percent of the fastest CPU
+    int uclampMin;
+    // whether it spreads over the boost cpuset
+    bool spread;
+    // 0 lasts until ended
+    milliseconds defaultDuration;
+    milliseconds limit;
+};
+
+// indexed by PowerPolicy::Boost
+const BoostLevel kLevels[PowerPolicy::kBoostCount] = {
+    {"interaction", 200, 20, false, milliseconds(200), milliseconds(5000)},
+    {"launch", 400, 50, true, milliseconds(5000), milliseconds(5000)},
+    {"sustained_performance", 150, 30, false, milliseconds(0), milliseconds(0)},
+    {"rendering", 200, 40, false, milliseconds(100), milliseconds(1000)},
+};
+
+// cpu.weight off screen, in percent of the baseline
+constexpr int kBackgroundWeight = 20;
+// cpu.weight limits from the cgroup v2 documentation
+constexpr int kMinWeight = 1;
+constexpr int kMaxWeight = 10000;
+constexpr int kDefaultWeight = 100;
+
+bool readFile(const std::string& path, std::string* value) {
+    std::ifstream file(path);
+
+    if (!file)
+        return false;
+    std::getline(file, *value);
+    return true;
+}
+
+}  // namespace
+
+PowerPolicy::PowerPolicy(const std::string& cgroupDir, const std::string& boostCpus)
+    : mCgroupDir(cgroupDir), mBoostCpus(boostCpus) {
+    std::string value;
+
+    mBaseline.weight = kDefaultWeight;
+    if (readFile(mCgroupDir + "/cpu.weight", &value))
+        mBaseline.weight = std::clamp(atoi(value.c_str()), kMinWeight, kMaxWeight);
+    // a percentage with two decimals, or "max"
+    if (readFile(mCgroupDir + "/cpu.uclamp.min", &value))
+        mBaseline.uclampMin = value == "max" ? 100 : atoi(value.c_str());
+    if (!mBoostCpus.empty() && readFile(mCgroupDir + "/cpuset.cpus", &value))
+        mBaseline.cpus = value;
+    mApplied = mBaseline;
+
+    ALOGI("power policy on %s: weight %d, uclamp.min %d%s%s", mCgroupDir.c_str(),
+          mBaseline.weight, mBaseline.uclampMin, mBoostCpus.empty() ? "" : ", launches on ",
+          mBoostCpus.c_str());
+
+    mTimer = std::thread(&PowerPolicy::timerLoop, this);
+}
+
+PowerPolicy::~PowerPolicy() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopping = true;
+        mChanged.notify_one();
+    }
+    mTimer.join();
+
+    // leave the container as the host set it up
+    std::lock_guard<std::mutex> lock(mLock);
+    std::fill(std::begin(mActive), std::end(mActive), false);
+    mInteractive = true;
+    updateLocked();
+}
+
+bool PowerPolicy::write(const char* file, const std::string& value) {
+    std::string path = mCgroupDir + "/" + file;
+    // cgroup files only validate the value on write(), a buffered stream would not tell
+    int fd = open(path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    int error = 0;
+
+    if (fd < 0) {
+        error = errno;
+    } else {
+        ssize_t written = ::write(fd, value.data(), value.size());
+        if (written < 0)
+            error = errno;
+        else if (static_cast<size_t>(written) != value.size())
+            error = EIO;
+        close(fd);
+    }
+    if (error) {
+        // a file we cannot write fails the same way every time
+        if (mWarned.insert(file).second)
+            ALOGW("cannot write %s to %s: %s", value.c_str(), path.c_str(), strerror(error));
+        else
+            ALOGV("cannot write %s to %s: %s", value.c_str(), path.c_str(), strerror(error));
+        return false;
+    }
+    return true;
+}
+
+void PowerPolicy::updateLocked() {
+    Settings wanted = mBaseline;
+
+    if (!mInteractive)
+        wanted.weight = std::max(kMinWeight, mBaseline.weight * kBackgroundWeight / 100);
+    for (int i = 0; i < kBoostCount; i++) {
+        const BoostLevel& level = kLevels[i];
+
+        if (!mActive[i])
+            continue;
+        wanted.weight = std::max(wanted.weight,
+                                 std::min(kMaxWeight, mBaseline.weight * level.weight / 100));
+        wanted.uclampMin = std::max(wanted.uclampMin, level.uclampMin);
+        if (level.spread && !mBoostCpus.empty())
+            wanted.cpus = mBoostCpus;
+    }
+
+    if (wanted == mApplied)
+        return;
+    // a setting we cannot write is retried on the next change only
+    if (wanted.weight != mApplied.weight && write("cpu.weight", std::to_string(wanted.weight)))
+        mApplied.weight = wanted.weight;
+    if (wanted.uclampMin != mApplied.uclampMin &&
+            write("cpu.uclamp.min", std::to_string(wanted.uclampMin)))
+        mApplied.uclampMin = wanted.uclampMin;
+    if (wanted.cpus != mApplied.cpus && write("cpuset.cpus", wanted.cpus))
+        mApplied.cpus = wanted.cpus;
+
+    ALOGV("weight %d, uclamp.min %d, cpus %s", mApplied.weight, mApplied.uclampMin,
+          mApplied.cpus.c_str());
+}
+
+void PowerPolicy::start(Boost boost, milliseconds duration) {
+    const BoostLevel& level = kLevels[static_cast<int>(boost)];
+    std::lock_guard<std::mutex> lock(mLock);
+    int i = static_cast<int>(boost);
+
+    if (duration <= milliseconds(0))
+        duration = level.defaultDuration;
+    if (level.limit > milliseconds(0))
+        duration = std::min(duration, level.limit);
+
+    // a boost that is already on only ever gets longer
+    Clock::time_point expiry =
+            duration > milliseconds(0) ? Clock::now() + duration : Clock::time_point::max();
+    if (!mActive[i] || expiry > mExpiry[i])
+        mExpiry[i] = expiry;
+    if (!mActive[i]) {
+        ALOGV("%s boost on", level.name);
+        mActive[i] = true;
+        updateLocked();
+    }
+    mChanged.notify_one();
+}
+
+void PowerPolicy::end(Boost boost) {
+    std::lock_guard<std::mutex> lock(mLock);
+    int i = static_cast<int>(boost);
+
+    if (!mActive[i])
+        return;
+    ALOGV("%s boost off", kLevels[i].name);
+    mActive[i] = false;
+    updateLocked();
+    mChanged.notify_one();
+}
+
+void PowerPolicy::setInteractive(bool interactive) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mInteractive = interactive;
+    updateLocked();
+}
+
+void PowerPolicy::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Clock::time_point now = Clock::now();
+
+    dprintf(fd, "cgroup %s, %s\n", mCgroupDir.c_str(), mInteractive ? "interactive" : "background");
+    dprintf(fd, "  baseline: weight %d, uclamp.min %d, cpus %s\n", mBaseline.weight,
+            mBaseline.uclampMin, mBaseline.cpus.c_str());
+    dprintf(fd, "  applied: weight %d, uclamp.min %d, cpus %s\n", mApplied.weight,
+            mApplied.uclampMin, mApplied.cpus.c_str());
+    for (int i = 0; i < kBoostCount; i++) {
+        if (!mActive[i])
+            continue;
+        if (mExpiry[i] == Clock::time_point::max())
+            dprintf(fd, "  %s boost, until ended\n", kLevels[i].name);
+        else
+            dprintf(fd, "  %s boost, %lld ms left\n", kLevels[i].name,
+                    static_cast<long long>(std::chrono::duration_cast<milliseconds>(
+                                                   mExpiry[i] - now).count()));
+    }
+}
+
+void PowerPolicy::timerLoop() {
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (!mStopping) {
+        Clock::time_point now = Clock::now();
+        Clock::time_point next = Clock::time_point::max();
+        bool expired = false;
+
+        for (int i = 0; i < kBoostCount; i++) {
+            if (!mActive[i])
+                continue;
+            if (mExpiry[i] <= now) {
+                ALOGV("%s boost expired", kLevels[i].name);
+                mActive[i] = false;
+                expired = true;
+            } else {
+                next = std::min(next, mExpiry[i]);
+            }
+        }
+        if (expired)
+            updateLocked();
+
+        if (next == Clock::time_point::max())
+            mChanged.wait(lock);
+        else
+            mChanged.wait_until(lock, next);
+    }
+}
+
+}  // namespace waydroid
+}  // namespace impl
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_POWER_POWERPOLICY_H
+#define ANDROID_HARDWARE_POWER_POWERPOLICY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace impl {
+namespace waydroid {
+
+/*
+ * Turns power hints into CPU share for the whole container, through the
+ * cgroup v2 files of the cgroup it runs in: cpu.weight, cpu.uclamp.min and
+ * cpuset.cpus.  What the host configured there is the interactive baseline,
+ * boosts are relative to it and expire on their own; several boosts at once
+ * get the strongest of each setting.  Files that are missing or that the
+ * host did not delegate to us are left alone.
+ */
+class PowerPolicy {
+  public:
+    enum class Boost {
+        INTERACTION,
+        LAUNCH,
+        SUSTAINED_PERFORMANCE,
+        // hint sessions that cannot clamp their own threads
+        RENDERING,
+    };
+    static constexpr int kBoostCount = 4;
+    // how long a boost lasts when the hint does not say
+    static constexpr std::chrono::milliseconds kDefault{-1};
+
+    // cgroupDir is the container's own cgroup, boostCpus the cpuset a launch
+    // may spread to, empty to leave cpuset.cpus alone.
+    PowerPolicy(const std::string& cgroupDir, const std::string& boostCpus);
+    ~PowerPolicy();
+
+    // Starts a boost or extends it, it never lasts longer than its limit.
+    void start(Boost boost, std::chrono::milliseconds duration = kDefault);
+    void end(Boost boost);
+    // Off screen the container drops to a background share.
+    void setInteractive(bool interactive);
+
+    void dump(int fd);
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Settings {
+        int weight = 0;
+        int uclampMin = 0;
+        std::string cpus;
+
+        bool operator==(const Settings& other) const {
+            return weight == other.weight && uclampMin == other.uclampMin && cpus == other.cpus;
+        }
+        bool operator!=(const Settings& other) const { return !(*this == other); }
+    };
+
+    // Works out what applies now and writes what changed, with mLock held.
+    void updateLocked();
+    void timerLoop();
+    bool write(const char* file, const std::string& value);
+
+    const std::string mCgroupDir;
+    const std::string mBoostCpus;
+    // what the host gave us, restored when nothing is boosted
+    Settings mBaseline;
+    // what the files hold now
+    Settings mApplied;
+    // files a write failed on, warned about once
+    std::set<std::string> mWarned;
+
+    std::mutex mLock;
+    std::condition_variable mChanged;
+    bool mInteractive = true;
+    bool mActive[kBoostCount] = {};
+    Clock::time_point mExpiry[kBoostCount];
+    bool mStopping = false;
+    std::thread mTimer;
+};
+
+}  // namespace waydroid
+}  // namespace impl
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+#endif  // ANDROID_HARDWARE_POWER_POWERPOLICY_H
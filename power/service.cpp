@@ -14,53 +14,33 @@
  * limitations under the License.
  */
 
-#define LOG_TAG "android.hardware.power@1.0-service.waydroid"
+#define LOG_TAG "android.hardware.power-service.waydroid"
 
-#include <android/log.h>
-#include <hidl/HidlTransportSupport.h>
-#include "Power.h"
-
-using android::sp;
-using android::status_t;
-using android::OK;
+#include <android/binder_manager.h>
+#include <android/binder_process.h>
+#include <log/log.h>
 
-// libhwbinder:
-using android::hardware::configureRpcThreadpool;
-using android::hardware::joinRpcThreadpool;
+#include "Power.h"
 
-// Generated HIDL files
-using android::hardware::power::V1_0::IPower;
-using android::hardware::power::V1_0::implementation::Power;
+using aidl::android::hardware::power::impl::waydroid::Power;
 
 int main() {
+    ALOGI("Power HAL Service for Waydroid is starting.");
 
-    status_t status;
-    android::sp<IPower> service = nullptr;
-
-    ALOGI("Power HAL Service 1.0 for Waydroid is starting.");
-
-    service = new Power();
-    if (service == nullptr) {
-        ALOGE("Can not create an instance of Power HAL Iface, exiting.");
+    ABinderProcess_setThreadPoolMaxThreadCount(0);
+    std::shared_ptr<Power> power = ndk::SharedRefBase::make<Power>();
 
-        goto shutdown;
-    }
-
-    configureRpcThreadpool(1, true /*callerWillJoin*/);
-
-    status = service->registerAsService();
-    if (status != OK) {
+    const std::string instance = std::string() + Power::descriptor + "/default";
+    binder_status_t status = AServiceManager_addService(power->asBinder().get(), instance.c_str());
+    if (status != STATUS_OK) {
         ALOGE("Could not register service for Power HAL Iface (%d).", status);
-        goto shutdown;
+        return 1;
     }
 
     ALOGI("Power Service is ready");
-    joinRpcThreadpool();
-    //Should not pass this line
+    ABinderProcess_joinThreadPool();
 
-shutdown:
     // In normal operation, we don't expect the thread pool to exit
-
     ALOGE("Power Service is shutting down");
     return 1;
 }
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "HintController.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace impl {
+namespace waydroid {
+namespace {
+
+// a 60 Hz frame
+constexpr int64_t kTarget = 16666666;
+
+int64_t late(double fraction) {
+    return static_cast<int64_t>(kTarget * (1 + fraction));
+}
+
+// Feeds the same duration count times, returns the last output.
+int feed(HintController* controller, int64_t actual, int count) {
+    int output = 0;
+
+    for (int i = 0; i < count; i++)
+        output = controller->update(actual);
+    return output;
+}
+
+TEST(HintControllerTest, OnTargetStaysAtRest) {
+    HintController controller(kTarget);
+
+    EXPECT_EQ(0, feed(&controller, kTarget, 100));
+    EXPECT_EQ(0, controller.output());
+}
+
+TEST(HintControllerTest, OverrunBoostsAndKeepsBoosting) {
+    HintController controller(kTarget);
+
+    // 10% late: 6 proportional, 0.8 integral
+    EXPECT_EQ(7, controller.update(late(0.1)));
+
+    int last = controller.output();
+    for (int i = 0; i < 10; i++) {
+        int output = controller.update(late(0.1));
+        EXPECT_GE(output, last) << "report " << i;
+        last = output;
+    }
+    EXPECT_EQ(15, last);
+    // what is left once the work makes it is the integral alone
+    EXPECT_EQ(9, controller.update(kTarget));
+}
+
+TEST(HintControllerTest, SlackPullsBackSlowerThanOverrunPushes) {
+    HintController controller(kTarget);
+
+    feed(&controller, late(0.5), 5);
+    EXPECT_EQ(20, controller.update(kTarget));
+
+    // early frames drop the proportional part at once, the integral slowly
+    EXPECT_EQ(0, controller.update(late(-0.5)));
+    feed(&controller, late(-0.5), 4);
+    EXPECT_EQ(15, controller.update(kTarget));
+}
+
+TEST(HintControllerTest, ErrorIsClamped) {
+    HintController controller(kTarget);
+
+    // a stall counts as 100% late, no more
+    EXPECT_EQ(68, controller.update(kTarget * 10));
+}
+
+TEST(HintControllerTest, OutputIsClamped) {
+    HintController controller(kTarget);
+
+    EXPECT_EQ(100, feed(&controller, kTarget * 10, 50));
+    // the integral stops at the top too, so it comes back down right away
+    EXPECT_EQ(100, controller.update(kTarget));
+    EXPECT_EQ(69, controller.update(late(-0.5)));
+
+    HintController idle(kTarget);
+    EXPECT_EQ(0, feed(&idle, late(-0.9), 50));
+    // and it does not build up a debt at the bottom
+    EXPECT_EQ(7, idle.update(late(0.1)));
+}
+
+TEST(HintControllerTest, ResetForgetsTheHistory) {
+    HintController controller(kTarget);
+
+    feed(&controller, late(0.5), 10);
+    controller.reset();
+    EXPECT_EQ(0, controller.output());
+    EXPECT_EQ(0, controller.update(kTarget));
+    EXPECT_EQ(7, controller.update(late(0.1)));
+}
+
+TEST(HintControllerTest, NewTargetKeepsTheIntegral) {
+    HintController controller(kTarget);
+
+    feed(&controller, late(0.5), 5);
+    controller.setTarget(kTarget / 2);
+    EXPECT_EQ(kTarget / 2, controller.target());
+    EXPECT_EQ(20, controller.update(kTarget / 2));
+}
+
+TEST(HintControllerTest, BogusReportsAreIgnored) {
+    HintController controller(kTarget);
+
+    controller.update(late(0.5));
+    int output = controller.output();
+    EXPECT_EQ(output, controller.update(0));
+    EXPECT_EQ(output, controller.update(-1));
+
+    HintController untargeted(0);
+    EXPECT_EQ(0, untargeted.update(kTarget));
+}
+
+}  // namespace
+}  // namespace waydroid
+}  // namespace impl
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the policy against a directory that stands in for the container's
+ * cgroup, as waydroid.power.cgroup would point it at.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "PowerPolicy.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace impl {
+namespace waydroid {
+namespace {
+
+using std::chrono::milliseconds;
+using Boost = PowerPolicy::Boost;
+
+constexpr char kBoostCpus[] = "0-7";
+
+class PowerPolicyTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        char dir[] = "/tmp/power_policy_test.XXXXXX";
+
+        ASSERT_NE(nullptr, mkdtemp(dir));
+        mDir = dir;
+        writeFile("cpu.weight", "100");
+        writeFile("cpu.uclamp.min", "0.00");
+        writeFile("cpuset.cpus", "0-1");
+        mPolicy = std::make_unique<PowerPolicy>(mDir, kBoostCpus);
+    }
+
+    void TearDown() override {
+        mPolicy.reset();
+        for (const char* file : {"cpu.weight", "cpu.uclamp.min", "cpuset.cpus"})
+            unlink((mDir + "/" + file).c_str());
+        rmdir(mDir.c_str());
+    }
+
+    void writeFile(const char* file, const std::string& value) {
+        std::ofstream(mDir + "/" + file) << value;
+    }
+
+    std::string readFile(const char* file) {
+        std::ifstream in(mDir + "/" + file);
+        std::string value;
+
+        std::getline(in, value);
+        return value;
+    }
+
+    // Expiry runs on the policy's own thread, give it a moment.
+    std::string waitFor(const char* file, const std::string& value) {
+        for (int i = 0; i < 300 && readFile(file) != value; i++)
+            std::this_thread::sleep_for(milliseconds(10));
+        return readFile(file);
+    }
+
+    std::string mDir;
+    std::unique_ptr<PowerPolicy> mPolicy;
+};
+
+TEST_F(PowerPolicyTest, BaselineIsLeftAlone) {
+    EXPECT_EQ("100", readFile("cpu.weight"));
+    EXPECT_EQ("0.00", readFile("cpu.uclamp.min"));
+    EXPECT_EQ("0-1", readFile("cpuset.cpus"));
+}
+
+TEST_F(PowerPolicyTest, BoostsStack) {
+    mPolicy->start(Boost::INTERACTION, milliseconds(5000));
+    EXPECT_EQ("200", readFile("cpu.weight"));
+    EXPECT_EQ("20", readFile("cpu.uclamp.min"));
+    EXPECT_EQ("0-1", readFile("cpuset.cpus"));
+
+    // the strongest of each setting wins
+    mPolicy->start(Boost::LAUNCH);
+    EXPECT_EQ("400", readFile("cpu.weight"));
+    EXPECT_EQ("50", readFile("cpu.uclamp.min"));
+    EXPECT_EQ(kBoostCpus, readFile("cpuset.cpus"));
+
+    mPolicy->end(Boost::LAUNCH);
+    EXPECT_EQ("200", readFile("cpu.weight"));
+    EXPECT_EQ("20", readFile("cpu.uclamp.min"));
+    EXPECT_EQ("0-1", readFile("cpuset.cpus"));
+
+    mPolicy->end(Boost::INTERACTION);
+    EXPECT_EQ("100", readFile("cpu.weight"));
+    EXPECT_EQ("0", readFile("cpu.uclamp.min"));
+}
+
+TEST_F(PowerPolicyTest, BoostsExpire) {
+    mPolicy->start(Boost::INTERACTION, milliseconds(200));
+    EXPECT_EQ("200", readFile("cpu.weight"));
+
+    // each file is written in turn, wait for both
+    EXPECT_EQ("100", waitFor("cpu.weight", "100"));
+    EXPECT_EQ("0", waitFor("cpu.uclamp.min", "0"));
+}
+
+TEST_F(PowerPolicyTest, RestartingOnlyExtends) {
+    mPolicy->start(Boost::INTERACTION, milliseconds(600));
+    mPolicy->start(Boost::INTERACTION, milliseconds(10));
+
+    std::this_thread::sleep_for(milliseconds(100));
+    EXPECT_EQ("200", readFile("cpu.weight"));
+    EXPECT_EQ("100", waitFor("cpu.weight", "100"));
+    EXPECT_EQ("0", waitFor("cpu.uclamp.min", "0"));
+}
+
+TEST_F(PowerPolicyTest, DurationsAreCapped) {
+    // rendering lasts a second at most
+    mPolicy->start(Boost::RENDERING, milliseconds(60000));
+    EXPECT_EQ("40", readFile("cpu.uclamp.min"));
+
+    std::this_thread::sleep_for(milliseconds(900));
+    EXPECT_EQ("0", waitFor("cpu.uclamp.min", "0"));
+    EXPECT_EQ("100", waitFor("cpu.weight", "100"));
+}
+
+TEST_F(PowerPolicyTest, SustainedLastsUntilEnded) {
+    mPolicy->start(Boost::SUSTAINED_PERFORMANCE);
+
+    std::this_thread::sleep_for(milliseconds(300));
+    EXPECT_EQ("150", readFile("cpu.weight"));
+    mPolicy->end(Boost::SUSTAINED_PERFORMANCE);
+    EXPECT_EQ("100", readFile("cpu.weight"));
+}
+
+TEST_F(PowerPolicyTest, BackgroundWeight) {
+    mPolicy->setInteractive(false);
+    EXPECT_EQ("20", readFile("cpu.weight"));
+
+    // a boost still gets its share off screen
+    mPolicy->start(Boost::LAUNCH);
+    EXPECT_EQ("400", readFile("cpu.weight"));
+    mPolicy->end(Boost::LAUNCH);
+    EXPECT_EQ("20", readFile("cpu.weight"));
+
+    mPolicy->setInteractive(true);
+    EXPECT_EQ("100", readFile("cpu.weight"));
+}
+
+TEST_F(PowerPolicyTest, BaselineIsRestoredOnExit) {
+    mPolicy->start(Boost::LAUNCH);
+    mPolicy->setInteractive(false);
+    mPolicy.reset();
+
+    EXPECT_EQ("100", readFile("cpu.weight"));
+    EXPECT_EQ("0", readFile("cpu.uclamp.min"));
+    EXPECT_EQ("0-1", readFile("cpuset.cpus"));
+}
+
+}  // namespace
+}  // namespace waydroid
+}  // namespace impl
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.sensors@2.1-service.waydroid"
+//#define LOG_NDEBUG 0
+
+#include "DirectChannel.h"
+
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <cutils/ashmem.h>
+#include <log/log.h>
+#include <sensors/convert.h>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V1_0 {
+namespace implementation {
+
+std::unique_ptr<DirectChannel> DirectChannel::create(const SharedMemInfo& mem) {
+    const native_handle_t* handle = mem.memoryHandle.getNativeHandle();
+
+    if (mem.format != SharedMemFormat::SENSORS_EVENT || mem.size < sizeof(sensors_event_t) ||
+            !handle || handle->numFds < 1 || handle->data[0] < 0) {
+        ALOGE("direct channel: unusable memory, format %d size %u",
+              static_cast<int>(mem.format), mem.size);
+        return nullptr;
+    }
+
+    switch (mem.type) {
+        case SharedMemType::ASHMEM:
+            if (ashmem_get_size_region(handle->data[0]) < static_cast<int>(mem.size)) {
+                ALOGE("direct channel: ashmem region smaller than %u bytes", mem.size);
+                return nullptr;
+            }
+            break;
+        case SharedMemType::GRALLOC:
+            // BLOB buffers from our gralloc are a plain dma-buf behind the first fd,
+            // which maps like any shared memory
+            break;
+        default:
+            ALOGE("direct channel: memory type %d not supported", static_cast<int>(mem.type));
+            return nullptr;
+    }
+
+    native_handle_t* clone = native_handle_clone(handle);
+    if (!clone) {
+        ALOGE("direct channel: cannot clone the handle");
+        return nullptr;
+    }
+    void* base = mmap(nullptr, mem.size, PROT_READ | PROT_WRITE, MAP_SHARED, clone->data[0], 0);
+    if (base == MAP_FAILED) {
+        ALOGE("direct channel: cannot map %u bytes: %s", mem.size, strerror(errno));
+        native_handle_close(clone);
+        native_handle_delete(clone);
+        return nullptr;
+    }
+
+    return std::unique_ptr<DirectChannel>(new DirectChannel(mem.type, clone, base, mem.size));
+}
+
+DirectChannel::DirectChannel(SharedMemType type, native_handle_t* handle, void* base, size_t size)
+    : mType(type),
+      mHandle(handle),
+      mBase(base),
+      mSize(size),
+      mRing(static_cast<sensors_event_t*>(base)),
+      mSlots(size / sizeof(sensors_event_t)) {
+}
+
+DirectChannel::~DirectChannel() {
+    munmap(mBase, mSize);
+    native_handle_close(mHandle);
+    native_handle_delete(mHandle);
+}
+
+void DirectChannel::write(const Event& event, int32_t reportToken) {
+    sensors_event_t* slot = mRing + mWritePos;
+    sensors_event_t out;
+
+    convertToSensorEvent(event, &out);
+    out.version = sizeof(sensors_event_t);
+    out.sensor = reportToken;
+
+    // the slot reads as stale while it is rewritten, and the new counter
+    // only shows up once the whole event is in place
+    __atomic_store_n(&slot->reserved0, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    out.reserved0 = 0;
+    memcpy(slot, &out, sizeof(out));
+    __atomic_store_n(&slot->reserved0, static_cast<int32_t>(mCounter), __ATOMIC_RELEASE);
+
+    if (++mCounter == 0)
+        mCounter = 1;
+    if (++mWritePos == mSlots)
+        mWritePos = 0;
+}
+
+}  // namespace implementation
+}  // namespace V1_0
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
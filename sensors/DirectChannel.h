@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_HARDWARE_SENSORS_V1_0_DIRECTCHANNEL_H_
+#define ANDROID_HARDWARE_SENSORS_V1_0_DIRECTCHANNEL_H_
+
+#include <android/hardware/sensors/1.0/ISensors.h>
+#include <cutils/native_handle.h>
+#include <hardware/sensors.h>
+
+#include <memory>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V1_0 {
+namespace implementation {
+
+/*
+ * Client memory that events are written straight into, as a ring of
+ * sensors_event_t.  Readers follow the atomic counter in reserved0, which
+ * counts up from 1 and skips 0 when it wraps, so nothing else needs to be
+ * shared with them.  Not thread safe, the caller serializes writes.
+ */
+class DirectChannel {
+  public:
+    // Maps the client's memory, null when it cannot be used.
+    static std::unique_ptr<DirectChannel> create(const SharedMemInfo& mem);
+    ~DirectChannel();
+
+    SharedMemType type() const { return mType; }
+
+    // Appends an event, tagged with the report token instead of the sensor handle.
+    void write(const Event& event, int32_t reportToken);
+
+  private:
+    DirectChannel(SharedMemType type, native_handle_t* handle, void* base, size_t size);
+
+    const SharedMemType mType;
+    // our own copy, the one passed to registerDirectChannel() is closed after the call
+    native_handle_t* const mHandle;
+    void* const mBase;
+    const size_t mSize;
+
+    sensors_event_t* const mRing;
+    const size_t mSlots;
+    size_t mWritePos = 0;
+    uint32_t mCounter = 1;
+};
+
+}  // namespace implementation
+}  // namespace V1_0
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_SENSORS_V1_0_DIRECTCHANNEL_H_
@@ -0,0 +1,565 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.sensors@2.1-service.waydroid"
+//#define LOG_NDEBUG 0
+
+#include "IioSensors.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <log/log.h>
+#include <utils/SystemClock.h>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V1_0 {
+namespace implementation {
+
+// kernel buffer size in scans, which is also the FIFO we advertise
+static constexpr uint32_t kBufferLength = 256;
+// used when the driver does not list its sampling frequencies
+static constexpr double kDefaultMinFrequency = 1.0;
+static constexpr double kDefaultMaxFrequency = 100.0;
+
+struct IioSensors::Kind {
+    // IIO channel type, as in in_<channel>_x_en
+    const char* channel;
+    SensorType type;
+    const char* typeAsString;
+    const char* label;
+    int axes;
+    // from the IIO unit, after scale, to the Android one
+    double unit;
+    SensorFlagBits reportingMode;
+};
+
+static const IioSensors::Kind kKinds[] = {
+    {"accel", SensorType::ACCELEROMETER, "android.sensor.accelerometer", "Accelerometer", 3,
+     1.0, SensorFlagBits::CONTINUOUS_MODE},
+    {"anglvel", SensorType::GYROSCOPE, "android.sensor.gyroscope", "Gyroscope", 3,
+     1.0, SensorFlagBits::CONTINUOUS_MODE},
+    // gauss to microtesla
+    {"magn", SensorType::MAGNETIC_FIELD, "android.sensor.magnetic_field", "Magnetometer", 3,
+     100.0, SensorFlagBits::CONTINUOUS_MODE},
+    {"illuminance", SensorType::LIGHT, "android.sensor.light", "Ambient light", 1,
+     1.0, SensorFlagBits::ON_CHANGE_MODE},
+    // kilopascal to hectopascal
+    {"pressure", SensorType::PRESSURE, "android.sensor.pressure", "Barometer", 1,
+     10.0, SensorFlagBits::CONTINUOUS_MODE},
+};
+
+static const char* const kAxes[] = {"_x", "_y", "_z"};
+
+struct DirCloser {
+    void operator()(DIR* dir) const { closedir(dir); }
+};
+using Dir = std::unique_ptr<DIR, DirCloser>;
+
+static bool readFile(const std::string& path, std::string* value) {
+    std::ifstream file(path);
+    if (!file)
+        return false;
+    std::getline(file, *value);
+    return true;
+}
+
+/*
+ * Write value to path and close file, sysfs reports errors on the flush.
+ */
+template <typename T>
+static bool set(const std::string& path, const T& value) {
+    std::ofstream file(path);
+    if (!file)
+        return false;
+    file << value << std::endl;
+    return file.good();
+}
+
+static bool exists(const std::string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+static double readDouble(const std::string& path, double fallback) {
+    std::string value;
+    if (!readFile(path, &value) || value.empty())
+        return fallback;
+    return strtod(value.c_str(), nullptr);
+}
+
+// scan_elements type, e.g. "le:s12/16>>4"
+static bool parseType(const std::string& type, IioSensors::Channel* channel) {
+    char endian, sign;
+    unsigned int realBits, storageBits, shift;
+
+    if (sscanf(type.c_str(), "%ce:%c%u/%u>>%u", &endian, &sign, &realBits, &storageBits,
+               &shift) != 5)
+        return false;
+    if (storageBits == 0 || storageBits > 64 || storageBits % 8 || realBits > storageBits)
+        return false;
+
+    channel->bigEndian = endian == 'b';
+    channel->isSigned = sign == 's' || sign == 'S';
+    channel->realBits = realBits;
+    channel->storageBits = storageBits;
+    channel->shift = shift;
+    return true;
+}
+
+static bool probeChannel(const std::string& path, const std::string& name,
+                         IioSensors::Channel* channel) {
+    std::string scan = path + "/scan_elements/in_" + name;
+    std::string type;
+
+    if (!exists(scan + "_en") || !readFile(scan + "_type", &type) || !parseType(type, channel))
+        return false;
+    channel->name = name;
+    channel->index = static_cast<int>(readDouble(scan + "_index", -1));
+    return channel->index >= 0;
+}
+
+static int64_t valueOf(const IioSensors::Channel& channel, const uint8_t* scan) {
+    const uint8_t* p = scan + channel.offset;
+    unsigned int bytes = channel.storageBits / 8;
+    uint64_t raw = 0;
+
+    for (unsigned int i = 0; i < bytes; i++)
+        raw = (raw << 8) | p[channel.bigEndian ? i : bytes - 1 - i];
+    raw >>= channel.shift;
+    if (channel.realBits < 64)
+        raw &= (1ULL << channel.realBits) - 1;
+    if (channel.isSigned && channel.realBits < 64 && channel.realBits > 0) {
+        unsigned int unused = 64 - channel.realBits;
+        return static_cast<int64_t>(raw << unused) >> unused;
+    }
+    return static_cast<int64_t>(raw);
+}
+
+IioSensors::IioSensors(const std::string& sysfsRoot, const std::string& devRoot,
+                       EventCallback callback)
+    : mSysfsRoot(sysfsRoot), mDevRoot(devRoot), mCallback(callback) {
+}
+
+IioSensors::~IioSensors() {
+    std::lock_guard<std::mutex> lock(mLock);
+    for (auto& device : mDevices)
+        stop(device.get());
+}
+
+bool IioSensors::probeDevice(const std::string& entry, Device* device) {
+    std::string path = mSysfsRoot + "/" + entry;
+    std::string name;
+
+    // unbuffered devices could only be polled through sysfs, not worth waking up for
+    if (!readFile(path + "/name", &name) || !exists(path + "/scan_elements"))
+        return false;
+
+    for (const Kind& kind : kKinds) {
+        std::vector<Channel> channels;
+
+        for (int axis = 0; axis < kind.axes; axis++) {
+            Channel channel;
+            std::string channelName = std::string(kind.channel) + (kind.axes > 1 ? kAxes[axis] : "");
+
+            if (!probeChannel(path, channelName, &channel))
+                break;
+            // per channel scale and offset first, then the ones shared by the type
+            std::string prefix = path + "/in_" + kind.channel;
+            channel.scale = readDouble(path + "/in_" + channelName + "_scale",
+                                       readDouble(prefix + "_scale", 1.0));
+            channel.valueOffset = readDouble(path + "/in_" + channelName + "_offset",
+                                             readDouble(prefix + "_offset", 0.0));
+            channels.push_back(channel);
+        }
+        if (channels.size() != static_cast<size_t>(kind.axes))
+            continue;
+
+        device->path = path;
+        device->node = mDevRoot + "/" + entry;
+        device->kind = &kind;
+        device->channels = channels;
+        device->hasTimestamp = probeChannel(path, "timestamp", &device->timestamp);
+
+        // where the chip sits relative to the screen
+        std::string matrix;
+        if (readFile(path + "/in_" + kind.channel + "_mount_matrix", &matrix) ||
+                readFile(path + "/mount_matrix", &matrix)) {
+            double m[9];
+            if (sscanf(matrix.c_str(), "%lf, %lf, %lf; %lf, %lf, %lf; %lf, %lf, %lf",
+                       &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &m[6], &m[7], &m[8]) == 9)
+                std::copy(m, m + 9, device->mount);
+        }
+
+        device->frequencyPath = path + "/sampling_frequency";
+        if (!exists(device->frequencyPath))
+            device->frequencyPath = path + "/in_" + kind.channel + "_sampling_frequency";
+        std::string available;
+        if (readFile(device->frequencyPath + "_available", &available)) {
+            std::istringstream values(available);
+            double frequency;
+            while (values >> frequency) {
+                if (frequency > 0)
+                    device->frequencies.push_back(frequency);
+            }
+            std::sort(device->frequencies.begin(), device->frequencies.end());
+        }
+
+        // HID sensor hubs and most IMUs only fill the buffer from their own trigger
+        if (exists(path + "/trigger/current_trigger")) {
+            std::string wanted = name + "-dev" + entry.substr(strlen("iio:device"));
+            Dir dir(opendir(mSysfsRoot.c_str()));
+            struct dirent* d;
+
+            while (dir && (d = readdir(dir.get()))) {
+                std::string trigger;
+                if (strncmp(d->d_name, "trigger", strlen("trigger")) == 0 &&
+                        readFile(mSysfsRoot + "/" + d->d_name + "/name", &trigger) &&
+                        trigger == wanted)
+                    device->trigger = trigger;
+            }
+        }
+
+        ALOGI("%s: %s sensor, %zu channels%s%s", entry.c_str(), kind.label,
+              channels.size(), device->hasTimestamp ? ", timestamped" : "",
+              device->trigger.empty() ? "" : ", triggered");
+        return true;
+    }
+
+    return false;
+}
+
+std::vector<SensorInfo> IioSensors::probe(int32_t firstHandle) {
+    std::lock_guard<std::mutex> lock(mLock);
+    std::vector<SensorInfo> sensors;
+    std::vector<std::string> entries;
+    Dir dir(opendir(mSysfsRoot.c_str()));
+    struct dirent* d;
+
+    if (!dir) {
+        ALOGI("no IIO devices under %s", mSysfsRoot.c_str());
+        return sensors;
+    }
+    while ((d = readdir(dir.get()))) {
+        if (strncmp(d->d_name, "iio:device", strlen("iio:device")) == 0)
+            entries.push_back(d->d_name);
+    }
+    // stable handles across restarts as long as the host does not change
+    std::sort(entries.begin(), entries.end());
+
+    for (const std::string& entry : entries) {
+        std::unique_ptr<Device> device(new Device);
+
+        if (!probeDevice(entry, device.get()))
+            continue;
+        device->handle = firstHandle + static_cast<int32_t>(mDevices.size());
+
+        const Channel& channel = device->channels[0];
+        const Kind* kind = device->kind;
+        double resolution = channel.scale * kind->unit;
+        double maxRaw = std::ldexp(1.0, channel.realBits - (channel.isSigned ? 1 : 0));
+        double minFrequency = device->frequencies.empty() ? kDefaultMinFrequency
+                                                          : device->frequencies.front();
+        double maxFrequency = device->frequencies.empty() ? kDefaultMaxFrequency
+                                                          : device->frequencies.back();
+
+        SensorInfo info;
+        info.sensorHandle = device->handle;
+        info.name = std::string(kind->label) + " (" + entry + ")";
+        info.vendor = "Waydroid IIO";
+        info.version = 1;
+        info.type = kind->type;
+        info.typeAsString = kind->typeAsString;
+        info.maxRange = static_cast<float>(std::fabs(resolution) * maxRaw);
+        info.resolution = static_cast<float>(std::fabs(resolution));
+        info.power = 0.1f;
+        // microseconds, on-change sensors report a 0 minimum
+        info.minDelay = kind->reportingMode == SensorFlagBits::ON_CHANGE_MODE
+                                ? 0
+                                : static_cast<int32_t>(1000000 / maxFrequency);
+        info.maxDelay = static_cast<int32_t>(1000000 / minFrequency);
+        info.fifoReservedEventCount = kBufferLength;
+        info.fifoMaxEventCount = kBufferLength;
+        info.requiredPermission = "";
+        info.flags = static_cast<uint32_t>(kind->reportingMode);
+        sensors.push_back(info);
+
+        mDevices.push_back(std::move(device));
+    }
+
+    return sensors;
+}
+
+IioSensors::Device* IioSensors::findDevice(int32_t handle) {
+    for (auto& device : mDevices) {
+        if (device->handle == handle)
+            return device.get();
+    }
+    return nullptr;
+}
+
+bool IioSensors::start(Device* device) {
+    std::string scanElements = device->path + "/scan_elements";
+    std::vector<Channel*> scan;
+    std::string enabled;
+
+    // the chardev has a single reader: whoever holds it owns the scan setup
+    device->fd = open(device->node.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    device->wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (device->fd < 0 || device->wakeFd < 0) {
+        ALOGE("%s: cannot open: %s", device->node.c_str(), strerror(errno));
+        stop(device);
+        return false;
+    }
+    if (readFile(device->path + "/buffer/enable", &enabled) && enabled == "1") {
+        ALOGE("%s: buffer already in use on the host", device->path.c_str());
+        stop(device);
+        return false;
+    }
+
+    // only our channels go in the scan, in index order
+    Dir dir(opendir(scanElements.c_str()));
+    struct dirent* d;
+    while (dir && (d = readdir(dir.get()))) {
+        size_t len = strlen(d->d_name);
+        if (len > 3 && strcmp(d->d_name + len - 3, "_en") == 0)
+            set(scanElements + "/" + d->d_name, 0);
+    }
+    for (Channel& channel : device->channels)
+        scan.push_back(&channel);
+    if (device->hasTimestamp)
+        scan.push_back(&device->timestamp);
+    std::sort(scan.begin(), scan.end(),
+              [](const Channel* a, const Channel* b) { return a->index < b->index; });
+
+    // every element is aligned to its own size
+    device->scanSize = 0;
+    size_t align = 1;
+    for (Channel* channel : scan) {
+        size_t bytes = channel->storageBits / 8;
+        if (!set(scanElements + "/in_" + channel->name + "_en", 1)) {
+            ALOGE("%s: cannot enable %s", device->path.c_str(), channel->name.c_str());
+            stop(device);
+            return false;
+        }
+        device->scanSize = (device->scanSize + bytes - 1) / bytes * bytes;
+        channel->offset = device->scanSize;
+        device->scanSize += bytes;
+        align = std::max(align, bytes);
+    }
+    device->scanSize = (device->scanSize + align - 1) / align * align;
+
+    // Android timestamps are CLOCK_BOOTTIME
+    if (device->hasTimestamp && !set(device->path + "/current_timestamp_clock", "boottime"))
+        ALOGW("%s: cannot use boottime timestamps", device->path.c_str());
+    if (!device->trigger.empty())
+        set(device->path + "/trigger/current_trigger", device->trigger);
+
+    // the fastest listed frequency that is at least what was asked for
+    if (device->samplingPeriodNs > 0) {
+        double wanted = 1e9 / device->samplingPeriodNs;
+        double frequency = wanted;
+        if (!device->frequencies.empty()) {
+            auto it = std::lower_bound(device->frequencies.begin(), device->frequencies.end(),
+                                       wanted * 0.99);
+            frequency = it != device->frequencies.end() ? *it : device->frequencies.back();
+        }
+        set(device->frequencyPath, frequency);
+    }
+
+    // the kernel wakes the reader once a batch worth of scans is in
+    uint32_t watermark = 1;
+    if (device->samplingPeriodNs > 0 && device->maxReportLatencyNs > 0)
+        watermark = std::clamp<int64_t>(device->maxReportLatencyNs / device->samplingPeriodNs,
+                                        1, kBufferLength / 2);
+    set(device->path + "/buffer/length", kBufferLength);
+    set(device->path + "/buffer/watermark", watermark);
+
+    if (!set(device->path + "/buffer/enable", 1)) {
+        ALOGE("%s: cannot enable the buffer", device->path.c_str());
+        stop(device);
+        return false;
+    }
+    device->bufferEnabled = true;
+    device->haveLastValue = false;
+    device->reader = std::thread(&IioSensors::readerLoop, this, device);
+
+    ALOGV("%s: started, %zu byte scans, watermark %u", device->path.c_str(), device->scanSize,
+          watermark);
+    return true;
+}
+
+void IioSensors::stop(Device* device) {
+    if (device->reader.joinable()) {
+        uint64_t one = 1;
+        if (write(device->wakeFd, &one, sizeof(one)) != sizeof(one))
+            ALOGE("%s: cannot wake the reader", device->path.c_str());
+        device->reader.join();
+    }
+    if (device->fd >= 0) {
+        close(device->fd);
+        device->fd = -1;
+    }
+    if (device->wakeFd >= 0) {
+        close(device->wakeFd);
+        device->wakeFd = -1;
+    }
+    if (device->bufferEnabled) {
+        set(device->path + "/buffer/enable", 0);
+        device->bufferEnabled = false;
+    }
+}
+
+void IioSensors::readerLoop(Device* device) {
+    struct pollfd fds[2] = {
+        {device->fd, POLLIN, 0},
+        {device->wakeFd, POLLIN, 0},
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("%s: poll failed: %s", device->node.c_str(), strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            ALOGE("%s: device went away", device->node.c_str());
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+            drain(device);
+    }
+}
+
+void IioSensors::drain(Device* device) {
+    std::lock_guard<std::mutex> lock(device->lock);
+    std::vector<uint8_t> buffer(device->scanSize * kBufferLength);
+
+    for (;;) {
+        ssize_t n = read(device->fd, buffer.data(), buffer.size());
+        if (n <= 0)
+            break;
+
+        for (size_t offset = 0; offset + device->scanSize <= static_cast<size_t>(n);
+                offset += device->scanSize) {
+            Event event;
+            // posted under the lock so flush() cannot overtake older samples
+            if (parseScan(device, buffer.data() + offset, &event))
+                mCallback(event);
+        }
+        if (static_cast<size_t>(n) < buffer.size())
+            break;
+    }
+}
+
+bool IioSensors::parseScan(Device* device, const uint8_t* scan, Event* event) {
+    const Kind* kind = device->kind;
+    double values[3] = {0, 0, 0};
+
+    for (int i = 0; i < kind->axes; i++) {
+        const Channel& channel = device->channels[i];
+        values[i] = (valueOf(channel, scan) + channel.valueOffset) * channel.scale * kind->unit;
+    }
+
+    event->sensorHandle = device->handle;
+    event->sensorType = kind->type;
+    event->timestamp = device->hasTimestamp ? valueOf(device->timestamp, scan)
+                                            : elapsedRealtimeNano();
+
+    if (kind->axes == 3) {
+        const double* m = device->mount;
+        event->u.vec3.x = static_cast<float>(m[0] * values[0] + m[1] * values[1] + m[2] * values[2]);
+        event->u.vec3.y = static_cast<float>(m[3] * values[0] + m[4] * values[1] + m[5] * values[2]);
+        event->u.vec3.z = static_cast<float>(m[6] * values[0] + m[7] * values[1] + m[8] * values[2]);
+        event->u.vec3.status = SensorStatus::ACCURACY_HIGH;
+    } else {
+        float value = static_cast<float>(values[0]);
+        if (kind->reportingMode == SensorFlagBits::ON_CHANGE_MODE) {
+            if (device->haveLastValue && value == device->lastValue)
+                return false;
+            device->lastValue = value;
+            device->haveLastValue = true;
+        }
+        event->u.scalar = value;
+    }
+    return true;
+}
+
+bool IioSensors::activate(int32_t handle, bool enabled) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Device* device = findDevice(handle);
+
+    if (!device)
+        return false;
+    if (device->enabled == enabled)
+        return true;
+
+    if (enabled) {
+        if (!start(device))
+            return false;
+    } else {
+        stop(device);
+    }
+    device->enabled = enabled;
+    return true;
+}
+
+bool IioSensors::batch(int32_t handle, int64_t samplingPeriodNs, int64_t maxReportLatencyNs) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Device* device = findDevice(handle);
+
+    if (!device)
+        return false;
+    device->samplingPeriodNs = samplingPeriodNs;
+    device->maxReportLatencyNs = maxReportLatencyNs;
+
+    // frequency and watermark can only change with the buffer off
+    if (device->enabled) {
+        stop(device);
+        device->enabled = start(device);
+        return device->enabled;
+    }
+    return true;
+}
+
+void IioSensors::flush(int32_t handle) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Device* device = findDevice(handle);
+
+    if (device && device->enabled && device->fd >= 0)
+        drain(device);
+}
+
+}  // namespace implementation
+}  // namespace V1_0
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
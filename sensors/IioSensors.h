@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_HARDWARE_SENSORS_V1_0_IIOSENSORS_H_
+#define ANDROID_HARDWARE_SENSORS_V1_0_IIOSENSORS_H_
+
+#include <android/hardware/sensors/1.0/types.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V1_0 {
+namespace implementation {
+
+/*
+ * Host sensors exposed by the kernel IIO subsystem.
+ *
+ * Only buffered devices are used: samples come through the IIO character
+ * device with kernel timestamps, and the buffer watermark does the
+ * batching, so nothing wakes up between batches.  Each IIO device backs a
+ * single Android sensor.
+ */
+class IioSensors {
+  public:
+    struct Kind;
+    using EventCallback = std::function<void(const Event&)>;
+
+    // sysfsRoot holds the iio:deviceN directories, devRoot their nodes.
+    IioSensors(const std::string& sysfsRoot, const std::string& devRoot,
+               EventCallback callback);
+    ~IioSensors();
+
+    // Finds the supported host sensors, numbering them from firstHandle.
+    std::vector<SensorInfo> probe(int32_t firstHandle);
+
+    bool activate(int32_t handle, bool enabled);
+    bool batch(int32_t handle, int64_t samplingPeriodNs, int64_t maxReportLatencyNs);
+    // Delivers whatever the kernel buffer holds right now.
+    void flush(int32_t handle);
+
+    struct Channel {
+        std::string name;
+        int index = 0;
+        bool isSigned = false;
+        bool bigEndian = false;
+        unsigned int realBits = 0;
+        unsigned int storageBits = 0;
+        unsigned int shift = 0;
+        size_t offset = 0;
+        double scale = 1.0;
+        double valueOffset = 0.0;
+    };
+
+  private:
+    struct Device {
+        std::string path;
+        std::string node;
+        // the device's own trigger, for drivers that need one to fill the buffer
+        std::string trigger;
+        std::string frequencyPath;
+        // available sampling frequencies, ascending
+        std::vector<double> frequencies;
+        const Kind* kind = nullptr;
+        int32_t handle = 0;
+        std::vector<Channel> channels;
+        bool hasTimestamp = false;
+        Channel timestamp;
+        size_t scanSize = 0;
+        double mount[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+
+        int64_t samplingPeriodNs = 0;
+        int64_t maxReportLatencyNs = 0;
+        bool enabled = false;
+        float lastValue = 0;
+        bool haveLastValue = false;
+
+        // serializes draining the buffer between the reader and flush()
+        std::mutex lock;
+        int fd = -1;
+        int wakeFd = -1;
+        std::thread reader;
+        // whether the buffer is on because of us, the host may be using it too
+        bool bufferEnabled = false;
+    };
+
+    bool probeDevice(const std::string& entry, Device* device);
+    bool start(Device* device);
+    void stop(Device* device);
+    void readerLoop(Device* device);
+    void drain(Device* device);
+    bool parseScan(Device* device, const uint8_t* scan, Event* event);
+    Device* findDevice(int32_t handle);
+
+    const std::string mSysfsRoot;
+    const std::string mDevRoot;
+    const EventCallback mCallback;
+
+    // held across configuration changes of any device
+    std::mutex mLock;
+    std::vector<std::unique_ptr<Device>> mDevices;
+};
+
+}  // namespace implementation
+}  // namespace V1_0
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_SENSORS_V1_0_IIOSENSORS_H_
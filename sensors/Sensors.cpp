@@ -20,18 +20,372 @@
 
 #include "Sensors.h"
 
+#include <cutils/properties.h>
+#include <hardware_legacy/power.h>
+
+#include <algorithm>
+#include <vector>
+
 namespace android {
 namespace hardware {
 namespace sensors {
-namespace V1_0 {
+namespace V2_1 {
 namespace implementation {
 
+using ::android::hardware::sensors::V1_0::MetaDataEventType;
+using ::android::hardware::sensors::V1_0::SensorFlagBits;
+using ::android::hardware::sensors::V1_0::SensorFlagShift;
+using ::android::hardware::sensors::V2_0::EventQueueFlagBits;
+using ::android::hardware::sensors::V2_0::WakeLockQueueFlagBits;
+
+// Events that do not fit in the Event FMQ beyond this are dropped, oldest
+// first, so a stalled sensor service cannot make us grow without bounds.
+static constexpr size_t kMaxPendingEvents = 4096;
+// how long a full Event FMQ is waited on before looking at batches again
+static constexpr int64_t kQueueFullWaitNs = 100000000;
+// held while the framework has wake-up events it did not acknowledge, at most this long
+static constexpr const char* kWakeLockName = "SensorsHAL_WAKEUP";
+static constexpr std::chrono::seconds kWakeLockTimeout(1);
+
+static V2_1::SensorInfo convertToNewSensorInfo(const V1_0::SensorInfo& info) {
+    V2_1::SensorInfo out;
+
+    out.sensorHandle = info.sensorHandle;
+    out.name = info.name;
+    out.vendor = info.vendor;
+    out.version = info.version;
+    out.type = static_cast<V2_1::SensorType>(info.type);
+    out.typeAsString = info.typeAsString;
+    out.maxRange = info.maxRange;
+    out.resolution = info.resolution;
+    out.power = info.power;
+    out.minDelay = info.minDelay;
+    out.fifoReservedEventCount = info.fifoReservedEventCount;
+    out.fifoMaxEventCount = info.fifoMaxEventCount;
+    out.requiredPermission = info.requiredPermission;
+    out.maxDelay = info.maxDelay;
+    out.flags = info.flags;
+    return out;
+}
+
+static V2_1::Event convertToNewEvent(const V1_0::Event& event) {
+    V2_1::Event out;
+
+    out.timestamp = event.timestamp;
+    out.sensorHandle = event.sensorHandle;
+    out.sensorType = static_cast<V2_1::SensorType>(event.sensorType);
+    out.u = event.u;
+    return out;
+}
+
+// Nominal direct report periods, from the RateLevel documentation.
+static int64_t directPeriodNs(RateLevel rate) {
+    switch (rate) {
+        case RateLevel::NORMAL:
+            return 20000000;
+        case RateLevel::FAST:
+            return 5000000;
+        case RateLevel::VERY_FAST:
+            return 1250000;
+        default:
+            return 0;
+    }
+}
+
+// The fastest rate level a continuous sensor keeps up with.
+static RateLevel maxDirectRate(const V1_0::SensorInfo& info) {
+    RateLevel best = RateLevel::STOP;
+
+    if (info.minDelay <= 0)
+        return best;
+    for (RateLevel rate : {RateLevel::NORMAL, RateLevel::FAST, RateLevel::VERY_FAST}) {
+        if (static_cast<int64_t>(info.minDelay) * 1000 <= directPeriodNs(rate))
+            best = rate;
+    }
+    return best;
+}
+
+// At most one event per period gets through, with some slack for jitter.
+static bool isDue(int64_t lastEventNs, int64_t periodNs, int64_t timestamp) {
+    return !lastEventNs || !periodNs || timestamp - lastEventNs >= periodNs - periodNs / 8;
+}
+
 Sensors::Sensors() {
+    char sysfsRoot[PROPERTY_VALUE_MAX];
+    char devRoot[PROPERTY_VALUE_MAX];
+
+    // overridable to run against a fake sysfs tree and character devices
+    property_get("waydroid.sensors.iio_sysfs", sysfsRoot, "/sys/bus/iio/devices");
+    property_get("waydroid.sensors.iio_dev", devRoot, "/dev");
+
+    mIio.reset(new IioSensors(sysfsRoot, devRoot,
+                              [this](const V1_0::Event& event) { postEvent(event); }));
+    for (const V1_0::SensorInfo& info : mIio->probe(1))
+        addSensor(info, true);
+}
+
+Sensors::~Sensors() {
+    std::lock_guard<std::mutex> config(mConfigLock);
+    reset();
+}
+
+bool Sensors::hasSensors() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return !mSensors.empty();
+}
+
+void Sensors::addSensor(const V1_0::SensorInfo& info, bool hardwareFifo) {
+    std::lock_guard<std::mutex> lock(mLock);
+    SensorState state;
+
+    state.info = info;
+    state.hardwareFifo = hardwareFifo;
+
+    // direct reports are written from the driver's events, which only
+    // continuous sensors deliver at a steady rate
+    RateLevel directRate = maxDirectRate(info);
+    if ((info.flags & static_cast<uint32_t>(SensorFlagBits::MASK_REPORTING_MODE)) ==
+                static_cast<uint32_t>(SensorFlagBits::CONTINUOUS_MODE) &&
+            directRate != RateLevel::STOP) {
+        state.info.flags |= static_cast<uint32_t>(directRate)
+                                    << static_cast<uint8_t>(SensorFlagShift::DIRECT_REPORT);
+        state.info.flags |= static_cast<uint32_t>(SensorFlagBits::DIRECT_CHANNEL_ASHMEM) |
+                            static_cast<uint32_t>(SensorFlagBits::DIRECT_CHANNEL_GRALLOC);
+    }
+    mSensors.emplace(info.sensorHandle, std::move(state));
+}
+
+void Sensors::queueEventLocked(const V1_0::Event& event) {
+    if (mEvents.size() >= kMaxPendingEvents) {
+        ALOGV("event queue full, dropping the oldest event");
+        mEvents.pop_front();
+    }
+    mEvents.push_back(event);
+}
+
+void Sensors::flushFifoLocked(SensorState& sensor) {
+    for (const V1_0::Event& event : sensor.fifo)
+        queueEventLocked(event);
+    sensor.fifo.clear();
+}
+
+bool Sensors::nextDeadlineLocked(Clock::time_point* deadline) {
+    bool found = false;
+
+    for (auto& entry : mSensors) {
+        const SensorState& sensor = entry.second;
+
+        if (sensor.fifo.empty())
+            continue;
+        if (!found || sensor.fifoDeadline < *deadline)
+            *deadline = sensor.fifoDeadline;
+        found = true;
+    }
+    return found;
+}
+
+void Sensors::expireFifosLocked() {
+    Clock::time_point now = Clock::now();
+
+    for (auto& entry : mSensors) {
+        SensorState& sensor = entry.second;
+
+        if (!sensor.fifo.empty() && sensor.fifoDeadline <= now)
+            flushFifoLocked(sensor);
+    }
+}
+
+void Sensors::writeDirectLocked(SensorState& sensor, const V1_0::Event& event) {
+    for (auto& entry : sensor.directReports) {
+        DirectReport& report = entry.second;
+        auto channel = mDirectChannels.find(entry.first);
+
+        if (channel == mDirectChannels.end() ||
+                !isDue(report.lastEventNs, report.periodNs, event.timestamp))
+            continue;
+        report.lastEventNs = event.timestamp;
+        // the report token is the sensor handle
+        channel->second->write(event, event.sensorHandle);
+    }
+}
+
+void Sensors::postEvent(const V1_0::Event& event) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mSensors.find(event.sensorHandle);
+
+    if (it == mSensors.end())
+        return;
+    SensorState& sensor = it->second;
+
+    // direct reports go out right away, whatever the framework is doing
+    writeDirectLocked(sensor, event);
+    if (!sensor.enabled)
+        return;
+
+    if (!isDue(sensor.lastEventNs, sensor.samplingPeriodNs, event.timestamp))
+        return;
+    sensor.lastEventNs = event.timestamp;
+
+    if (sensor.maxReportLatencyNs > 0 && !sensor.hardwareFifo) {
+        bool wasEmpty = sensor.fifo.empty();
+
+        if (wasEmpty)
+            sensor.fifoDeadline = Clock::now() + std::chrono::nanoseconds(sensor.maxReportLatencyNs);
+        sensor.fifo.push_back(event);
+        if (sensor.fifo.size() < sensor.info.fifoMaxEventCount) {
+            // the writer thread has a new deadline to wait for
+            if (wasEmpty)
+                mEventsAvailable.notify_one();
+            return;
+        }
+        flushFifoLocked(sensor);
+    } else {
+        queueEventLocked(event);
+    }
+    writeEventsLocked();
+}
+
+bool Sensors::isWakeUpLocked(int32_t handle) {
+    auto it = mSensors.find(handle);
+
+    return it != mSensors.end() &&
+           (it->second.info.flags & static_cast<uint32_t>(SensorFlagBits::WAKE_UP));
+}
+
+void Sensors::writeEventsLocked() {
+    if (mEvents.empty() || !mEventQueueFlag)
+        return;
+
+    size_t count = std::min(mEvents.size(), mEventQueue ? mEventQueue->availableToWrite()
+                                                        : mEventQueue_2_1->availableToWrite());
+    if (count > 0) {
+        auto end = mEvents.begin() + count;
+        uint32_t wakeUpEvents = 0;
+        bool written;
+
+        if (mEventQueue) {
+            mWriteBuffer.assign(mEvents.begin(), end);
+            written = mEventQueue->write(mWriteBuffer.data(), count);
+        } else {
+            mWriteBuffer_2_1.clear();
+            for (auto it = mEvents.begin(); it != end; ++it)
+                mWriteBuffer_2_1.push_back(convertToNewEvent(*it));
+            written = mEventQueue_2_1->write(mWriteBuffer_2_1.data(), count);
+        }
+        if (!written) {
+            ALOGE("cannot write %zu events to the event queue", count);
+            return;
+        }
+
+        for (auto it = mEvents.begin(); it != end; ++it) {
+            if (isWakeUpLocked(it->sensorHandle))
+                wakeUpEvents++;
+        }
+        mEvents.erase(mEvents.begin(), end);
+        mEventQueueFlag->wake(static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS));
+
+        // the device stays awake until the framework says it handled them
+        if (wakeUpEvents) {
+            mOutstandingWakeUpEvents += wakeUpEvents;
+            mWakeLockDeadline = Clock::now() + kWakeLockTimeout;
+            if (!mHasWakeLock) {
+                acquire_wake_lock(PARTIAL_WAKE_LOCK, kWakeLockName);
+                mHasWakeLock = true;
+                // its thread now has a timeout to keep
+                mWakeLockQueueFlag->wake(static_cast<uint32_t>(WakeLockQueueFlagBits::DATA_WRITTEN));
+            }
+        }
+    }
+
+    // the writer thread waits for the framework to make room
+    if (!mEvents.empty())
+        mEventsAvailable.notify_one();
+}
+
+void Sensors::writerLoop() {
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (mRunning) {
+        Clock::time_point deadline;
+
+        expireFifosLocked();
+        writeEventsLocked();
+        if (!mEvents.empty()) {
+            uint32_t state;
+
+            lock.unlock();
+            mEventQueueFlag->wait(static_cast<uint32_t>(EventQueueFlagBits::EVENTS_READ), &state,
+                                  kQueueFullWaitNs);
+            lock.lock();
+        } else if (nextDeadlineLocked(&deadline)) {
+            mEventsAvailable.wait_until(lock, deadline);
+        } else {
+            mEventsAvailable.wait(lock);
+        }
+    }
+}
+
+void Sensors::wakeLockLoop() {
+    while (mRunning) {
+        int64_t timeoutNs = 0;
+        uint32_t state;
+        uint32_t handled = 0;
+        uint32_t count;
+
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            if (mHasWakeLock)
+                timeoutNs = std::max<int64_t>(
+                        1, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   mWakeLockDeadline - Clock::now())
+                                   .count());
+        }
+
+        // no timeout while nothing is outstanding, new wake-up events wake us
+        mWakeLockQueueFlag->wait(static_cast<uint32_t>(WakeLockQueueFlagBits::DATA_WRITTEN),
+                                 &state, timeoutNs);
+        while (mWakeLockQueue->read(&count, 1))
+            handled += count;
+
+        std::lock_guard<std::mutex> lock(mLock);
+        mOutstandingWakeUpEvents -= std::min(handled, mOutstandingWakeUpEvents);
+        if (!mHasWakeLock)
+            continue;
+        if (mOutstandingWakeUpEvents && Clock::now() >= mWakeLockDeadline) {
+            ALOGW("%u wake-up events not acknowledged in time", mOutstandingWakeUpEvents);
+            mOutstandingWakeUpEvents = 0;
+        }
+        if (!mOutstandingWakeUpEvents) {
+            release_wake_lock(kWakeLockName);
+            mHasWakeLock = false;
+        }
+    }
 }
 
 Return<void> Sensors::getSensorsList(getSensorsList_cb _hidl_cb) {
-    hidl_vec<SensorInfo> out;
+    std::vector<V1_0::SensorInfo> sensors;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        for (const auto& entry : mSensors)
+            sensors.push_back(entry.second.info);
+    }
 
+    hidl_vec<V1_0::SensorInfo> out(sensors);
+    _hidl_cb(out);
+    return Void();
+}
+
+Return<void> Sensors::getSensorsList_2_1(getSensorsList_2_1_cb _hidl_cb) {
+    std::vector<V2_1::SensorInfo> sensors;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        for (const auto& entry : mSensors)
+            sensors.push_back(convertToNewSensorInfo(entry.second.info));
+    }
+
+    hidl_vec<V2_1::SensorInfo> out(sensors);
     _hidl_cb(out);
     return Void();
 }
@@ -40,53 +394,386 @@ Return<Result> Sensors::setOperationMode(OperationMode) {
     return Result::INVALID_OPERATION;
 }
 
+bool Sensors::updateDriver(int32_t handle) {
+    bool enabled;
+    int64_t periodNs;
+    int64_t latencyNs;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        SensorState& sensor = mSensors[handle];
+
+        // the fastest rate anyone asked for, direct reports cannot wait for a batch
+        enabled = sensor.enabled || !sensor.directReports.empty();
+        periodNs = sensor.enabled ? sensor.samplingPeriodNs : 0;
+        latencyNs = sensor.enabled ? sensor.maxReportLatencyNs : 0;
+        for (const auto& entry : sensor.directReports) {
+            if (!periodNs || entry.second.periodNs < periodNs)
+                periodNs = entry.second.periodNs;
+            latencyNs = 0;
+        }
+
+        if (enabled == sensor.driverEnabled &&
+                (!enabled || (periodNs == sensor.driverPeriodNs &&
+                              latencyNs == sensor.driverLatencyNs)))
+            return true;
+    }
+
+    bool ok;
+    if (enabled)
+        ok = mIio->batch(handle, periodNs, latencyNs) && mIio->activate(handle, true);
+    else
+        ok = mIio->activate(handle, false);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    SensorState& sensor = mSensors[handle];
+    sensor.driverEnabled = ok ? enabled : false;
+    sensor.driverPeriodNs = periodNs;
+    sensor.driverLatencyNs = latencyNs;
+    return ok;
+}
+
 Return<Result> Sensors::activate(
-        int32_t, bool) {
+        int32_t handle, bool enabled) {
+    std::lock_guard<std::mutex> config(mConfigLock);
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mSensors.find(handle);
+
+        if (it == mSensors.end())
+            return Result::BAD_VALUE;
+        SensorState& sensor = it->second;
+
+        sensor.enabled = enabled;
+        if (!enabled) {
+            // nobody is waiting for what is still batched
+            sensor.fifo.clear();
+            sensor.lastEventNs = 0;
+        }
+    }
+
+    if (!updateDriver(handle)) {
+        if (enabled) {
+            std::lock_guard<std::mutex> lock(mLock);
+            mSensors[handle].enabled = false;
+        }
+        return Result::INVALID_OPERATION;
+    }
     return Result::OK;
 }
 
-Return<void> Sensors::poll(int32_t, poll_cb _hidl_cb) {
-    hidl_vec<Event> out;
-    hidl_vec<SensorInfo> dynamicSensorsAdded;
+void Sensors::reset() {
+    std::vector<int32_t> handles;
 
-    _hidl_cb(Result::OK, out, dynamicSensorsAdded);
-    return Void();
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        for (auto& entry : mSensors) {
+            SensorState& sensor = entry.second;
+
+            sensor.enabled = false;
+            sensor.fifo.clear();
+            sensor.lastEventNs = 0;
+            sensor.directReports.clear();
+            handles.push_back(entry.first);
+        }
+        mDirectChannels.clear();
+    }
+    for (int32_t handle : handles)
+        updateDriver(handle);
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mRunning = false;
+        mEventsAvailable.notify_all();
+        if (mEventQueueFlag)
+            mEventQueueFlag->wake(static_cast<uint32_t>(EventQueueFlagBits::EVENTS_READ));
+        if (mWakeLockQueueFlag)
+            mWakeLockQueueFlag->wake(static_cast<uint32_t>(WakeLockQueueFlagBits::DATA_WRITTEN));
+    }
+    if (mWriterThread.joinable())
+        mWriterThread.join();
+    if (mWakeLockThread.joinable())
+        mWakeLockThread.join();
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mEvents.clear();
+    if (mEventQueueFlag)
+        EventFlag::deleteEventFlag(&mEventQueueFlag);
+    if (mWakeLockQueueFlag)
+        EventFlag::deleteEventFlag(&mWakeLockQueueFlag);
+    mEventQueue.reset();
+    mEventQueue_2_1.reset();
+    mWakeLockQueue.reset();
+    mCallback = nullptr;
+    if (mHasWakeLock) {
+        release_wake_lock(kWakeLockName);
+        mHasWakeLock = false;
+    }
+    mOutstandingWakeUpEvents = 0;
 }
 
-Return<Result> Sensors::batch(int32_t, int64_t, int64_t) {
+Result Sensors::start(std::unique_ptr<EventQueue> eventQueue,
+                      std::unique_ptr<EventQueue_2_1> eventQueue_2_1,
+                      const MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+                      const sp<V2_0::ISensorsCallback>& callback) {
+    std::unique_ptr<WakeLockQueue> wakeLockQueue(new WakeLockQueue(wakeLockDescriptor, true));
+    std::atomic<uint32_t>* flagWord =
+            eventQueue ? eventQueue->getEventFlagWord() : eventQueue_2_1->getEventFlagWord();
+    EventFlag* eventQueueFlag = nullptr;
+    EventFlag* wakeLockQueueFlag = nullptr;
+
+    if (!wakeLockQueue->isValid() ||
+            EventFlag::createEventFlag(flagWord, &eventQueueFlag) != OK ||
+            EventFlag::createEventFlag(wakeLockQueue->getEventFlagWord(), &wakeLockQueueFlag) != OK) {
+        ALOGE("cannot set up the event and wake lock queues");
+        if (eventQueueFlag)
+            EventFlag::deleteEventFlag(&eventQueueFlag);
+        return Result::BAD_VALUE;
+    }
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mEventQueue = std::move(eventQueue);
+    mEventQueue_2_1 = std::move(eventQueue_2_1);
+    mEventQueueFlag = eventQueueFlag;
+    mWakeLockQueue = std::move(wakeLockQueue);
+    mWakeLockQueueFlag = wakeLockQueueFlag;
+    mCallback = callback;
+
+    mRunning = true;
+    mWriterThread = std::thread(&Sensors::writerLoop, this);
+    mWakeLockThread = std::thread(&Sensors::wakeLockLoop, this);
     return Result::OK;
 }
 
-Return<Result> Sensors::flush(int32_t) {
+/*
+ * Called again whenever the framework restarts: nothing it asked for
+ * before stands, and the queues are new.
+ */
+Return<Result> Sensors::initialize(
+        const MQDescriptorSync<V1_0::Event>& eventQueueDescriptor,
+        const MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+        const sp<V2_0::ISensorsCallback>& sensorsCallback) {
+    std::lock_guard<std::mutex> config(mConfigLock);
+    std::unique_ptr<EventQueue> eventQueue(new EventQueue(eventQueueDescriptor, true));
+
+    reset();
+    if (sensorsCallback == nullptr || !eventQueue->isValid())
+        return Result::BAD_VALUE;
+    return start(std::move(eventQueue), nullptr, wakeLockDescriptor, sensorsCallback);
+}
+
+Return<Result> Sensors::initialize_2_1(
+        const MQDescriptorSync<V2_1::Event>& eventQueueDescriptor,
+        const MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+        const sp<V2_1::ISensorsCallback>& sensorsCallback) {
+    std::lock_guard<std::mutex> config(mConfigLock);
+    std::unique_ptr<EventQueue_2_1> eventQueue(new EventQueue_2_1(eventQueueDescriptor, true));
+
+    reset();
+    if (sensorsCallback == nullptr || !eventQueue->isValid())
+        return Result::BAD_VALUE;
+    return start(nullptr, std::move(eventQueue), wakeLockDescriptor, sensorsCallback);
+}
+
+Return<Result> Sensors::batch(
+        int32_t sensor_handle,
+        int64_t sampling_period_ns,
+        int64_t max_report_latency_ns) {
+    std::lock_guard<std::mutex> config(mConfigLock);
+    std::unique_lock<std::mutex> lock(mLock);
+    auto it = mSensors.find(sensor_handle);
+
+    if (it == mSensors.end() || sampling_period_ns < 0 || max_report_latency_ns < 0)
+        return Result::BAD_VALUE;
+    SensorState& sensor = it->second;
+
+    // minDelay and maxDelay are in microseconds, 0 means no limit
+    if (sensor.info.minDelay > 0)
+        sampling_period_ns = std::max(sampling_period_ns,
+                                      static_cast<int64_t>(sensor.info.minDelay) * 1000);
+    if (sensor.info.maxDelay > 0)
+        sampling_period_ns = std::min(sampling_period_ns,
+                                      static_cast<int64_t>(sensor.info.maxDelay) * 1000);
+    // no FIFO, no batching
+    if (sensor.info.fifoMaxEventCount == 0)
+        max_report_latency_ns = 0;
+
+    sensor.samplingPeriodNs = sampling_period_ns;
+    sensor.maxReportLatencyNs = max_report_latency_ns;
+
+    if (!sensor.fifo.empty()) {
+        Clock::time_point deadline =
+                Clock::now() + std::chrono::nanoseconds(max_report_latency_ns);
+
+        // a shorter latency applies to what is already batched
+        if (max_report_latency_ns == 0) {
+            flushFifoLocked(sensor);
+            writeEventsLocked();
+        } else if (deadline < sensor.fifoDeadline) {
+            sensor.fifoDeadline = deadline;
+            mEventsAvailable.notify_one();
+        }
+    }
+    lock.unlock();
+
+    if (!updateDriver(sensor_handle))
+        return Result::INVALID_OPERATION;
     return Result::OK;
 }
 
-Return<Result> Sensors::injectSensorData(const Event&) {
+Return<Result> Sensors::flush(int32_t handle) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mSensors.find(handle);
+
+        if (it == mSensors.end() || !it->second.enabled)
+            return Result::BAD_VALUE;
+        // one-shot sensors have nothing to flush, the spec wants them refused
+        if ((it->second.info.flags &
+                    static_cast<uint32_t>(SensorFlagBits::MASK_REPORTING_MODE)) ==
+                static_cast<uint32_t>(SensorFlagBits::ONE_SHOT_MODE))
+            return Result::BAD_VALUE;
+    }
+
+    // what the kernel holds goes out first, through postEvent()
+    mIio->flush(handle);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    SensorState& sensor = mSensors[handle];
+
+    flushFifoLocked(sensor);
+
+    V1_0::Event complete;
+    complete.sensorHandle = handle;
+    complete.sensorType = V1_0::SensorType::META_DATA;
+    complete.timestamp = 0;
+    complete.u.meta.what = MetaDataEventType::META_DATA_FLUSH_COMPLETE;
+    queueEventLocked(complete);
+    writeEventsLocked();
+    return Result::OK;
+}
+
+Return<Result> Sensors::injectSensorData(const V1_0::Event&) {
     // HAL does not support
     return Result::INVALID_OPERATION;
 }
 
-Return<void> Sensors::registerDirectChannel(
-        const SharedMemInfo&, registerDirectChannel_cb _hidl_cb) {
+Return<Result> Sensors::injectSensorData_2_1(const V2_1::Event&) {
     // HAL does not support
-    _hidl_cb(Result::INVALID_OPERATION, -1);
+    return Result::INVALID_OPERATION;
+}
+
+Return<void> Sensors::registerDirectChannel(
+        const SharedMemInfo& mem, registerDirectChannel_cb _hidl_cb) {
+    std::unique_ptr<DirectChannel> channel = DirectChannel::create(mem);
+
+    if (!channel) {
+        _hidl_cb(Result::BAD_VALUE, -1);
+        return Void();
+    }
+
+    int32_t channelHandle;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        channelHandle = mNextChannelHandle++;
+        mDirectChannels.emplace(channelHandle, std::move(channel));
+    }
+
+    _hidl_cb(Result::OK, channelHandle);
     return Void();
 }
 
-Return<Result> Sensors::unregisterDirectChannel(int32_t) {
-    // HAL does not support
-    return Result::INVALID_OPERATION;
+Return<Result> Sensors::unregisterDirectChannel(int32_t channelHandle) {
+    std::lock_guard<std::mutex> config(mConfigLock);
+    std::vector<int32_t> stopped;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mDirectChannels.find(channelHandle) == mDirectChannels.end())
+            return Result::BAD_VALUE;
+
+        for (auto& entry : mSensors) {
+            if (entry.second.directReports.erase(channelHandle))
+                stopped.push_back(entry.first);
+        }
+        // nothing writes to it any more once it is gone from the map
+        mDirectChannels.erase(channelHandle);
+    }
+
+    for (int32_t handle : stopped)
+        updateDriver(handle);
+    return Result::OK;
 }
 
 Return<void> Sensors::configDirectReport(
-        int32_t, int32_t, RateLevel, configDirectReport_cb _hidl_cb) {
-    // HAL does not support
-    _hidl_cb(Result::INVALID_OPERATION, -1);
+        int32_t sensorHandle, int32_t channelHandle, RateLevel rate,
+        configDirectReport_cb _hidl_cb) {
+    std::lock_guard<std::mutex> config(mConfigLock);
+    std::vector<int32_t> changed;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        if (mDirectChannels.find(channelHandle) == mDirectChannels.end()) {
+            _hidl_cb(Result::BAD_VALUE, -1);
+            return Void();
+        }
+
+        if (sensorHandle == -1) {
+            // -1 stops every sensor on the channel, and nothing else
+            if (rate != RateLevel::STOP) {
+                _hidl_cb(Result::BAD_VALUE, -1);
+                return Void();
+            }
+            for (auto& entry : mSensors) {
+                if (entry.second.directReports.erase(channelHandle))
+                    changed.push_back(entry.first);
+            }
+        } else {
+            auto it = mSensors.find(sensorHandle);
+
+            if (it == mSensors.end()) {
+                _hidl_cb(Result::BAD_VALUE, -1);
+                return Void();
+            }
+            SensorState& sensor = it->second;
+            uint32_t maxRate = (sensor.info.flags &
+                                static_cast<uint32_t>(SensorFlagBits::MASK_DIRECT_REPORT)) >>
+                               static_cast<uint8_t>(SensorFlagShift::DIRECT_REPORT);
+
+            if (rate == RateLevel::STOP) {
+                sensor.directReports.erase(channelHandle);
+            } else if (static_cast<uint32_t>(rate) > maxRate) {
+                _hidl_cb(Result::BAD_VALUE, -1);
+                return Void();
+            } else {
+                DirectReport& report = sensor.directReports[channelHandle];
+                report.periodNs = directPeriodNs(rate);
+                report.lastEventNs = 0;
+            }
+            changed.push_back(sensorHandle);
+        }
+    }
+
+    bool ok = true;
+    for (int32_t handle : changed)
+        ok = updateDriver(handle) && ok;
+
+    if (!ok && rate != RateLevel::STOP) {
+        std::lock_guard<std::mutex> lock(mLock);
+        mSensors[sensorHandle].directReports.erase(channelHandle);
+        _hidl_cb(Result::INVALID_OPERATION, -1);
+        return Void();
+    }
+
+    // the token is what the events carry in place of the sensor handle
+    _hidl_cb(Result::OK, rate == RateLevel::STOP ? 0 : sensorHandle);
     return Void();
 }
 
 }  // namespace implementation
-}  // namespace V1_0
+}  // namespace V2_1
 }  // namespace sensors
 }  // namespace hardware
 }  // namespace android
@@ -14,32 +14,78 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-#ifndef ANDROID_HARDWARE_SENSORS_V1_0_SENSORS_H_
-#define ANDROID_HARDWARE_SENSORS_V1_0_SENSORS_H_
+#ifndef ANDROID_HARDWARE_SENSORS_V2_1_SENSORS_H_
+#define ANDROID_HARDWARE_SENSORS_V2_1_SENSORS_H_
 
-#define LOG_TAG "android.hardware.sensors@1.0-service.waydroid"
+#define LOG_TAG "android.hardware.sensors@2.1-service.waydroid"
 //#define LOG_NDEBUG 0
 
-#include <android/hardware/sensors/1.0/ISensors.h>
+#include <android/hardware/sensors/2.1/ISensors.h>
+#include <fmq/MessageQueue.h>
 #include <log/log.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "DirectChannel.h"
+#include "IioSensors.h"
+
 namespace android {
 namespace hardware {
 namespace sensors {
-namespace V1_0 {
+namespace V2_1 {
 namespace implementation {
 
-struct Sensors : public ::android::hardware::sensors::V1_0::ISensors {
+using ::android::hardware::EventFlag;
+using ::android::hardware::kSynchronizedReadWrite;
+using ::android::hardware::MessageQueue;
+using ::android::hardware::MQDescriptorSync;
+using ::android::hardware::sensors::V1_0::OperationMode;
+using ::android::hardware::sensors::V1_0::RateLevel;
+using ::android::hardware::sensors::V1_0::Result;
+using ::android::hardware::sensors::V1_0::SharedMemInfo;
+using ::android::hardware::sensors::V1_0::implementation::DirectChannel;
+using ::android::hardware::sensors::V1_0::implementation::IioSensors;
+
+/*
+ * Events go to the framework through the Event FMQ, written by whichever
+ * thread has them: the IIO readers for what is not batched, a writer thread
+ * for expired batches and for what did not fit while the queue was full.
+ * Internally events and sensors are the 1.0 types, which the 2.1 ones only
+ * extend with new sensor types.
+ */
+struct Sensors : public ::android::hardware::sensors::V2_1::ISensors {
     Sensors();
+    ~Sensors();
+
+    // False when the host has nothing we can expose.
+    bool hasSensors();
 
     Return<void> getSensorsList(getSensorsList_cb _hidl_cb) override;
 
+    Return<void> getSensorsList_2_1(getSensorsList_2_1_cb _hidl_cb) override;
+
     Return<Result> setOperationMode(OperationMode mode) override;
 
     Return<Result> activate(
             int32_t handle, bool enabled) override;
 
-    Return<void> poll(int32_t maxCount, poll_cb _hidl_cb) override;
+    Return<Result> initialize(
+            const MQDescriptorSync<V1_0::Event>& eventQueueDescriptor,
+            const MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+            const sp<V2_0::ISensorsCallback>& sensorsCallback) override;
+
+    Return<Result> initialize_2_1(
+            const MQDescriptorSync<V2_1::Event>& eventQueueDescriptor,
+            const MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+            const sp<V2_1::ISensorsCallback>& sensorsCallback) override;
 
     Return<Result> batch(
             int32_t sensor_handle,
@@ -48,7 +94,9 @@ struct Sensors : public ::android::hardware::sensors::V1_0::ISensors {
 
     Return<Result> flush(int32_t handle) override;
 
-    Return<Result> injectSensorData(const Event& event) override;
+    Return<Result> injectSensorData(const V1_0::Event& event) override;
+
+    Return<Result> injectSensorData_2_1(const V2_1::Event& event) override;
 
     Return<void> registerDirectChannel(
             const SharedMemInfo& mem, registerDirectChannel_cb _hidl_cb) override;
@@ -58,12 +106,103 @@ struct Sensors : public ::android::hardware::sensors::V1_0::ISensors {
     Return<void> configDirectReport(
             int32_t sensorHandle, int32_t channelHandle, RateLevel rate,
             configDirectReport_cb _hidl_cb) override;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+    using EventQueue = MessageQueue<V1_0::Event, kSynchronizedReadWrite>;
+    using EventQueue_2_1 = MessageQueue<V2_1::Event, kSynchronizedReadWrite>;
+    using WakeLockQueue = MessageQueue<uint32_t, kSynchronizedReadWrite>;
+
+    struct DirectReport {
+        int64_t periodNs = 0;
+        int64_t lastEventNs = 0;
+    };
+
+    struct SensorState {
+        V1_0::SensorInfo info;
+        // the driver batches in hardware, events come already grouped
+        bool hardwareFifo = false;
+        bool enabled = false;
+        int64_t samplingPeriodNs = 0;
+        int64_t maxReportLatencyNs = 0;
+        // timestamp of the last event let through, for the sampling period
+        int64_t lastEventNs = 0;
+        // events held back until the report latency expires or it fills up
+        std::deque<V1_0::Event> fifo;
+        Clock::time_point fifoDeadline;
+        // direct channel reports, by channel handle, independent of enabled
+        std::map<int32_t, DirectReport> directReports;
+        // what the driver was last set up with, for the FMQ and the reports together
+        bool driverEnabled = false;
+        int64_t driverPeriodNs = 0;
+        int64_t driverLatencyNs = 0;
+    };
+
+    // Registers a sensor, its handle must be unique.
+    void addSensor(const V1_0::SensorInfo& info, bool hardwareFifo);
+    // Queues an event from a sensor, honouring its rate and batching.
+    void postEvent(const V1_0::Event& event);
+    // Sets the driver up for whoever wants the sensor, with mConfigLock held.
+    bool updateDriver(int32_t handle);
+
+    // Both initialize() flavours, once the queues are set up.
+    Result start(std::unique_ptr<EventQueue> eventQueue,
+                 std::unique_ptr<EventQueue_2_1> eventQueue_2_1,
+                 const MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+                 const sp<V2_0::ISensorsCallback>& callback);
+    // Deactivates everything and stops the threads, with mConfigLock held.
+    void reset();
+    void writerLoop();
+    void wakeLockLoop();
+
+    // All of these must be called with mLock held.
+    void flushFifoLocked(SensorState& sensor);
+    void queueEventLocked(const V1_0::Event& event);
+    // Earliest batch deadline, false when nothing is batched.
+    bool nextDeadlineLocked(Clock::time_point* deadline);
+    void expireFifosLocked();
+    void writeDirectLocked(SensorState& sensor, const V1_0::Event& event);
+    // Moves what fits from mEvents to the Event FMQ.
+    void writeEventsLocked();
+    bool isWakeUpLocked(int32_t handle);
+
+    // never called with mLock held, it posts events from its own threads
+    std::unique_ptr<IioSensors> mIio;
+
+    // serializes driver reconfiguration and initialize(), taken before mLock
+    std::mutex mConfigLock;
+    std::mutex mLock;
+    std::condition_variable mEventsAvailable;
+    std::map<int32_t, SensorState> mSensors;
+    // events not in the Event FMQ yet
+    std::deque<V1_0::Event> mEvents;
+    std::map<int32_t, std::unique_ptr<DirectChannel>> mDirectChannels;
+    int32_t mNextChannelHandle = 1;
+
+    // set up by initialize(), only one of the event queues is used
+    std::unique_ptr<EventQueue> mEventQueue;
+    std::unique_ptr<EventQueue_2_1> mEventQueue_2_1;
+    EventFlag* mEventQueueFlag = nullptr;
+    std::vector<V1_0::Event> mWriteBuffer;
+    std::vector<V2_1::Event> mWriteBuffer_2_1;
+    sp<V2_0::ISensorsCallback> mCallback;
+
+    // wake-up events the framework has not acknowledged yet, under mLock
+    uint32_t mOutstandingWakeUpEvents = 0;
+    bool mHasWakeLock = false;
+    Clock::time_point mWakeLockDeadline;
+    std::unique_ptr<WakeLockQueue> mWakeLockQueue;
+    EventFlag* mWakeLockQueueFlag = nullptr;
+
+    std::atomic<bool> mRunning{false};
+    std::thread mWriterThread;
+    std::thread mWakeLockThread;
 };
 
 }  // namespace implementation
-}  // namespace V1_0
+}  // namespace V2_1
 }  // namespace sensors
 }  // namespace hardware
 }  // namespace android
 
-#endif  // ANDROID_HARDWARE_SENSORS_V1_0_SENSORS_H_
+#endif  // ANDROID_HARDWARE_SENSORS_V2_1_SENSORS_H_
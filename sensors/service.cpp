@@ -23,18 +23,22 @@
 using android::hardware::configureRpcThreadpool;
 using android::hardware::joinRpcThreadpool;
 
-using android::hardware::sensors::V1_0::ISensors;
-using android::hardware::sensors::V1_0::implementation::Sensors;
+using android::hardware::sensors::V2_1::ISensors;
+using android::hardware::sensors::V2_1::implementation::Sensors;
 
 using android::OK;
 using android::status_t;
 
 int main() {
-    if (!property_get_bool("waydroid.stub_sensors_hal", false))
+    android::sp<Sensors> sensors = new Sensors();
+
+    // without host sensors the HAL only runs when asked to stand in as a stub
+    if (!sensors->hasSensors() && !property_get_bool("waydroid.stub_sensors_hal", false))
         return 0;
 
-    android::sp<ISensors> service = new Sensors();
+    android::sp<ISensors> service = sensors;
 
+    // events go through the FMQ from our own threads, calls never block for long
     configureRpcThreadpool(1, true);
 
     status_t status = service->registerAsService();
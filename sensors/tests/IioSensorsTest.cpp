@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2021 Waydroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the IIO bridge against a directory laid out like /sys/bus/iio/devices,
+ * as waydroid.sensors.iio_sysfs would point it at, with a FIFO standing in
+ * for the character device.
+ */
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "IioSensors.h"
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V1_0 {
+namespace implementation {
+namespace {
+
+constexpr char kDevice[] = "iio:device0";
+constexpr size_t kScanSize = 16;
+
+class IioSensorsTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        char dir[] = "/tmp/iio_sensors_test.XXXXXX";
+
+        ASSERT_NE(nullptr, mkdtemp(dir));
+        mDir = dir;
+        mSysfs = mDir + "/sys";
+        mDev = mDir + "/dev";
+        mPath = mSysfs + "/" + kDevice;
+        for (const std::string& path : {mSysfs, mDev, mPath, mPath + "/scan_elements",
+                                        mPath + "/buffer"})
+            ASSERT_EQ(0, mkdir(path.c_str(), 0755));
+        ASSERT_EQ(0, mkfifo((mDev + "/" + kDevice).c_str(), 0600));
+
+        writeFile("name", "accel_3d");
+        writeFile("in_accel_scale", "0.5");
+        writeFile("sampling_frequency", "0");
+        writeFile("sampling_frequency_available", "12.5 25 50 100 200");
+        writeFile("buffer/enable", "0");
+        writeFile("buffer/length", "0");
+        writeFile("buffer/watermark", "0");
+        writeFile("scan_elements/in_timestamp_en", "0");
+        writeFile("scan_elements/in_timestamp_type", "le:s64/64>>0");
+        writeFile("scan_elements/in_timestamp_index", "3");
+    }
+
+    void TearDown() override {
+        mSensors.reset();
+        if (mWriter >= 0)
+            close(mWriter);
+        nftw(mDir.c_str(), [](const char* path, const struct stat*, int, struct FTW*) {
+            return remove(path);
+        }, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    void writeFile(const std::string& file, const std::string& value) {
+        std::ofstream(mPath + "/" + file) << value;
+    }
+
+    std::string readFile(const std::string& file) {
+        std::ifstream in(mPath + "/" + file);
+        std::string value;
+
+        std::getline(in, value);
+        return value;
+    }
+
+    // x, y and z at indexes 0 to 2, all of the same type
+    void addAxes(const std::string& type) {
+        for (int axis = 0; axis < 3; axis++) {
+            std::string channel = std::string("scan_elements/in_accel_") + "xyz"[axis];
+            writeFile(channel + "_en", "0");
+            writeFile(channel + "_type", type);
+            writeFile(channel + "_index", std::to_string(axis));
+        }
+    }
+
+    int32_t probe() {
+        mSensors = std::make_unique<IioSensors>(mSysfs, mDev, [this](const Event& event) {
+            std::lock_guard<std::mutex> lock(mLock);
+            mEvents.push_back(event);
+            mCond.notify_all();
+        });
+        std::vector<SensorInfo> sensors = mSensors->probe(1);
+        EXPECT_EQ(1u, sensors.size());
+        return sensors.empty() ? -1 : sensors[0].sensorHandle;
+    }
+
+    // Axes are 16 bit storage at offsets 0, 2 and 4, the timestamp at 8.
+    void feed(const uint16_t (&axes)[3], int64_t timestamp, bool bigEndian = false) {
+        uint8_t scan[kScanSize] = {};
+
+        for (int axis = 0; axis < 3; axis++) {
+            scan[axis * 2 + (bigEndian ? 1 : 0)] = axes[axis] & 0xff;
+            scan[axis * 2 + (bigEndian ? 0 : 1)] = axes[axis] >> 8;
+        }
+        memcpy(scan + 8, &timestamp, sizeof(timestamp));
+
+        // the reader has the other end open once the sensor is active
+        if (mWriter < 0)
+            mWriter = open((mDev + "/" + kDevice).c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        ASSERT_GE(mWriter, 0);
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(scan)), write(mWriter, scan, sizeof(scan)));
+    }
+
+    std::vector<Event> waitForEvents(size_t count) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mCond.wait_for(lock, std::chrono::seconds(2), [&] { return mEvents.size() >= count; });
+        return mEvents;
+    }
+
+    std::string mDir;
+    std::string mSysfs;
+    std::string mDev;
+    std::string mPath;
+    int mWriter = -1;
+    std::unique_ptr<IioSensors> mSensors;
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::vector<Event> mEvents;
+};
+
+TEST_F(IioSensorsTest, ProbesBufferedDevice) {
+    addAxes("le:s16/16>>0");
+    mSensors = std::make_unique<IioSensors>(mSysfs, mDev, [](const Event&) {});
+    std::vector<SensorInfo> sensors = mSensors->probe(5);
+
+    ASSERT_EQ(1u, sensors.size());
+    EXPECT_EQ(5, sensors[0].sensorHandle);
+    EXPECT_EQ(SensorType::ACCELEROMETER, sensors[0].type);
+    EXPECT_FLOAT_EQ(0.5f, sensors[0].resolution);
+    EXPECT_FLOAT_EQ(0.5f * 32768, sensors[0].maxRange);
+    // microseconds, from the fastest and slowest listed frequencies
+    EXPECT_EQ(5000, sensors[0].minDelay);
+    EXPECT_EQ(80000, sensors[0].maxDelay);
+}
+
+TEST_F(IioSensorsTest, LittleEndianSigned) {
+    addAxes("le:s16/16>>0");
+    int32_t handle = probe();
+    ASSERT_TRUE(mSensors->activate(handle, true));
+
+    feed({static_cast<uint16_t>(-4), 2, 1000}, 123456789);
+    std::vector<Event> events = waitForEvents(1);
+
+    ASSERT_EQ(1u, events.size());
+    EXPECT_EQ(handle, events[0].sensorHandle);
+    EXPECT_EQ(123456789, events[0].timestamp);
+    // scaled by in_accel_scale
+    EXPECT_FLOAT_EQ(-2.0f, events[0].u.vec3.x);
+    EXPECT_FLOAT_EQ(1.0f, events[0].u.vec3.y);
+    EXPECT_FLOAT_EQ(500.0f, events[0].u.vec3.z);
+}
+
+TEST_F(IioSensorsTest, BigEndianShifted) {
+    // 12 significant bits in the top of a big endian word
+    addAxes("be:s12/16>>4");
+    int32_t handle = probe();
+    ASSERT_TRUE(mSensors->activate(handle, true));
+
+    feed({static_cast<uint16_t>(-3 << 4), 0x7ff << 4, static_cast<uint16_t>((5 << 4) | 0xf)}, 1,
+         true);
+    std::vector<Event> events = waitForEvents(1);
+
+    ASSERT_EQ(1u, events.size());
+    EXPECT_FLOAT_EQ(-1.5f, events[0].u.vec3.x);
+    EXPECT_FLOAT_EQ(0x7ff * 0.5f, events[0].u.vec3.y);
+    // the bits below the shift are not part of the value
+    EXPECT_FLOAT_EQ(2.5f, events[0].u.vec3.z);
+}
+
+TEST_F(IioSensorsTest, UnsignedIsNotExtended) {
+    addAxes("le:u12/16>>0");
+    int32_t handle = probe();
+    ASSERT_TRUE(mSensors->activate(handle, true));
+
+    // bits above the real ones are masked off
+    feed({0xfff, 0xf001, 0}, 1);
+    std::vector<Event> events = waitForEvents(1);
+
+    ASSERT_EQ(1u, events.size());
+    EXPECT_FLOAT_EQ(0xfff * 0.5f, events[0].u.vec3.x);
+    EXPECT_FLOAT_EQ(0.5f, events[0].u.vec3.y);
+}
+
+TEST_F(IioSensorsTest, MountMatrix) {
+    addAxes("le:s16/16>>0");
+    // chip x along the screen y, chip y against the screen x
+    writeFile("mount_matrix", "0, 1, 0; -1, 0, 0; 0, 0, 1");
+    writeFile("in_accel_x_scale", "1");
+    writeFile("in_accel_y_scale", "1");
+    writeFile("in_accel_z_scale", "1");
+    int32_t handle = probe();
+    ASSERT_TRUE(mSensors->activate(handle, true));
+
+    feed({10, 20, 30}, 1);
+    std::vector<Event> events = waitForEvents(1);
+
+    ASSERT_EQ(1u, events.size());
+    EXPECT_FLOAT_EQ(20.0f, events[0].u.vec3.x);
+    EXPECT_FLOAT_EQ(-10.0f, events[0].u.vec3.y);
+    EXPECT_FLOAT_EQ(30.0f, events[0].u.vec3.z);
+}
+
+TEST_F(IioSensorsTest, ScanSetupOnActivate) {
+    addAxes("le:s16/16>>0");
+    writeFile("scan_elements/in_anglvel_x_en", "1");
+    int32_t handle = probe();
+    ASSERT_TRUE(mSensors->activate(handle, true));
+
+    EXPECT_EQ("1", readFile("buffer/enable"));
+    EXPECT_EQ("256", readFile("buffer/length"));
+    EXPECT_EQ("1", readFile("scan_elements/in_accel_x_en"));
+    EXPECT_EQ("1", readFile("scan_elements/in_timestamp_en"));
+    // only our channels go in the scan
+    EXPECT_EQ("0", readFile("scan_elements/in_anglvel_x_en"));
+    EXPECT_EQ("boottime", readFile("current_timestamp_clock"));
+
+    ASSERT_TRUE(mSensors->activate(handle, false));
+    EXPECT_EQ("0", readFile("buffer/enable"));
+}
+
+TEST_F(IioSensorsTest, WatermarkAndFrequency) {
+    addAxes("le:s16/16>>0");
+    int32_t handle = probe();
+
+    // 50 Hz, batched over 200 ms
+    ASSERT_TRUE(mSensors->batch(handle, 20000000, 200000000));
+    ASSERT_TRUE(mSensors->activate(handle, true));
+    EXPECT_EQ("50", readFile("sampling_frequency"));
+    EXPECT_EQ("10", readFile("buffer/watermark"));
+
+    // the next listed frequency up, and no batching
+    ASSERT_TRUE(mSensors->batch(handle, 1000000000 / 60, 0));
+    EXPECT_EQ("100", readFile("sampling_frequency"));
+    EXPECT_EQ("1", readFile("buffer/watermark"));
+
+    // faster than the device goes, and a batch longer than half the buffer
+    ASSERT_TRUE(mSensors->batch(handle, 1000000, 1000000000));
+    EXPECT_EQ("200", readFile("sampling_frequency"));
+    EXPECT_EQ("128", readFile("buffer/watermark"));
+
+    // just under a listed frequency still gets it
+    ASSERT_TRUE(mSensors->batch(handle, 80100000, 0));
+    EXPECT_EQ("12.5", readFile("sampling_frequency"));
+}
+
+TEST_F(IioSensorsTest, FlushDeliversQueuedScansInOrder) {
+    addAxes("le:s16/16>>0");
+    int32_t handle = probe();
+    ASSERT_TRUE(mSensors->batch(handle, 10000000, 1000000000));
+    ASSERT_TRUE(mSensors->activate(handle, true));
+
+    for (int64_t timestamp = 1; timestamp <= 5; timestamp++)
+        feed({static_cast<uint16_t>(timestamp), 0, 0}, timestamp);
+    // whatever the reader has not taken yet is drained before flush returns
+    mSensors->flush(handle);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    ASSERT_EQ(5u, mEvents.size());
+    for (size_t i = 0; i < mEvents.size(); i++)
+        EXPECT_EQ(static_cast<int64_t>(i + 1), mEvents[i].timestamp);
+}
+
+TEST_F(IioSensorsTest, HostBufferIsLeftAlone) {
+    addAxes("le:s16/16>>0");
+    writeFile("buffer/enable", "1");
+    writeFile("scan_elements/in_accel_x_en", "1");
+    int32_t handle = probe();
+
+    EXPECT_FALSE(mSensors->activate(handle, true));
+    EXPECT_EQ("1", readFile("buffer/enable"));
+    EXPECT_EQ("1", readFile("scan_elements/in_accel_x_en"));
+    EXPECT_EQ("0", readFile("scan_elements/in_timestamp_en"));
+}
+
+TEST_F(IioSensorsTest, UnopenableDeviceIsLeftAlone) {
+    addAxes("le:s16/16>>0");
+    writeFile("scan_elements/in_anglvel_x_en", "1");
+    unlink((mDev + "/" + kDevice).c_str());
+    int32_t handle = probe();
+
+    EXPECT_FALSE(mSensors->activate(handle, true));
+    EXPECT_EQ("0", readFile("buffer/enable"));
+    EXPECT_EQ("1", readFile("scan_elements/in_anglvel_x_en"));
+}
+
+}  // namespace
+}  // namespace implementation
+}  // namespace V1_0
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android